@@ -39,18 +39,40 @@ struct Block_Request;
  */
 DEFINE_LIST(Block_Request_List, Block_Request);
 
+/*
+ * Maximum number of memory segments in one request.
+ * This also bounds how many requests the I/O scheduler
+ * can merge into one.
+ */
+#define BLOCK_MAX_SEGMENTS 16
+
+/*
+ * A piece of memory taking part in a block transfer.
+ */
+struct Block_Segment {
+    void *buf;			/* Memory for this piece of the transfer. */
+    int numBlocks;		/* Number of consecutive blocks it holds. */
+};
+
 /*
  * An I/O request for a block device.
+ * The request covers numBlocks consecutive blocks starting at blockNum;
+ * their data is spread over the segments in order.
  */
 struct Block_Request {
     struct Block_Device *dev;
     enum Request_Type type;
     int blockNum;
-    void *buf;
+    int numBlocks;
+    int numSegments;
+    struct Block_Segment segment[BLOCK_MAX_SEGMENTS];
     volatile enum Request_State state;
     volatile int errorCode;
     struct Thread_Queue waitQueue;
 
+    ulong_t postTick;			/* When the request was posted. */
+    struct Block_Request *mergedNext;	/* Requests merged into this one. */
+
     DEFINE_LINK(Block_Request_List, Block_Request);
 };
 
@@ -59,6 +81,17 @@ IMPLEMENT_LIST(Block_Request_List, Block_Request);
 struct Block_Device;
 struct Block_Device_Ops;
 
+/*
+ * An I/O scheduler.
+ * Next_Request() removes the request the driver should serve next
+ * from given (non-empty) queue and returns it.
+ */
+struct Block_Scheduler {
+    const char *name;
+    struct Block_Request *(*Next_Request)(struct Block_Request_List *requestQueue,
+	struct Block_Device *dev);
+};
+
 /*
  * A block device.
  */
@@ -70,6 +103,8 @@ struct Block_Device {
     void *driverData;
     struct Thread_Queue *waitQueue;
     struct Block_Request_List *requestQueue;
+    struct Block_Scheduler *scheduler;
+    int headPos;		/* Block following the last one served. */
 
     DEFINE_LINK(Block_Device_List, Block_Device);
 };
@@ -93,11 +128,13 @@ int Register_Block_Device(const char *name, struct Block_Device_Ops *ops,
 int Open_Block_Device(const char *name, struct Block_Device **pDev);
 int Close_Block_Device(struct Block_Device *dev);
 struct Block_Request *Create_Request(struct Block_Device *dev, enum Request_Type type,
-    int blockNum, void *buf);
+    int blockNum, const struct Block_Segment *segments, int numSegments);
+void Destroy_Request(struct Block_Request *request);
 void Post_Request_And_Wait(struct Block_Request *request);
 struct Block_Request *Dequeue_Request(struct Block_Request_List *requestQueue,
     struct Thread_Queue *waitQueue);
 void Notify_Request_Completion(struct Block_Request *request, enum Request_State state, int errorCode);
+int Set_Block_Scheduler(const char *devName, const char *schedName);
 
 /*
  * High level block device API.
@@ -105,12 +142,34 @@ void Notify_Request_Completion(struct Block_Request *request, enum Request_State
  */
 int Block_Read(struct Block_Device *dev, int blockNum, void *buf);
 int Block_Write(struct Block_Device *dev, int blockNum, void *buf);
+int Block_Read_Multi(struct Block_Device *dev, int blockNum, int numBlocks, void *buf);
+int Block_Write_Multi(struct Block_Device *dev, int blockNum, int numBlocks, void *buf);
+int Block_Read_Segments(struct Block_Device *dev, int blockNum,
+    const struct Block_Segment *segments, int numSegments);
+int Block_Write_Segments(struct Block_Device *dev, int blockNum,
+    const struct Block_Segment *segments, int numSegments);
 int Get_Num_Blocks(struct Block_Device *dev);
 
 /*
  * Misc. routines
  */
 
+/*
+ * Get the memory for the index'th block of given request.
+ * Drivers use this to walk the segments of a request.
+ */
+static __inline__ void *Get_Request_Block_Buffer(struct Block_Request *request, int index)
+{
+    int i;
+
+    for (i = 0; i < request->numSegments; ++i) {
+	if (index < request->segment[i].numBlocks)
+	    return (char*) request->segment[i].buf + index * SECTOR_SIZE;
+	index -= request->segment[i].numBlocks;
+    }
+    return 0;
+}
+
 /*
  * Round offset up to nearest sector.
  */
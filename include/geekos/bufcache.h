@@ -21,9 +21,25 @@ struct Block_Device;
  */
 #define FS_BUFFER_DIRTY	0x01	/*!< Buffer contains uncommitted data. */
 #define FS_BUFFER_INUSE	0x02	/*!< Buffer is in use. */
+#define FS_BUFFER_READAHEAD 0x04	/*!< Buffer was read ahead, and not looked up since. */
+
+/*
+ * Number of hash chains per buffer cache (must be a power of two).
+ */
+#define FS_BUFFER_HASH_SIZE 64
+
+/*
+ * Number of ranges of blocks that can wait to be read ahead.
+ */
+#define FS_BUFFER_READAHEAD_QUEUE 16
 
 struct FS_Buffer;
+struct FS_Buffer_Cache;
+struct FS_Buffer_Cache_Stat;
 DEFINE_LIST(FS_Buffer_List, FS_Buffer);
+DEFINE_LIST(FS_Buffer_Hash_List, FS_Buffer);
+DEFINE_LIST(FS_Buffer_LRU_List, FS_Buffer);
+DEFINE_LIST(FS_Buffer_Cache_List, FS_Buffer_Cache);
 
 /*!
  * A buffer containing the data of one filesystem block.
@@ -32,10 +48,23 @@ struct FS_Buffer {
     ulong_t fsBlockNum;		/*!< Filesystem block number. */
     void *data;			/*!< In-memory data of block. May be out of sync with disk. */
     uint_t flags;		/*!< Flags representing state of buffer. */
+    ulong_t dirtyTick;		/*!< Tick at which the buffer became dirty. */
     DEFINE_LINK(FS_Buffer_List, FS_Buffer);
+    DEFINE_LINK(FS_Buffer_Hash_List, FS_Buffer);	/*!< Chain in hash bucket. */
+    DEFINE_LINK(FS_Buffer_LRU_List, FS_Buffer);	/*!< Clean or dirty LRU list, when not in use. */
 };
 
 IMPLEMENT_LIST(FS_Buffer_List, FS_Buffer);
+IMPLEMENT_LIST(FS_Buffer_Hash_List, FS_Buffer);
+IMPLEMENT_LIST(FS_Buffer_LRU_List, FS_Buffer);
+
+/*!
+ * A range of blocks waiting to be read ahead.
+ */
+struct FS_Readahead_Request {
+    ulong_t fsBlockNum;		/*!< First block of the range. */
+    ulong_t numBlocks;		/*!< Number of blocks in the range. */
+};
 
 /*!
  * A cache for buffers containing the data for filesystem blocks.
@@ -46,11 +75,35 @@ struct FS_Buffer_Cache {
     struct Block_Device *dev;		/*!< Block device. */
     uint_t fsBlockSize;			/*!< Size of filesystem blocks. */
     uint_t numCached;			/*!< Current number of buffers (cached blocks). */
+    uint_t numDirty;			/*!< Number of buffers with uncommitted data. */
     struct FS_Buffer_List bufferList;	/*!< List of buffers. */
+    struct FS_Buffer_Hash_List hashTable[FS_BUFFER_HASH_SIZE]; /*!< Buffers by block number. */
+    struct FS_Buffer_LRU_List cleanList; /*!< Clean unused buffers, least recently used first. */
+    struct FS_Buffer_LRU_List dirtyList; /*!< Dirty unused buffers, least recently used first. */
     struct Mutex lock;			/*!< Lock for synchronization. */
     struct Condition cond;		/*!< Condition: waiting for a buffer. */
+    uint_t numInFlight;			/*!< Buffers the background threads are doing I/O on. */
+
+    ulong_t numHits;			/*!< Lookups satisfied from the cache. */
+    ulong_t numMisses;			/*!< Lookups that had to read the block. */
+    ulong_t numEvictions;		/*!< Buffers stolen for another block. */
+    ulong_t numFlushed;			/*!< Buffers written back by the flusher. */
+    ulong_t numReadahead;		/*!< Buffers read ahead. */
+    ulong_t numReadaheadHits;		/*!< Buffers read ahead and then looked up. */
+
+    struct FS_Readahead_Request readaheadQueue[FS_BUFFER_READAHEAD_QUEUE]; /*!< Ranges to read ahead. */
+    uint_t readaheadHead;		/*!< First queued range. */
+    uint_t readaheadCount;		/*!< Number of queued ranges. */
+    struct Condition readaheadCond;	/*!< Condition: ranges queued for read-ahead. */
+
+    struct Kernel_Thread *flusher;	/*!< Background write-back thread. */
+    struct Kernel_Thread *readahead;	/*!< Background read-ahead thread. */
+    bool flusherExit;			/*!< Set to ask the background threads to exit. */
+    DEFINE_LINK(FS_Buffer_Cache_List, FS_Buffer_Cache);
 };
 
+IMPLEMENT_LIST(FS_Buffer_Cache_List, FS_Buffer_Cache);
+
 struct FS_Buffer_Cache *Create_FS_Buffer_Cache(struct Block_Device *dev, uint_t fsBlockSize);
 int Sync_FS_Buffer_Cache(struct FS_Buffer_Cache *cache);
 int Destroy_FS_Buffer_Cache(struct FS_Buffer_Cache *cache);
@@ -59,5 +112,8 @@ int Get_FS_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, struct FS_B
 void Modify_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf);
 int Sync_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf);
 int Release_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf);
+void Prefetch_FS_Buffers(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, ulong_t numBlocks);
+
+int Get_FS_Buffer_Cache_Stat(const char *devName, struct FS_Buffer_Cache_Stat *stat);
 
 #endif /* GEEKOS_BUFCACHE_H */
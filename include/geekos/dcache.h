@@ -0,0 +1,29 @@
+/*
+ * Dentry cache: results of recent path lookups
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef GEEKOS_DCACHE_H
+#define GEEKOS_DCACHE_H
+
+#include <geekos/ktypes.h>
+#include <geekos/fileio.h>
+
+struct Mount_Point;
+
+/* Longest path the cache keeps an entry for */
+#define DCACHE_MAX_PATH_LEN	79
+
+void Init_Dentry_Cache(void);
+ulong_t Dentry_Cache_Generation(void);
+bool Dentry_Cache_Lookup(const char *path, int *pResult, struct VFS_File_Stat *stat);
+void Dentry_Cache_Insert(const char *path, ulong_t generation, struct Mount_Point *mountPoint,
+    ulong_t fileGeneration, int result, const struct VFS_File_Stat *stat);
+void Dentry_Cache_Invalidate(const char *path, bool subtree);
+void Dentry_Cache_Flush(void);
+void Dentry_Cache_File_Changed(struct Mount_Point *mountPoint);
+void Get_Dentry_Cache_Stat(struct VFS_Dentry_Cache_Stat *stat, bool reset);
+
+#endif  /* GEEKOS_DCACHE_H */
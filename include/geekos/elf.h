@@ -46,6 +46,11 @@ typedef struct {
     unsigned  int   alignment;
 } programHeader;
 
+/*
+ * Values of the type field of programHeader.
+ */
+#define PT_LOAD	1	 /* Segment is loaded into memory. */
+
 /*
  * Bits in flags field of programHeader.
  * These describe memory permissions required by the segment.
@@ -80,4 +80,32 @@ struct VFS_Mount_Request {
     char fstype[VFS_MAX_FS_NAME_LEN+1];	/* Filesystem type: e.g., "gosfs". */
 };
 
+/*
+ * Statistics for the buffer cache of a block device.
+ * This is filled in by the BufCacheStat() system call.
+ */
+struct FS_Buffer_Cache_Stat {
+    ulong_t numHits;		/* Lookups satisfied from the cache. */
+    ulong_t numMisses;		/* Lookups that had to read the block. */
+    ulong_t numEvictions;	/* Buffers stolen for another block. */
+    ulong_t numFlushed;		/* Buffers written back in the background. */
+    ulong_t numReadahead;	/* Buffers read ahead in the background. */
+    ulong_t numReadaheadHits;	/* Buffers read ahead and then looked up. */
+    uint_t numCached;		/* Buffers currently allocated. */
+    uint_t numDirty;		/* Buffers holding uncommitted data. */
+};
+
+/*
+ * Statistics for the VFS dentry cache of recent path lookups.
+ * This is filled in by the DCacheStat() system call.
+ */
+struct VFS_Dentry_Cache_Stat {
+    ulong_t numHits;		/* Lookups of paths cached as existing. */
+    ulong_t numNegativeHits;	/* Lookups of paths cached as not existing. */
+    ulong_t numMisses;		/* Lookups that had to ask the filesystem. */
+    ulong_t numEvictions;	/* Entries dropped to make room. */
+    ulong_t numInvalidations;	/* Entries dropped because their path changed. */
+    uint_t numCached;		/* Entries currently cached. */
+};
+
 #endif
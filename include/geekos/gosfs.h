@@ -80,14 +80,68 @@ typedef struct {
 	char path[VFS_MAX_PATH_LEN];
 	char suffix[GOSFS_FILENAME_MAX];
 	Dir_Entry_Ptr dirEntryPtr;
+	int dirBlock;		/* First block of the directory holding the entry */
 } Path_Info;
 
 /* magic number to indicate its a PFAT disk */
 #define GOSFS_MAGIC		0xDEADBEEF
 
+/* magic number of a disk whose files are mapped by extents */
+#define GOSFS_MAGIC_EXTENTS	0xDEADBEF1
+
+/*
+ * A run of consecutive filesystem blocks.
+ * On a disk formatted for extents, the blockList of a file holds
+ * GOSFS_NUM_INLINE_EXTENTS extents in place of the direct blocks;
+ * the indirect block holds GOSFS_EXTENTS_PER_BLOCK more, and the
+ * doubly-indirect block holds GOSFS_EXTENTS_PER_BLOCK index entries,
+ * each pointing to a block of extents.  Extents map the file's blocks
+ * in order; the first one with count 0 ends the list.
+ */
+struct GOSFS_Extent {
+    ulong_t start;		/* First filesystem block */
+    ulong_t count;		/* Number of blocks */
+};
+
+struct GOSFS_Extent_Index {
+    ulong_t block;		/* Block of extents */
+    ulong_t firstBlock;		/* File block mapped by its first extent */
+};
+
+#define GOSFS_NUM_INLINE_EXTENTS \
+    (GOSFS_NUM_DIRECT_BLOCKS * sizeof(ulong_t) / sizeof(struct GOSFS_Extent))
+#define GOSFS_EXTENTS_PER_BLOCK	(GOSFS_FS_BLOCK_SIZE / sizeof(struct GOSFS_Extent))
+
 /* Number of directory entries that fit in a filesystem block. */
 #define GOSFS_DIR_ENTRIES_PER_BLOCK	(GOSFS_FS_BLOCK_SIZE / sizeof(struct GOSFS_Dir_Entry))
 
+/*
+ * A directory starts with one block, holding "." and ".." and the
+ * first entries added to it.  Once that block is full, more entries
+ * go to leaf blocks chosen by a hash of the name, through an index
+ * block named by the "." entry: a sorted array of (hash, block)
+ * pairs, where each leaf holds the names whose hash is at least its
+ * own and less than the next one's.  The first pair has hash 0.
+ * A full leaf is split in two at its median hash, and an empty one
+ * is freed.  Entries are read in the order of the first block, then
+ * of the leaves.
+ */
+#define GOSFS_DIR_INDEX_PTR		1	/* blockList slot of "." naming the index */
+
+struct GOSFS_Dir_Index_Entry {
+    ulong_t hash;		/* Least name hash in the leaf */
+    ulong_t block;		/* Leaf block */
+};
+
+#define GOSFS_DIR_INDEX_MAX \
+    (GOSFS_FS_BLOCK_SIZE / sizeof(struct GOSFS_Dir_Index_Entry) - 1)
+
+struct GOSFS_Dir_Index {
+    ulong_t count;		/* Number of leaves */
+    ulong_t reserved;
+    struct GOSFS_Dir_Index_Entry leaves[GOSFS_DIR_INDEX_MAX];
+};
+
 void Init_GOSFS(void);
 
 #endif
@@ -17,6 +17,7 @@ struct Kernel_Thread;
 struct User_Context;
 struct Interrupt_State;
 struct Process_Info;
+struct Sched_Stat;
 
 #define MAX_PROC_NAME_SZB 128
 /*
@@ -71,6 +72,9 @@ struct Kernel_Thread {
     char name[MAX_PROC_NAME_SZB]; /* weak */
 
 	struct Thread_Queue* waitQueue;
+
+	/* Tick at which a thread in Sleep_Ticks() should be woken */
+	ulong_t wakeTick;
 };
 
 struct sysinfo {
@@ -112,6 +116,7 @@ int MAX_QUEUE_LEVEL;
 
 void Switch_To_RR(void);
 void Switch_To_MLF(void);
+void Get_Sched_Stat(struct Sched_Stat* stat, bool reset);
 
 /*
  * Scheduler operations.
@@ -124,6 +129,8 @@ struct Kernel_Thread* Start_Kernel_Thread(
     bool detached
 );
 struct Kernel_Thread* Start_User_Thread(struct User_Context* userContext, bool detached);
+struct Kernel_Thread* Start_Forked_User_Thread(struct User_Context* userContext,
+    struct Interrupt_State* state);
 void Make_Runnable(struct Kernel_Thread* kthread);
 void Make_Runnable_Atomic(struct Kernel_Thread* kthread);
 struct Kernel_Thread* Get_Current(void);
@@ -145,6 +152,7 @@ void Switch_To_Thread(struct Kernel_Thread*);
 void Wait(struct Thread_Queue* waitQueue);
 void Wake_Up(struct Thread_Queue* waitQueue);
 void Wake_Up_One(struct Thread_Queue* waitQueue);
+void Wake_Up_Process(struct Kernel_Thread* kthread);
 
 /*
  * Pointer to currently executing thread.
@@ -0,0 +1,27 @@
+/*
+ * Fast LZ77-style compression
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef GEEKOS_LZ_H
+#define GEEKOS_LZ_H
+
+#include <geekos/ktypes.h>
+
+/*
+ * Scratch space for LZ_Compress(); it need not be initialized,
+ * but must not be used by two compressions at once.
+ */
+#define LZ_HASH_BITS 12
+
+struct LZ_Workspace {
+    unsigned short table[1 << LZ_HASH_BITS];
+};
+
+ulong_t LZ_Compress(const void *in, ulong_t inLen, void *out, ulong_t outMax,
+    struct LZ_Workspace *work);
+int LZ_Decompress(const void *in, ulong_t inLen, void *out, ulong_t outMax);
+
+#endif  /* GEEKOS_LZ_H */
@@ -17,6 +17,7 @@
 #include <geekos/paging.h>
 
 struct Boot_Info;
+struct VM_Stat;
 
 /*
  * Page flags
@@ -29,6 +30,9 @@ struct Boot_Info;
 #define PAGE_HEAP      0x0010	 /* page is in kernel heap */
 #define PAGE_PAGEABLE  0x0020	 /* page can be paged out */
 #define PAGE_LOCKED    0x0040    /* page is taken should not be freed */
+#define PAGE_INACTIVE  0x0080    /* pageable page is on the inactive list */
+#define PAGE_BUDDY     0x0100    /* page starts a free block on the buddy freelists */
+#define PAGE_READAHEAD 0x0200    /* page read in ahead of a fault, not yet scanned */
 
 /*
  * PC memory map
@@ -64,9 +68,10 @@ DEFINE_LIST(Page_List, Page);
 struct Page {
     unsigned flags;			 /* Flags indicating state of page */
     DEFINE_LINK(Page_List, Page);	 /* Link fields for Page_List */
-    int clock;
+    int refCount;			 /* Free_Page() calls needed to free the page */
     ulong_t vaddr;			 /* User virtual address where page is mapped */
     pte_t *entry;			 /* Page table entry referring to the page */
+    int order;				 /* Size (log2 pages) of the free block a PAGE_BUDDY page starts */
 };
 
 IMPLEMENT_LIST(Page_List, Page);
@@ -74,8 +79,25 @@ IMPLEMENT_LIST(Page_List, Page);
 void Init_Mem(struct Boot_Info* bootInfo);
 void Init_BSS(void);
 void* Alloc_Page(void);
+void* Alloc_Pages(int order);
+void* Alloc_Zeroed_Page(void);
+bool Zero_Free_Page(void);
 void* Alloc_Pageable_Page(pte_t *entry, ulong_t vaddr);
+void* Alloc_Unmapped_Page(void);
+void* Alloc_Zeroed_Unmapped_Page(void);
+void Map_Pageable_Page(void *paddr, pte_t *entry, ulong_t vaddr);
 void Free_Page(void* pageAddr);
+void Free_Pages(void* pageAddr, int order);
+void Get_Page_Reference(void* pageAddr);
+void Share_Page(void* pageAddr);
+int Set_Page_Replacement(int policy);
+int Get_Page_Replacement(void);
+void Start_Pageout_Daemon(void);
+
+/*
+ * Paging counters, updated by mem.c and paging.c.
+ */
+extern struct VM_Stat g_vmStat;
 
 /*
  * Determine if given address is a multiple of the page size.
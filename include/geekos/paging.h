@@ -19,6 +19,7 @@
 
 struct Page;
 struct User_Context;
+struct VM_Stat;
 
 #define PAGING_IRQ 14
 
@@ -99,6 +100,7 @@ typedef struct {
  * Bits used in the kernelInfo field of the PTE's:
  */
 #define KINFO_PAGE_ON_DISK	0x4	 /* Page not present; contents in paging file */
+#define KINFO_PAGE_COW		0x2	 /* Page present read-only; copied on the first write */
 
 void Init_VM(struct Boot_Info *bootInfo);
 void Init_Paging(void);
@@ -108,6 +110,24 @@ extern void Set_PDBR(pde_t *pageDir);
 extern pde_t *Get_PDBR(void);
 extern void Enable_Paging(pde_t *pageDir);
 
+/*
+ * Pages whose TLB entries are to be invalidated together.
+ * Past TLB_BATCH_MAX pages, a single full flush is cheaper
+ * than one invlpg per page.
+ */
+#define TLB_BATCH_MAX 16
+
+struct TLB_Batch {
+    int numPages;
+    ulong_t vaddr[TLB_BATCH_MAX];
+};
+
+bool Prepare_User_Page_For_Write(ulong_t vaddr);
+void Invalidate_Page(ulong_t vaddr);
+void Init_TLB_Batch(struct TLB_Batch *batch);
+void Add_To_TLB_Batch(struct TLB_Batch *batch, ulong_t vaddr);
+void Flush_TLB_Batch(struct TLB_Batch *batch);
+
 /*
  * Return the address that caused a page fault.
  */
@@ -122,9 +142,14 @@ static __inline__ ulong_t Get_Page_Fault_Address(void)
 }
 
 int Find_Space_On_Paging_File(void);
+int Find_Run_On_Paging_File(int numSlots);
 void Free_Space_On_Paging_File(int pagefileIndex);
 void Write_To_Paging_File(void *paddr, ulong_t vaddr, int pagefileIndex);
+void Write_Pages_To_Paging_File(void **paddrs, int numPages, int pagefileIndex);
+void Get_VM_Stat(struct VM_Stat *stat, bool reset);
 void Read_From_Paging_File(void *paddr, ulong_t vaddr, int pagefileIndex);
+void Read_Pages_From_Paging_File(void **paddrs, int numPages, int pagefileIndex);
+int Set_Swap_Readahead(int numPages);
 
 
 #endif
@@ -0,0 +1,43 @@
+/*
+ * PCI configuration space access
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef GEEKOS_PCI_H
+#define GEEKOS_PCI_H
+
+#include <geekos/ktypes.h>
+
+/* Offsets of configuration registers we care about */
+#define PCI_CONFIG_VENDOR_ID	0x00
+#define PCI_CONFIG_COMMAND	0x04
+#define PCI_CONFIG_CLASS	0x08
+#define PCI_CONFIG_HEADER_TYPE	0x0c
+#define PCI_CONFIG_BAR(n)	(0x10 + (n) * 4)
+
+/* Bits of the command register */
+#define PCI_COMMAND_IO		0x0001
+#define PCI_COMMAND_MEMORY	0x0002
+#define PCI_COMMAND_BUS_MASTER	0x0004
+
+/* Classes and subclasses */
+#define PCI_CLASS_STORAGE	0x01
+#define PCI_SUBCLASS_IDE	0x01
+
+/*
+ * Location of a function on the PCI bus.
+ */
+struct PCI_Device {
+    int bus;
+    int device;
+    int function;
+    int progIf;			/* programming interface byte of the class code */
+};
+
+ulong_t PCI_Read_Config(struct PCI_Device *pci, int reg);
+void PCI_Write_Config(struct PCI_Device *pci, int reg, ulong_t value);
+bool PCI_Find_Class(int classCode, int subclass, struct PCI_Device *pci);
+
+#endif  /* GEEKOS_PCI_H */
@@ -0,0 +1,27 @@
+/*
+ * Object caches (slab allocator)
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef GEEKOS_SLAB_H
+#define GEEKOS_SLAB_H
+
+#include <geekos/ktypes.h>
+
+struct Object_Cache;
+
+/*
+ * Object constructor.  It is called once for each object when the
+ * slab holding it is created, not on every allocation; an object
+ * must be returned to the cache in its constructed state.
+ */
+typedef void (*Object_Constructor)(void *obj);
+
+struct Object_Cache *Create_Object_Cache(const char *name, ulong_t objSize,
+    Object_Constructor ctor);
+void *Cache_Alloc(struct Object_Cache *cache);
+void Cache_Free(struct Object_Cache *cache, void *obj);
+
+#endif  /* GEEKOS_SLAB_H */
@@ -56,6 +56,7 @@ void Cond_Wait(struct Condition* cond, struct Mutex* mutex);
 void Cond_Signal(struct Condition* cond);
 void Cond_Broadcast(struct Condition* cond);
 
+void Init_Semaphores(void);
 int Create_Semaphore(char* name, int ival);
 int P(int sid);
 int V(int sid);
@@ -77,6 +77,14 @@ enum {
     SYS_REGDELIVER,	 /* Register user-space handler routines */
     SYS_RETURNSIG,	 /* Called when signal handler is done executing */
     SYS_WAITNOPID,	 /* Like Wait, but doesn't require a PID. */
+    SYS_SCHEDSTAT,	 /* Get (and optionally reset) scheduler statistics */
+    SYS_BUFCACHESTAT,	 /* Get buffer cache statistics of a block device */
+    SYS_SETIOSCHEDULER,	 /* Select the I/O scheduler of a block device */
+    SYS_VMSTAT,		 /* Get (and optionally reset) virtual memory statistics */
+    SYS_SETPAGEREPLACEMENT, /* Select the page replacement policy */
+    SYS_FORK,		 /* Fork a copy-on-write duplicate of the process */
+    SYS_SETSWAPREADAHEAD, /* Set the number of pages read ahead on swap-in */
+    SYS_DCACHESTAT,	 /* Get (and optionally reset) dentry cache statistics */
 };
 
 /*
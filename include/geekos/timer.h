@@ -33,6 +33,9 @@ int Start_Timer(int ticks, timerCallback);
 int Get_Remaing_Timer_Ticks(int id);
 int Cancel_Timer(int id);
 
+void Sleep_Ticks(int ticks);
+void Wake_Sleeper(struct Kernel_Thread* kthread);
+
 void Micro_Delay(int us);
 
 #endif  /* GEEKOS_TIMER_H */
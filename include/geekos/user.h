@@ -26,6 +26,76 @@ struct Process_Info {
 	int status;
 };
 
+/*
+ * Scheduler statistics, returned by the SchedStat system call.
+ */
+struct Sched_Stat {
+	unsigned long numSwitches;	/* calls to Get_Next_Runnable() */
+	unsigned long pickCycles;	/* TSC cycles spent picking the next thread */
+	unsigned long maxPickCycles;	/* worst single pick */
+	int numRunnable;	/* threads currently on the run queues */
+};
+
+/*
+ * Page replacement policies, for the SetPageReplacement system call.
+ */
+#define PAGE_REPLACE_CLOCK	0	/* one CLOCK hand over all pageable pages */
+#define PAGE_REPLACE_TWO_LIST	1	/* active/inactive lists, evict from inactive */
+
+/*
+ * Most pages a swap-in may read ahead, for the SetSwapReadahead system call.
+ */
+#define SWAP_READAHEAD_MAX	15
+
+/*
+ * Physical memory is allocated in blocks of 2^order pages,
+ * for order 0 to PAGE_MAX_ORDER.
+ */
+#define PAGE_MAX_ORDER	10
+
+/*
+ * Virtual memory statistics, returned by the VMStat system call.
+ */
+struct VM_Stat {
+	unsigned long numFaults;	/* page faults handled */
+	unsigned long numRefaults;	/* faults that read an evicted page back in */
+	unsigned long numEvictions;	/* pages chosen for page out */
+	unsigned long numScanned;	/* pages the replacement hand looked at */
+	unsigned long numPageOuts;	/* pages written to the paging file */
+	unsigned long numPageOutsAborted; /* of those, pages kept because they were used meanwhile */
+	unsigned int numFreePages;	/* pages on the freelist */
+	unsigned int numActive;		/* pageable pages on the active list */
+	unsigned int numInactive;	/* pageable pages on the inactive list */
+	unsigned int numFreeSwapSlots;	/* free page sized chunks of the paging file */
+	int replacement;		/* PAGE_REPLACE_* policy in use */
+	unsigned long numPageoutWakeups; /* times the pageout daemon went to work */
+	unsigned long numDirectReclaims; /* allocations that had to page out themselves */
+	unsigned long numExePageIns;	/* pages read in from executables on first touch */
+	unsigned long numZeroFills;	/* pages zero filled on first touch */
+	unsigned long numTextShares;	/* faults satisfied by an already cached text page */
+	unsigned int numSharedTextPages; /* text pages cached for sharing */
+	unsigned long numCowFaults;	/* write faults on copy-on-write pages */
+	unsigned long numCowCopies;	/* of those, faults that had to copy the page */
+	unsigned long numTlbInvalidations; /* single TLB entries invalidated */
+	unsigned long numTlbFlushes;	/* whole TLB flushes for overflowing batches */
+	unsigned int numZeroedPages;	/* pages zeroed ahead of time by the idle thread */
+	unsigned long numZeroedHits;	/* zeroed page allocations served from those */
+	unsigned long numZeroedMisses;	/* zeroed page allocations that zeroed a page */
+	int swapReadahead;		/* pages read ahead after a swapped out page */
+	unsigned long numReadaheadPages; /* pages read in ahead of a fault */
+	unsigned long numReadaheadHits;	/* of those, pages used before the scan came by */
+	unsigned long numReadaheadMisses; /* of those, pages the scan found unused */
+	unsigned long numZswapStores;	/* pages kept compressed instead of written out */
+	unsigned long numZswapRejects;	/* pages that compressed badly or found the pool full */
+	unsigned long numZswapHits;	/* pages read back from the compressed cache */
+	unsigned long numZswapMisses;	/* pages read back from the paging file */
+	unsigned long numZswapWritebacks; /* cold compressed pages written to the paging file */
+	unsigned int numZswapPages;	/* pages held compressed */
+	unsigned long zswapCompressedBytes; /* their compressed size */
+	unsigned long zswapPoolBytes;	/* memory they take up */
+	unsigned int numFreeBlocks[PAGE_MAX_ORDER + 1]; /* free blocks of each order */
+};
+
 #ifdef GEEKOS
 
 #include <geekos/ktypes.h>
@@ -37,6 +107,7 @@ struct Process_Info {
 #include <geekos/signal.h>
 
 struct File;
+struct Exe_Image;
 
 /* Number of files user process can have open. */
 #define USER_MAX_FILES		10
@@ -105,6 +176,16 @@ struct User_Context {
     signal_handler ignHandler;
     signal_handler returnSignal;
 
+    /*
+     * The executable, and where its segments go in user memory.
+     * Pages of the segments are read from the file the first
+     * time they are touched.
+     */
+    struct File *exeFile;
+    struct Exe_Format exeFormat;
+
+    /* Read-only text pages shared with other instances of the executable */
+    struct Exe_Image *exeImage;
 };
 
 struct Kernel_Thread;
@@ -117,6 +198,7 @@ struct Interrupt_State;
 void Attach_User_Context(struct Kernel_Thread* kthread, struct User_Context* context);
 void Detach_User_Context(struct Kernel_Thread* kthread);
 int Spawn(const char *program, const char *command, struct Kernel_Thread **pThread, bool detached);
+int Fork(struct Interrupt_State* state, struct Kernel_Thread **pThread);
 void Switch_To_User_Context(struct Kernel_Thread* kthread, struct Interrupt_State* state);
 
 /*
@@ -124,9 +206,13 @@ void Switch_To_User_Context(struct Kernel_Thread* kthread, struct Interrupt_Stat
  */
 
 void Destroy_User_Context(struct User_Context* context);
-int Load_User_Program(char *exeFileData, ulong_t exeFileLength,
+int Load_User_Program(const char *program, struct File *exeFile,
     struct Exe_Format *exeFormat, const char *command,
     struct User_Context **pUserContext);
+int Load_User_Page(struct User_Context *context, void *paddr, ulong_t vaddr);
+void *Get_Shared_Text_Page(struct User_Context *context, ulong_t vaddr);
+void Exe_Image_File_Written(struct File *file);
+int Fork_User_Context(struct User_Context *parent, struct User_Context **pChild);
 ulong_t Get_User_Address(ulong_t srcInUser);
 bool Copy_From_User(void* destInKernel, ulong_t srcInUser, ulong_t bufSize);
 bool Copy_To_User(ulong_t destInUser, void* srcInKernel, ulong_t bufSize);
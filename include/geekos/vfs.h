@@ -25,6 +25,13 @@
 #define VFS_NO_MORE_DIR_ENTRIES 1
 
 #define MAX_PREFIX_LEN 16 /* Moved from vfs.c */
+
+/*
+ * Sequential reads keep between this many bytes of a file
+ * read ahead of the reader; see Readahead_Range().
+ */
+#define VFS_READAHEAD_MIN (16 * 1024)
+#define VFS_READAHEAD_MAX (128 * 1024)
 #define CURR_DIR 0
 #define PREV_DIR 1
 
@@ -48,6 +55,7 @@ struct Mount_Point {
     char *pathPrefix;		 /* Path prefix where fs is mounted. */
     struct Block_Device *dev;	 /* Block device filesystem is mounted on. */
     void *fsData;		 /* For use by the filesystem implementation. */
+    ulong_t fileGeneration;	 /* Bumped when a file is written; see dcache.c. */
     DEFINE_LINK(Mount_Point_List, Mount_Point);
 };
 
@@ -64,6 +72,13 @@ struct Mount_Point_Ops {
     /* TODO: ACLs */
 };
 
+/* Read-ahead state of an opened file. */
+struct File_Readahead {
+    ulong_t nextBlock;		 /* Block following those last read. */
+    ulong_t aheadEnd;		 /* Block following those last read ahead. */
+    ulong_t window;		 /* Blocks to keep read ahead; 0 if access is random. */
+};
+
 /* An opened file or directory. */
 struct File {
     /*
@@ -81,6 +96,8 @@ struct File {
      */
     int mode;			 /* Mode (read vs. write). */
     struct Mount_Point *mountPoint; /* Mounted filesystem file is part of. */
+
+    struct File_Readahead readahead; /* Kept by Readahead_Range(). */
 };
 
 /* Operations that can be performed on a File. */
@@ -136,6 +153,9 @@ struct File *Allocate_File(struct File_Ops *ops, int filePos, int endPos, void *
 int FStat(struct File *file, struct VFS_File_Stat *stat);
 int Read(struct File *file, void *buf, ulong_t len);
 int Write(struct File *file, void *buf, ulong_t len);
+int Seek(struct File *file, ulong_t len);
+bool Readahead_Range(struct File *file, ulong_t first, ulong_t end, ulong_t numBlocks,
+    ulong_t blockSize, ulong_t *pStart, ulong_t *pEnd);
 int Read_Fully(const char *path, void **pBuffer, ulong_t *pLen);
 
 /* Directory operations. */
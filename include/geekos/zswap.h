@@ -0,0 +1,20 @@
+/*
+ * Compressed in-memory cache in front of the paging file
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#ifndef GEEKOS_ZSWAP_H
+#define GEEKOS_ZSWAP_H
+
+#include <geekos/ktypes.h>
+
+struct Paging_Device;
+
+void Init_Zswap(struct Paging_Device *pagingDevice);
+bool Zswap_Store(void *paddr, int pagefileIndex);
+bool Zswap_Load(void *paddr, int pagefileIndex);
+bool Zswap_Release(int pagefileIndex);
+
+#endif  /* GEEKOS_ZSWAP_H */
@@ -27,6 +27,9 @@ int Format(const char *dev, const char *fstype);
 int Mount(const char *dev, const char *prefix, const char *fstype);
 int Seek(int fd, int pos);
 int Delete(const char *path);
+int Get_Buffer_Cache_Stat(const char *dev, struct FS_Buffer_Cache_Stat *stat);
+int Set_IO_Scheduler(const char *dev, const char *sched);
+int Get_Dentry_Cache_Stat(struct VFS_Dentry_Cache_Stat *stat, int reset);
 
 #endif  /* FILEIO_H */
 
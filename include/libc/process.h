@@ -27,6 +27,10 @@ void usleep(int us);
 void alarm(int ms, int* cb);
 int PS(struct Process_Info *ptable, int len);
 int WaitNoPID(int *status);
+int Get_VM_Stat(struct VM_Stat *stat, int reset);
+int Set_Page_Replacement(int policy);
+int Fork(void);
+int Set_Swap_Readahead(int numPages);
 
 
 #endif  /* PROCESS_H */
@@ -11,8 +11,11 @@
 #ifndef SCHED_H
 #define SCHED_H
 
+#include <geekos/user.h>
+
 int Set_Scheduling_Policy(int policy, int quantum);
 int Get_Time_Of_Day(void);
+int Get_Sched_Stat(struct Sched_Stat *stat, int reset);
 
 #endif  /* SCHED_H */
 
@@ -11,10 +11,12 @@
 #include <geekos/screen.h>
 #include <geekos/string.h>
 #include <geekos/malloc.h>
+#include <geekos/slab.h>
 #include <geekos/int.h>
 #include <geekos/kthread.h>
 #include <geekos/synch.h>
 #include <geekos/blockdev.h>
+#include <geekos/timer.h>
 
 /*#define BLOCKDEV_DEBUG */
 #ifdef BLOCKDEV_DEBUG
@@ -44,24 +46,176 @@ IMPLEMENT_LIST(Block_Device_List, Block_Device);
  */
 static struct Block_Device_List s_deviceList;
 
+/*
+ * Block requests.  A request is freed with an empty wait queue,
+ * so that is part of its constructed state.  The cache is created
+ * when the first device is registered.
+ */
+static struct Object_Cache *s_requestCache;
+
+static void Construct_Request(void *obj)
+{
+    Clear_Thread_Queue(&((struct Block_Request*) obj)->waitQueue);
+}
+
+/*
+ * I/O scheduling.
+ * Requests sit on the device queue in arrival order.  The FIFO
+ * scheduler serves them in that order.  C-LOOK serves them in
+ * ascending block order from the block following the last one served,
+ * wrapping around to the lowest queued block, and merges requests for
+ * adjacent blocks into one.  Under C-LOOK, a request that has waited
+ * longer than its deadline is served first regardless of position,
+ * so reads are not starved by a stream of requests ahead of the head.
+ */
+#define BLOCK_READ_DEADLINE	500	/* ticks */
+#define BLOCK_WRITE_DEADLINE	5000	/* ticks */
+
+static struct Block_Request *FIFO_Next_Request(struct Block_Request_List *requestQueue,
+    struct Block_Device *dev)
+{
+    struct Block_Request *request = Get_Front_Of_Block_Request_List(requestQueue);
+    Remove_From_Front_Of_Block_Request_List(requestQueue);
+    return request;
+}
+
+/*
+ * Has given request waited past its deadline?
+ */
+static __inline__ bool Is_Request_Expired(struct Block_Request *request)
+{
+    ulong_t deadline = (request->type == BLOCK_READ) ? BLOCK_READ_DEADLINE : BLOCK_WRITE_DEADLINE;
+    return g_numTicks - request->postTick >= deadline;
+}
+
+/*
+ * Fold queued requests for blocks adjacent to given request
+ * (same device, same direction) into it, as long as its
+ * segment vector has room.
+ */
+static void Merge_Requests(struct Block_Request_List *requestQueue, struct Block_Request *request)
+{
+    struct Block_Request *other;
+    int n;
+
+    other = Get_Front_Of_Block_Request_List(requestQueue);
+    while (other != 0) {
+	n = other->numSegments;
+	if (other->dev != request->dev || other->type != request->type
+	    || request->numSegments + n > BLOCK_MAX_SEGMENTS) {
+	    other = Get_Next_In_Block_Request_List(other);
+	    continue;
+	}
+
+	if (other->blockNum == request->blockNum + request->numBlocks) {
+	    /* Back merge: other's segments follow ours. */
+	    memcpy(&request->segment[request->numSegments], other->segment,
+		n * sizeof(struct Block_Segment));
+	} else if (other->blockNum + other->numBlocks == request->blockNum) {
+	    /* Front merge: other's segments precede ours. */
+	    memmove(&request->segment[n], request->segment,
+		request->numSegments * sizeof(struct Block_Segment));
+	    memcpy(request->segment, other->segment, n * sizeof(struct Block_Segment));
+	    request->blockNum = other->blockNum;
+	} else {
+	    other = Get_Next_In_Block_Request_List(other);
+	    continue;
+	}
+
+	Debug("Merged request for block %d into %d\n", other->blockNum, request->blockNum);
+	request->numSegments += n;
+	request->numBlocks += other->numBlocks;
+	Remove_From_Block_Request_List(requestQueue, other);
+	other->mergedNext = request->mergedNext;
+	request->mergedNext = other;
+
+	/* The merged range grew, so earlier requests may now be adjacent. */
+	other = Get_Front_Of_Block_Request_List(requestQueue);
+    }
+}
+
+static struct Block_Request *CLOOK_Next_Request(struct Block_Request_List *requestQueue,
+    struct Block_Device *dev)
+{
+    struct Block_Request *request, *best = 0, *lowest = 0;
+
+    request = Get_Front_Of_Block_Request_List(requestQueue);
+    while (request != 0) {
+	/* The queue is in arrival order, so the first expired one is the oldest. */
+	if (Is_Request_Expired(request)) {
+	    best = request;
+	    break;
+	}
+	if (request->dev == dev) {
+	    if (request->blockNum >= dev->headPos
+		&& (best == 0 || request->blockNum < best->blockNum))
+		best = request;
+	    if (lowest == 0 || request->blockNum < lowest->blockNum)
+		lowest = request;
+	}
+	request = Get_Next_In_Block_Request_List(request);
+    }
+
+    /* Nothing ahead of the head: wrap around to the lowest block. */
+    if (best == 0)
+	best = lowest;
+    KASSERT(best != 0);
+
+    Remove_From_Block_Request_List(requestQueue, best);
+    Merge_Requests(requestQueue, best);
+    return best;
+}
+
+static struct Block_Scheduler s_fifoScheduler = { "fifo", FIFO_Next_Request };
+static struct Block_Scheduler s_clookScheduler = { "clook", CLOOK_Next_Request };
+
+static struct Block_Scheduler *s_schedulerTable[] = {
+    &s_fifoScheduler,
+    &s_clookScheduler,
+};
+#define NUM_SCHEDULERS (sizeof(s_schedulerTable) / sizeof(s_schedulerTable[0]))
+
+/*
+ * Scheduler given to newly registered devices.
+ */
+#define DEFAULT_SCHEDULER (&s_clookScheduler)
+
 /*
  * Perform a block IO request.
  * Returns 0 if successful, error code on failure.
  */
-static int Do_Request(struct Block_Device *dev, enum Request_Type type, int blockNum, void *buf)
+static int Do_Request(struct Block_Device *dev, enum Request_Type type, int blockNum,
+    const struct Block_Segment *segments, int numSegments)
 {
     struct Block_Request *request;
     int rc;
 
-    request = Create_Request(dev, type, blockNum, buf);
+    if (numSegments <= 0 || numSegments > BLOCK_MAX_SEGMENTS)
+	return EINVALID;
+
+    request = Create_Request(dev, type, blockNum, segments, numSegments);
     if (request == 0)
 	return ENOMEM;
     Post_Request_And_Wait(request);
     rc = request->errorCode;
-    Free(request);
+    Destroy_Request(request);
     return rc;
 }
 
+/*
+ * Perform a block IO request for consecutive blocks
+ * held in one contiguous buffer.
+ */
+static int Do_Contiguous_Request(struct Block_Device *dev, enum Request_Type type,
+    int blockNum, int numBlocks, void *buf)
+{
+    struct Block_Segment segment;
+
+    segment.buf = buf;
+    segment.numBlocks = numBlocks;
+    return Do_Request(dev, type, blockNum, &segment, 1);
+}
+
 /* ----------------------------------------------------------------------
  * Public functions
  * ---------------------------------------------------------------------- */
@@ -93,8 +247,19 @@ int Register_Block_Device(const char *name, struct Block_Device_Ops *ops,
     dev->driverData = driverData;
     dev->waitQueue = waitQueue;
     dev->requestQueue = requestQueue;
+    dev->scheduler = DEFAULT_SCHEDULER;
+    dev->headPos = 0;
 
     Mutex_Lock(&s_blockdevLock);
+    if (s_requestCache == 0) {
+	s_requestCache = Create_Object_Cache("Block_Request", sizeof(struct Block_Request),
+	    Construct_Request);
+	if (s_requestCache == 0) {
+	    Mutex_Unlock(&s_blockdevLock);
+	    Free(dev);
+	    return ENOMEM;
+	}
+    }
     /* FIXME: handle name conflict with existing device */
     Debug("Registering block device %s\n", dev->name);
     Add_To_Back_Of_Block_Device_List(&s_deviceList, dev);
@@ -159,23 +324,48 @@ int Close_Block_Device(struct Block_Device *dev)
 }
 
 /*
- * Create a block device request to transfer a single block.
+ * Create a block device request to transfer consecutive blocks
+ * to or from given memory segments.
+ * Returns a null pointer if the segments are invalid or there
+ * isn't enough memory.
  */
 struct Block_Request *Create_Request(struct Block_Device *dev, enum Request_Type type,
-    int blockNum, void *buf)
+    int blockNum, const struct Block_Segment *segments, int numSegments)
 {
-    struct Block_Request *request = Malloc(sizeof(*request));
+    struct Block_Request *request;
+    int i;
+
+    if (numSegments <= 0 || numSegments > BLOCK_MAX_SEGMENTS)
+	return 0;
+
+    request = Cache_Alloc(s_requestCache);
     if (request != 0) {
 	request->dev = dev;
 	request->type = type;
 	request->blockNum = blockNum;
-	request->buf = buf;
+	request->numBlocks = 0;
+	request->numSegments = numSegments;
+	for (i = 0; i < numSegments; ++i) {
+	    KASSERT(segments[i].numBlocks > 0);
+	    request->segment[i] = segments[i];
+	    request->numBlocks += segments[i].numBlocks;
+	}
 	request->state = PENDING;
-	Clear_Thread_Queue(&request->waitQueue);
+	request->mergedNext = 0;
+	KASSERT(Is_Thread_Queue_Empty(&request->waitQueue));
     }
     return request;
 }
 
+/*
+ * Free a request made by Create_Request(), once it has been completed.
+ */
+void Destroy_Request(struct Block_Request *request)
+{
+    KASSERT(request->state == COMPLETED || request->state == ERROR);
+    Cache_Free(s_requestCache, request);
+}
+
 /*
  * Send a block IO request to a device and wait for it to be handled.
  * Returns when the driver completes the requests or signals
@@ -193,6 +383,7 @@ void Post_Request_And_Wait(struct Block_Request *request)
     /* Send request to the driver */
     Debug("Posting block device request [@%x]...\n", request);
     Disable_Interrupts();
+    request->postTick = g_numTicks;
     Add_To_Back_Of_Block_Request_List(dev->requestQueue, request);
     Wake_Up(dev->waitQueue);
     Enable_Interrupts();
@@ -208,42 +399,84 @@ void Post_Request_And_Wait(struct Block_Request *request)
 }
 
 /*
- * Wait for a block request to arrive.
+ * Wait for a block request to arrive, and pick the one to serve
+ * next using the I/O scheduler of the device that has waited longest.
+ * (Several devices may share one request queue.)
  */
 struct Block_Request *Dequeue_Request(struct Block_Request_List *requestQueue,
     struct Thread_Queue *waitQueue)
 {
     struct Block_Request *request;
+    struct Block_Device *dev;
 
     Disable_Interrupts();
     while (Is_Block_Request_List_Empty(requestQueue))
 	Wait(waitQueue);
-    request = Get_Front_Of_Block_Request_List(requestQueue);
-    Remove_From_Front_Of_Block_Request_List(requestQueue);
+    dev = Get_Front_Of_Block_Request_List(requestQueue)->dev;
+    request = dev->scheduler->Next_Request(requestQueue, dev);
+    request->dev->headPos = request->blockNum + request->numBlocks;
     Enable_Interrupts();
 
     return request;
 }
 
 /*
- * Signal the completion of a block request.
+ * Signal the completion of a block request,
+ * and of any requests merged into it.
  */
 void Notify_Request_Completion(struct Block_Request *request, enum Request_State state, int errorCode)
 {
+    struct Block_Request *next;
+
     Disable_Interrupts();
-    request->state = state;
-    request->errorCode = errorCode;
-    Wake_Up(&request->waitQueue);
+    while (request != 0) {
+	next = request->mergedNext;
+	request->state = state;
+	request->errorCode = errorCode;
+	Wake_Up(&request->waitQueue);
+	request = next;
+    }
     Enable_Interrupts();
 }
 
+/*
+ * Select the I/O scheduler ("fifo" or "clook") of a named block device.
+ * Return 0 if successful, error code on error.
+ */
+int Set_Block_Scheduler(const char *devName, const char *schedName)
+{
+    struct Block_Device *dev;
+    struct Block_Scheduler *sched = 0;
+    uint_t i;
+
+    for (i = 0; i < NUM_SCHEDULERS; ++i) {
+	if (strcmp(s_schedulerTable[i]->name, schedName) == 0)
+	    sched = s_schedulerTable[i];
+    }
+    if (sched == 0)
+	return EINVALID;
+
+    Mutex_Lock(&s_blockdevLock);
+    dev = Get_Front_Of_Block_Device_List(&s_deviceList);
+    while (dev != 0 && strcmp(dev->name, devName) != 0)
+	dev = Get_Next_In_Block_Device_List(dev);
+    if (dev != 0) {
+	Disable_Interrupts();
+	dev->scheduler = sched;
+	Enable_Interrupts();
+    }
+    Mutex_Unlock(&s_blockdevLock);
+
+    return dev != 0 ? 0 : ENODEV;
+}
+
 /*
  * Read a block from given device.
  * Return 0 if successful, error code on error.
  */
 int Block_Read(struct Block_Device *dev, int blockNum, void *buf)
 {
-    return Do_Request(dev, BLOCK_READ, blockNum, buf);
+    return Do_Contiguous_Request(dev, BLOCK_READ, blockNum, 1, buf);
 }
 
 /*
@@ -252,7 +485,49 @@ int Block_Read(struct Block_Device *dev, int blockNum, void *buf)
  */
 int Block_Write(struct Block_Device *dev, int blockNum, void *buf)
 {
-    return Do_Request(dev, BLOCK_WRITE, blockNum, buf);
+    return Do_Contiguous_Request(dev, BLOCK_WRITE, blockNum, 1, buf);
+}
+
+/*
+ * Read consecutive blocks from given device into one buffer,
+ * using a single request.
+ * Return 0 if successful, error code on error.
+ */
+int Block_Read_Multi(struct Block_Device *dev, int blockNum, int numBlocks, void *buf)
+{
+    return Do_Contiguous_Request(dev, BLOCK_READ, blockNum, numBlocks, buf);
+}
+
+/*
+ * Write consecutive blocks from one buffer to given device,
+ * using a single request.
+ * Return 0 if successful, error code on error.
+ */
+int Block_Write_Multi(struct Block_Device *dev, int blockNum, int numBlocks, void *buf)
+{
+    return Do_Contiguous_Request(dev, BLOCK_WRITE, blockNum, numBlocks, buf);
+}
+
+/*
+ * Read consecutive blocks from given device, scattering them
+ * over the given memory segments.
+ * Return 0 if successful, error code on error.
+ */
+int Block_Read_Segments(struct Block_Device *dev, int blockNum,
+    const struct Block_Segment *segments, int numSegments)
+{
+    return Do_Request(dev, BLOCK_READ, blockNum, segments, numSegments);
+}
+
+/*
+ * Write consecutive blocks to given device, gathering them
+ * from the given memory segments.
+ * Return 0 if successful, error code on error.
+ */
+int Block_Write_Segments(struct Block_Device *dev, int blockNum,
+    const struct Block_Segment *segments, int numSegments)
+{
+    return Do_Request(dev, BLOCK_WRITE, blockNum, segments, numSegments);
 }
 
 /*
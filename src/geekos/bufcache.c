@@ -11,14 +11,53 @@
 #include <geekos/kassert.h>
 #include <geekos/mem.h>
 #include <geekos/malloc.h>
+#include <geekos/slab.h>
 #include <geekos/blockdev.h>
 #include <geekos/bufcache.h>
+#include <geekos/string.h>
+#include <geekos/fileio.h>
+#include <geekos/kthread.h>
+#include <geekos/timer.h>
 
 /*
  * Maximum number of buffers that are cached per-filesystem.
  */
 #define FS_BUFFER_CACHE_MAX_BLOCKS 128
 
+/*
+ * Write-back policy of the flusher thread.  A buffer that has been
+ * dirty for FS_BUFFER_DIRTY_AGE ticks is written back on the next pass.
+ * If more than FS_BUFFER_DIRTY_HIGH percent of the cached buffers are
+ * dirty, the flusher is woken immediately and writes back the oldest
+ * ones until no more than FS_BUFFER_DIRTY_LOW percent are dirty.
+ */
+#define FS_BUFFER_FLUSH_INTERVAL	500
+#define FS_BUFFER_DIRTY_AGE		3000
+#define FS_BUFFER_DIRTY_HIGH		50
+#define FS_BUFFER_DIRTY_LOW		25
+
+/*
+ * Read-ahead: filesystems queue ranges of blocks they expect to be
+ * read soon, and a background thread reads the ones not cached into
+ * new or clean buffers, up to BLOCK_MAX_SEGMENTS buffers per request.
+ * The buffers are marked in use while they are read, so lookups wait
+ * for them, but the cache is not locked during the read.  Read-ahead
+ * is only a hint: it never waits for a dirty buffer to be written,
+ * and a range that doesn't fit in the queue is dropped.
+ */
+
+/*
+ * List of all buffer caches, so their statistics can be
+ * looked up by device name.
+ */
+static struct FS_Buffer_Cache_List s_cacheList;
+static struct Mutex s_cacheListLock;
+
+/*
+ * Buffer headers of all caches; created along with the first cache.
+ */
+static struct Object_Cache *s_bufferCache;
+
 /* ----------------------------------------------------------------------
  * Private functions
  * ---------------------------------------------------------------------- */
@@ -39,27 +78,35 @@ static uint_t Get_Num_Sectors_Per_FS_Block(struct FS_Buffer_Cache *cache)
 }
 
 /*
- * Read or write a filesystem buffer.
+ * Read or write a filesystem buffer, as a single
+ * multi-sector request.
  */
 static int Do_Buffer_IO(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf,
-    int (*IO_Func)(struct Block_Device *dev, int blockNum, void *buf))
+    int (*IO_Func)(struct Block_Device *dev, int blockNum, int numBlocks, void *buf))
 {
-    uint_t offset;
-    int sectorCount = 0;
-    int blockNum = buf->fsBlockNum * Get_Num_Sectors_Per_FS_Block(cache);
-    char *ptr = (char*) buf->data;
-
-    for (offset = 0; offset < cache->fsBlockSize; offset += SECTOR_SIZE) {
-		int rc = IO_Func(cache->dev, blockNum, ptr + offset);
-		if (rc != 0)
-		    return rc;
-		++sectorCount;
-		++blockNum;
-    }
-    KASSERT(offset == cache->fsBlockSize);
-    KASSERT(sectorCount == Get_Num_Sectors_Per_FS_Block(cache));
+    uint_t numSectors = Get_Num_Sectors_Per_FS_Block(cache);
 
-    return 0;
+    KASSERT(numSectors * SECTOR_SIZE == cache->fsBlockSize);
+
+    return IO_Func(cache->dev, buf->fsBlockNum * numSectors, numSectors, buf->data);
+}
+
+/*
+ * Get the hash chain for given filesystem block.
+ */
+static __inline__ struct FS_Buffer_Hash_List *Get_Hash_Chain(
+    struct FS_Buffer_Cache *cache, ulong_t fsBlockNum)
+{
+    return &cache->hashTable[fsBlockNum & (FS_BUFFER_HASH_SIZE - 1)];
+}
+
+/*
+ * Get the LRU list an unused buffer belongs on.
+ */
+static __inline__ struct FS_Buffer_LRU_List *Get_LRU_List(
+    struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
+{
+    return (buf->flags & FS_BUFFER_DIRTY) ? &cache->dirtyList : &cache->cleanList;
 }
 
 /*
@@ -72,21 +119,90 @@ static int Sync_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
     KASSERT(IS_HELD(&cache->lock));
 
     if (buf->flags & FS_BUFFER_DIRTY) {
-	if ((rc = Do_Buffer_IO(cache, buf, Block_Write)) == 0)
+	if ((rc = Do_Buffer_IO(cache, buf, Block_Write_Multi)) == 0) {
+	    /* An unused buffer moves from the dirty to the clean list. */
+	    if (!(buf->flags & FS_BUFFER_INUSE)) {
+		Remove_From_FS_Buffer_LRU_List(&cache->dirtyList, buf);
+		Add_To_Back_Of_FS_Buffer_LRU_List(&cache->cleanList, buf);
+	    }
 	    buf->flags &= ~(FS_BUFFER_DIRTY);
+	    --cache->numDirty;
+	}
     }
 
     return rc;
 }
 
 /*
- * Move a buffer to the front of the cache buffer list,
- * to indicate that it has been used recently.
+ * Look up the buffer for given block in the hash table.
+ * Returns null if the block is not cached.
  */
-static void Move_To_Front(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
+static struct FS_Buffer *Lookup_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum)
 {
-    Remove_From_FS_Buffer_List(&cache->bufferList, buf);
-    Add_To_Front_Of_FS_Buffer_List(&cache->bufferList, buf);
+    struct FS_Buffer *buf;
+
+    buf = Get_Front_Of_FS_Buffer_Hash_List(Get_Hash_Chain(cache, fsBlockNum));
+    while (buf != 0 && buf->fsBlockNum != fsBlockNum)
+	buf = Get_Next_In_FS_Buffer_Hash_List(buf);
+
+    return buf;
+}
+
+/*
+ * Allocate a new buffer, if the cache holds fewer than
+ * its maximum number of buffers.
+ * Returns null if it doesn't, or if there is no memory.
+ */
+static struct FS_Buffer *Alloc_Buffer(struct FS_Buffer_Cache *cache)
+{
+    struct FS_Buffer *buf;
+
+    if (cache->numCached >= FS_BUFFER_CACHE_MAX_BLOCKS)
+	return 0;
+
+    buf = (struct FS_Buffer*) Cache_Alloc(s_bufferCache);
+    if (buf == 0)
+	return 0;
+    buf->data = Alloc_Page();
+    if (buf->data == 0) {
+	Cache_Free(s_bufferCache, buf);
+	return 0;
+    }
+    buf->flags = 0;
+    Add_To_Back_Of_FS_Buffer_List(&cache->bufferList, buf);
+    ++cache->numCached;
+    return buf;
+}
+
+/*
+ * Take a buffer whose block could not be read out of use.
+ * Don't leave stale data behind for the next lookup:
+ * park the buffer under an impossible block number
+ * at the front of the clean list, to be reused first.
+ */
+static void Discard_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
+{
+    Remove_From_FS_Buffer_Hash_List(Get_Hash_Chain(cache, buf->fsBlockNum), buf);
+    buf->flags = 0;
+    buf->fsBlockNum = ~0UL;
+    Add_To_Front_Of_FS_Buffer_Hash_List(Get_Hash_Chain(cache, buf->fsBlockNum), buf);
+    Add_To_Front_Of_FS_Buffer_LRU_List(&cache->cleanList, buf);
+}
+
+/*
+ * Choose an unused buffer to steal for another block.
+ * Clean buffers are preferred, since they can be reused without I/O.
+ * Returns null if every buffer is in use.
+ */
+static struct FS_Buffer *Find_Victim(struct FS_Buffer_Cache *cache)
+{
+    if (!Is_FS_Buffer_LRU_List_Empty(&cache->cleanList))
+	return Get_Front_Of_FS_Buffer_LRU_List(&cache->cleanList);
+
+    /* Out of clean buffers: this reader pays for a write. */
+    if (cache->flusher != 0)
+	Wake_Sleeper(cache->flusher);
+    return Get_Front_Of_FS_Buffer_LRU_List(&cache->dirtyList);
 }
 
 /*
@@ -95,63 +211,61 @@ static void Move_To_Front(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
  */
 static int Get_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, struct FS_Buffer **pBuf)
 {
-    struct FS_Buffer *buf, *lru = 0;
+    struct FS_Buffer *buf, *lru;
     int rc;
 
     Debug("Request block %lu\n", fsBlockNum);
 
     KASSERT(IS_HELD(&cache->lock));
 
-    /*
-     * Look for existing buffer.
-     * As a side-effect, finds the least recently used
-     * buffer that is not in use (if any).
-     */
-    buf = Get_Front_Of_FS_Buffer_List(&cache->bufferList);
-    while (buf != 0) {
-		if (buf->fsBlockNum == fsBlockNum) {
-		    /* If buffer is in use, wait until it is available. */
-		    while (buf->flags & FS_BUFFER_INUSE) {
-				Debug("Waiting for block %lu\n", fsBlockNum);
-				Cond_Wait(&cache->cond, &cache->lock);
-		    }
-		    goto done;
-		}
-
-		/* If buffer isn't in use, it's a candidate for LRU. */
-		if (!(buf->flags & FS_BUFFER_INUSE))
-		    lru = buf;
-
-		buf = Get_Next_In_FS_Buffer_List(buf);
+    /* Look for existing buffer. */
+    buf = Lookup_Buffer(cache, fsBlockNum);
+    if (buf != 0) {
+	++cache->numHits;
+
+	/* If buffer is in use, wait until it is available. */
+	while (buf->flags & FS_BUFFER_INUSE) {
+	    Debug("Waiting for block %lu\n", fsBlockNum);
+	    Cond_Wait(&cache->cond, &cache->lock);
+	}
+
+	/* The waiters may have evicted it while we slept. */
+	if (buf->fsBlockNum != fsBlockNum)
+	    return Get_Buffer(cache, fsBlockNum, pBuf);
+
+	if (buf->flags & FS_BUFFER_READAHEAD) {
+	    buf->flags &= ~(FS_BUFFER_READAHEAD);
+	    ++cache->numReadaheadHits;
+	}
+	Remove_From_FS_Buffer_LRU_List(Get_LRU_List(cache, buf), buf);
+	goto done;
     }
 
+    ++cache->numMisses;
+
     /*
      * If number of allocated buffers does not exceed the
      * limit, allocate a new one.
      */
-    if (cache->numCached < FS_BUFFER_CACHE_MAX_BLOCKS) {
-		buf = (struct FS_Buffer*) Malloc(sizeof(*buf));
-		if (buf != 0) {
-		    buf->data = Alloc_Page();
-		    if (buf->data == 0)
-			Free(buf);
-		    else {
-			/* Successful creation */
-			buf->fsBlockNum = fsBlockNum;
-			buf->flags = 0;
-			Add_To_Front_Of_FS_Buffer_List(&cache->bufferList, buf);
-			++cache->numCached;
-			goto readAndAcquire;
-		    }
-		}
+    buf = Alloc_Buffer(cache);
+    if (buf != 0) {
+	buf->fsBlockNum = fsBlockNum;
+	goto readAndAcquire;
     }
     
     /*
-     * If there is no LRU buffer, then we have exceeded
+     * If there is no unused buffer, then we have exceeded
      * the number of available buffers.
      */
-    if (lru == 0)
-		return ENOMEM;
+    lru = Find_Victim(cache);
+    if (lru == 0) {
+	/* Buffers being written back or read ahead will come free soon */
+	if (cache->numInFlight > 0) {
+	    Cond_Wait(&cache->cond, &cache->lock);
+	    return Get_Buffer(cache, fsBlockNum, pBuf);
+	}
+	return ENOMEM;
+    }
 
     KASSERT(!noEvict);
 
@@ -161,21 +275,29 @@ static int Get_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, struct
 
     /* LRU buffer is clean, so we can steal it. */
     buf = lru;
+    Remove_From_FS_Buffer_LRU_List(&cache->cleanList, buf);
+    Remove_From_FS_Buffer_Hash_List(Get_Hash_Chain(cache, buf->fsBlockNum), buf);
+    buf->fsBlockNum = fsBlockNum;
     buf->flags = 0;
-    Move_To_Front(cache, buf);
+    ++cache->numEvictions;
 
 readAndAcquire:
+    /* The buffer selected should be clean (no uncommitted data). */
+    KASSERT(!(buf->flags & FS_BUFFER_DIRTY));
+
     /*
-     * The buffer selected should be clean (no uncommitted data),
-     * and should have been moved to the front of the buffer list
-     * (to show it has just been referenced).
+     * Publish the buffer before reading, marked in use, so that
+     * other lookups of this block wait for the read to finish.
      */
-    KASSERT(!(buf->flags & FS_BUFFER_DIRTY));
-    KASSERT(Get_Front_Of_FS_Buffer_List(&cache->bufferList) == buf);
+    buf->flags |= FS_BUFFER_INUSE;
+    Add_To_Front_Of_FS_Buffer_Hash_List(Get_Hash_Chain(cache, fsBlockNum), buf);
 
     /* Read block data into buffer. */
-    if ((rc = Do_Buffer_IO(cache, buf, Block_Read)) != 0)
+    if ((rc = Do_Buffer_IO(cache, buf, Block_Read_Multi)) != 0) {
+		Discard_Buffer(cache, buf);
+		Cond_Broadcast(&cache->cond);
 		return rc;
+    }
 
 done:
     /* Buffer is now in use. */
@@ -187,6 +309,214 @@ done:
     return 0;
 }
 
+/*
+ * Is the fraction of dirty buffers above given percentage?
+ */
+static __inline__ bool Dirty_Above(struct FS_Buffer_Cache *cache, uint_t percent)
+{
+    return cache->numDirty * 100 > cache->numCached * percent;
+}
+
+/*
+ * Write back unused dirty buffers that are too old, or, if too many
+ * buffers are dirty, the least recently used ones.  They are written
+ * in batches of up to BLOCK_MAX_SEGMENTS buffers, which are marked in
+ * use meanwhile, so the cache is not locked during the writes.
+ * Must be called with cache mutex held; it is dropped while writing.
+ */
+static void Flush_Dirty_Buffers(struct FS_Buffer_Cache *cache)
+{
+    struct FS_Buffer *bufs[BLOCK_MAX_SEGMENTS];
+    bool more = true;
+
+    KASSERT(IS_HELD(&cache->lock));
+
+    while (more && !cache->flusherExit) {
+	struct FS_Buffer *buf, *next;
+	uint_t numDirty = cache->numDirty;
+	int i, n = 0, numWritten, rc = 0;
+
+	/* Take the next batch out of the dirty list, oldest first */
+	buf = Get_Front_Of_FS_Buffer_LRU_List(&cache->dirtyList);
+	while (buf != 0 && n < BLOCK_MAX_SEGMENTS) {
+	    next = Get_Next_In_FS_Buffer_LRU_List(buf);
+	    if (numDirty * 100 > cache->numCached * FS_BUFFER_DIRTY_LOW ||
+		g_numTicks - buf->dirtyTick >= FS_BUFFER_DIRTY_AGE) {
+		Remove_From_FS_Buffer_LRU_List(&cache->dirtyList, buf);
+		buf->flags |= FS_BUFFER_INUSE;
+		bufs[n++] = buf;
+		--numDirty;
+	    }
+	    buf = next;
+	}
+	more = (buf != 0);
+	if (n == 0)
+	    break;
+	cache->numInFlight += n;
+
+	Mutex_Unlock(&cache->lock);
+	for (numWritten = 0; numWritten < n; ++numWritten) {
+	    if ((rc = Do_Buffer_IO(cache, bufs[numWritten], Block_Write_Multi)) != 0)
+		break;
+	}
+	Mutex_Lock(&cache->lock);
+
+	/* Sync_Cache() may have written some of them meanwhile */
+	for (i = 0; i < numWritten; ++i) {
+	    if (bufs[i]->flags & FS_BUFFER_DIRTY) {
+		bufs[i]->flags &= ~(FS_BUFFER_DIRTY);
+		--cache->numDirty;
+	    }
+	    ++cache->numFlushed;
+	}
+	/* Back on the LRU lists; those still dirty stay the oldest */
+	for (i = n - 1; i >= 0; --i) {
+	    bufs[i]->flags &= ~(FS_BUFFER_INUSE);
+	    if (bufs[i]->flags & FS_BUFFER_DIRTY)
+		Add_To_Front_Of_FS_Buffer_LRU_List(&cache->dirtyList, bufs[i]);
+	}
+	for (i = 0; i < n; ++i) {
+	    if (!(bufs[i]->flags & FS_BUFFER_DIRTY))
+		Add_To_Back_Of_FS_Buffer_LRU_List(&cache->cleanList, bufs[i]);
+	}
+	cache->numInFlight -= n;
+	Cond_Broadcast(&cache->cond);
+	if (rc != 0)
+	    break;
+    }
+}
+
+/*
+ * Body of the flusher thread of a buffer cache.
+ * It periodically writes back dirty buffers, so that a cache
+ * miss rarely has to wait for a dirty victim to be written.
+ */
+static void Flusher(ulong_t arg)
+{
+    struct FS_Buffer_Cache *cache = (struct FS_Buffer_Cache*) arg;
+
+    Mutex_Lock(&cache->lock);
+    while (!cache->flusherExit) {
+	Flush_Dirty_Buffers(cache);
+
+	Mutex_Unlock(&cache->lock);
+	Sleep_Ticks(FS_BUFFER_FLUSH_INTERVAL);
+	Mutex_Lock(&cache->lock);
+    }
+
+    /* Let Destroy_FS_Buffer_Cache() know we are gone. */
+    cache->flusher = 0;
+    Cond_Broadcast(&cache->cond);
+    Mutex_Unlock(&cache->lock);
+}
+
+/*
+ * Read the blocks of given range that aren't cached, in as few
+ * requests as possible.
+ * Must be called with cache mutex held; it is dropped while reading.
+ */
+static void Read_Ahead(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, ulong_t numBlocks)
+{
+    uint_t numSectors = Get_Num_Sectors_Per_FS_Block(cache);
+    struct FS_Buffer *bufs[BLOCK_MAX_SEGMENTS];
+    struct Block_Segment segments[BLOCK_MAX_SEGMENTS];
+    ulong_t end = fsBlockNum + numBlocks;
+
+    KASSERT(IS_HELD(&cache->lock));
+
+    while (fsBlockNum < end) {
+	ulong_t first;
+	int i, n = 0, rc;
+
+	/* Skip the blocks that are cached (or being read) already */
+	while (fsBlockNum < end && Lookup_Buffer(cache, fsBlockNum) != 0)
+	    ++fsBlockNum;
+	first = fsBlockNum;
+
+	/* Publish buffers, in use, for the run of missing blocks that follows */
+	while (n < BLOCK_MAX_SEGMENTS && fsBlockNum < end && Lookup_Buffer(cache, fsBlockNum) == 0) {
+	    struct FS_Buffer *buf = Alloc_Buffer(cache);
+
+	    if (buf == 0) {
+		if (Is_FS_Buffer_LRU_List_Empty(&cache->cleanList))
+		    break;
+		buf = Remove_From_Front_Of_FS_Buffer_LRU_List(&cache->cleanList);
+		Remove_From_FS_Buffer_Hash_List(Get_Hash_Chain(cache, buf->fsBlockNum), buf);
+		++cache->numEvictions;
+	    }
+	    buf->fsBlockNum = fsBlockNum;
+	    buf->flags = FS_BUFFER_INUSE | FS_BUFFER_READAHEAD;
+	    Add_To_Front_Of_FS_Buffer_Hash_List(Get_Hash_Chain(cache, fsBlockNum), buf);
+
+	    bufs[n] = buf;
+	    segments[n].buf = buf->data;
+	    segments[n].numBlocks = numSectors;
+	    ++n;
+	    ++fsBlockNum;
+	}
+	if (n == 0)
+	    break;		/* no clean buffer to spare */
+	cache->numInFlight += n;
+
+	Mutex_Unlock(&cache->lock);
+	rc = Block_Read_Segments(cache->dev, first * numSectors, segments, n);
+	Mutex_Lock(&cache->lock);
+
+	for (i = 0; i < n; ++i) {
+	    if (rc != 0)
+		Discard_Buffer(cache, bufs[i]);
+	    else {
+		bufs[i]->flags &= ~(FS_BUFFER_INUSE);
+		Add_To_Back_Of_FS_Buffer_LRU_List(&cache->cleanList, bufs[i]);
+	    }
+	}
+	cache->numInFlight -= n;
+	Cond_Broadcast(&cache->cond);
+	if (rc != 0)
+	    break;
+	cache->numReadahead += n;
+    }
+}
+
+/*
+ * Body of the read-ahead thread of a buffer cache.
+ * It reads the ranges queued by Prefetch_FS_Buffers().
+ */
+static void Readahead(ulong_t arg)
+{
+    struct FS_Buffer_Cache *cache = (struct FS_Buffer_Cache*) arg;
+
+    Mutex_Lock(&cache->lock);
+    while (!cache->flusherExit) {
+	struct FS_Readahead_Request request;
+
+	if (cache->readaheadCount == 0) {
+	    Cond_Wait(&cache->readaheadCond, &cache->lock);
+	    continue;
+	}
+	request = cache->readaheadQueue[cache->readaheadHead];
+	cache->readaheadHead = (cache->readaheadHead + 1) % FS_BUFFER_READAHEAD_QUEUE;
+	--cache->readaheadCount;
+
+	Read_Ahead(cache, request.fsBlockNum, request.numBlocks);
+    }
+
+    /* Let Destroy_FS_Buffer_Cache() know we are gone. */
+    cache->readahead = 0;
+    Cond_Broadcast(&cache->cond);
+    Mutex_Unlock(&cache->lock);
+}
+
+/*
+ * Wake the flusher early if too many buffers are dirty.
+ * Must be called with cache mutex held.
+ */
+static void Kick_Flusher(struct FS_Buffer_Cache *cache)
+{
+    if (cache->flusher != 0 && Dirty_Above(cache, FS_BUFFER_DIRTY_HIGH))
+	Wake_Sleeper(cache->flusher);
+}
+
 /*
  * Synchronize cache with disk.
  */
@@ -214,7 +544,7 @@ static void Free_Buffer(struct FS_Buffer *buf)
 {
     KASSERT(!(buf->flags & (FS_BUFFER_DIRTY | FS_BUFFER_INUSE)));
     Free_Page(buf->data);
-    Free(buf);
+    Cache_Free(s_bufferCache, buf);
 }
 
 /* ----------------------------------------------------------------------
@@ -227,6 +557,7 @@ static void Free_Buffer(struct FS_Buffer *buf)
 struct FS_Buffer_Cache *Create_FS_Buffer_Cache(struct Block_Device *dev, uint_t fsBlockSize)
 {
     struct FS_Buffer_Cache *cache;
+    int i;
 
     KASSERT(dev != 0);
     KASSERT(dev->inUse);
@@ -237,6 +568,13 @@ struct FS_Buffer_Cache *Create_FS_Buffer_Cache(struct Block_Device *dev, uint_t
      */
     KASSERT(fsBlockSize <= PAGE_SIZE);
 
+    Mutex_Lock(&s_cacheListLock);
+    if (s_bufferCache == 0)
+	s_bufferCache = Create_Object_Cache("FS_Buffer", sizeof(struct FS_Buffer), 0);
+    Mutex_Unlock(&s_cacheListLock);
+    if (s_bufferCache == 0)
+		return 0;
+
     cache = (struct FS_Buffer_Cache*) Malloc(sizeof(*cache));
     if (cache == 0)
 		return 0;
@@ -244,9 +582,32 @@ struct FS_Buffer_Cache *Create_FS_Buffer_Cache(struct Block_Device *dev, uint_t
     cache->dev = dev;
     cache->fsBlockSize = fsBlockSize;
     cache->numCached = 0;
+    cache->numDirty = 0;
+    cache->numInFlight = 0;
     Clear_FS_Buffer_List(&cache->bufferList);
+    for (i = 0; i < FS_BUFFER_HASH_SIZE; ++i)
+	Clear_FS_Buffer_Hash_List(&cache->hashTable[i]);
+    Clear_FS_Buffer_LRU_List(&cache->cleanList);
+    Clear_FS_Buffer_LRU_List(&cache->dirtyList);
     Mutex_Init(&cache->lock);
     Cond_Init(&cache->cond);
+    cache->numHits = cache->numMisses = cache->numEvictions = 0;
+    cache->numFlushed = 0;
+    cache->numReadahead = cache->numReadaheadHits = 0;
+    cache->readaheadHead = cache->readaheadCount = 0;
+    Cond_Init(&cache->readaheadCond);
+    cache->flusherExit = false;
+
+    cache->flusher = Start_Kernel_Thread(Flusher, (ulong_t) cache, PRIORITY_NORMAL, true);
+    if (cache->flusher != 0)
+	strcpy(cache->flusher->name, "{Flusher}");
+    cache->readahead = Start_Kernel_Thread(Readahead, (ulong_t) cache, PRIORITY_NORMAL, true);
+    if (cache->readahead != 0)
+	strcpy(cache->readahead->name, "{Readahead}");
+
+    Mutex_Lock(&s_cacheListLock);
+    Add_To_Back_Of_FS_Buffer_Cache_List(&s_cacheList, cache);
+    Mutex_Unlock(&s_cacheListLock);
 
     return cache;
 }
@@ -276,8 +637,21 @@ int Destroy_FS_Buffer_Cache(struct FS_Buffer_Cache *cache)
     int rc;
     struct FS_Buffer *buf;
 
+    Mutex_Lock(&s_cacheListLock);
+    Remove_From_FS_Buffer_Cache_List(&s_cacheList, cache);
+    Mutex_Unlock(&s_cacheListLock);
+
     Mutex_Lock(&cache->lock);
 
+    /* Stop the flusher and read-ahead threads. */
+    cache->flusherExit = true;
+    while (cache->flusher != 0 || cache->readahead != 0) {
+	if (cache->flusher != 0)
+	    Wake_Sleeper(cache->flusher);
+	Cond_Broadcast(&cache->readaheadCond);
+	Cond_Wait(&cache->cond, &cache->lock);
+    }
+
     /* Flush all contents back to disk. */
     rc = Sync_Cache(cache);
 
@@ -289,6 +663,8 @@ int Destroy_FS_Buffer_Cache(struct FS_Buffer_Cache *cache)
 	buf = next;
     }
     Clear_FS_Buffer_List(&cache->bufferList);
+    Clear_FS_Buffer_LRU_List(&cache->cleanList);
+    Clear_FS_Buffer_LRU_List(&cache->dirtyList);
 
     Mutex_Unlock(&cache->lock);
 
@@ -318,7 +694,15 @@ int Get_FS_Buffer(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, struct FS_B
 void Modify_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
 {
     KASSERT(buf->flags & FS_BUFFER_INUSE);
-    buf->flags |= FS_BUFFER_DIRTY;
+
+    Mutex_Lock(&cache->lock);
+    if (!(buf->flags & FS_BUFFER_DIRTY)) {
+	buf->flags |= FS_BUFFER_DIRTY;
+	buf->dirtyTick = g_numTicks;
+	++cache->numDirty;
+	Kick_Flusher(cache);
+    }
+    Mutex_Unlock(&cache->lock);
 }
 
 /*
@@ -356,6 +740,7 @@ int Release_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
      */
     if (rc == 0) {
 	buf->flags &= ~(FS_BUFFER_INUSE);
+	Add_To_Back_Of_FS_Buffer_LRU_List(Get_LRU_List(cache, buf), buf);
 	Cond_Broadcast(&cache->cond);
     }
     Debug("Released block %lu\n", buf->fsBlockNum);
@@ -365,3 +750,53 @@ int Release_FS_Buffer(struct FS_Buffer_Cache *cache, struct FS_Buffer *buf)
     return rc;
 }
 
+/*
+ * Ask for given blocks to be read into the cache in the background,
+ * because they are expected to be looked up soon.
+ */
+void Prefetch_FS_Buffers(struct FS_Buffer_Cache *cache, ulong_t fsBlockNum, ulong_t numBlocks)
+{
+    Mutex_Lock(&cache->lock);
+    if (cache->readahead != 0 && cache->readaheadCount < FS_BUFFER_READAHEAD_QUEUE) {
+	struct FS_Readahead_Request *request = &cache->readaheadQueue[
+	    (cache->readaheadHead + cache->readaheadCount) % FS_BUFFER_READAHEAD_QUEUE];
+
+	request->fsBlockNum = fsBlockNum;
+	request->numBlocks = numBlocks;
+	++cache->readaheadCount;
+	Cond_Signal(&cache->readaheadCond);
+    }
+    Mutex_Unlock(&cache->lock);
+}
+
+/*
+ * Get the statistics of the buffer cache for given block device.
+ */
+int Get_FS_Buffer_Cache_Stat(const char *devName, struct FS_Buffer_Cache_Stat *stat)
+{
+    struct FS_Buffer_Cache *cache;
+    int rc = ENODEV;
+
+    Mutex_Lock(&s_cacheListLock);
+    cache = Get_Front_Of_FS_Buffer_Cache_List(&s_cacheList);
+    while (cache != 0) {
+	if (strcmp(cache->dev->name, devName) == 0) {
+	    Mutex_Lock(&cache->lock);
+	    stat->numHits = cache->numHits;
+	    stat->numMisses = cache->numMisses;
+	    stat->numEvictions = cache->numEvictions;
+	    stat->numFlushed = cache->numFlushed;
+	    stat->numReadahead = cache->numReadahead;
+	    stat->numReadaheadHits = cache->numReadaheadHits;
+	    stat->numCached = cache->numCached;
+	    stat->numDirty = cache->numDirty;
+	    Mutex_Unlock(&cache->lock);
+	    rc = 0;
+	    break;
+	}
+	cache = Get_Next_In_FS_Buffer_Cache_List(cache);
+    }
+    Mutex_Unlock(&s_cacheListLock);
+
+    return rc;
+}
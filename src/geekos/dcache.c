@@ -0,0 +1,364 @@
+/*
+ * Dentry cache: results of recent path lookups
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#include <geekos/errno.h>
+#include <geekos/kassert.h>
+#include <geekos/list.h>
+#include <geekos/string.h>
+#include <geekos/screen.h>
+#include <geekos/synch.h>
+#include <geekos/slab.h>
+#include <geekos/vfs.h>
+#include <geekos/dcache.h>
+
+/*
+ * The VFS remembers what recent lookups of a path found, so that
+ * the same path looked up again costs neither a search of the mount
+ * points nor a walk of the filesystem's directories.  Filesystems
+ * are only ever asked about whole paths, so an entry is keyed by the
+ * absolute path, not by its parent and name; paths that would need
+ * normalising ("//", "." or "..") are not cached.  An entry holds
+ * the stat of the file, or records that nothing is there (a negative
+ * entry), which is what repeated searches along a PATH find.
+ *
+ * Creating or deleting a path drops its entry and its parent's, and
+ * deleting a directory drops everything under it.  A lookup racing
+ * with such a change may have seen the old state, so every change
+ * bumps a generation number and a result is only cached if the
+ * generation has not moved since the lookup started.  Writes change
+ * the size of files, so the stat of a file is only good while its
+ * mount point's file generation is the one it was cached with.
+ * Entries are kept in LRU order; the least recently used one makes
+ * way for a new one when the cache is full.
+ * The cache is protected by a mutex.
+ */
+#define DCACHE_MAX_ENTRIES	256
+#define DCACHE_HASH_SIZE	128	/* power of 2 */
+
+struct Dentry;
+DEFINE_LIST(Dentry_Hash_List, Dentry);
+DEFINE_LIST(Dentry_LRU_List, Dentry);
+
+struct Dentry {
+    ulong_t hash;
+    struct Mount_Point *mountPoint;	/* null if no filesystem is mounted there */
+    int result;				/* 0, or ENOTFOUND for a negative entry */
+    ulong_t fileGeneration;		/* of the mount point, when the stat was taken */
+    struct VFS_File_Stat stat;
+    char path[DCACHE_MAX_PATH_LEN + 1];
+    DEFINE_LINK(Dentry_Hash_List, Dentry);
+    DEFINE_LINK(Dentry_LRU_List, Dentry);
+};
+
+IMPLEMENT_LIST(Dentry_Hash_List, Dentry);
+IMPLEMENT_LIST(Dentry_LRU_List, Dentry);
+
+static struct Mutex s_dcacheLock;
+static struct Object_Cache *s_dentryCache;
+static struct Dentry_Hash_List s_hashTable[DCACHE_HASH_SIZE];
+static struct Dentry_LRU_List s_lruList;
+static ulong_t s_generation;
+static struct VFS_Dentry_Cache_Stat s_stat;
+
+/* FNV-1a */
+static ulong_t Path_Hash(const char *path)
+{
+    ulong_t hash = 2166136261UL;
+
+    while (*path != '\0') {
+	hash ^= (uchar_t) *path++;
+	hash *= 16777619UL;
+    }
+    return hash;
+}
+
+/*
+ * Is the path absolute, with no empty, "." or ".." components
+ * and no trailing slash?  Only such paths are cached.
+ */
+static bool Is_Normal_Path(const char *path)
+{
+    const char *p = path;
+
+    if (*p != '/')
+	return false;
+    while (*p != '\0') {
+	++p;			/* past the slash */
+	if (*p == '/' || *p == '\0')
+	    return false;
+	if (p[0] == '.' && (p[1] == '/' || p[1] == '\0' ||
+		(p[1] == '.' && (p[2] == '/' || p[2] == '\0'))))
+	    return false;
+	while (*p != '/' && *p != '\0')
+	    ++p;
+    }
+    return true;
+}
+
+/*
+ * Find the entry for given path.
+ * Cache lock must be held.
+ */
+static struct Dentry *Find_Dentry(const char *path, ulong_t hash)
+{
+    struct Dentry *dentry;
+
+    dentry = Get_Front_Of_Dentry_Hash_List(&s_hashTable[hash & (DCACHE_HASH_SIZE - 1)]);
+    while (dentry != 0) {
+	if (dentry->hash == hash && strcmp(dentry->path, path) == 0)
+	    return dentry;
+	dentry = Get_Next_In_Dentry_Hash_List(dentry);
+    }
+    return 0;
+}
+
+/*
+ * Remove an entry from the cache and free it.
+ * Cache lock must be held.
+ */
+static void Drop_Dentry(struct Dentry *dentry)
+{
+    Remove_From_Dentry_Hash_List(&s_hashTable[dentry->hash & (DCACHE_HASH_SIZE - 1)], dentry);
+    Remove_From_Dentry_LRU_List(&s_lruList, dentry);
+    --s_stat.numCached;
+    Cache_Free(s_dentryCache, dentry);
+}
+
+/*
+ * Drop the entry for given path, if there is one.
+ * Cache lock must be held.
+ */
+static void Drop_Path(const char *path)
+{
+    struct Dentry *dentry = Find_Dentry(path, Path_Hash(path));
+
+    if (dentry != 0) {
+	Drop_Dentry(dentry);
+	++s_stat.numInvalidations;
+    }
+}
+
+/* ----------------------------------------------------------------------
+ * Public functions
+ * ---------------------------------------------------------------------- */
+
+/*
+ * Set up the dentry cache.
+ */
+void Init_Dentry_Cache(void)
+{
+    Mutex_Init(&s_dcacheLock);
+    s_dentryCache = Create_Object_Cache("dentry", sizeof(struct Dentry), 0);
+    if (s_dentryCache == 0)
+	Print("  Error: could not create dentry cache\n");
+}
+
+/*
+ * Get the current generation of the cache.  A lookup takes it
+ * before asking the filesystem, and passes it to Dentry_Cache_Insert().
+ */
+ulong_t Dentry_Cache_Generation(void)
+{
+    ulong_t generation;
+
+    Mutex_Lock(&s_dcacheLock);
+    generation = s_generation;
+    Mutex_Unlock(&s_dcacheLock);
+    return generation;
+}
+
+/*
+ * Look up the cached result for given path.
+ * Params:
+ *   path - absolute path
+ *   pResult - where to store the result of the lookup: 0, or
+ *     ENOTFOUND if the path does not exist
+ *   stat - where to store the stat of the file, or null
+ * Returns true if the cache had the result, false if not.
+ */
+bool Dentry_Cache_Lookup(const char *path, int *pResult, struct VFS_File_Stat *stat)
+{
+    struct Dentry *dentry;
+
+    if (s_dentryCache == 0 || strlen(path) > DCACHE_MAX_PATH_LEN || !Is_Normal_Path(path))
+	return false;
+
+    Mutex_Lock(&s_dcacheLock);
+    dentry = Find_Dentry(path, Path_Hash(path));
+    if (dentry != 0 && dentry->result == 0 && !dentry->stat.isDirectory &&
+	dentry->fileGeneration != dentry->mountPoint->fileGeneration) {
+	/* A file was written since; its size may be stale */
+	Drop_Dentry(dentry);
+	dentry = 0;
+    }
+    if (dentry != 0) {
+	*pResult = dentry->result;
+	if (dentry->result == 0) {
+	    if (stat != 0)
+		*stat = dentry->stat;
+	    ++s_stat.numHits;
+	} else {
+	    ++s_stat.numNegativeHits;
+	}
+	Remove_From_Dentry_LRU_List(&s_lruList, dentry);
+	Add_To_Back_Of_Dentry_LRU_List(&s_lruList, dentry);
+    } else {
+	++s_stat.numMisses;
+    }
+    Mutex_Unlock(&s_dcacheLock);
+
+    return dentry != 0;
+}
+
+/*
+ * Remember the result of looking up a path.
+ * Params:
+ *   path - absolute path
+ *   generation - generation of the cache when the lookup started
+ *   mountPoint - mount point the path is on, or null if none
+ *   fileGeneration - file generation of the mount point when the
+ *     lookup started
+ *   result - 0 if the path was found, or the error it gave;
+ *     only ENOTFOUND is cached
+ *   stat - stat of the file, if it was found
+ */
+void Dentry_Cache_Insert(const char *path, ulong_t generation, struct Mount_Point *mountPoint,
+    ulong_t fileGeneration, int result, const struct VFS_File_Stat *stat)
+{
+    struct Dentry *dentry;
+    ulong_t hash;
+
+    if (result != 0 && result != ENOTFOUND)
+	return;
+    if (s_dentryCache == 0 || strlen(path) > DCACHE_MAX_PATH_LEN || !Is_Normal_Path(path))
+	return;
+    KASSERT(result != 0 || (mountPoint != 0 && stat != 0));
+
+    hash = Path_Hash(path);
+
+    Mutex_Lock(&s_dcacheLock);
+    if (generation != s_generation)
+	goto done;		/* the namespace changed during the lookup */
+
+    dentry = Find_Dentry(path, hash);
+    if (dentry != 0) {
+	Remove_From_Dentry_LRU_List(&s_lruList, dentry);
+    } else {
+	if (s_stat.numCached >= DCACHE_MAX_ENTRIES) {
+	    Drop_Dentry(Get_Front_Of_Dentry_LRU_List(&s_lruList));
+	    ++s_stat.numEvictions;
+	}
+	dentry = (struct Dentry*) Cache_Alloc(s_dentryCache);
+	if (dentry == 0)
+	    goto done;
+	dentry->hash = hash;
+	strcpy(dentry->path, path);
+	Add_To_Back_Of_Dentry_Hash_List(&s_hashTable[hash & (DCACHE_HASH_SIZE - 1)], dentry);
+	++s_stat.numCached;
+    }
+    Add_To_Back_Of_Dentry_LRU_List(&s_lruList, dentry);
+
+    dentry->mountPoint = mountPoint;
+    dentry->result = result;
+    dentry->fileGeneration = fileGeneration;
+    if (result == 0)
+	dentry->stat = *stat;
+
+done:
+    Mutex_Unlock(&s_dcacheLock);
+}
+
+/*
+ * Forget what is cached about a path that was created or deleted,
+ * and about its parent directory.
+ * Params:
+ *   path - absolute path
+ *   subtree - if true, also forget everything under the path
+ */
+void Dentry_Cache_Invalidate(const char *path, bool subtree)
+{
+    ulong_t len = strlen(path);
+    char parent[DCACHE_MAX_PATH_LEN + 1];
+    char *slash;
+
+    if (len > DCACHE_MAX_PATH_LEN || !Is_Normal_Path(path)) {
+	/* It might be cached under a different spelling */
+	Dentry_Cache_Flush();
+	return;
+    }
+
+    Mutex_Lock(&s_dcacheLock);
+    ++s_generation;
+
+    Drop_Path(path);
+    strcpy(parent, path);
+    slash = strrchr(parent, '/');
+    if (slash != parent) {
+	*slash = '\0';
+	Drop_Path(parent);
+    }
+
+    if (subtree) {
+	struct Dentry *dentry = Get_Front_Of_Dentry_LRU_List(&s_lruList);
+
+	while (dentry != 0) {
+	    struct Dentry *next = Get_Next_In_Dentry_LRU_List(dentry);
+
+	    if (strncmp(dentry->path, path, len) == 0 && dentry->path[len] == '/') {
+		Drop_Dentry(dentry);
+		++s_stat.numInvalidations;
+	    }
+	    dentry = next;
+	}
+    }
+    Mutex_Unlock(&s_dcacheLock);
+}
+
+/*
+ * Forget everything; e.g., when a filesystem is mounted.
+ */
+void Dentry_Cache_Flush(void)
+{
+    Mutex_Lock(&s_dcacheLock);
+    ++s_generation;
+    while (!Is_Dentry_LRU_List_Empty(&s_lruList)) {
+	Drop_Dentry(Get_Front_Of_Dentry_LRU_List(&s_lruList));
+	++s_stat.numInvalidations;
+    }
+    Mutex_Unlock(&s_dcacheLock);
+}
+
+/*
+ * Note that the contents of a file on given mount point changed,
+ * so the cached stats of its files may be out of date.
+ */
+void Dentry_Cache_File_Changed(struct Mount_Point *mountPoint)
+{
+    Mutex_Lock(&s_dcacheLock);
+    ++mountPoint->fileGeneration;
+    Mutex_Unlock(&s_dcacheLock);
+}
+
+/*
+ * Get statistics for the dentry cache.
+ * Params:
+ *   stat - where to store the statistics
+ *   reset - if true, reset the counters after reading them
+ */
+void Get_Dentry_Cache_Stat(struct VFS_Dentry_Cache_Stat *stat, bool reset)
+{
+    Mutex_Lock(&s_dcacheLock);
+    *stat = s_stat;
+    if (reset) {
+	s_stat.numHits = 0;
+	s_stat.numNegativeHits = 0;
+	s_stat.numMisses = 0;
+	s_stat.numEvictions = 0;
+	s_stat.numInvalidations = 0;
+    }
+    Mutex_Unlock(&s_dcacheLock);
+}
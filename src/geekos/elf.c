@@ -33,17 +33,31 @@ int Parse_ELF_Executable(char *exeFileData, ulong_t exeFileLength,
 	struct Exe_Format *exeFormat)
 {
 	int i = 0;
-	int j = 0;
 	struct Exe_Segment* segment;
 	elfHeader* eHeader = (elfHeader*)exeFileData;
-	programHeader* pheader = (programHeader*)(exeFileData + eHeader->phoff);
-	exeFormat->numSegments = eHeader->phnum;
+	programHeader* pheader;
+
+	/* The headers must all be in the buffer */
+	if (exeFileLength < sizeof(elfHeader) ||
+	    eHeader->phentsize < sizeof(programHeader) ||
+	    eHeader->phoff + eHeader->phnum * eHeader->phentsize > exeFileLength)
+		return ENOEXEC;
+
+	pheader = (programHeader*)(exeFileData + eHeader->phoff);
+	exeFormat->numSegments = 0;
 	exeFormat->entryAddr = eHeader->entry;
 	
 	//Print("\n *** Segment List *** \n\n");
-	for(; i < exeFormat->numSegments; i++)
+	for(; i < eHeader->phnum; i++)
 	{
-		segment = &exeFormat->segmentList[i];
+		/* Only loadable segments go into user memory */
+		if (pheader->type != PT_LOAD) {
+			pheader = (programHeader*)((char*)pheader + eHeader->phentsize);
+			continue;
+		}
+		if (exeFormat->numSegments == EXE_MAX_SEGMENTS)
+			return ENOEXEC;
+		segment = &exeFormat->segmentList[exeFormat->numSegments++];
 		segment->lengthInFile = pheader->fileSize;
 		segment->offsetInFile = pheader->offset;
 		segment->protFlags = pheader->flags;
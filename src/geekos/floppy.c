@@ -184,6 +184,7 @@ static struct Thread_Queue s_floppyInterruptWaitQueue;
  * Page of memory used for floppy DMA.
  */
 static uchar_t *s_transferBuf;
+#define FLOPPY_MAX_BLOCKS_PER_TRANSFER (PAGE_SIZE / SECTOR_SIZE)
 
 /*
  * Queue of floppy block I/O requests.
@@ -457,7 +458,12 @@ static bool Floppy_Seek(int drive, int cylinder, int head)
     return success;
 }
 
-static int Floppy_Transfer(int direction, int driveNum, int blockNum, char *buf)
+/*
+ * Transfer numBlocks blocks, starting at blockNum, between the disk
+ * and the DMA transfer buffer.  The blocks must all lie on one track
+ * and fit in the transfer buffer.
+ */
+static int Floppy_Transfer(int direction, int driveNum, int blockNum, int numBlocks)
 {
     struct Floppy_Drive *drive = &s_driveTable[driveNum];
     struct Floppy_Parameters *params = drive->params;
@@ -473,6 +479,8 @@ static int Floppy_Transfer(int direction, int driveNum, int blockNum, char *buf)
     KASSERT(params != 0);
 
     LBA_To_CHS(&s_driveTable[driveNum], blockNum, &cylinder, &head, &sector);
+    KASSERT(numBlocks > 0 && sector + numBlocks - 1 <= params->sectors);
+    KASSERT(numBlocks <= FLOPPY_MAX_BLOCKS_PER_TRANSFER);
 
     if (!Floppy_Seek(driveNum, cylinder, head))
 	return -1;
@@ -480,7 +488,7 @@ static int Floppy_Transfer(int direction, int driveNum, int blockNum, char *buf)
     Disable_Interrupts();
 
     /* Set up DMA for transfer */
-    Setup_DMA(dmaDirection, FDC_DMA, s_transferBuf, SECTOR_SIZE);
+    Setup_DMA(dmaDirection, FDC_DMA, s_transferBuf, numBlocks * SECTOR_SIZE);
 
     /* Turn the floppy motor on */
     Start_Motor(driveNum);
@@ -503,7 +511,7 @@ static int Floppy_Transfer(int direction, int driveNum, int blockNum, char *buf)
     Floppy_Out(head);
     Floppy_Out(sector);
     Floppy_Out(params->sectorSizeCode);
-    Floppy_Out(params->sectors);
+    Floppy_Out(sector + numBlocks - 1);  /* EOT: last sector to transfer */
     Floppy_Out(params->gapLengthCode);
     Floppy_Out(0xFF);  /* DTL */
 
@@ -533,36 +541,73 @@ static int Floppy_Transfer(int direction, int driveNum, int blockNum, char *buf)
     return result;
 }
 
-static int Floppy_Read(int driveNum, int blockNum, char *buffer)
+/*
+ * Get the number of blocks, starting at blockNum, that may be
+ * moved by one Floppy_Transfer(): up to the end of the track,
+ * and no more than fit in the transfer buffer.
+ */
+static int Floppy_Transfer_Count(int driveNum, int blockNum, int numBlocks)
 {
-    int rc;
+    struct Floppy_Parameters *params = s_driveTable[driveNum].params;
+    int untilEndOfTrack = params->sectors - (blockNum % params->sectors);
+
+    if (numBlocks > untilEndOfTrack)
+	numBlocks = untilEndOfTrack;
+    if (numBlocks > FLOPPY_MAX_BLOCKS_PER_TRANSFER)
+	numBlocks = FLOPPY_MAX_BLOCKS_PER_TRANSFER;
+    return numBlocks;
+}
+
+static int Floppy_Read(int driveNum, struct Block_Request *request)
+{
+    int rc = 0, done, count, i;
 
-    Debug("Floppy_Read(%d,%d,%x)\n", driveNum, blockNum, buffer);
+    Debug("Floppy_Read(%d,%d,%d)\n", driveNum, request->blockNum, request->numBlocks);
+
+    for (done = 0; done < request->numBlocks; done += count) {
+	count = Floppy_Transfer_Count(driveNum, request->blockNum + done,
+	    request->numBlocks - done);
 
 #ifndef NDEBUG
-    memset(buffer, (char) 0xcd, SECTOR_SIZE);
-    memset(s_transferBuf, (char) 0xcd, SECTOR_SIZE);
+	memset(s_transferBuf, (char) 0xcd, count * SECTOR_SIZE);
 #endif
 
-    rc = Floppy_Transfer(FLOPPY_READ, driveNum, blockNum, buffer);
+	rc = Floppy_Transfer(FLOPPY_READ, driveNum, request->blockNum + done, count);
+	if (rc != 0)
+	    break;
 
-    if (rc == 0) {
 	/*
 	 * Successful transfer!
 	 * Copy data from transfer buffer into caller's buffer.
 	 */
-	memcpy(buffer, s_transferBuf, SECTOR_SIZE);
+	for (i = 0; i < count; ++i)
+	    memcpy(Get_Request_Block_Buffer(request, done + i),
+		s_transferBuf + i * SECTOR_SIZE, SECTOR_SIZE);
     }
 
     return rc;
 }
 
-static int Floppy_Write(int driveNum, int blockNum, char *buffer)
+static int Floppy_Write(int driveNum, struct Block_Request *request)
 {
-    Debug("Floppy_Write(%d,%d,%x)\n", driveNum, blockNum, buffer);
+    int rc = 0, done, count, i;
+
+    Debug("Floppy_Write(%d,%d,%d)\n", driveNum, request->blockNum, request->numBlocks);
+
+    for (done = 0; done < request->numBlocks; done += count) {
+	count = Floppy_Transfer_Count(driveNum, request->blockNum + done,
+	    request->numBlocks - done);
 
-    memcpy(s_transferBuf, buffer, SECTOR_SIZE);
-    return Floppy_Transfer(FLOPPY_WRITE, driveNum, blockNum, buffer);
+	for (i = 0; i < count; ++i)
+	    memcpy(s_transferBuf + i * SECTOR_SIZE,
+		Get_Request_Block_Buffer(request, done + i), SECTOR_SIZE);
+
+	rc = Floppy_Transfer(FLOPPY_WRITE, driveNum, request->blockNum + done, count);
+	if (rc != 0)
+	    break;
+    }
+
+    return rc;
 }
 
 /*
@@ -585,9 +630,9 @@ static void Floppy_Request_Thread(ulong_t arg)
 
 	/* Perform the I/O. */
 	if (request->type == BLOCK_READ)
-	    rc = Floppy_Read(request->dev->unit, request->blockNum, request->buf);
+	    rc = Floppy_Read(request->dev->unit, request);
 	else
-	    rc = Floppy_Write(request->dev->unit, request->blockNum, request->buf);
+	    rc = Floppy_Write(request->dev->unit, request);
 
 	/* Notify the requesting thread of the outcome of the I/O. */
 	Debug("FRQ: Notifying requesting thread...\n");
@@ -12,6 +12,7 @@
 #include <geekos/kassert.h>
 #include <geekos/screen.h>
 #include <geekos/malloc.h>
+#include <geekos/slab.h>
 #include <geekos/string.h>
 #include <geekos/bitset.h>
 #include <geekos/synch.h>
@@ -34,17 +35,64 @@ typedef struct {
 	struct FS_Buffer_Cache* fscache;
 	struct GOSFS_Dir_Entry rootDirEntry;
 	struct Mutex lock;
+	struct Mutex dirLock;		/* Held while looking up or changing directories */
 	struct GOSFS_File_List fileList;
+	bool extents;			/* Files are mapped by extents, not block pointers */
+	uchar_t *allocMap;		/* Used blocks, plus blocks reserved for appends */
 } GOSFS_Instance;
 
+/*
+ * Blocks reserved past the end of a file being appended to,
+ * so other files' blocks don't end up in between.
+ */
+#define GOSFS_PREALLOC_BLOCKS	16
+
 struct GOSFS_File {
     Dir_Entry_Ptr dirEntryPtr;		/* Entry informations of file */
     struct FS_Buffer *pBuf;			/* Buffer of file */
     struct Mutex lock;			 	/* Synchronize concurrent accesses */
+
+    /*
+     * Block map: the file's size and block pointers, and the pointers
+     * of the indirect blocks most recently gone through, so finding
+     * the next block of a sequential access costs no buffer lookups.
+     * Protected by the file's lock.
+     */
+    bool mapValid;				/* Fields below loaded from the dir entry */
+    bool entryDirty;			/* Size or blockList changed since */
+    ulong_t size;				/* Size of file */
+    ulong_t blockList[GOSFS_NUM_BLOCK_PTRS];	/* Direct and indirect block pointers */
+    ulong_t *indirect;			/* Pointers in the indirect block, or 0 */
+    ulong_t *dblIndirect;			/* Pointers in the doubly-indirect block, or 0 */
+    ulong_t *dblChild;			/* Pointers in one of its second-level blocks, or 0 */
+    ulong_t dblChildIndex;			/* Which second-level block dblChild holds */
+    ulong_t lastBlock;			/* Filesystem block last appended */
+
+    /*
+     * With extents, the blocks hold extents rather than pointers,
+     * and the extent last looked up is kept as a cursor, at given
+     * position in the list and mapping from given file block.
+     */
+    struct GOSFS_Extent cur;		/* count is 0 if no cursor */
+    ulong_t curIndex;
+    ulong_t curFirst;
+
+    int refCount;				/* Number of open File objects */
+    bool deleted;				/* Entry deleted; open Files get ENOTFOUND */
+    ulong_t preallocStart;			/* Blocks reserved for appends */
+    ulong_t preallocCount;
     DEFINE_LINK(GOSFS_File_List, GOSFS_File);
 };
 IMPLEMENT_LIST(GOSFS_File_List, GOSFS_File);
 
+/*
+ * GOSFS_File objects come from an object cache.  They cache the
+ * block map of their directory entry, so they stay on the
+ * instance's list after the last close.  Deleting the entry takes
+ * the object off the list, and frees it once it is not open.
+ */
+static struct Object_Cache *s_gosfsFileCache;
+
 
 /* ----------------------------------------------------------------------
  * Implementation of VFS operations
@@ -56,121 +104,1582 @@ IMPLEMENT_LIST(GOSFS_File_List, GOSFS_File);
 static struct GOSFS_Dir_Entry* Get_Entry_By_Ptr(GOSFS_Instance *instance, Dir_Entry_Ptr* dirEntryPtr)
 {
 	struct FS_Buffer *pBuf;
+	struct GOSFS_Dir_Entry *entry;
 
 	if(dirEntryPtr->base == 0){ /* Check whether root directory */
 		return &instance->rootDirEntry;
 	}
 
-	if(Get_FS_Buffer(instance->fscache, dirEntryPtr->base, &pBuf) != 0)
-	{		
-		Print("Get_FS_Buffer Error.\n");
-		return NULL;
+	if(Get_FS_Buffer(instance->fscache, dirEntryPtr->base, &pBuf) != 0)
+	{		
+		Print("Get_FS_Buffer Error.\n");
+		return NULL;
+	}
+
+	entry = &((struct GOSFS_Dir_Entry*)pBuf->data)[dirEntryPtr->offset];
+	Release_FS_Buffer(instance->fscache, pBuf);
+	return entry;
+}
+
+/*
+ * Load the size and block pointers of a file from its directory entry,
+ * unless they are already in its block map.
+ */
+static int Load_Block_Map(GOSFS_Instance *instance, struct GOSFS_File *gosfsFile)
+{
+    struct FS_Buffer *pBuf;
+    struct GOSFS_Dir_Entry *entry;
+    int rc;
+
+    if (gosfsFile->deleted)
+	return ENOTFOUND;
+    if (gosfsFile->mapValid)
+	return 0;
+
+    if ((rc = Get_FS_Buffer(instance->fscache, gosfsFile->dirEntryPtr.base, &pBuf)) != 0)
+	return rc;
+    entry = &((struct GOSFS_Dir_Entry*) pBuf->data)[gosfsFile->dirEntryPtr.offset];
+    gosfsFile->size = entry->size;
+    memcpy(gosfsFile->blockList, entry->blockList, sizeof(gosfsFile->blockList));
+    Release_FS_Buffer(instance->fscache, pBuf);
+
+    gosfsFile->mapValid = true;
+    gosfsFile->entryDirty = false;
+    gosfsFile->lastBlock = 0;
+    gosfsFile->cur.count = 0;
+    return 0;
+}
+
+/*
+ * Write the size and block pointers of a file back to its
+ * directory entry, if they changed.
+ */
+static int Store_Block_Map(GOSFS_Instance *instance, struct GOSFS_File *gosfsFile)
+{
+    struct FS_Buffer *pBuf;
+    struct GOSFS_Dir_Entry *entry;
+    int rc;
+
+    if (!gosfsFile->entryDirty)
+	return 0;
+
+    if ((rc = Get_FS_Buffer(instance->fscache, gosfsFile->dirEntryPtr.base, &pBuf)) != 0)
+	return rc;
+    entry = &((struct GOSFS_Dir_Entry*) pBuf->data)[gosfsFile->dirEntryPtr.offset];
+    entry->size = gosfsFile->size;
+    memcpy(entry->blockList, gosfsFile->blockList, sizeof(entry->blockList));
+    Modify_FS_Buffer(instance->fscache, pBuf);
+    Release_FS_Buffer(instance->fscache, pBuf);
+
+    gosfsFile->entryDirty = false;
+    return 0;
+}
+
+/*
+ * Give back blocks.  The caller must hold the instance lock.
+ * Blocks that were only reserved are in allocMap alone.
+ */
+static void Free_FS_Blocks(GOSFS_Instance *instance, ulong_t start, ulong_t count, bool reserved)
+{
+    Super_Block *superBlock = (Super_Block*) instance->fsinfo->data;
+    ulong_t i;
+
+    for (i = start; i < start + count; ++i) {
+	Clear_Bit(instance->allocMap, i);
+	if (!reserved)
+	    Clear_Bit(superBlock->bitmap, i);
+    }
+    if (!reserved)
+	Modify_FS_Buffer(instance->fscache, instance->fsinfo);
+}
+
+/*
+ * Let go of the blocks reserved for appends to a file.
+ */
+static void Release_Prealloc(GOSFS_Instance *instance, struct GOSFS_File *gosfsFile)
+{
+    if (gosfsFile->preallocCount == 0)
+	return;
+
+    Mutex_Lock(&instance->lock);
+    Free_FS_Blocks(instance, gosfsFile->preallocStart, gosfsFile->preallocCount, true);
+    Mutex_Unlock(&instance->lock);
+    gosfsFile->preallocCount = 0;
+}
+
+/*
+ * Find the GOSFS_File object for the directory entry at given
+ * position, if there is one.  The caller must hold the instance lock.
+ */
+static struct GOSFS_File *Find_GOSFS_File_Locked(GOSFS_Instance *instance, Dir_Entry_Ptr *dirEntryPtr)
+{
+    struct GOSFS_File *gosfsFile;
+
+    for (gosfsFile = Get_Front_Of_GOSFS_File_List(&instance->fileList);
+	 gosfsFile != 0;
+	 gosfsFile = Get_Next_In_GOSFS_File_List(gosfsFile)) {
+	if (gosfsFile->dirEntryPtr.base == dirEntryPtr->base &&
+	    gosfsFile->dirEntryPtr.offset == dirEntryPtr->offset)
+	    break;
+    }
+
+    return gosfsFile;
+}
+
+/*
+ * Same, taking the instance lock.
+ */
+static struct GOSFS_File *Find_GOSFS_File(GOSFS_Instance *instance, Dir_Entry_Ptr *dirEntryPtr)
+{
+    struct GOSFS_File *gosfsFile;
+
+    Mutex_Lock(&instance->lock);
+    gosfsFile = Find_GOSFS_File_Locked(instance, dirEntryPtr);
+    Mutex_Unlock(&instance->lock);
+
+    return gosfsFile;
+}
+
+/*
+ * Give back the block map of a file.  The caller must hold its lock.
+ */
+static void Drop_Block_Map(GOSFS_Instance *instance, struct GOSFS_File *gosfsFile)
+{
+    Release_Prealloc(instance, gosfsFile);
+    if (gosfsFile->indirect != 0)
+	Free(gosfsFile->indirect);
+    if (gosfsFile->dblIndirect != 0)
+	Free(gosfsFile->dblIndirect);
+    if (gosfsFile->dblChild != 0)
+	Free(gosfsFile->dblChild);
+    gosfsFile->indirect = gosfsFile->dblIndirect = gosfsFile->dblChild = 0;
+    gosfsFile->mapValid = false;
+    gosfsFile->entryDirty = false;
+}
+
+/*
+ * The directory entry at given position is being deleted.  Take its
+ * GOSFS_File object off the instance's list, so a new entry in the
+ * same slot gets a fresh one, and make Files still open on it fail.
+ * The object is freed here, or by the last close.  The caller holds
+ * the directory lock, and must not hold any FS_Buffer: the file lock
+ * is always taken before those.
+ */
+static void Detach_GOSFS_File(GOSFS_Instance *instance, Dir_Entry_Ptr *dirEntryPtr)
+{
+    struct GOSFS_File *gosfsFile;
+    bool unused;
+
+    Mutex_Lock(&instance->lock);
+    if ((gosfsFile = Find_GOSFS_File_Locked(instance, dirEntryPtr)) != 0)
+	Remove_From_GOSFS_File_List(&instance->fileList, gosfsFile);
+    Mutex_Unlock(&instance->lock);
+    if (gosfsFile == 0)
+	return;
+
+    Mutex_Lock(&gosfsFile->lock);
+    Drop_Block_Map(instance, gosfsFile);
+    gosfsFile->deleted = true;
+    unused = (gosfsFile->refCount == 0);
+    Mutex_Unlock(&gosfsFile->lock);
+
+    if (unused)
+	Cache_Free(s_gosfsFileCache, gosfsFile);
+}
+
+/*
+ * Choose a free block near the goal: the goal itself, else the start
+ * of the next run of eight free blocks, so the file has room to grow,
+ * else the next free block.
+ * The caller must hold the instance lock.
+ */
+static int Find_Free_Block(GOSFS_Instance *instance, ulong_t goal)
+{
+    Super_Block *superBlock = (Super_Block*) instance->fsinfo->data;
+    ulong_t numBlocks = superBlock->size;
+    ulong_t numBytes = numBlocks / 8;
+    uchar_t *map = instance->allocMap;
+    ulong_t i;
+
+    if (goal >= numBlocks)
+	goal = 0;
+
+    if (!Is_Bit_Set(map, goal))
+	return goal;
+
+    for (i = 1; numBytes > 0 && i <= numBytes; ++i) {
+	ulong_t byte = (goal / 8 + i) % numBytes;
+	if (map[byte] == 0)
+	    return byte * 8;
+    }
+
+    for (i = 1; i < numBlocks; ++i) {
+	ulong_t block = (goal + i) % numBlocks;
+	if (!Is_Bit_Set(map, block))
+	    return block;
+    }
+
+    return -1;
+}
+
+/*
+ * Allocate a free filesystem block as near the goal as possible.
+ * If it will hold block pointers, it is cleared.
+ */
+static int Alloc_FS_Block(GOSFS_Instance *instance, ulong_t goal, bool clear, ulong_t *pFsBlock)
+{
+    Super_Block *superBlock = (Super_Block*) instance->fsinfo->data;
+    struct FS_Buffer *pBuf;
+    int freeBit, rc;
+
+    Mutex_Lock(&instance->lock);
+    freeBit = Find_Free_Block(instance, goal);
+    if (freeBit < 0) {
+	Mutex_Unlock(&instance->lock);
+	return ENOSPACE;
+    }
+    Set_Bit(instance->allocMap, freeBit);
+    Set_Bit(superBlock->bitmap, freeBit);
+    Modify_FS_Buffer(instance->fscache, instance->fsinfo);
+    Mutex_Unlock(&instance->lock);
+
+    if (clear) {
+	if ((rc = Get_FS_Buffer(instance->fscache, freeBit, &pBuf)) != 0)
+	    return rc;
+	memset(pBuf->data, '\0', GOSFS_FS_BLOCK_SIZE);
+	Modify_FS_Buffer(instance->fscache, pBuf);
+	Release_FS_Buffer(instance->fscache, pBuf);
+    }
+
+    *pFsBlock = freeBit;
+    return 0;
+}
+
+/*
+ * Allocate the block to append to a file.  It is taken from the
+ * blocks reserved for the file if there are any; otherwise it is
+ * allocated near the goal, and the free blocks following it are
+ * reserved for the appends to come.
+ */
+static int Alloc_File_Block(GOSFS_Instance *instance, struct GOSFS_File *gosfsFile,
+    ulong_t goal, ulong_t *pFsBlock)
+{
+    Super_Block *superBlock = (Super_Block*) instance->fsinfo->data;
+    ulong_t fsBlock;
+    int rc;
+
+    if (gosfsFile->preallocCount > 0) {
+	fsBlock = gosfsFile->preallocStart++;
+	--gosfsFile->preallocCount;
+	Mutex_Lock(&instance->lock);
+	Set_Bit(superBlock->bitmap, fsBlock);
+	Modify_FS_Buffer(instance->fscache, instance->fsinfo);
+	Mutex_Unlock(&instance->lock);
+    } else {
+	if ((rc = Alloc_FS_Block(instance, goal, false, &fsBlock)) < 0)
+	    return rc;
+
+	Mutex_Lock(&instance->lock);
+	gosfsFile->preallocStart = fsBlock + 1;
+	while (gosfsFile->preallocCount < GOSFS_PREALLOC_BLOCKS &&
+	       gosfsFile->preallocStart + gosfsFile->preallocCount < (ulong_t) superBlock->size &&
+	       !Is_Bit_Set(instance->allocMap, gosfsFile->preallocStart + gosfsFile->preallocCount)) {
+	    Set_Bit(instance->allocMap, gosfsFile->preallocStart + gosfsFile->preallocCount);
+	    ++gosfsFile->preallocCount;
+	}
+	Mutex_Unlock(&instance->lock);
+    }
+
+    gosfsFile->lastBlock = fsBlock;
+    *pFsBlock = fsBlock;
+    return 0;
+}
+
+/*
+ * Where to look for the next block of a file: after the block last
+ * appended, else near its directory.
+ */
+static __inline__ ulong_t Block_Goal(struct GOSFS_File *gosfsFile)
+{
+    return gosfsFile->lastBlock != 0 ? gosfsFile->lastBlock + 1 : gosfsFile->dirEntryPtr.base;
+}
+
+/*
+ * Make sure *pPtrs holds the pointers stored in given indirect block.
+ * A block just allocated holds no pointers yet, so it isn't read.
+ */
+static int Load_Ptr_Block(GOSFS_Instance *instance, ulong_t fsBlock, bool fresh, ulong_t **pPtrs)
+{
+    struct FS_Buffer *pBuf;
+    int rc;
+
+    if (*pPtrs == 0) {
+	*pPtrs = (ulong_t*) Malloc(GOSFS_FS_BLOCK_SIZE);
+	if (*pPtrs == 0)
+	    return ENOMEM;
+    }
+
+    if (fresh) {
+	memset(*pPtrs, '\0', GOSFS_FS_BLOCK_SIZE);
+	return 0;
+    }
+
+    if ((rc = Get_FS_Buffer(instance->fscache, fsBlock, &pBuf)) != 0) {
+	/* Don't leave a cache that looks valid */
+	Free(*pPtrs);
+	*pPtrs = 0;
+	return rc;
+    }
+    memcpy(*pPtrs, pBuf->data, GOSFS_FS_BLOCK_SIZE);
+    Release_FS_Buffer(instance->fscache, pBuf);
+    return 0;
+}
+
+/*
+ * Store values in an indirect block, and in its cached copy.
+ */
+static int Store_Ptrs(GOSFS_Instance *instance, ulong_t fsBlock, ulong_t *ptrs,
+    ulong_t index, const ulong_t *values, ulong_t count)
+{
+    struct FS_Buffer *pBuf;
+    int rc;
+
+    if ((rc = Get_FS_Buffer(instance->fscache, fsBlock, &pBuf)) != 0)
+	return rc;
+    memcpy((ulong_t*) pBuf->data + index, values, count * sizeof(ulong_t));
+    Modify_FS_Buffer(instance->fscache, pBuf);
+    Release_FS_Buffer(instance->fscache, pBuf);
+
+    memcpy(ptrs + index, values, count * sizeof(ulong_t));
+    return 0;
+}
+
+/*
+ * Look up a pointer in the dir entry's blockList or an indirect
+ * block; if it is missing and allocate is set, allocate the block
+ * it should point to.  Data blocks are appended to the file;
+ * indirect blocks are cleared.
+ * Returns 1 if the block was allocated, 0 if it was there already
+ * (or is a hole), or an error code (< 0).
+ */
+static int Get_Ptr(GOSFS_Instance *instance, struct GOSFS_File *gosfsFile,
+    ulong_t ptrBlock, ulong_t *ptrs, ulong_t index, bool allocate, bool indirect,
+    ulong_t *pFsBlock)
+{
+    ulong_t fsBlock = ptrs[index];
+    int rc;
+
+    if (fsBlock == 0 && allocate) {
+	/* Reopened: continue after the block before this one */
+	if (gosfsFile->lastBlock == 0 && index > 0)
+	    gosfsFile->lastBlock = ptrs[index - 1];
+
+	if (indirect)
+	    rc = Alloc_FS_Block(instance, Block_Goal(gosfsFile), true, &fsBlock);
+	else
+	    rc = Alloc_File_Block(instance, gosfsFile, Block_Goal(gosfsFile), &fsBlock);
+	if (rc < 0)
+	    return rc;
+
+	if (ptrs == gosfsFile->blockList) {
+	    ptrs[index] = fsBlock;
+	    gosfsFile->entryDirty = true;
+	} else if ((rc = Store_Ptrs(instance, ptrBlock, ptrs, index, &fsBlock, 1)) < 0) {
+	    return rc;
+	}
+	*pFsBlock = fsBlock;
+	return 1;
+    }
+
+    *pFsBlock = fsBlock;
+    return 0;
+}
+
+/*
+ * Find the filesystem block holding given block of a file mapped by
+ * block pointers.  The pointers of the indirect blocks on the way are
+ * kept in the file's block map, so they are only read when the access
+ * moves on to another indirect block.
+ */
+static int Get_Pointer_Block(GOSFS_Instance *instance, struct GOSFS_File *gosfsFile,
+    ulong_t blockNum, bool allocate, ulong_t *pFsBlock)
+{
+    ulong_t ptrBlock, childBlock, childIndex;
+    int rc;
+
+    if (blockNum < GOSFS_NUM_DIRECT_BLOCKS)
+	return Get_Ptr(instance, gosfsFile, 0, gosfsFile->blockList, blockNum,
+	    allocate, false, pFsBlock);
+    blockNum -= GOSFS_NUM_DIRECT_BLOCKS;
+
+    if (blockNum < GOSFS_NUM_PTRS_PER_BLOCK) {
+	/* Singly-indirect */
+	rc = Get_Ptr(instance, gosfsFile, 0, gosfsFile->blockList, GOSFS_NUM_DIRECT_BLOCKS,
+	    allocate, true, &ptrBlock);
+	if (rc < 0)
+	    return rc;
+	if (ptrBlock == 0) {
+	    *pFsBlock = 0;
+	    return 0;
+	}
+	if (gosfsFile->indirect == 0 || rc == 1) {
+	    if ((rc = Load_Ptr_Block(instance, ptrBlock, rc == 1, &gosfsFile->indirect)) < 0)
+		return rc;
+	}
+	return Get_Ptr(instance, gosfsFile, ptrBlock, gosfsFile->indirect, blockNum,
+	    allocate, false, pFsBlock);
+    }
+    blockNum -= GOSFS_NUM_PTRS_PER_BLOCK;
+
+    if (blockNum >= GOSFS_NUM_PTRS_PER_BLOCK * GOSFS_NUM_PTRS_PER_BLOCK)
+	return EINVALID;
+
+    /* Doubly-indirect */
+    rc = Get_Ptr(instance, gosfsFile, 0, gosfsFile->blockList,
+	GOSFS_NUM_DIRECT_BLOCKS + GOSFS_NUM_INDIRECT_BLOCKS, allocate, true, &ptrBlock);
+    if (rc < 0)
+	return rc;
+    if (ptrBlock == 0) {
+	*pFsBlock = 0;
+	return 0;
+    }
+    if (gosfsFile->dblIndirect == 0 || rc == 1) {
+	if ((rc = Load_Ptr_Block(instance, ptrBlock, rc == 1, &gosfsFile->dblIndirect)) < 0)
+	    return rc;
+	gosfsFile->dblChildIndex = ULONG_MAX;
+    }
+
+    childIndex = blockNum / GOSFS_NUM_PTRS_PER_BLOCK;
+    rc = Get_Ptr(instance, gosfsFile, ptrBlock, gosfsFile->dblIndirect, childIndex,
+	allocate, true, &childBlock);
+    if (rc < 0)
+	return rc;
+    if (childBlock == 0) {
+	*pFsBlock = 0;
+	return 0;
+    }
+    if (gosfsFile->dblChild == 0 || gosfsFile->dblChildIndex != childIndex || rc == 1) {
+	gosfsFile->dblChildIndex = ULONG_MAX;
+	if ((rc = Load_Ptr_Block(instance, childBlock, rc == 1, &gosfsFile->dblChild)) < 0)
+	    return rc;
+	gosfsFile->dblChildIndex = childIndex;
+    }
+    return Get_Ptr(instance, gosfsFile, childBlock, gosfsFile->dblChild,
+	blockNum % GOSFS_NUM_PTRS_PER_BLOCK, allocate, false, pFsBlock);
+}
+
+/*
+ * Get the extent at given position in a file's extent list;
+ * past the end of the list, its count is 0.
+ */
+static int Get_Extent(GOSFS_Instance *instance, struct GOSFS_File *gosfsFile,
+    ulong_t index, struct GOSFS_Extent *extent)
+{
+    struct GOSFS_Extent_Index *extentIndex;
+    ulong_t child;
+    int rc;
+
+    extent->count = 0;
+
+    if (index < GOSFS_NUM_INLINE_EXTENTS) {
+	*extent = ((struct GOSFS_Extent*) gosfsFile->blockList)[index];
+	return 0;
+    }
+    index -= GOSFS_NUM_INLINE_EXTENTS;
+
+    if (index < GOSFS_EXTENTS_PER_BLOCK) {
+	ulong_t block = gosfsFile->blockList[GOSFS_NUM_DIRECT_BLOCKS];
+	if (block == 0)
+	    return 0;
+	if (gosfsFile->indirect == 0 &&
+	    (rc = Load_Ptr_Block(instance, block, false, &gosfsFile->indirect)) < 0)
+	    return rc;
+	*extent = ((struct GOSFS_Extent*) gosfsFile->indirect)[index];
+	return 0;
+    }
+    index -= GOSFS_EXTENTS_PER_BLOCK;
+
+    child = index / GOSFS_EXTENTS_PER_BLOCK;
+    if (child >= GOSFS_EXTENTS_PER_BLOCK ||
+	gosfsFile->blockList[GOSFS_NUM_DIRECT_BLOCKS + GOSFS_NUM_INDIRECT_BLOCKS] == 0)
+	return 0;
+    if (gosfsFile->dblIndirect == 0) {
+	rc = Load_Ptr_Block(instance, gosfsFile->blockList[GOSFS_NUM_DIRECT_BLOCKS + GOSFS_NUM_INDIRECT_BLOCKS],
+	    false, &gosfsFile->dblIndirect);
+	if (rc < 0)
+	    return rc;
+	gosfsFile->dblChildIndex = ULONG_MAX;
+    }
+    extentIndex = &((struct GOSFS_Extent_Index*) gosfsFile->dblIndirect)[child];
+    if (extentIndex->block == 0)
+	return 0;
+    if (gosfsFile->dblChild == 0 || gosfsFile->dblChildIndex != child) {
+	gosfsFile->dblChildIndex = ULONG_MAX;
+	if ((rc = Load_Ptr_Block(instance, extentIndex->block, false, &gosfsFile->dblChild)) < 0)
+	    return rc;
+	gosfsFile->dblChildIndex = child;
+    }
+    *extent = ((struct GOSFS_Extent*) gosfsFile->dblChild)[index % GOSFS_EXTENTS_PER_BLOCK];
+    return 0;
+}
+
+/*
+ * Store the extent at given position in a file's extent list, mapping
+ * from given file block; blocks to hold it are allocated as needed.
+ */
+static int Set_Extent(GOSFS_Instance *instance, struct GOSFS_File *gosfsFile,
+    ulong_t index, struct GOSFS_Extent *extent, ulong_t firstBlock)
+{
+    ulong_t *slot, child, block;
+    int rc;
+
+    if (index < GOSFS_NUM_INLINE_EXTENTS) {
+	((struct GOSFS_Extent*) gosfsFile->blockList)[index] = *extent;
+	gosfsFile->entryDirty = true;
+	return 0;
+    }
+    index -= GOSFS_NUM_INLINE_EXTENTS;
+
+    if (index < GOSFS_EXTENTS_PER_BLOCK) {
+	slot = &gosfsFile->blockList[GOSFS_NUM_DIRECT_BLOCKS];
+	if (*slot == 0) {
+	    if ((rc = Alloc_FS_Block(instance, extent->start, true, &block)) < 0)
+		return rc;
+	    *slot = block;
+	    gosfsFile->entryDirty = true;
+	    if ((rc = Load_Ptr_Block(instance, block, true, &gosfsFile->indirect)) < 0)
+		return rc;
+	} else if (gosfsFile->indirect == 0 &&
+		   (rc = Load_Ptr_Block(instance, *slot, false, &gosfsFile->indirect)) < 0) {
+	    return rc;
+	}
+	return Store_Ptrs(instance, *slot, gosfsFile->indirect, index * 2, (ulong_t*) extent, 2);
+    }
+    index -= GOSFS_EXTENTS_PER_BLOCK;
+
+    child = index / GOSFS_EXTENTS_PER_BLOCK;
+    if (child >= GOSFS_EXTENTS_PER_BLOCK)
+	return ENOSPACE;	/* too many extents */
+
+    slot = &gosfsFile->blockList[GOSFS_NUM_DIRECT_BLOCKS + GOSFS_NUM_INDIRECT_BLOCKS];
+    if (*slot == 0) {
+	if ((rc = Alloc_FS_Block(instance, extent->start, true, &block)) < 0)
+	    return rc;
+	*slot = block;
+	gosfsFile->entryDirty = true;
+	if ((rc = Load_Ptr_Block(instance, block, true, &gosfsFile->dblIndirect)) < 0)
+	    return rc;
+	gosfsFile->dblChildIndex = ULONG_MAX;
+    } else if (gosfsFile->dblIndirect == 0) {
+	if ((rc = Load_Ptr_Block(instance, *slot, false, &gosfsFile->dblIndirect)) < 0)
+	    return rc;
+	gosfsFile->dblChildIndex = ULONG_MAX;
+    }
+
+    block = ((struct GOSFS_Extent_Index*) gosfsFile->dblIndirect)[child].block;
+    if (block == 0) {
+	struct GOSFS_Extent_Index extentIndex;
+
+	if ((rc = Alloc_FS_Block(instance, extent->start, true, &block)) < 0)
+	    return rc;
+	extentIndex.block = block;
+	extentIndex.firstBlock = firstBlock;
+	rc = Store_Ptrs(instance, *slot, gosfsFile->dblIndirect, child * 2, (ulong_t*) &extentIndex, 2);
+	if (rc < 0)
+	    return rc;
+	gosfsFile->dblChildIndex = ULONG_MAX;
+	if ((rc = Load_Ptr_Block(instance, block, true, &gosfsFile->dblChild)) < 0)
+	    return rc;
+	gosfsFile->dblChildIndex = child;
+    } else if (gosfsFile->dblChild == 0 || gosfsFile->dblChildIndex != child) {
+	gosfsFile->dblChildIndex = ULONG_MAX;
+	if ((rc = Load_Ptr_Block(instance, block, false, &gosfsFile->dblChild)) < 0)
+	    return rc;
+	gosfsFile->dblChildIndex = child;
+    }
+    return Store_Ptrs(instance, block, gosfsFile->dblChild,
+	(index % GOSFS_EXTENTS_PER_BLOCK) * 2, (ulong_t*) extent, 2);
+}
+
+/*
+ * Move a file's extent cursor to the extent mapping given block.
+ * Sequential access finds it at or just after the cursor; other
+ * lookups start over, skipping whole blocks of extents through the
+ * doubly-indirect index.  If the block is past the last extent,
+ * the cursor is left on the last extent.
+ * Returns 1 if the block is mapped, 0 if not, or an error code (< 0).
+ */
+static int Find_Extent(GOSFS_Instance *instance, struct GOSFS_File *gosfsFile, ulong_t blockNum)
+{
+    const ulong_t dblStart = GOSFS_NUM_INLINE_EXTENTS + GOSFS_EXTENTS_PER_BLOCK;
+    struct GOSFS_Extent extent;
+    ulong_t index, first;
+    int rc;
+
+    if (gosfsFile->cur.count != 0 && blockNum >= gosfsFile->curFirst) {
+	if (blockNum < gosfsFile->curFirst + gosfsFile->cur.count)
+	    return 1;
+	index = gosfsFile->curIndex + 1;
+	first = gosfsFile->curFirst + gosfsFile->cur.count;
+    } else {
+	gosfsFile->cur.count = 0;
+	index = 0;
+	first = 0;
+    }
+
+    for (;;) {
+	/* At the start of a block of extents: skip those that end before the block */
+	if (index >= dblStart && (index - dblStart) % GOSFS_EXTENTS_PER_BLOCK == 0 &&
+	    gosfsFile->dblIndirect != 0) {
+	    struct GOSFS_Extent_Index *extentIndex = (struct GOSFS_Extent_Index*) gosfsFile->dblIndirect;
+	    ulong_t child = (index - dblStart) / GOSFS_EXTENTS_PER_BLOCK;
+
+	    while (child + 1 < GOSFS_EXTENTS_PER_BLOCK && extentIndex[child + 1].block != 0 &&
+		   extentIndex[child + 1].firstBlock <= blockNum)
+		++child;
+	    if (dblStart + child * GOSFS_EXTENTS_PER_BLOCK != index) {
+		index = dblStart + child * GOSFS_EXTENTS_PER_BLOCK;
+		first = extentIndex[child].firstBlock;
+	    }
+	}
+
+	if ((rc = Get_Extent(instance, gosfsFile, index, &extent)) < 0)
+	    return rc;
+	if (extent.count == 0)
+	    return 0;
+
+	gosfsFile->cur = extent;
+	gosfsFile->curIndex = index;
+	gosfsFile->curFirst = first;
+	if (blockNum < first + extent.count)
+	    return 1;
+
+	++index;
+	first += extent.count;
+    }
+}
+
+/*
+ * Find the filesystem block holding given block of a file mapped by
+ * extents.  Blocks can only be allocated at the end of the file;
+ * one following the last extent just makes it longer.
+ */
+static int Get_Extent_Block(GOSFS_Instance *instance, struct GOSFS_File *gosfsFile,
+    ulong_t blockNum, bool allocate, ulong_t *pFsBlock)
+{
+    struct GOSFS_Extent extent;
+    ulong_t index, first, fsBlock;
+    int rc;
+
+    if ((rc = Find_Extent(instance, gosfsFile, blockNum)) < 0)
+	return rc;
+    if (rc == 1) {
+	*pFsBlock = gosfsFile->cur.start + (blockNum - gosfsFile->curFirst);
+	return 0;
+    }
+    if (!allocate) {
+	*pFsBlock = 0;
+	return 0;
+    }
+
+    /* Writes don't go past the end of the file, so there are no holes */
+    first = gosfsFile->cur.count != 0 ? gosfsFile->curFirst + gosfsFile->cur.count : 0;
+    if (blockNum != first)
+	return EINVALID;
+
+    if (gosfsFile->cur.count != 0 && gosfsFile->lastBlock == 0)
+	gosfsFile->lastBlock = gosfsFile->cur.start + gosfsFile->cur.count - 1;
+    if ((rc = Alloc_File_Block(instance, gosfsFile, Block_Goal(gosfsFile), &fsBlock)) < 0)
+	return rc;
+
+    if (gosfsFile->cur.count != 0 && fsBlock == gosfsFile->cur.start + gosfsFile->cur.count) {
+	extent = gosfsFile->cur;
+	++extent.count;
+	index = gosfsFile->curIndex;
+	first = gosfsFile->curFirst;
+    } else {
+	extent.start = fsBlock;
+	extent.count = 1;
+	index = gosfsFile->cur.count != 0 ? gosfsFile->curIndex + 1 : 0;
+    }
+
+    if ((rc = Set_Extent(instance, gosfsFile, index, &extent, first)) < 0) {
+	Mutex_Lock(&instance->lock);
+	Free_FS_Blocks(instance, fsBlock, 1, false);
+	Mutex_Unlock(&instance->lock);
+	return rc;
+    }
+    gosfsFile->cur = extent;
+    gosfsFile->curIndex = index;
+    gosfsFile->curFirst = first;
+
+    *pFsBlock = fsBlock;
+    return 1;
+}
+
+/*
+ * Find the filesystem block holding given block of a file.
+ * If allocate is set, missing blocks are allocated; otherwise a hole
+ * comes back as block 0.
+ * Called with the file's lock held and its block map loaded.
+ * Returns 1 if the data block was allocated, 0 if not, or an error
+ * code (< 0).
+ */
+static int Get_File_Block(GOSFS_Instance *instance, struct GOSFS_File *gosfsFile,
+    ulong_t blockNum, bool allocate, ulong_t *pFsBlock)
+{
+    KASSERT(gosfsFile->mapValid);
+
+    if (instance->extents)
+	return Get_Extent_Block(instance, gosfsFile, blockNum, allocate, pFsBlock);
+    else
+	return Get_Pointer_Block(instance, gosfsFile, blockNum, allocate, pFsBlock);
+}
+
+/*
+ * Give back the blocks of an indirect block, and the block itself.
+ * Called with the instance lock held.
+ */
+static int Free_Ptr_Block(GOSFS_Instance *instance, ulong_t fsBlock, int depth)
+{
+    struct FS_Buffer *pBuf;
+    ulong_t i;
+    int rc = 0;
+
+    if (depth > 0) {
+	if ((rc = Get_FS_Buffer(instance->fscache, fsBlock, &pBuf)) != 0)
+	    return rc;
+	for (i = 0; i < GOSFS_NUM_PTRS_PER_BLOCK; ++i) {
+	    ulong_t ptr = ((ulong_t*) pBuf->data)[i];
+	    if (ptr != 0 && (rc = Free_Ptr_Block(instance, ptr, depth - 1)) < 0)
+		break;
+	}
+	Release_FS_Buffer(instance->fscache, pBuf);
+	if (rc < 0)
+	    return rc;
+    }
+
+    Free_FS_Blocks(instance, fsBlock, 1, false);
+    return 0;
+}
+
+/*
+ * Give back the extents in a block of extents, and the block itself.
+ * Called with the instance lock held.
+ */
+static int Free_Extent_Block(GOSFS_Instance *instance, ulong_t fsBlock)
+{
+    struct FS_Buffer *pBuf;
+    struct GOSFS_Extent *extent;
+    ulong_t i;
+    int rc;
+
+    if ((rc = Get_FS_Buffer(instance->fscache, fsBlock, &pBuf)) != 0)
+	return rc;
+    extent = (struct GOSFS_Extent*) pBuf->data;
+    for (i = 0; i < GOSFS_EXTENTS_PER_BLOCK && extent[i].count != 0; ++i)
+	Free_FS_Blocks(instance, extent[i].start, extent[i].count, false);
+    Release_FS_Buffer(instance->fscache, pBuf);
+
+    Free_FS_Blocks(instance, fsBlock, 1, false);
+    return 0;
+}
+
+/*
+ * Give back all the blocks of a file.
+ */
+static int Free_File_Blocks(GOSFS_Instance *instance, struct GOSFS_Dir_Entry *entry)
+{
+    struct GOSFS_Extent *extent = (struct GOSFS_Extent*) entry->blockList;
+    ulong_t dblBlock = entry->blockList[GOSFS_NUM_DIRECT_BLOCKS + GOSFS_NUM_INDIRECT_BLOCKS];
+    struct FS_Buffer *pBuf;
+    ulong_t i;
+    int rc = 0;
+
+    Mutex_Lock(&instance->lock);
+
+    if (!instance->extents) {
+	for (i = 0; i < GOSFS_NUM_BLOCK_PTRS && rc == 0; ++i) {
+	    int depth = (i < GOSFS_NUM_DIRECT_BLOCKS) ? 0
+		: (i < GOSFS_NUM_DIRECT_BLOCKS + GOSFS_NUM_INDIRECT_BLOCKS) ? 1 : 2;
+	    if (entry->blockList[i] != 0)
+		rc = Free_Ptr_Block(instance, entry->blockList[i], depth);
+	}
+	goto done;
+    }
+
+    for (i = 0; i < GOSFS_NUM_INLINE_EXTENTS && extent[i].count != 0; ++i)
+	Free_FS_Blocks(instance, extent[i].start, extent[i].count, false);
+    if (entry->blockList[GOSFS_NUM_DIRECT_BLOCKS] != 0 &&
+	(rc = Free_Extent_Block(instance, entry->blockList[GOSFS_NUM_DIRECT_BLOCKS])) < 0)
+	goto done;
+    if (dblBlock != 0) {
+	struct GOSFS_Extent_Index *extentIndex;
+
+	if ((rc = Get_FS_Buffer(instance->fscache, dblBlock, &pBuf)) != 0)
+	    goto done;
+	extentIndex = (struct GOSFS_Extent_Index*) pBuf->data;
+	for (i = 0; i < GOSFS_EXTENTS_PER_BLOCK && extentIndex[i].block != 0 && rc == 0; ++i)
+	    rc = Free_Extent_Block(instance, extentIndex[i].block);
+	Release_FS_Buffer(instance->fscache, pBuf);
+	if (rc == 0)
+	    Free_FS_Blocks(instance, dblBlock, 1, false);
+    }
+
+done:
+    Mutex_Unlock(&instance->lock);
+    return rc;
+}
+
+static int GOSFS_FStat(struct File *file, struct VFS_File_Stat *stat)
+{
+    struct GOSFS_File *gosfsFile = (struct GOSFS_File*) file->fsData;
+    GOSFS_Instance *instance = (GOSFS_Instance*) file->mountPoint->fsData;
+    struct FS_Buffer *pBuf;
+    struct GOSFS_Dir_Entry *entry;
+    int rc;
+
+    Mutex_Lock(&gosfsFile->lock);
+    if ((rc = Load_Block_Map(instance, gosfsFile)) == 0 &&
+	(rc = Get_FS_Buffer(instance->fscache, gosfsFile->dirEntryPtr.base, &pBuf)) == 0) {
+	entry = &((struct GOSFS_Dir_Entry*) pBuf->data)[gosfsFile->dirEntryPtr.offset];
+	stat->size = gosfsFile->size;
+	stat->isDirectory = (entry->flags & GOSFS_DIRENTRY_ISDIRECTORY) ? 1 : 0;
+	stat->isSetuid = (entry->flags & GOSFS_DIRENTRY_SETUID) ? 1 : 0;
+	memcpy(stat->acls, entry->acl, sizeof(stat->acls));
+	Release_FS_Buffer(instance->fscache, pBuf);
+    }
+    Mutex_Unlock(&gosfsFile->lock);
+
+    return rc;
+}
+
+/*
+ * Have given blocks of a file read into the buffer cache in the
+ * background, in runs of consecutive filesystem blocks.
+ * Called with the file's lock held and its block map loaded.
+ */
+static void Readahead_File_Blocks(GOSFS_Instance *instance, struct GOSFS_File *gosfsFile,
+    ulong_t start, ulong_t end)
+{
+    struct GOSFS_Extent cur = gosfsFile->cur;
+    ulong_t curIndex = gosfsFile->curIndex, curFirst = gosfsFile->curFirst;
+    ulong_t runStart = 0, runLength = 0, fsBlock, i;
+
+    for (i = start; i < end; ++i) {
+	if (Get_File_Block(instance, gosfsFile, i, false, &fsBlock) < 0)
+	    break;
+	if (runLength != 0 && fsBlock == runStart + runLength) {
+	    ++runLength;
+	    continue;
+	}
+	if (runLength != 0)
+	    Prefetch_FS_Buffers(instance->fscache, runStart, runLength);
+	/* Holes have nothing to read */
+	runStart = fsBlock;
+	runLength = (fsBlock != 0) ? 1 : 0;
+    }
+    if (runLength != 0)
+	Prefetch_FS_Buffers(instance->fscache, runStart, runLength);
+
+    /* The read itself carries on from where the extent cursor was */
+    gosfsFile->cur = cur;
+    gosfsFile->curIndex = curIndex;
+    gosfsFile->curFirst = curFirst;
+}
+
+/*
+ * Read data from current position in file.
+ */
+static int GOSFS_Read(struct File *file, void *buf, ulong_t numBytes)
+{
+    struct GOSFS_File *gosfsFile = (struct GOSFS_File*) file->fsData;
+    GOSFS_Instance *instance = (GOSFS_Instance*) file->mountPoint->fsData;
+    struct FS_Buffer *pBuf;
+    ulong_t pos = file->filePos, end, fsBlock;
+    ulong_t raStart, raEnd;
+    int rc = 0;
+
+    if (!(file->mode & O_READ))
+	return EACCESS;
+
+    /* Special case: can't handle reads longer than INT_MAX */
+    if (numBytes > INT_MAX)
+	return EINVALID;
+
+    Mutex_Lock(&gosfsFile->lock);
+
+    if ((rc = Load_Block_Map(instance, gosfsFile)) < 0)
+	goto done;
+    file->endPos = gosfsFile->size;
+
+    /* Stop at the end of the file */
+    if (pos >= gosfsFile->size)
+	goto done;
+    end = (numBytes > gosfsFile->size - pos) ? gosfsFile->size : pos + numBytes;
+
+    if (Readahead_Range(file, pos / GOSFS_FS_BLOCK_SIZE, (end - 1) / GOSFS_FS_BLOCK_SIZE + 1,
+	    (gosfsFile->size - 1) / GOSFS_FS_BLOCK_SIZE + 1, GOSFS_FS_BLOCK_SIZE, &raStart, &raEnd))
+	Readahead_File_Blocks(instance, gosfsFile, raStart, raEnd);
+
+    while (pos < end) {
+	ulong_t offset = pos % GOSFS_FS_BLOCK_SIZE;
+	ulong_t count = GOSFS_FS_BLOCK_SIZE - offset;
+
+	if (count > end - pos)
+	    count = end - pos;
+
+	if ((rc = Get_File_Block(instance, gosfsFile, pos / GOSFS_FS_BLOCK_SIZE, false, &fsBlock)) < 0)
+	    goto done;
+
+	if (fsBlock == 0) {
+	    /* A hole reads as zeroes */
+	    memset(buf, '\0', count);
+	} else {
+	    if ((rc = Get_FS_Buffer(instance->fscache, fsBlock, &pBuf)) != 0)
+		goto done;
+	    memcpy(buf, (char*) pBuf->data + offset, count);
+	    Release_FS_Buffer(instance->fscache, pBuf);
+	}
+
+	buf = (char*) buf + count;
+	pos += count;
+    }
+
+done:
+    rc = (rc < 0) ? rc : (int) (pos - file->filePos);
+    if (rc > 0)
+	file->filePos = pos;
+    Mutex_Unlock(&gosfsFile->lock);
+    return rc;
+}
+
+/*
+ * Write data to current position in file.
+ */
+static int GOSFS_Write(struct File *file, void *buf, ulong_t numBytes)
+{
+    struct GOSFS_File *gosfsFile = (struct GOSFS_File*) file->fsData;
+    GOSFS_Instance *instance = (GOSFS_Instance*) file->mountPoint->fsData;
+    struct FS_Buffer *pBuf;
+    ulong_t start = file->filePos;
+    ulong_t end = file->filePos + numBytes;
+    ulong_t pos = start, fsBlock;
+    int rc, storeRc;
+
+    if (!(file->mode & O_WRITE))
+	return EACCESS;
+
+    /* Special case: can't handle writes longer than INT_MAX */
+    if (numBytes > INT_MAX || end < start)
+	return EINVALID;
+
+    Mutex_Lock(&gosfsFile->lock);
+
+    if ((rc = Load_Block_Map(instance, gosfsFile)) < 0)
+	goto done;
+
+    while (pos < end) {
+	ulong_t offset = pos % GOSFS_FS_BLOCK_SIZE;
+	ulong_t count = GOSFS_FS_BLOCK_SIZE - offset;
+	bool fresh;
+
+	if (count > end - pos)
+	    count = end - pos;
+
+	if ((rc = Get_File_Block(instance, gosfsFile, pos / GOSFS_FS_BLOCK_SIZE, true, &fsBlock)) < 0)
+	    break;
+	fresh = (rc == 1);
+
+	if ((rc = Get_FS_Buffer(instance->fscache, fsBlock, &pBuf)) != 0)
+	    break;
+	/* Whatever a new block held before must not show through */
+	if (fresh && count < GOSFS_FS_BLOCK_SIZE)
+	    memset(pBuf->data, '\0', GOSFS_FS_BLOCK_SIZE);
+	memcpy((char*) pBuf->data + offset, buf, count);
+	Modify_FS_Buffer(instance->fscache, pBuf);
+	Release_FS_Buffer(instance->fscache, pBuf);
+
+	buf = (char*) buf + count;
+	pos += count;
+	if (pos > gosfsFile->size) {
+	    gosfsFile->size = pos;
+	    gosfsFile->entryDirty = true;
+	}
+    }
+
+    /* Record what was written, even if not all of it could be */
+    storeRc = Store_Block_Map(instance, gosfsFile);
+    if (storeRc < 0)
+	rc = storeRc;
+    else if (pos > start)
+	rc = pos - start;
+    file->filePos = pos;
+    file->endPos = gosfsFile->size;
+
+done:
+    Mutex_Unlock(&gosfsFile->lock);
+    return rc;
+}
+
+/*
+ * Seek to a position in file.
+ */
+static int GOSFS_Seek(struct File *file, ulong_t pos)
+{
+    struct GOSFS_File *gosfsFile = (struct GOSFS_File*) file->fsData;
+    GOSFS_Instance *instance = (GOSFS_Instance*) file->mountPoint->fsData;
+    int rc;
+
+    Mutex_Lock(&gosfsFile->lock);
+    if ((rc = Load_Block_Map(instance, gosfsFile)) == 0) {
+	file->endPos = gosfsFile->size;
+	/* Seeking to the end is allowed, so the file can be appended to */
+	if (pos > gosfsFile->size)
+	    rc = EINVALID;
+	else
+	    file->filePos = pos;
+    }
+    Mutex_Unlock(&gosfsFile->lock);
+
+    return rc;
+}
+
+/*
+ * Close a file.
+ */
+static int GOSFS_Close(struct File *file)
+{
+    struct GOSFS_File *gosfsFile = (struct GOSFS_File*) file->fsData;
+    GOSFS_Instance *instance = (GOSFS_Instance*) file->mountPoint->fsData;
+
+    bool unused;
+
+    /*
+     * The GOSFS_File object caching the contents of the file
+     * will remain in the GOSFS_Instance object, to speed up
+     * future accesses to this file.  Blocks reserved for appends
+     * are given back once nobody has it open.
+     */
+    Mutex_Lock(&gosfsFile->lock);
+    KASSERT(gosfsFile->refCount > 0);
+    if (--gosfsFile->refCount == 0)
+	Release_Prealloc(instance, gosfsFile);
+    unused = (gosfsFile->refCount == 0 && gosfsFile->deleted);
+    Mutex_Unlock(&gosfsFile->lock);
+
+    /* Its entry was deleted, so no one can find it again */
+    if (unused)
+	Cache_Free(s_gosfsFileCache, gosfsFile);
+    return 0;
+
+    //TODO("GeekOS filesystem close operation");
+}
+
+/*static*/ struct File_Ops s_gosfsFileOps = {
+    &GOSFS_FStat,
+    &GOSFS_Read,
+    &GOSFS_Write,
+    &GOSFS_Seek,
+    &GOSFS_Close,
+    0, /* Read_Entry */
+};
+
+/* ----------------------------------------------------------------------
+ * Directories
+ * ---------------------------------------------------------------------- */
+
+/*
+ * Hash of a file name, which chooses the leaf of a large directory
+ * it goes in (FNV-1a).
+ */
+static ulong_t Name_Hash(const char *name)
+{
+    ulong_t hash = 2166136261UL;
+
+    while (*name != '\0') {
+	hash ^= (uchar_t) *name++;
+	hash *= 16777619UL;
+    }
+    return hash;
+}
+
+static __inline__ bool Is_Free_Dir_Entry(struct GOSFS_Dir_Entry *entry)
+{
+    return !(entry->flags & GOSFS_DIRENTRY_USED) && !(entry->flags & GOSFS_DIRENTRY_ISDIRECTORY);
+}
+
+/*
+ * Give back a block of a directory.
+ */
+static void Free_Dir_Block(GOSFS_Instance *instance, ulong_t fsBlock)
+{
+    Mutex_Lock(&instance->lock);
+    Free_FS_Blocks(instance, fsBlock, 1, false);
+    Mutex_Unlock(&instance->lock);
+}
+
+/*
+ * Get the index block of the directory whose first block is given;
+ * it is 0 if the directory has no index.
+ */
+static int Get_Dir_Index(GOSFS_Instance *instance, ulong_t dirBlock, ulong_t *pIndexBlock)
+{
+    struct FS_Buffer *pBuf;
+    int rc;
+
+    if ((rc = Get_FS_Buffer(instance->fscache, dirBlock, &pBuf)) != 0)
+	return rc;
+    *pIndexBlock = ((struct GOSFS_Dir_Entry*) pBuf->data)[0].blockList[GOSFS_DIR_INDEX_PTR];
+    Release_FS_Buffer(instance->fscache, pBuf);
+    return 0;
+}
+
+/*
+ * Get given block of a directory: block 0 is its first block,
+ * the rest are its leaves in hash order.
+ * Returns VFS_NO_MORE_DIR_ENTRIES past the last one.
+ */
+static int Get_Dir_Block(GOSFS_Instance *instance, ulong_t dirBlock, ulong_t blockNum, ulong_t *pFsBlock)
+{
+    struct FS_Buffer *pBuf;
+    struct GOSFS_Dir_Index *index;
+    ulong_t indexBlock;
+    int rc;
+
+    if (blockNum == 0) {
+	*pFsBlock = dirBlock;
+	return 0;
+    }
+
+    if ((rc = Get_Dir_Index(instance, dirBlock, &indexBlock)) != 0)
+	return rc;
+    if (indexBlock == 0)
+	return VFS_NO_MORE_DIR_ENTRIES;
+
+    if ((rc = Get_FS_Buffer(instance->fscache, indexBlock, &pBuf)) != 0)
+	return rc;
+    index = (struct GOSFS_Dir_Index*) pBuf->data;
+    if (blockNum > index->count)
+	rc = VFS_NO_MORE_DIR_ENTRIES;
+    else
+	*pFsBlock = index->leaves[blockNum - 1].block;
+    Release_FS_Buffer(instance->fscache, pBuf);
+    return rc;
+}
+
+/*
+ * Find the leaf of a directory index that holds the names with
+ * given hash, by binary search.  Returns its position and block.
+ */
+static int Find_Dir_Leaf(GOSFS_Instance *instance, ulong_t indexBlock, ulong_t hash,
+    ulong_t *pPos, ulong_t *pLeafBlock)
+{
+    struct FS_Buffer *pBuf;
+    struct GOSFS_Dir_Index *index;
+    ulong_t lo, hi, mid;
+    int rc;
+
+    if ((rc = Get_FS_Buffer(instance->fscache, indexBlock, &pBuf)) != 0)
+	return rc;
+    index = (struct GOSFS_Dir_Index*) pBuf->data;
+    if (index->count == 0 || index->count > GOSFS_DIR_INDEX_MAX) {
+	Release_FS_Buffer(instance->fscache, pBuf);
+	return EINVALIDFS;
+    }
+
+    /* The last leaf whose least hash is not above the one wanted */
+    lo = 0;
+    hi = index->count - 1;
+    while (lo < hi) {
+	mid = (lo + hi + 1) / 2;
+	if (index->leaves[mid].hash <= hash)
+	    lo = mid;
+	else
+	    hi = mid - 1;
+    }
+
+    *pPos = lo;
+    *pLeafBlock = index->leaves[lo].block;
+    Release_FS_Buffer(instance->fscache, pBuf);
+    return 0;
+}
+
+/*
+ * Look for a name in one block of a directory.
+ * Returns 0, the position of its entry and, if found is not null,
+ * a copy of the entry; or ENOTFOUND.
+ */
+static int Find_In_Dir_Block(GOSFS_Instance *instance, ulong_t fsBlock, const char *name,
+    Dir_Entry_Ptr *dirEntryPtr, struct GOSFS_Dir_Entry *found)
+{
+    struct FS_Buffer *pBuf;
+    struct GOSFS_Dir_Entry *dir;
+    int i, rc;
+
+    if ((rc = Get_FS_Buffer(instance->fscache, fsBlock, &pBuf)) != 0)
+	return rc;
+    dir = (struct GOSFS_Dir_Entry*) pBuf->data;
+
+    rc = ENOTFOUND;
+    for (i = 0; i < GOSFS_DIR_ENTRIES_PER_BLOCK; ++i) {
+	if (!Is_Free_Dir_Entry(&dir[i]) && strcmp(dir[i].filename, name) == 0) {
+	    dirEntryPtr->base = fsBlock;
+	    dirEntryPtr->offset = i;
+	    if (found != 0)
+		memcpy(found, &dir[i], sizeof(struct GOSFS_Dir_Entry));
+	    rc = 0;
+	    break;
 	}
+    }
 
-	Release_FS_Buffer(instance->fscache, pBuf);
-	return &((struct GOSFS_Dir_Entry*)pBuf->data)[dirEntryPtr->offset];
+    Release_FS_Buffer(instance->fscache, pBuf);
+    return rc;
 }
 
-static int GOSFS_FStat(struct File *file, struct VFS_File_Stat *stat)
+/*
+ * Find the entry for a name in the directory whose first block is
+ * given: it is in the first block, or in the leaf its hash leads to.
+ */
+static int Find_Dir_Entry(GOSFS_Instance *instance, ulong_t dirBlock, const char *name,
+    Dir_Entry_Ptr *dirEntryPtr, struct GOSFS_Dir_Entry *found)
 {
-    TODO("GeekOS filesystem FStat operation");
+    ulong_t indexBlock, pos, leafBlock;
+    int rc;
+
+    rc = Find_In_Dir_Block(instance, dirBlock, name, dirEntryPtr, found);
+    if (rc != ENOTFOUND)
+	return rc;
+
+    if ((rc = Get_Dir_Index(instance, dirBlock, &indexBlock)) != 0)
+	return rc;
+    if (indexBlock == 0)
+	return ENOTFOUND;
+    if ((rc = Find_Dir_Leaf(instance, indexBlock, Name_Hash(name), &pos, &leafBlock)) != 0)
+	return rc;
+    return Find_In_Dir_Block(instance, leafBlock, name, dirEntryPtr, found);
 }
 
 /*
- * Read data from current position in file.
+ * Find the entry of a subdirectory, known by its first block, in the
+ * directory whose first block is given.  Without a name to hash,
+ * every block of the directory has to be looked through.
  */
-static int GOSFS_Read(struct File *file, void *buf, ulong_t numBytes)
+static int Find_Subdir_Entry(GOSFS_Instance *instance, ulong_t dirBlock, ulong_t subdirBlock,
+    Dir_Entry_Ptr *dirEntryPtr, struct GOSFS_Dir_Entry *found)
 {
-    TODO("GeekOS filesystem read operation");
+    struct FS_Buffer *pBuf;
+    struct GOSFS_Dir_Entry *dir;
+    ulong_t blockNum, fsBlock;
+    int i, rc;
+
+    for (blockNum = 0; ; ++blockNum) {
+	if ((rc = Get_Dir_Block(instance, dirBlock, blockNum, &fsBlock)) != 0)
+	    return (rc == VFS_NO_MORE_DIR_ENTRIES) ? ENOTFOUND : rc;
+	if ((rc = Get_FS_Buffer(instance->fscache, fsBlock, &pBuf)) != 0)
+	    return rc;
+	dir = (struct GOSFS_Dir_Entry*) pBuf->data;
+
+	for (i = 0; i < GOSFS_DIR_ENTRIES_PER_BLOCK; ++i) {
+	    if (dir[i].flags == GOSFS_DIRENTRY_ISDIRECTORY && dir[i].blockList[0] == subdirBlock) {
+		dirEntryPtr->base = fsBlock;
+		dirEntryPtr->offset = i;
+		memcpy(found, &dir[i], sizeof(struct GOSFS_Dir_Entry));
+		Release_FS_Buffer(instance->fscache, pBuf);
+		return 0;
+	    }
+	}
+	Release_FS_Buffer(instance->fscache, pBuf);
+    }
 }
 
-static ulong_t Do_Get_Block()
+/*
+ * Take a free slot in a directory block for a new entry with given
+ * name and flags.  Returns ENOSPACE if the block is full.
+ */
+static int Claim_Dir_Slot(GOSFS_Instance *instance, ulong_t fsBlock, const char *name, ulong_t flags,
+    Dir_Entry_Ptr *dirEntryPtr)
 {
+    struct FS_Buffer *pBuf;
+    struct GOSFS_Dir_Entry *dir;
+    int i, rc;
+
+    if ((rc = Get_FS_Buffer(instance->fscache, fsBlock, &pBuf)) != 0)
+	return rc;
+    dir = (struct GOSFS_Dir_Entry*) pBuf->data;
+
+    rc = ENOSPACE;
+    for (i = 0; i < GOSFS_DIR_ENTRIES_PER_BLOCK; ++i) {
+	if (Is_Free_Dir_Entry(&dir[i])) {
+	    memset(&dir[i], '\0', sizeof(struct GOSFS_Dir_Entry));
+	    strncpy(dir[i].filename, name, GOSFS_FILENAME_MAX);
+	    dir[i].flags = flags;
+	    Modify_FS_Buffer(instance->fscache, pBuf);
+	    dirEntryPtr->base = fsBlock;
+	    dirEntryPtr->offset = i;
+	    rc = 0;
+	    break;
+	}
+    }
 
+    Release_FS_Buffer(instance->fscache, pBuf);
+    return rc;
 }
 
-static ulong_t Get_Block_Pos(ulong_t offset)
+/*
+ * Give a directory whose first block is full an index, with one
+ * leaf for all names.
+ */
+static int Create_Dir_Index(GOSFS_Instance *instance, ulong_t dirBlock, ulong_t *pIndexBlock)
 {
-#if 0
-    if(offset < 32*1024){
-    	;
-    }
-    else {
-    	return EUNSPECIFIED;
-	}
-	
-    return Do_Get_Block(pos, vroot, 1, 0);
-#endif
+    struct FS_Buffer *pBuf;
+    struct GOSFS_Dir_Index *index;
+    ulong_t indexBlock, leafBlock;
+    int rc;
+
+    if ((rc = Alloc_FS_Block(instance, dirBlock, true, &indexBlock)) < 0)
+	return rc;
+    if ((rc = Alloc_FS_Block(instance, indexBlock, true, &leafBlock)) < 0)
+	goto freeIndex;
+
+    if ((rc = Get_FS_Buffer(instance->fscache, indexBlock, &pBuf)) != 0)
+	goto freeLeaf;
+    index = (struct GOSFS_Dir_Index*) pBuf->data;
+    index->count = 1;
+    index->leaves[0].hash = 0;
+    index->leaves[0].block = leafBlock;
+    Modify_FS_Buffer(instance->fscache, pBuf);
+    Release_FS_Buffer(instance->fscache, pBuf);
+
+    if ((rc = Get_FS_Buffer(instance->fscache, dirBlock, &pBuf)) != 0)
+	goto freeLeaf;
+    ((struct GOSFS_Dir_Entry*) pBuf->data)[0].blockList[GOSFS_DIR_INDEX_PTR] = indexBlock;
+    Modify_FS_Buffer(instance->fscache, pBuf);
+    Release_FS_Buffer(instance->fscache, pBuf);
+
+    *pIndexBlock = indexBlock;
+    return 0;
+
+freeLeaf:
+    Free_Dir_Block(instance, leafBlock);
+freeIndex:
+    Free_Dir_Block(instance, indexBlock);
+    return rc;
 }
 
 /*
- * Write data to current position in file.
+ * Split the full leaf at given position of a directory index at its
+ * median hash, moving the entries from there up to a new leaf.
+ * GOSFS_File objects go along with their entries.  An open file may
+ * be writing its entry, so the objects for the entries moved, and
+ * any stale ones for the slots they move to, are locked first,
+ * before the buffers are taken.
  */
-static int GOSFS_Write(struct File *file, void *buf, ulong_t numBytes)
+static int Split_Dir_Leaf(GOSFS_Instance *instance, ulong_t indexBlock, ulong_t pos, ulong_t leafBlock)
 {
-    struct GOSFS_File *gosfsFile = (struct GOSFS_File*) file->fsData;
-    struct GOSFS_Instance *instance = (struct GOSFS_Instance*) file->mountPoint->fsData;
-    ulong_t start = file->filePos;
-    ulong_t end = file->filePos + numBytes;
-    ulong_t startBlock, endBlock, curBlock;
-    ulong_t i;
+    struct FS_Buffer *pIndexBuf = 0, *pLeafBuf = 0, *pNewBuf = 0;
+    struct GOSFS_Dir_Index *index;
+    struct GOSFS_Dir_Entry *leaf, *newLeaf;
+    struct GOSFS_File *fromFile[GOSFS_DIR_ENTRIES_PER_BLOCK], *toFile[GOSFS_DIR_ENTRIES_PER_BLOCK];
+    ulong_t hashes[GOSFS_DIR_ENTRIES_PER_BLOCK], sorted[GOSFS_DIR_ENTRIES_PER_BLOCK];
+    ulong_t splitHash, newBlock, numLeaves;
+    Dir_Entry_Ptr ptr;
+    int i, j, numMoved, rc;
+
+    if ((rc = Get_FS_Buffer(instance->fscache, indexBlock, &pIndexBuf)) != 0)
+	return rc;
+    numLeaves = ((struct GOSFS_Dir_Index*) pIndexBuf->data)->count;
+    Release_FS_Buffer(instance->fscache, pIndexBuf);
+    if (numLeaves >= GOSFS_DIR_INDEX_MAX)
+	return ENOSPACE;
 
-	/* Special case: can't handle writes longer than INT_MAX */
-    if (numBytes > INT_MAX)
-		return EINVALID;
-    
-    /*
-     * Now the complicated part; ensure that all blocks containing the
-     * data we need are in the file data cache.
-     */
-    startBlock = Round_Down_To_Block(start);
-    endBlock = Round_Up_To_Block(end) / SECTOR_SIZE;
-	
-    Print(" # GOSFS_Write : %d, %d\n", file->filePos, file->endPos);
-	Print(" # GOSFS_Write : %s\n", buf);
+    /* Hash the names, in order */
+    if ((rc = Get_FS_Buffer(instance->fscache, leafBlock, &pLeafBuf)) != 0)
+	return rc;
+    leaf = (struct GOSFS_Dir_Entry*) pLeafBuf->data;
+    for (i = 0; i < GOSFS_DIR_ENTRIES_PER_BLOCK; ++i) {
+	KASSERT(!Is_Free_Dir_Entry(&leaf[i]));
+	hashes[i] = Name_Hash(leaf[i].filename);
+	for (j = i; j > 0 && sorted[j - 1] > hashes[i]; --j)
+	    sorted[j] = sorted[j - 1];
+	sorted[j] = hashes[i];
+    }
+    Release_FS_Buffer(instance->fscache, pLeafBuf);
+
+    /* Split at the median, or the nearest hash leaving neither half empty */
+    for (j = GOSFS_DIR_ENTRIES_PER_BLOCK / 2; j < GOSFS_DIR_ENTRIES_PER_BLOCK && sorted[j] == sorted[j - 1]; ++j)
+	;
+    if (j == GOSFS_DIR_ENTRIES_PER_BLOCK) {
+	for (j = GOSFS_DIR_ENTRIES_PER_BLOCK / 2; j > 0 && sorted[j] == sorted[j - 1]; --j)
+	    ;
+	if (j == 0)
+	    return ENOSPACE;	/* every name has the same hash */
+    }
+    splitHash = sorted[j];
 
-	for (int offset = startBlock; offset < end; offset += SECTOR_SIZE) {
-	
-		//int rc = Block_Write(blockDev, blockNum, (char*)super_block + offset);
-		//if (rc != 0)
-		//    return rc;
-		//++blockNum;
-    }	
-	
-    TODO("GeekOS filesystem write operation");
+    if ((rc = Alloc_FS_Block(instance, leafBlock, true, &newBlock)) < 0)
+	return rc;
+
+    numMoved = 0;
+    for (i = 0; i < GOSFS_DIR_ENTRIES_PER_BLOCK; ++i) {
+	if (hashes[i] < splitHash)
+	    continue;
+	ptr.base = leafBlock;
+	ptr.offset = i;
+	if ((fromFile[numMoved] = Find_GOSFS_File(instance, &ptr)) != 0)
+	    Mutex_Lock(&fromFile[numMoved]->lock);
+	ptr.base = newBlock;
+	ptr.offset = numMoved;
+	if ((toFile[numMoved] = Find_GOSFS_File(instance, &ptr)) != 0)
+	    Mutex_Lock(&toFile[numMoved]->lock);
+	++numMoved;
+    }
+
+    if ((rc = Get_FS_Buffer(instance->fscache, indexBlock, &pIndexBuf)) != 0 ||
+	(rc = Get_FS_Buffer(instance->fscache, leafBlock, &pLeafBuf)) != 0 ||
+	(rc = Get_FS_Buffer(instance->fscache, newBlock, &pNewBuf)) != 0) {
+	Free_Dir_Block(instance, newBlock);
+	goto done;
+    }
+    index = (struct GOSFS_Dir_Index*) pIndexBuf->data;
+    leaf = (struct GOSFS_Dir_Entry*) pLeafBuf->data;
+    newLeaf = (struct GOSFS_Dir_Entry*) pNewBuf->data;
+
+    for (i = 0, j = 0; i < GOSFS_DIR_ENTRIES_PER_BLOCK; ++i) {
+	if (hashes[i] < splitHash)
+	    continue;
+	memcpy(&newLeaf[j], &leaf[i], sizeof(struct GOSFS_Dir_Entry));
+	memset(&leaf[i], '\0', sizeof(struct GOSFS_Dir_Entry));
+	if (fromFile[j] != 0) {
+	    fromFile[j]->dirEntryPtr.base = newBlock;
+	    fromFile[j]->dirEntryPtr.offset = j;
+	}
+	if (toFile[j] != 0) {
+	    toFile[j]->dirEntryPtr.base = leafBlock;
+	    toFile[j]->dirEntryPtr.offset = i;
+	}
+	++j;
+    }
+
+    memmove(&index->leaves[pos + 2], &index->leaves[pos + 1],
+	(index->count - pos - 1) * sizeof(struct GOSFS_Dir_Index_Entry));
+    index->leaves[pos + 1].hash = splitHash;
+    index->leaves[pos + 1].block = newBlock;
+    ++index->count;
+
+    Modify_FS_Buffer(instance->fscache, pIndexBuf);
+    Modify_FS_Buffer(instance->fscache, pLeafBuf);
+    Modify_FS_Buffer(instance->fscache, pNewBuf);
+
+done:
+    if (pNewBuf != 0)
+	Release_FS_Buffer(instance->fscache, pNewBuf);
+    if (pLeafBuf != 0)
+	Release_FS_Buffer(instance->fscache, pLeafBuf);
+    if (pIndexBuf != 0)
+	Release_FS_Buffer(instance->fscache, pIndexBuf);
+    for (i = 0; i < numMoved; ++i) {
+	if (toFile[i] != 0)
+	    Mutex_Unlock(&toFile[i]->lock);
+	if (fromFile[i] != 0)
+	    Mutex_Unlock(&fromFile[i]->lock);
+    }
+    return rc;
 }
 
 /*
- * Seek to a position in file.
+ * Add an entry with given name and flags to the directory whose
+ * first block is given.  It goes in the first block while that has
+ * room, and after that in the leaf for its hash.
  */
-static int GOSFS_Seek(struct File *file, ulong_t pos)
+static int Add_Dir_Entry(GOSFS_Instance *instance, ulong_t dirBlock, const char *name, ulong_t flags,
+    Dir_Entry_Ptr *dirEntryPtr)
 {
-    TODO("GeekOS filesystem seek operation");
+    ulong_t indexBlock, pos, leafBlock;
+    int rc;
+
+    rc = Claim_Dir_Slot(instance, dirBlock, name, flags, dirEntryPtr);
+    if (rc != ENOSPACE)
+	return rc;
+
+    if ((rc = Get_Dir_Index(instance, dirBlock, &indexBlock)) != 0)
+	return rc;
+    if (indexBlock == 0 && (rc = Create_Dir_Index(instance, dirBlock, &indexBlock)) != 0)
+	return rc;
+
+    /* Each half of a split leaf has room */
+    for (;;) {
+	if ((rc = Find_Dir_Leaf(instance, indexBlock, Name_Hash(name), &pos, &leafBlock)) != 0)
+	    return rc;
+	rc = Claim_Dir_Slot(instance, leafBlock, name, flags, dirEntryPtr);
+	if (rc != ENOSPACE)
+	    return rc;
+	if ((rc = Split_Dir_Leaf(instance, indexBlock, pos, leafBlock)) != 0)
+	    return rc;
+    }
 }
 
 /*
- * Close a file.
+ * Clear the entry at given position of the directory whose first
+ * block is given.  A leaf left empty is freed, and with the last
+ * leaf the index.
  */
-static int GOSFS_Close(struct File *file)
+static int Remove_Dir_Entry(GOSFS_Instance *instance, ulong_t dirBlock, Dir_Entry_Ptr *dirEntryPtr)
 {
-    /*
-     * The GOSFS_File object caching the contents of the file
-     * will remain in the GOSFS_Instance object, to speed up
-     * future accesses to this file.
-     */
-    return 0;
+    struct FS_Buffer *pBuf;
+    struct GOSFS_Dir_Entry *dir;
+    struct GOSFS_Dir_Index *index;
+    ulong_t hash, indexBlock, pos, leafBlock, numLeaves;
+    bool empty = true;
+    int i, rc;
 
-    //TODO("GeekOS filesystem close operation");
-}
+    if ((rc = Get_FS_Buffer(instance->fscache, dirEntryPtr->base, &pBuf)) != 0)
+	return rc;
+    dir = (struct GOSFS_Dir_Entry*) pBuf->data;
+    hash = Name_Hash(dir[dirEntryPtr->offset].filename);
+    memset(&dir[dirEntryPtr->offset], '\0', sizeof(struct GOSFS_Dir_Entry));
+    for (i = 0; i < GOSFS_DIR_ENTRIES_PER_BLOCK; ++i) {
+	if (!Is_Free_Dir_Entry(&dir[i]))
+	    empty = false;
+    }
+    Modify_FS_Buffer(instance->fscache, pBuf);
+    Release_FS_Buffer(instance->fscache, pBuf);
 
-/*static*/ struct File_Ops s_gosfsFileOps = {
-    &GOSFS_FStat,
-    &GOSFS_Read,
-    &GOSFS_Write,
-    &GOSFS_Seek,
-    &GOSFS_Close,
-    0, /* Read_Entry */
-};
+    if ((ulong_t) dirEntryPtr->base == dirBlock || !empty)
+	return 0;
+
+    /* The entry was the last in its leaf */
+    if ((rc = Get_Dir_Index(instance, dirBlock, &indexBlock)) != 0)
+	return rc;
+    if (indexBlock == 0)
+	return 0;
+    if ((rc = Find_Dir_Leaf(instance, indexBlock, hash, &pos, &leafBlock)) != 0)
+	return rc;
+    if (leafBlock != (ulong_t) dirEntryPtr->base)
+	return 0;
+
+    if ((rc = Get_FS_Buffer(instance->fscache, indexBlock, &pBuf)) != 0)
+	return rc;
+    index = (struct GOSFS_Dir_Index*) pBuf->data;
+    --index->count;
+    memmove(&index->leaves[pos], &index->leaves[pos + 1],
+	(index->count - pos) * sizeof(struct GOSFS_Dir_Index_Entry));
+    index->leaves[0].hash = 0;	/* the first leaf takes the lowest hashes */
+    numLeaves = index->count;
+    Modify_FS_Buffer(instance->fscache, pBuf);
+    Release_FS_Buffer(instance->fscache, pBuf);
+    Free_Dir_Block(instance, leafBlock);
+
+    if (numLeaves == 0) {
+	if ((rc = Get_FS_Buffer(instance->fscache, dirBlock, &pBuf)) != 0)
+	    return rc;
+	((struct GOSFS_Dir_Entry*) pBuf->data)[0].blockList[GOSFS_DIR_INDEX_PTR] = 0;
+	Modify_FS_Buffer(instance->fscache, pBuf);
+	Release_FS_Buffer(instance->fscache, pBuf);
+	Free_Dir_Block(instance, indexBlock);
+    }
+    return 0;
+}
 
 /*
  * Stat operation for an already open directory.
@@ -185,6 +1694,18 @@ static int GOSFS_FStat_Directory(struct File *dir, struct VFS_File_Stat *stat)
  */
 static int GOSFS_Close_Directory(struct File *dir)
 {
+    struct GOSFS_File *gosfsDir = (struct GOSFS_File*) dir->fsData;
+    bool unused;
+
+    Mutex_Lock(&gosfsDir->lock);
+    KASSERT(gosfsDir->refCount > 0);
+    --gosfsDir->refCount;
+    unused = (gosfsDir->refCount == 0 && gosfsDir->deleted);
+    Mutex_Unlock(&gosfsDir->lock);
+
+    if (unused)
+	Cache_Free(s_gosfsFileCache, gosfsDir);
+    return 0;
     //TODO("GeekOS filesystem Close directory operation");
 }
 
@@ -193,36 +1714,54 @@ static int GOSFS_Close_Directory(struct File *dir)
  */
 static int GOSFS_Read_Entry(struct File *dir, struct VFS_Dir_Entry *entry)
 {
-	Dir_Entry_Ptr dentryPtr = ((struct GOSFS_File*)dir->fsData)->dirEntryPtr;
+	struct GOSFS_File *gosfsDir = (struct GOSFS_File*) dir->fsData;
     GOSFS_Instance *instance = (GOSFS_Instance*) dir->mountPoint->fsData;
     struct FS_Buffer_Cache* fscache = instance->fscache;
     struct FS_Buffer *pBuf;
     struct GOSFS_Dir_Entry *dentry;
    	struct VFS_File_Stat* stats;
-    int blockNum;
+    ulong_t dirBlock, blockNum, fsBlock;
 	int rc = 0;
 	int i;
 
-	dentry = Get_Entry_By_Ptr(instance, &dentryPtr);
-	blockNum = dentry->blockList[0];
-	//Release_FS_Buffer(fscache, pBuf);
+	Mutex_Lock(&instance->dirLock);
+	if (gosfsDir->deleted) {
+		rc = ENOTFOUND;
+		goto done;
+	}
+	dentry = Get_Entry_By_Ptr(instance, &gosfsDir->dirEntryPtr);
+	if (dentry == 0) {
+		rc = EUNSPECIFIED;
+		goto done;
+	}
+	dirBlock = dentry->blockList[0];
 
-	GET_FS_BUFFER(fscache, blockNum, &pBuf);
-	
-	while(dir->filePos < dir->endPos){
-		i = dir->filePos/sizeof(struct GOSFS_Dir_Entry);
-		dentry = &((struct GOSFS_Dir_Entry *)pBuf->data)[i];
-		dir->filePos += sizeof(struct GOSFS_Dir_Entry);
-		if(	dentry->flags == GOSFS_DIRENTRY_USED ||
-			dentry->flags == GOSFS_DIRENTRY_ISDIRECTORY ||
-			dentry->flags == GOSFS_DIRENTRY_SETUID ){ /* weak */
+	/*
+	 * The position counts entry slots through the blocks of the
+	 * directory: its first block, then its leaves.
+	 */
+	for (;;) {
+		i = dir->filePos / sizeof(struct GOSFS_Dir_Entry);
+		blockNum = i / GOSFS_DIR_ENTRIES_PER_BLOCK;
+		i %= GOSFS_DIR_ENTRIES_PER_BLOCK;
+
+		/* VFS_NO_MORE_DIR_ENTRIES past the last block */
+		if ((rc = Get_Dir_Block(instance, dirBlock, blockNum, &fsBlock)) != 0)
+			goto done;
+		if ((rc = Get_FS_Buffer(fscache, fsBlock, &pBuf)) != 0)
+			goto done;
+
+		for (; i < GOSFS_DIR_ENTRIES_PER_BLOCK; ++i) {
+			dentry = &((struct GOSFS_Dir_Entry *)pBuf->data)[i];
+			if (!Is_Free_Dir_Entry(dentry))
+				break;
+		}
+		if (i < GOSFS_DIR_ENTRIES_PER_BLOCK) {
+			dir->filePos = (blockNum * GOSFS_DIR_ENTRIES_PER_BLOCK + i + 1) * sizeof(struct GOSFS_Dir_Entry);
 			break;
 		}
-	}
-	
-	if (dir->filePos >= dir->endPos){
-		rc = VFS_NO_MORE_DIR_ENTRIES;
-		goto fail; /* Reached the end of the directory. */
+		Release_FS_Buffer(fscache, pBuf);
+		dir->filePos = (blockNum + 1) * GOSFS_DIR_ENTRIES_PER_BLOCK * sizeof(struct GOSFS_Dir_Entry);
 	}
 	
 	/*
@@ -238,12 +1777,11 @@ static int GOSFS_Read_Entry(struct File *dir, struct VFS_Dir_Entry *entry)
 	stats->size = dentry->size;
 	memcpy(stats->acls, dentry->acl, VFS_MAX_ACL_ENTRIES);
 	stats->isSetuid = 0; /* weak */
-	
-	fail:
-		Release_FS_Buffer(fscache, pBuf);
+	Release_FS_Buffer(fscache, pBuf);
+
+	done:
+		Mutex_Unlock(&instance->dirLock);
 	return rc;
-	
-	//TODO("GeekOS filesystem Read_Entry operation");
 }
 
 /*static*/ struct File_Ops s_gosfsDirOps = {
@@ -258,107 +1796,67 @@ static int GOSFS_Read_Entry(struct File *dir, struct VFS_Dir_Entry *entry)
 
 /*
  * Look up a directory entry in a GOSFS filesystem.
+ * If only the last component of the path is missing, returns
+ * EUNSPECIFIED, with the directory it would go in as dirBlock.
+ * The caller must hold the directory lock.
  */
 static int Do_GOSFS_Lookup(GOSFS_Instance *instance, Path_Info* pathInfo)
 {
     Super_Block *superBlock = (Super_Block *)instance->fsinfo->data;
-	struct FS_Buffer_Cache* fscache = instance->fscache;
-    struct GOSFS_Dir_Entry* dir, *entry;
-    struct FS_Buffer *pBuf;
+    struct GOSFS_Dir_Entry entry, *parentEntry;
     char prefix[MAX_PREFIX_LEN + 1];
-    char *suffix = 0;
-    int i;
+    char *suffix;
     char* path = pathInfo->path;
 	int retval = 0;
 	int base = superBlock->rootDirectoryPointer;
-	int minFreeEntry;
 
     KASSERT(*path == '/');
+    KASSERT(IS_HELD(&instance->dirLock));
 
     /* Special case: root directory. */
+    pathInfo->dirBlock = base;
     if (strcmp(path, "/") == 0){
 		return 0;
 	}
 	
+	suffix = path;
 	while(strcmp(suffix, "/") != 0){ /* weak */
 		Unpack_Path(path, prefix, &suffix);
 		Debug("%s, %s\n", prefix, suffix);
-		minFreeEntry = -1;
-
-		KASSERT(base != 0);
-		if(Get_FS_Buffer(fscache, base, &pBuf) != 0)
-		{		
-			Debug("Get_FS_Buffer Error.\n");
-			return EUNSPECIFIED;
-		}
-		
-		entry = dir = (struct GOSFS_Dir_Entry*)(pBuf->data);
-		#if 0
-		Print("blkNum : %d\n", pBuf->fsBlockNum);
-		Print("size0 : %d\n", (&entry[0])->size);
-		Print("entry0 : %s\n", (&entry[0])->filename);
-		Print("entry1 : %s\n", (&entry[1])->filename);
-		#endif
-	    for (i = 0; i < GOSFS_DIR_ENTRIES_PER_BLOCK; ++i) {
-	    	entry = &dir[i];
-			if (strcmp(entry->filename, prefix) == 0 &&
-				((entry->flags == GOSFS_DIRENTRY_USED && strcmp(suffix, "/") == 0) ||
-				 entry->flags == GOSFS_DIRENTRY_ISDIRECTORY)){ // If reach to term
-				Debug("entry offset : %d\n", i);
-				break;
-			}
-			/* weak : need to fix */
-			else if(minFreeEntry == -1 &&
-					!(entry->flags & GOSFS_DIRENTRY_USED) && 
-					!(entry->flags & GOSFS_DIRENTRY_ISDIRECTORY)){
-						minFreeEntry = i;
-						Debug("minFreeEntry : %d, %d\n", minFreeEntry, entry->flags);
-					}
-			else{
-				;
-			}
-	    }
+		pathInfo->dirBlock = base;
+		strcpy(pathInfo->suffix, prefix);
 
-	    if(i == GOSFS_DIR_ENTRIES_PER_BLOCK){ // There is no entry matched
+		retval = Find_Dir_Entry(instance, base, prefix, &pathInfo->dirEntryPtr, &entry);
+		if (retval == 0 && entry.flags != GOSFS_DIRENTRY_ISDIRECTORY && strcmp(suffix, "/") != 0)
+			retval = ENOTFOUND; /* Only the last component can be a file */
+		if (retval < 0) {
 	    	Debug("There is no entry matched\n");
-	    	pathInfo->dirEntryPtr.base = base; // need to modify
-			pathInfo->dirEntryPtr.offset = minFreeEntry;
-			strcpy(pathInfo->suffix, prefix);
-	    	retval = (strcmp(suffix,"/") == 0)? EUNSPECIFIED : ENOTFOUND;
-			Release_FS_Buffer(fscache, pBuf);
+	    	pathInfo->dirEntryPtr.base = base;
+			pathInfo->dirEntryPtr.offset = -1;
+			if (retval == ENOTFOUND)
+		    	retval = (strcmp(suffix,"/") == 0)? EUNSPECIFIED : ENOTFOUND;
 			break;
-	    }
-   	    else if(i == PREV_DIR){ /* weak */
+		}
+
+		path = suffix;
+   	    if (pathInfo->dirEntryPtr.base == base && pathInfo->dirEntryPtr.offset == PREV_DIR) {
+			/* For "..", use the entry of the parent in its own parent */
    	    	Dir_Entry_Ptr temp;
-   	    	int blk = entry->blockList[0];
-   	    	path = suffix;
-   	    	Release_FS_Buffer(fscache, pBuf);
-			temp.base = blk;
-			temp.offset = 0;
-			entry = Get_Entry_By_Ptr(instance, &temp); 
-			temp.base = entry[PREV_DIR].blockList[0];
-			temp.offset = 0;
-			entry = Get_Entry_By_Ptr(instance, &temp); 
-
-			int j;
-			for (j = 0; j < GOSFS_DIR_ENTRIES_PER_BLOCK; ++j) {
-				if(entry[j].blockList[0] == blk){
-					break;
-				}
+   	    	int parent = entry.blockList[0];
+
+			temp.base = parent;
+			temp.offset = PREV_DIR;
+			if ((parentEntry = Get_Entry_By_Ptr(instance, &temp)) == 0) {
+				retval = EUNSPECIFIED;
+				break;
 			}
-			strcpy(pathInfo->suffix, entry[j].filename);
-			pathInfo->dirEntryPtr.base = temp.base; // need to modify
-			pathInfo->dirEntryPtr.offset = j; 
-			base = entry[j].blockList[0];
+			pathInfo->dirBlock = parentEntry->blockList[0];
+			if ((retval = Find_Subdir_Entry(instance, pathInfo->dirBlock, parent,
+					&pathInfo->dirEntryPtr, &entry)) < 0)
+				break;
+			strcpy(pathInfo->suffix, entry.filename);
 	    }
-	   	else{
-	   		path = suffix;
-   			pathInfo->dirEntryPtr.base = base; // need to modify
-			pathInfo->dirEntryPtr.offset = i; // weak
-			strcpy(pathInfo->suffix, prefix);
-			Release_FS_Buffer(fscache, pBuf);
-			base = entry->blockList[0];
-	   	}
+		base = entry.blockList[0];
     }
 
     return retval;
@@ -397,11 +1895,12 @@ static struct GOSFS_File *Get_GOSFS_File(GOSFS_Instance* instance, Dir_Entry_Ptr
 		/*
 		 * Allocate File object, GOSFS_File object.
 		 */
-		if ((gosfsFile = (struct GOSFS_File *) Malloc(sizeof(struct GOSFS_File))) == 0 ) {
+		if ((gosfsFile = (struct GOSFS_File *) Cache_Alloc(s_gosfsFileCache)) == 0 ) {
 			goto memfail;
 		}
 
-		/* Populate GOSFS_File */
+		/* Populate GOSFS_File; its block map is loaded on first access */
+		memset(gosfsFile, '\0', sizeof(struct GOSFS_File));
 		memcpy(&(gosfsFile->dirEntryPtr), dirEntryPtr, sizeof(Dir_Entry_Ptr));
 		//gosfsFile->numBlocks = numBlocks;
 		Mutex_Init(&gosfsFile->lock);
@@ -416,7 +1915,7 @@ static struct GOSFS_File *Get_GOSFS_File(GOSFS_Instance* instance, Dir_Entry_Ptr
 
 memfail:
 	if (gosfsFile != 0)
-	Free(gosfsFile);
+	Cache_Free(s_gosfsFileCache, gosfsFile);
 
 done:
 	Mutex_Unlock(&instance->lock);
@@ -436,78 +1935,66 @@ static int GOSFS_Open(struct Mount_Point *mountPoint, const char *path, int mode
 	struct GOSFS_File *gosfsFile = 0;
 	struct File *file = 0;
 	struct FS_Buffer_Cache* fscache = instance->fscache;
-	struct FS_Buffer *pBuf;
+	ulong_t size;
 	Path_Info pathInfo;
 	strcpy(&pathInfo, path);
 	pathInfo.dirEntryPtr.base = GOSFS_SUPER_BLOCK;
 
+	Mutex_Lock(&instance->dirLock);
+
     /* Look up the directory entry */
     if ((retval = Do_GOSFS_Lookup(instance, &pathInfo)) < 0){ 
-    	if(retval == ENOTFOUND){ /* Wrong path, weak */
+    	if(retval != EUNSPECIFIED || !(mode & O_CREATE)){ /* Wrong path, or no file */
 			rc = ENOTFOUND;
-			goto fail;
-		}
-		else /* Valid path but there is no file */
-		{	
-			GET_FS_BUFFER(fscache, pathInfo.dirEntryPtr.base, &pBuf);
-		    entry = &((struct GOSFS_Dir_Entry*)pBuf->data)[pathInfo.dirEntryPtr.offset];
-
-		    /* There is no file, so create file */
-		    if (mode & O_CREATE){
-		   		Debug("EACCESS\n");
-		   		Debug("filename : %s\n", pathInfo.suffix);
-		   		strcpy(entry->filename, pathInfo.suffix);
-				entry->size = 0; /* Weak : not reasonable.. */
-				entry->flags = GOSFS_DIRENTRY_USED;
-
-				Super_Block* superBlock = (Super_Block*)instance->fsinfo->data;
-				int freeBit = Find_First_Free_Bit(superBlock->bitmap, superBlock->size);
-				Debug("freeBit : %d\n", freeBit);
-				entry->blockList[0] = freeBit;
-				Set_Bit(superBlock->bitmap, freeBit);
-
-				Modify_FS_Buffer(fscache, pBuf);
-				Modify_FS_Buffer(fscache, instance->fsinfo); // Superblock
-				Sync_FS_Buffer_Cache(fscache);
-				// need alloc data block
-			}
+			goto done;
 		}
+
+		/* Valid path but there is no file, so create file */
+   		Debug("filename : %s\n", pathInfo.suffix);
+		if((rc = Add_Dir_Entry(instance, pathInfo.dirBlock, pathInfo.suffix,
+				GOSFS_DIRENTRY_USED, &pathInfo.dirEntryPtr)) < 0)
+			goto done;
+		/* Blocks are allocated as the file is written */
+		Sync_FS_Buffer_Cache(fscache);
+		size = 0;
 	}
 	else{
 		Debug("FOUND\n");
-		GET_FS_BUFFER(fscache, pathInfo.dirEntryPtr.base, &pBuf);
-	    entry = &((struct GOSFS_Dir_Entry*)pBuf->data)[pathInfo.dirEntryPtr.offset];
-	    int flags = entry->flags;
-
+		if((entry = Get_Entry_By_Ptr(instance, &pathInfo.dirEntryPtr)) == 0){
+			rc = EUNSPECIFIED;
+			goto done;
+		}
 	    Debug("blockList[0] : %d\n", entry->blockList[0]);
 
-	    if(flags == GOSFS_DIRENTRY_ISDIRECTORY){
+	    if(entry->flags == GOSFS_DIRENTRY_ISDIRECTORY){
 	    	rc = EACCESS;
-	    	goto fail;
+	    	goto done;
 	    }	
+	    size = entry->size;
 	}
 
 	/* Get GOSFS_File object */
     gosfsFile = Get_GOSFS_File(instance, &(pathInfo.dirEntryPtr));
     if (gosfsFile == 0){
     	rc = EUNSPECIFIED;
-    	goto fail;
+    	goto done;
     }
 
 	/* Create the file object. */
-	file = Allocate_File(&s_gosfsFileOps, 0, entry->size, gosfsFile, O_READ, mountPoint);
+	file = Allocate_File(&s_gosfsFileOps, 0, size, gosfsFile, mode, mountPoint);
 	if (file == 0) {
 		rc = ENOMEM;
-		goto fail;
+		goto done;
 	}
+	Mutex_Lock(&gosfsFile->lock);
+	++gosfsFile->refCount;
+	Mutex_Unlock(&gosfsFile->lock);
 
 	/* Success! */
 	*pFile = file;
 
-	fail:
-	
 	done:
-	    Release_FS_Buffer(fscache, pBuf);
+		Mutex_Unlock(&instance->dirLock);
 		return rc;
 
     //TODO("GeekOS filesystem open operation");
@@ -522,82 +2009,76 @@ static int GOSFS_Create_Directory(struct Mount_Point *mountPoint, const char *pa
 	int retval = 0;
 	struct GOSFS_Dir_Entry* entry = 0;
 	GOSFS_Instance *instance = (GOSFS_Instance*) mountPoint->fsData;
-	struct GOSFS_File *gosfsFile = 0;
-	struct File *file = 0;
 	struct FS_Buffer_Cache* fscache = instance->fscache;
 	Path_Info pathInfo;
 	struct FS_Buffer *pBuf;
+	ulong_t freeBit;
 	strcpy(&pathInfo, path);
 	pathInfo.dirEntryPtr.base = GOSFS_SUPER_BLOCK;
 
-    /* Look up the directory entry */
-    if ((retval = Do_GOSFS_Lookup(instance, &pathInfo)) < 0){ 
-    	if(retval == ENOTFOUND){ /* Wrong path, weak */
-			Debug("ENOTFOUND\n");
-			rc = ENOTFOUND;
-			goto done;
-		}
-		else
-		{	
-			if(Get_FS_Buffer(fscache, pathInfo.dirEntryPtr.base, &pBuf) != 0)
-			{		
-				Debug("Get_FS_Buffer Error.\n");
-				rc = EUNSPECIFIED;
-				goto done;
-			}
-			entry = &((struct GOSFS_Dir_Entry*)pBuf->data)[pathInfo.dirEntryPtr.offset];
+	Mutex_Lock(&instance->dirLock);
 
-			/* There is no directory, so create directory */
-			Debug("EACCESS\n");
-			Debug("filename : %s\n", pathInfo.suffix);
-			strcpy(entry->filename, pathInfo.suffix);
-			entry->size = GOSFS_FS_BLOCK_SIZE; /* not reasonable.. */
-			entry->flags = GOSFS_DIRENTRY_ISDIRECTORY;
-
-			Super_Block* superBlock = (Super_Block*)instance->fsinfo->data;
-			int freeBit = Find_First_Free_Bit(superBlock->bitmap, superBlock->size);
-			Debug("freeBit : %d\n", freeBit);
-			entry->blockList[0] = freeBit;
-			entry->acl->permission = O_READ | O_WRITE;
-			Set_Bit(superBlock->bitmap, freeBit);
-
-			Modify_FS_Buffer(fscache, pBuf); // need to wrapper
-			Modify_FS_Buffer(fscache, instance->fsinfo); // Superblock
-			Sync_FS_Buffer_Cache(fscache);
-			Release_FS_Buffer(fscache, pBuf);
-			
-			if(Get_FS_Buffer(fscache, freeBit, &pBuf) != 0)
-			{		
-				Debug("Get_FS_Buffer Error.\n");
-				rc = EUNSPECIFIED;
-				goto done;
-			}			
-			entry = (struct GOSFS_Dir_Entry*)pBuf->data;
-			memset(pBuf->data, '\0', GOSFS_FS_BLOCK_SIZE); /* fill zero in the block */
-			strcpy(entry[0].filename, ".");
-			entry[0].flags = GOSFS_DIRENTRY_ISDIRECTORY;
-			entry[0].blockList[0] = freeBit;
-			entry[0].size = 1*GOSFS_FS_BLOCK_SIZE;
-			strcpy(entry[1].filename, "..");
-			entry[1].flags = GOSFS_DIRENTRY_ISDIRECTORY;
-			entry[1].blockList[0] = pathInfo.dirEntryPtr.base;
-			entry[1].size = 1*GOSFS_FS_BLOCK_SIZE;
-			Modify_FS_Buffer(fscache, pBuf); // need to wrapper
-			Sync_FS_Buffer_Cache(fscache);
-			Release_FS_Buffer(fscache, pBuf);
+    /* Look up the directory entry */
+    if ((retval = Do_GOSFS_Lookup(instance, &pathInfo)) == 0){
+		rc = EEXIST;
+		goto done;
+	}
+	else if(retval != EUNSPECIFIED){ /* Wrong path, weak */
+		Debug("ENOTFOUND\n");
+		rc = ENOTFOUND;
+		goto done;
+	}
 
-			rc = 0;
-			goto done;
+	/* There is no directory, so create directory, near its parent */
+	Debug("filename : %s\n", pathInfo.suffix);
+	if((rc = Alloc_FS_Block(instance, pathInfo.dirBlock, false, &freeBit)) < 0)
+		goto done;
+	Debug("freeBit : %lu\n", freeBit);
 
-		}
+	if(Get_FS_Buffer(fscache, freeBit, &pBuf) != 0)
+	{		
+		Debug("Get_FS_Buffer Error.\n");
+		Free_Dir_Block(instance, freeBit);
+		rc = EUNSPECIFIED;
+		goto done;
+	}			
+	entry = (struct GOSFS_Dir_Entry*)pBuf->data;
+	memset(pBuf->data, '\0', GOSFS_FS_BLOCK_SIZE); /* fill zero in the block */
+	strcpy(entry[0].filename, ".");
+	entry[0].flags = GOSFS_DIRENTRY_ISDIRECTORY;
+	entry[0].blockList[0] = freeBit;
+	entry[0].size = 1*GOSFS_FS_BLOCK_SIZE;
+	strcpy(entry[1].filename, "..");
+	entry[1].flags = GOSFS_DIRENTRY_ISDIRECTORY;
+	entry[1].blockList[0] = pathInfo.dirBlock;
+	entry[1].size = 1*GOSFS_FS_BLOCK_SIZE;
+	Modify_FS_Buffer(fscache, pBuf); // need to wrapper
+	Release_FS_Buffer(fscache, pBuf);
+
+	/* Enter it in the parent */
+	if((rc = Add_Dir_Entry(instance, pathInfo.dirBlock, pathInfo.suffix,
+			GOSFS_DIRENTRY_ISDIRECTORY, &pathInfo.dirEntryPtr)) < 0){
+		Free_Dir_Block(instance, freeBit);
+		goto done;
 	}
-	else
-	{
-		rc = EEXIST;
+	if(Get_FS_Buffer(fscache, pathInfo.dirEntryPtr.base, &pBuf) != 0)
+	{		
+		Debug("Get_FS_Buffer Error.\n");
+		rc = EUNSPECIFIED;
 		goto done;
 	}
-	
+	entry = &((struct GOSFS_Dir_Entry*)pBuf->data)[pathInfo.dirEntryPtr.offset];
+	entry->size = GOSFS_FS_BLOCK_SIZE; /* not reasonable.. */
+	entry->blockList[0] = freeBit;
+	entry->acl->permission = O_READ | O_WRITE;
+	Modify_FS_Buffer(fscache, pBuf); // need to wrapper
+	Release_FS_Buffer(fscache, pBuf);
+
+	Sync_FS_Buffer_Cache(fscache);
+	rc = 0;
+
 	done:
+		Mutex_Unlock(&instance->dirLock);
 		return rc;
 
     //TODO("GeekOS filesystem create directory operation");
@@ -620,6 +2101,8 @@ static int GOSFS_Open_Directory(struct Mount_Point *mountPoint, const char *path
 	strcpy(&pathInfo, path);
 	pathInfo.dirEntryPtr.base = GOSFS_SUPER_BLOCK;
 
+	Mutex_Lock(&instance->dirLock);
+
     /* Look up the directory entry */
     if ((retval = Do_GOSFS_Lookup(instance, &pathInfo)) < 0){ 
 		Debug("ENOTFOUND\n");
@@ -652,6 +2135,9 @@ static int GOSFS_Open_Directory(struct Mount_Point *mountPoint, const char *path
 		rc = ENOMEM;
 		goto fail;
 	}
+	Mutex_Lock(&gosfsFile->lock);
+	++gosfsFile->refCount;
+	Mutex_Unlock(&gosfsFile->lock);
 
 	/* Success! */
 	*pDir = file;
@@ -659,7 +2145,7 @@ static int GOSFS_Open_Directory(struct Mount_Point *mountPoint, const char *path
 	fail:
 	
 	done:
-	    //Release_FS_Buffer(fscache, pBuf);
+		Mutex_Unlock(&instance->dirLock);
 		return rc;
 
     TODO("GeekOS filesystem open directory operation");
@@ -678,73 +2164,90 @@ static int GOSFS_Delete(struct Mount_Point *mountPoint, const char *path)
 	struct FS_Buffer_Cache* fscache = instance->fscache;
 	Path_Info pathInfo;
 	struct FS_Buffer *pBuf, *pBuf_1;
+	ulong_t dirBlock;
+	int flags;
 	strcpy(&pathInfo, path);
 	pathInfo.dirEntryPtr.base = GOSFS_SUPER_BLOCK;
 
+	Mutex_Lock(&instance->dirLock);
+
     /* Look up the directory entry */
     if ((retval = Do_GOSFS_Lookup(instance, &pathInfo)) < 0){ 
 		Debug("ENOTFOUND\n");
 		rc = ENOTFOUND;
 		goto done;
 	}
+	else if(pathInfo.dirEntryPtr.base == GOSFS_SUPER_BLOCK ||
+			(pathInfo.dirEntryPtr.base == pathInfo.dirBlock && pathInfo.dirEntryPtr.offset <= PREV_DIR)){
+		rc = EACCESS; /* The root, "." or ".." */
+		goto done;
+	}
 	else{
 		Debug("FOUND\n");		
 
 	    GET_FS_BUFFER(fscache, pathInfo.dirEntryPtr.base, &pBuf)
 	    
 	    entry = &((struct GOSFS_Dir_Entry*)pBuf->data)[pathInfo.dirEntryPtr.offset];
-		Debug("flags : %d\n", entry->flags);
+		flags = entry->flags;
+		dirBlock = entry->blockList[0];
+		Release_FS_Buffer(fscache, pBuf);
+		Debug("flags : %d\n", flags);
 
-	    if(entry->flags & GOSFS_DIRENTRY_USED)
+	    if(flags & GOSFS_DIRENTRY_USED)
 		{
-			;
+			/*
+			 * Forget the file first: that waits for its readers and
+			 * writers, and stops them from changing the entry.
+			 * Then give back all its blocks.
+			 */
+			Detach_GOSFS_File(instance, &pathInfo.dirEntryPtr);
+			GET_FS_BUFFER(fscache, pathInfo.dirEntryPtr.base, &pBuf)
+			entry = &((struct GOSFS_Dir_Entry*)pBuf->data)[pathInfo.dirEntryPtr.offset];
+			rc = Free_File_Blocks(instance, entry);
+			Release_FS_Buffer(fscache, pBuf);
+			if(rc < 0)
+				goto done;
 		}
-		else if(entry->flags & GOSFS_DIRENTRY_ISDIRECTORY)
+		else if(flags & GOSFS_DIRENTRY_ISDIRECTORY)
 		{
-			Dir_Entry_Ptr dirEntryPtr;
-			struct GOSFS_Dir_Entry* nentry = 0;;
-			dirEntryPtr.base = entry->blockList[0];
-			dirEntryPtr.offset = 0;
-			nentry = Get_Entry_By_Ptr(instance, &dirEntryPtr);
-			/* Check whether empty.. */
-			for (i = 2; i < GOSFS_DIR_ENTRIES_PER_BLOCK; ++i) { /* weak */
-				if ((&nentry[i])->flags != 0){
-					Print("entry %d is not empty : %d \n", i, (&nentry[i])->flags);
-					rc = EUNSPECIFIED;
-					Release_FS_Buffer(fscache, pBuf);
-					goto done;
-				}
-			}	
-		}
-		
-		/* Need to consider crash */
-		Super_Block* superBlock = (Super_Block*)instance->fsinfo->data;
-		Clear_Bit(superBlock->bitmap, entry->blockList[0]);
-		Modify_FS_Buffer(fscache, instance->fsinfo); // Superblock
-		
-		if(Get_FS_Buffer(fscache, entry->blockList[0], &pBuf_1) != 0)
-	    {    	
-			Print("Get_FS_Buffer Error.\n");
-	    	return -1;
-	    }
-	    memset(pBuf_1->data, '\0', GOSFS_FS_BLOCK_SIZE); /* fill zero in the block */
-	    memset(entry, '\0', sizeof(struct GOSFS_Dir_Entry)); /* fill zero in the entry */
 
-		Modify_FS_Buffer(fscache, pBuf); // need to wrapper
-		Modify_FS_Buffer(fscache, pBuf_1); // need to wrapper
-
-		Sync_FS_Buffer_Cache(fscache);
-		Release_FS_Buffer(fscache, pBuf);
-		Release_FS_Buffer(fscache, pBuf_1);	
+			if(Get_FS_Buffer(fscache, dirBlock, &pBuf_1) != 0)
+			{    	
+				Print("Get_FS_Buffer Error.\n");
+				rc = EUNSPECIFIED;
+				goto done;
+			}
+			entry = (struct GOSFS_Dir_Entry*)pBuf_1->data;
 
-		rc = 0;
+			/* Check whether empty; a directory with leaves is not */
+			for (i = 2; i < GOSFS_DIR_ENTRIES_PER_BLOCK; ++i) {
+				if (!Is_Free_Dir_Entry(&entry[i]))
+					break;
+			}
+			if (i < GOSFS_DIR_ENTRIES_PER_BLOCK || entry[0].blockList[GOSFS_DIR_INDEX_PTR] != 0){
+				Print("directory is not empty\n");
+				rc = EUNSPECIFIED;
+				Release_FS_Buffer(fscache, pBuf_1);
+				goto done;
+			}
 
+			/* Need to consider crash */
+			memset(pBuf_1->data, '\0', GOSFS_FS_BLOCK_SIZE); /* fill zero in the block */
+			Modify_FS_Buffer(fscache, pBuf_1); // need to wrapper
+			Release_FS_Buffer(fscache, pBuf_1);
+			Free_Dir_Block(instance, dirBlock);
+			Detach_GOSFS_File(instance, &pathInfo.dirEntryPtr);
+		}
 
+		/* Clear the entry, and give back its leaf if it was the last one */
+		rc = Remove_Dir_Entry(instance, pathInfo.dirBlock, &pathInfo.dirEntryPtr);
+		Sync_FS_Buffer_Cache(fscache);
 	}
 
 	fail:
 	
 	done:
+		Mutex_Unlock(&instance->dirLock);
 		return rc;
 
     //TODO("GeekOS filesystem delete operation");
@@ -766,6 +2269,8 @@ static int GOSFS_Stat(struct Mount_Point *mountPoint, const char *path, struct V
 	strcpy(&pathInfo, path);
 	pathInfo.dirEntryPtr.base = GOSFS_SUPER_BLOCK;
 
+	Mutex_Lock(&instance->dirLock);
+
     /* Look up the directory entry */
     if ((retval = Do_GOSFS_Lookup(instance, &pathInfo)) < 0){ 
 		Debug("ENOTFOUND\n");
@@ -783,6 +2288,7 @@ static int GOSFS_Stat(struct Mount_Point *mountPoint, const char *path, struct V
 	}
 	
 	done:
+		Mutex_Unlock(&instance->dirLock);
 		return rc;
 
     TODO("GeekOS filesystem stat operation");
@@ -794,7 +2300,9 @@ static int GOSFS_Stat(struct Mount_Point *mountPoint, const char *path, struct V
  */
 static int GOSFS_Sync(struct Mount_Point *mountPoint)
 {
-    TODO("GeekOS filesystem sync operation");
+    GOSFS_Instance *instance = (GOSFS_Instance*) mountPoint->fsData;
+
+    return Sync_FS_Buffer_Cache(instance->fscache);
 }
 
 static GOSFS_Get_Path(struct Mount_Point *mountPoint, void *dentry, char *path)
@@ -803,15 +2311,16 @@ static GOSFS_Get_Path(struct Mount_Point *mountPoint, void *dentry, char *path)
 	struct FS_Buffer_Cache* fscache = instance->fscache;
 	Dir_Entry_Ptr* dentryPtr = (Dir_Entry_Ptr*)dentry;
 	Dir_Entry_Ptr* temp = (Dir_Entry_Ptr*)Malloc(sizeof(Dir_Entry_Ptr));
-	struct GOSFS_Dir_Entry* gosfsDentry;
+	struct GOSFS_Dir_Entry gosfsDentry;
 	struct GOSFS_Dir_Entry* prevBlkEntry; /* weak : Naming is not reasonable*/
-	int i;
 	int curBlkNum, prevBlkNum;
 	int rc = 0;
 
 	//Print("GOSFS_Get_Path %d, %d\n", dentryPtr->base, dentryPtr->offset);
 	//Print("filename : %s\n", Get_Entry_By_Ptr(instance, dentryPtr)->filename);
 
+	Mutex_Lock(&instance->dirLock);
+
 	/* Root directory */
 	if(Get_Entry_By_Ptr(instance, dentryPtr)->blockList[0] == ((Super_Block*)(instance->fsinfo->data))->rootDirectoryPointer)
 	{
@@ -848,38 +2357,27 @@ static GOSFS_Get_Path(struct Mount_Point *mountPoint, void *dentry, char *path)
 		if(temp->base == prevBlkNum) /* Reach to root? */
 			break;
 
-		//Print("get prev block\n");
-		temp->base = prevBlkNum;
-		temp->offset = 0; /* Previous block's first entry */
-		gosfsDentry = Get_Entry_By_Ptr(instance, temp);
-
 		//Print("Find dentry at previous block\n");
-		/* Find dentry at previous block*/
-		for (i = 0; i < GOSFS_DIR_ENTRIES_PER_BLOCK; ++i) {
-			if(gosfsDentry[i].blockList[0] == curBlkNum){
-				break;
-			}
-		}
-
-		/* There is no reference to next block */
-		if(i == GOSFS_DIR_ENTRIES_PER_BLOCK){
+		/* Find dentry in previous directory; there is no reference to next block? */
+		if(Find_Subdir_Entry(instance, prevBlkNum, curBlkNum, temp, &gosfsDentry) != 0){
 			//Print("There is no reference to next block\n");
 			rc =  EUNSPECIFIED;
 			goto done;
 		}
 
 		/* Add to path */
-		//Print("filename : %s\n", gosfsDentry[i].filename);
+		//Print("filename : %s\n", gosfsDentry.filename);
 		//Print("strlen : %d\n", strlen(path));
-		memmove(path + strlen(gosfsDentry[i].filename)+1, path, strlen(path)+1);
-		memcpy(path, gosfsDentry[i].filename, strlen(gosfsDentry[i].filename));
-		memcpy(path+strlen(gosfsDentry[i].filename), "/", 1);
-		if(strcmp(path+strlen(gosfsDentry[i].filename), "/") == 0)
-			strcpy(path+strlen(gosfsDentry[i].filename), "");
+		memmove(path + strlen(gosfsDentry.filename)+1, path, strlen(path)+1);
+		memcpy(path, gosfsDentry.filename, strlen(gosfsDentry.filename));
+		memcpy(path+strlen(gosfsDentry.filename), "/", 1);
+		if(strcmp(path+strlen(gosfsDentry.filename), "/") == 0)
+			strcpy(path+strlen(gosfsDentry.filename), "");
 		//Print("%s\n", path);	
 	}
 
 	done:
+	Mutex_Unlock(&instance->dirLock);
 	Free(temp);
 	return rc;	
 }
@@ -888,11 +2386,14 @@ static GOSFS_Lookup(struct Mount_Point *mountPoint, char *path, void** dentry)
 {
 	GOSFS_Instance *instance = (GOSFS_Instance*) mountPoint->fsData;
 	Dir_Entry_Ptr *dirEntryPtr = (Dir_Entry_Ptr *)Malloc(sizeof(Dir_Entry_Ptr));
+	struct GOSFS_Dir_Entry *entry;
 	Path_Info pathInfo;
 	strcpy(&pathInfo, path);
 	pathInfo.dirEntryPtr.base = GOSFS_SUPER_BLOCK;
 	int rc = 0;
 	
+	Mutex_Lock(&instance->dirLock);
+
     /* Look up the directory entry */
     if (Do_GOSFS_Lookup(instance, &pathInfo) < 0){ 
 		Debug("ENOTFOUND\n");
@@ -901,12 +2402,22 @@ static GOSFS_Lookup(struct Mount_Point *mountPoint, char *path, void** dentry)
 		goto done;
 	}
 
+	/*
+	 * A directory is known by its own "." entry, which stays put,
+	 * while its entry in the parent may move to another leaf.
+	 */
+	entry = Get_Entry_By_Ptr(instance, &pathInfo.dirEntryPtr);
+	if (entry != 0 && entry->flags == GOSFS_DIRENTRY_ISDIRECTORY) {
+		pathInfo.dirEntryPtr.base = entry->blockList[0];
+		pathInfo.dirEntryPtr.offset = 0;
+	}
 	memcpy(dirEntryPtr, &pathInfo.dirEntryPtr, sizeof(Dir_Entry_Ptr));
 
 	*dentry = (void*)dirEntryPtr;
 	Debug("GOSFS_Lookup %d, %d, %d\n", pathInfo.dirEntryPtr.base, pathInfo.dirEntryPtr.offset, g_currentThread->pid);
 
 	done:
+	Mutex_Unlock(&instance->dirLock);
 	return rc;
 
 
@@ -926,30 +2437,32 @@ static GOSFS_Lookup(struct Mount_Point *mountPoint, char *path, void** dentry)
 static int GOSFS_Format(struct Block_Device *blockDev)
 {
 	Super_Block* super_block = (Super_Block*)Malloc(sizeof(Super_Block));
-	struct GOSFS_Dir_Entry root_dir_entry[GOSFS_DIR_ENTRIES_PER_BLOCK];
-	uint_t offset;
-	int blockNum;
-	//(struct GOSFS_Dir_Entry*) Malloc(sizeof(struct GOSFS_Dir_Entry*));
+	/* The whole block is written; too big for the kernel stack */
+	struct GOSFS_Dir_Entry *root_dir_entry = (struct GOSFS_Dir_Entry*)Malloc(GOSFS_FS_BLOCK_SIZE);
+	int rc;
+
+	if (super_block == 0 || root_dir_entry == 0) {
+	    rc = ENOMEM;
+	    goto done;
+	}
 
 	/* Make Superblock */
 	super_block->size = Get_Num_Blocks(blockDev)/GOSFS_SECTORS_PER_FS_BLOCK;
 	super_block->rootDirectoryPointer = GOSFS_ROOT_DIR_BLOCK;
-	super_block->magic = GOSFS_MAGIC;
+	super_block->magic = GOSFS_MAGIC_EXTENTS; /* files are mapped by extents */
 	memset(super_block->bitmap, 0, sizeof(super_block->bitmap)); // weak
 	Set_Bit((void*)super_block->bitmap, GOSFS_SUPER_BLOCK); // superblock
 	Set_Bit((void*)super_block->bitmap, GOSFS_ROOT_DIR_BLOCK); // root dir
 
-	blockNum = GOSFS_SUPER_BLOCK * GOSFS_SECTORS_PER_FS_BLOCK;
-	for (offset = 0; offset < GOSFS_FS_BLOCK_SIZE; offset += SECTOR_SIZE) {
-		int rc = Block_Write(blockDev, blockNum, (char*)super_block + offset);
-		if (rc != 0)
-		    return rc;
-		++blockNum;
-    }
+	rc = Block_Write_Multi(blockDev, GOSFS_SUPER_BLOCK * GOSFS_SECTORS_PER_FS_BLOCK,
+		GOSFS_SECTORS_PER_FS_BLOCK, super_block);
+	if (rc != 0)
+	    goto done;
     
 	/* Make Root diretory entry 
 	 * Need to add acl
 	 */ 
+	memset(root_dir_entry, '\0', GOSFS_FS_BLOCK_SIZE);
 	strcpy(root_dir_entry[0].filename, ".");
 	root_dir_entry[0].flags = GOSFS_DIRENTRY_ISDIRECTORY;
 	root_dir_entry[0].blockList[0] = GOSFS_ROOT_DIR_BLOCK;
@@ -960,19 +2473,17 @@ static int GOSFS_Format(struct Block_Device *blockDev)
 	root_dir_entry[1].blockList[0] = GOSFS_ROOT_DIR_BLOCK;
 	root_dir_entry[1].size = 1*GOSFS_FS_BLOCK_SIZE;
 
-	blockNum = GOSFS_ROOT_DIR_BLOCK * GOSFS_SECTORS_PER_FS_BLOCK;
-	for (offset = 0; offset < GOSFS_FS_BLOCK_SIZE; offset += SECTOR_SIZE) {
-		int rc = Block_Write(blockDev, blockNum, (char*)root_dir_entry + offset);
-		if (rc != 0)
-		    return rc;
-		++blockNum;
-    }
+	rc = Block_Write_Multi(blockDev, GOSFS_ROOT_DIR_BLOCK * GOSFS_SECTORS_PER_FS_BLOCK,
+		GOSFS_SECTORS_PER_FS_BLOCK, root_dir_entry);
 	
     //TODO("GeekOS filesystem format operation");
 
-    Free(super_block);
-    //Free(root_dir_entry);
-    return 0;
+done:
+    if (super_block != 0)
+	Free(super_block);
+    if (root_dir_entry != 0)
+	Free(root_dir_entry);
+    return rc;
 }
 
 static int GOSFS_Mount(struct Mount_Point *mountPoint)
@@ -1004,10 +2515,17 @@ static int GOSFS_Mount(struct Mount_Point *mountPoint)
 	//Print("rootDir : %d\n", superBlock->rootDirectoryPointer);
 
     /* Does magic number match? */
-    if (superBlock->magic != GOSFS_MAGIC) {
+    if (superBlock->magic != GOSFS_MAGIC && superBlock->magic != GOSFS_MAGIC_EXTENTS) {
 		Print("Bad magic number (%x) for GOSFS filesystem\n", superBlock->magic);
 		goto invalidfs;
     }
+    instance->extents = (superBlock->magic == GOSFS_MAGIC_EXTENTS);
+
+    /* Blocks in use, to which blocks reserved for appends are added */
+    instance->allocMap = (uchar_t*) Malloc(sizeof(superBlock->bitmap));
+    if (instance->allocMap == 0)
+		goto memfail;
+    memcpy(instance->allocMap, superBlock->bitmap, sizeof(superBlock->bitmap));
 
     /* Create the fake root directory entry. */
     memset(&instance->rootDirEntry, '\0', sizeof(struct GOSFS_Dir_Entry));
@@ -1017,6 +2535,7 @@ static int GOSFS_Mount(struct Mount_Point *mountPoint)
 
  	/* Initialize instance lock and GOSFS_File list. */
     Mutex_Init(&instance->lock);
+    Mutex_Init(&instance->dirLock);
     Clear_GOSFS_File_List(&instance->fileList);
 
     /*
@@ -1080,5 +2599,7 @@ static struct Filesystem_Ops s_gosfsFilesystemOps = {
 
 void Init_GOSFS(void)
 {
+    s_gosfsFileCache = Create_Object_Cache("GOSFS_File", sizeof(struct GOSFS_File), 0);
+    KASSERT(s_gosfsFileCache != 0);
     Register_Filesystem("gosfs", &s_gosfsFilesystemOps);
 }
@@ -21,9 +21,12 @@
 #include <geekos/string.h>
 #include <geekos/io.h>
 #include <geekos/int.h>
+#include <geekos/irq.h>
 #include <geekos/screen.h>
 #include <geekos/timer.h>
 #include <geekos/kthread.h>
+#include <geekos/mem.h>
+#include <geekos/pci.h>
 #include <geekos/blockdev.h>
 #include <geekos/ide.h>
 
@@ -40,6 +43,13 @@
 #define IDE_COMMAND_REGISTER		0x1f7
 #define IDE_DEVICE_CONTROL_REGISTER	0x3F6
 
+/*
+ * IRQ of the primary channel.  Both drives this driver supports
+ * (master and slave at 0x1f0) sit on it; the secondary channel
+ * (IRQ 15) is not used.
+ */
+#define IDE_IRQ				14
+
 /* Drives */
 #define IDE_DRIVE_0			0xa0
 #define IDE_DRIVE_1			0xb0
@@ -51,6 +61,8 @@
 #define IDE_COMMAND_READ_BUFFER		0xE4
 #define IDE_COMMAND_WRITE_SECTORS	0x30
 #define IDE_COMMAND_WRITE_BUFFER	0xE8
+#define IDE_COMMAND_READ_DMA		0xC8
+#define IDE_COMMAND_WRITE_DMA		0xCA
 #define IDE_COMMAND_DIAGNOSTIC		0x90
 #define IDE_COMMAND_ATAPI_IDENT_DRIVE	0xA1
 
@@ -60,6 +72,10 @@
 #define	IDE_INDENTIFY_NUM_BYTES_TRACK	0x04
 #define	IDE_INDENTIFY_NUM_BYTES_SECTOR	0x05
 #define	IDE_INDENTIFY_NUM_SECTORS_TRACK	0x06
+#define	IDE_INDENTIFY_CAPABILITIES	0x31
+
+/* bits of the capabilities word */
+#define IDE_CAPABILITY_DMA		0x0100
 
 /* bits of Status Register */
 #define IDE_STATUS_DRIVE_BUSY		0x80
@@ -81,6 +97,38 @@
 #define	IDE_ERROR_INVALID_BLOCK	-2
 #define	IDE_ERROR_DRIVE_ERROR	-3
 
+/*
+ * Bus-master (PIIX style) DMA registers of the primary channel,
+ * relative to the I/O base in BAR 4 of the IDE controller.
+ */
+#define IDE_BM_COMMAND			0
+#define IDE_BM_STATUS			2
+#define IDE_BM_PRD_ADDRESS		4
+
+/* Bits of the bus-master command register */
+#define IDE_BM_COMMAND_START		0x01
+#define IDE_BM_COMMAND_READ		0x08	/* i.e., device to memory */
+
+/* Bits of the bus-master status register */
+#define IDE_BM_STATUS_ACTIVE		0x01
+#define IDE_BM_STATUS_ERROR		0x02
+#define IDE_BM_STATUS_INTERRUPT		0x04
+
+/*
+ * Physical Region Descriptor: one piece of memory taking part
+ * in a DMA transfer.  A region may not cross a 64K boundary;
+ * a byte count of 0 means 64K.
+ */
+struct IDE_PRD {
+    ulong_t addr;
+    ushort_t numBytes;
+    ushort_t flags;
+} __attribute__((packed));
+
+#define IDE_PRD_END_OF_TABLE		0x8000
+#define IDE_MAX_PRD			(PAGE_SIZE / sizeof(struct IDE_PRD))
+#define IDE_DMA_BOUNDARY		0x10000UL
+
 /* Control register bits */
 #define IDE_CONTROL_REGISTER		0x3F6
 #define IDE_CONTROL_SOFTWARE_RESET	0x04
@@ -91,20 +139,43 @@
 
 #define IDE_MAX_DRIVES			2
 
+/* Largest sector count we put in one command (the register holds 8 bits) */
+#define IDE_MAX_SECTORS_PER_COMMAND	255
+
 typedef struct {
     short num_Cylinders;
     short num_Heads;
     short num_SectorsPerTrack;
     short num_BytesPerSector;
+    bool dma;			/* Drive can do (multiword) DMA. */
 } ideDisk;
 
 int ideDebug = 0;
+
+/* Set to 0 to force PIO even when a bus-master controller is present. */
+int ideUseDMA = 1;
+
+/*
+ * I/O base of the bus-master registers, or 0 if no bus-master
+ * controller was found.  The PRD table lives in a page of its own,
+ * so it is aligned and does not cross a 64K boundary.
+ */
+static ushort_t s_ideBusMasterBase;
+static struct IDE_PRD *s_idePrdTable;
 static int numDrives;
 static ideDisk drives[IDE_MAX_DRIVES];
 
 struct Thread_Queue s_ideWaitQueue;
 struct Block_Request_List s_ideRequestQueue;
 
+/*
+ * Set by the interrupt handler, along with the status it read.
+ * The request thread sleeps on s_ideInterruptWaitQueue until then.
+ */
+static volatile bool s_ideInterruptPending;
+static volatile int s_ideInterruptStatus;
+static struct Thread_Queue s_ideInterruptWaitQueue;
+
 /*
  * return the number of logical blocks for a particular drive.
  *
@@ -121,31 +192,59 @@ static int IDE_getNumBlocks(int driveNum)
 }
 
 /*
- * Read a block at the logical block number indicated.
+ * Interrupt handler for the primary IDE channel.
+ * Reading the status register acknowledges the interrupt;
+ * the status is handed to the request thread.
  */
-static int IDE_Read(int driveNum, int blockNum, char *buffer)
+static void IDE_Interrupt_Handler(struct Interrupt_State* state)
 {
-    int i;
-    int head;
-    int sector;
-    int cylinder;
-    short *bufferW;
-    int reEnable = 0;
+    Begin_IRQ(state);
+    s_ideInterruptStatus = In_Byte(IDE_STATUS_REGISTER);
+    s_ideInterruptPending = true;
+    Wake_Up(&s_ideInterruptWaitQueue);
+    End_IRQ(state);
+}
 
-    if (driveNum < 0 || driveNum > (numDrives-1)) {
-	if (ideDebug) Print("ide: invalid drive %d\n", driveNum);
-        return IDE_ERROR_BAD_DRIVE;
-    }
+/*
+ * Sleep until the drive interrupts, and return the status
+ * it reported.  Must be called with interrupts enabled.
+ */
+static int IDE_Wait_For_Interrupt(void)
+{
+    int status;
 
-    if (blockNum < 0 || blockNum >= IDE_getNumBlocks(driveNum)) {
-	if (ideDebug) Print("ide: invalid block %d\n", blockNum);
-        return IDE_ERROR_INVALID_BLOCK;
-    }
+    Disable_Interrupts();
+    while (!s_ideInterruptPending)
+	Wait(&s_ideInterruptWaitQueue);
+    s_ideInterruptPending = false;
+    status = s_ideInterruptStatus;
+    Enable_Interrupts();
 
-    if (Interrupts_Enabled()) {
-	Disable_Interrupts();
-	reEnable = 1;
-    }
+    return status;
+}
+
+/*
+ * Wait until the drive is no longer busy, and return its status.
+ */
+static int IDE_Wait_Not_Busy(void)
+{
+    int status;
+
+    while ((status = In_Byte(IDE_STATUS_REGISTER)) & IDE_STATUS_DRIVE_BUSY)
+	;
+    return status;
+}
+
+/*
+ * Issue a read or write command for numBlocks (at most
+ * IDE_MAX_SECTORS_PER_COMMAND) blocks starting at blockNum.
+ */
+static void IDE_Issue_Command(int driveNum, int blockNum, int numBlocks, int command)
+{
+    bool iflag;
+    int head;
+    int sector;
+    int cylinder;
 
     /* now compute the head, cylinder, and sector */
     sector = blockNum % drives[driveNum].num_SectorsPerTrack + 1;
@@ -155,13 +254,15 @@ static int IDE_Read(int driveNum, int blockNum, char *buffer)
         drives[driveNum].num_Heads;
 
     if (ideDebug >= 2) {
-	Print ("request to read block %d\n", blockNum);
+	Print ("request to %s %d blocks at %d\n",
+	    command == IDE_COMMAND_READ_SECTORS ? "read" : "write", numBlocks, blockNum);
 	Print ("    head %d\n", head);
 	Print ("    cylinder %d\n", cylinder);
 	Print ("    sector %d\n", sector);
     }
 
-    Out_Byte(IDE_SECTOR_COUNT_REGISTER, 1);
+    /* The drive steps through sectors, heads and cylinders itself. */
+    Out_Byte(IDE_SECTOR_COUNT_REGISTER, numBlocks);
     Out_Byte(IDE_SECTOR_NUMBER_REGISTER, sector);
     Out_Byte(IDE_CYLINDER_LOW_REGISTER, LOW_BYTE(cylinder));
     Out_Byte(IDE_CYLINDER_HIGH_REGISTER, HIGH_BYTE(cylinder));
@@ -171,101 +272,231 @@ static int IDE_Read(int driveNum, int blockNum, char *buffer)
 	Out_Byte(IDE_DRIVE_HEAD_REGISTER, IDE_DRIVE_1 | head);
     }
 
-    Out_Byte(IDE_COMMAND_REGISTER, IDE_COMMAND_READ_SECTORS);
-
-    if (ideDebug > 2) Print("About to wait for Read \n");
-
-    /* wait for the drive */
-    while (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_BUSY);
+    /* Forget any earlier interrupt before the drive can raise a new one. */
+    iflag = Begin_Int_Atomic();
+    s_ideInterruptPending = false;
+    Out_Byte(IDE_COMMAND_REGISTER, command);
+    End_Int_Atomic(iflag);
+}
 
-    if (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_ERROR) {
-	Print("ERROR: Got Read %d\n", In_Byte(IDE_STATUS_REGISTER));
-	return IDE_ERROR_DRIVE_ERROR;
+/*
+ * Check that a transfer of numBlocks blocks at blockNum is valid.
+ */
+static int IDE_Check_Request(int driveNum, int blockNum, int numBlocks)
+{
+    if (driveNum < 0 || driveNum > (numDrives-1)) {
+	if (ideDebug) Print("ide: invalid drive %d\n", driveNum);
+        return IDE_ERROR_BAD_DRIVE;
     }
 
-    if (ideDebug > 2) Print("got buffer \n");
-
-    bufferW = (short *) buffer;
-    for (i=0; i < 256; i++) {
-        bufferW[i] = In_Word(IDE_DATA_REGISTER);
+    if (blockNum < 0 || numBlocks <= 0 ||
+	blockNum + numBlocks > IDE_getNumBlocks(driveNum)) {
+	if (ideDebug) Print("ide: invalid block %d (+%d)\n", blockNum, numBlocks);
+        return IDE_ERROR_INVALID_BLOCK;
     }
 
-    if (reEnable) Enable_Interrupts();
-
     return IDE_ERROR_NO_ERROR;
 }
 
 /*
- * Write a block at the logical block number indicated.
+ * Find out whether given request can be transferred by DMA.
+ * The drive and controller must support it, and every buffer
+ * must be word aligned, as the PRD format requires.
  */
-static int IDE_Write(int driveNum, int blockNum, char *buffer)
+static bool IDE_Can_Use_DMA(int driveNum, struct Block_Request *request)
 {
     int i;
-    int head;
-    int sector;
-    int cylinder;
-    short *bufferW;
-    int reEnable = 0;
 
-    if (driveNum < 0 || driveNum > (numDrives-1)) {
-        return IDE_ERROR_BAD_DRIVE;
-    }
+    if (!ideUseDMA || s_ideBusMasterBase == 0 || !drives[driveNum].dma)
+	return false;
 
-    if (blockNum < 0 || blockNum >= IDE_getNumBlocks(driveNum)) {
-        return IDE_ERROR_INVALID_BLOCK;
+    for (i = 0; i < request->numSegments; ++i) {
+	if (((ulong_t) request->segment[i].buf) & 1)
+	    return false;
     }
+    return true;
+}
 
-    if (Interrupts_Enabled()) {
-	Disable_Interrupts();
-	reEnable = 1;
+/*
+ * Fill in the PRD table for blocks [first, first+count) of given request.
+ * Blocks adjacent in memory share a region; regions are split
+ * at 64K boundaries.  Kernel memory is identity mapped, so the
+ * buffer addresses are the physical addresses the controller needs.
+ */
+static void IDE_Build_PRD_Table(struct Block_Request *request, int first, int count)
+{
+    int numPrd = 0;
+    ulong_t regionEnd = 0, regionLen = 0;
+    int i;
+
+    for (i = first; i < first + count; ++i) {
+	ulong_t addr = (ulong_t) Get_Request_Block_Buffer(request, i);
+	ulong_t left = SECTOR_SIZE;
+
+	while (left > 0) {
+	    ulong_t room = IDE_DMA_BOUNDARY - (addr & (IDE_DMA_BOUNDARY - 1));
+	    ulong_t len = left < room ? left : room;
+
+	    if (numPrd > 0 && addr == regionEnd && (addr & (IDE_DMA_BOUNDARY - 1)) != 0) {
+		/* Contiguous with the previous region, in the same 64K window */
+		regionLen += len;
+	    } else {
+		KASSERT(numPrd < (int) IDE_MAX_PRD);
+		s_idePrdTable[numPrd].addr = addr;
+		s_idePrdTable[numPrd].flags = 0;
+		regionLen = len;
+		++numPrd;
+	    }
+	    /* A full 64K region is encoded as 0 */
+	    s_idePrdTable[numPrd - 1].numBytes = (ushort_t) regionLen;
+
+	    regionEnd = addr + len;
+	    addr += len;
+	    left -= len;
+	}
     }
 
-    /* now compute the head, cylinder, and sector */
-    sector = blockNum % drives[driveNum].num_SectorsPerTrack + 1;
-    cylinder = blockNum / (drives[driveNum].num_Heads * 
-     	drives[driveNum].num_SectorsPerTrack);
-    head = (blockNum / drives[driveNum].num_SectorsPerTrack) % 
-        drives[driveNum].num_Heads;
+    KASSERT(numPrd > 0);
+    s_idePrdTable[numPrd - 1].flags = IDE_PRD_END_OF_TABLE;
+}
 
-    if (ideDebug) {
-	Print ("request to write block %d\n", blockNum);
-	Print ("    head %d\n", head);
-	Print ("    cylinder %d\n", cylinder);
-	Print ("    sector %d\n", sector);
-    }
+/*
+ * Transfer the blocks of given request by bus-master DMA.
+ * The CPU only programs the controller; the request thread sleeps
+ * until the drive interrupts at the end of each command.
+ */
+static int IDE_Transfer_DMA(int driveNum, struct Block_Request *request)
+{
+    bool read = request->type == BLOCK_READ;
+    int done, count, status, bmStatus;
+    int rc;
 
-    Out_Byte(IDE_SECTOR_COUNT_REGISTER, 1);
-    Out_Byte(IDE_SECTOR_NUMBER_REGISTER, sector);
-    Out_Byte(IDE_CYLINDER_LOW_REGISTER, LOW_BYTE(cylinder));
-    Out_Byte(IDE_CYLINDER_HIGH_REGISTER, HIGH_BYTE(cylinder));
-    if (driveNum == 0) {
-	Out_Byte(IDE_DRIVE_HEAD_REGISTER, IDE_DRIVE_0 | head);
-    } else if (driveNum == 1) {
-	Out_Byte(IDE_DRIVE_HEAD_REGISTER, IDE_DRIVE_1 | head);
-    }
+    if ((rc = IDE_Check_Request(driveNum, request->blockNum, request->numBlocks)) != 0)
+	return rc;
 
-    Out_Byte(IDE_COMMAND_REGISTER, IDE_COMMAND_WRITE_SECTORS);
+    for (done = 0; done < request->numBlocks; done += count) {
+	count = request->numBlocks - done;
+	if (count > IDE_MAX_SECTORS_PER_COMMAND)
+	    count = IDE_MAX_SECTORS_PER_COMMAND;
 
+	IDE_Build_PRD_Table(request, done, count);
 
-    /* wait for the drive */
-    while (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_BUSY);
+	/* Stop the engine, clear old status, and point it at the table */
+	Out_Byte(s_ideBusMasterBase + IDE_BM_COMMAND, 0);
+	Out_Byte(s_ideBusMasterBase + IDE_BM_STATUS,
+	    In_Byte(s_ideBusMasterBase + IDE_BM_STATUS) | IDE_BM_STATUS_ERROR | IDE_BM_STATUS_INTERRUPT);
+	Out_DWord(s_ideBusMasterBase + IDE_BM_PRD_ADDRESS, (ulong_t) s_idePrdTable);
+	Out_Byte(s_ideBusMasterBase + IDE_BM_COMMAND, read ? IDE_BM_COMMAND_READ : 0);
+
+	IDE_Issue_Command(driveNum, request->blockNum + done, count,
+	    read ? IDE_COMMAND_READ_DMA : IDE_COMMAND_WRITE_DMA);
+	Out_Byte(s_ideBusMasterBase + IDE_BM_COMMAND,
+	    (read ? IDE_BM_COMMAND_READ : 0) | IDE_BM_COMMAND_START);
+
+	if (ideDebug > 2) Print("About to wait for DMA\n");
+	status = IDE_Wait_For_Interrupt();
 
-    bufferW = (short *) buffer;
-    for (i=0; i < 256; i++) {
-        Out_Word(IDE_DATA_REGISTER, bufferW[i]);
+	Out_Byte(s_ideBusMasterBase + IDE_BM_COMMAND, 0);
+	bmStatus = In_Byte(s_ideBusMasterBase + IDE_BM_STATUS);
+	Out_Byte(s_ideBusMasterBase + IDE_BM_STATUS, bmStatus);
+
+	if ((status & (IDE_STATUS_DRIVE_ERROR | IDE_STATUS_DRIVE_WRITE_FAULT)) ||
+	    (bmStatus & IDE_BM_STATUS_ERROR)) {
+	    Print("ERROR: Got DMA %d (bus master %d)\n", status, bmStatus);
+	    return IDE_ERROR_DRIVE_ERROR;
+	}
     }
 
-    if (ideDebug) Print("About to wait for Write \n");
+    return IDE_ERROR_NO_ERROR;
+}
 
-    /* wait for the drive */
-    while (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_BUSY);
+/*
+ * Read the blocks of given request, using as few
+ * multi-sector commands as possible.
+ * The request thread sleeps until the drive interrupts
+ * to say each sector is ready.
+ */
+static int IDE_Read(int driveNum, struct Block_Request *request)
+{
+    int i, done, count, status;
+    short *bufferW;
+    int rc;
 
-    if (In_Byte(IDE_STATUS_REGISTER) & IDE_STATUS_DRIVE_ERROR) {
-	Print("ERROR: Got Read %d\n", In_Byte(IDE_STATUS_REGISTER));
-	return IDE_ERROR_DRIVE_ERROR;
+    if ((rc = IDE_Check_Request(driveNum, request->blockNum, request->numBlocks)) != 0)
+	return rc;
+
+    for (done = 0; done < request->numBlocks; ) {
+	count = request->numBlocks - done;
+	if (count > IDE_MAX_SECTORS_PER_COMMAND)
+	    count = IDE_MAX_SECTORS_PER_COMMAND;
+	IDE_Issue_Command(driveNum, request->blockNum + done, count, IDE_COMMAND_READ_SECTORS);
+
+	if (ideDebug > 2) Print("About to wait for Read \n");
+
+	/* The drive interrupts with DRQ set once per sector. */
+	for (; count > 0; --count, ++done) {
+	    status = IDE_Wait_For_Interrupt();
+	    if ((status & IDE_STATUS_DRIVE_ERROR) || !(status & IDE_STATUS_DRIVE_DATA_REQUEST)) {
+		Print("ERROR: Got Read %d\n", status);
+		return IDE_ERROR_DRIVE_ERROR;
+	    }
+
+	    bufferW = (short *) Get_Request_Block_Buffer(request, done);
+	    for (i=0; i < 256; i++) {
+	        bufferW[i] = In_Word(IDE_DATA_REGISTER);
+	    }
+	}
     }
 
-    if (reEnable) Enable_Interrupts();
+    return IDE_ERROR_NO_ERROR;
+}
+
+/*
+ * Write the blocks of given request, using as few
+ * multi-sector commands as possible.
+ * The drive asks for the first sector right away; after that
+ * it interrupts when it has taken each sector.
+ */
+static int IDE_Write(int driveNum, struct Block_Request *request)
+{
+    int i, done, count, status;
+    short *bufferW;
+    int rc;
+
+    if ((rc = IDE_Check_Request(driveNum, request->blockNum, request->numBlocks)) != 0)
+	return rc;
+
+    for (done = 0; done < request->numBlocks; ) {
+	count = request->numBlocks - done;
+	if (count > IDE_MAX_SECTORS_PER_COMMAND)
+	    count = IDE_MAX_SECTORS_PER_COMMAND;
+	IDE_Issue_Command(driveNum, request->blockNum + done, count, IDE_COMMAND_WRITE_SECTORS);
+
+	/* wait for the drive to ask for the first sector */
+	status = IDE_Wait_Not_Busy();
+
+	for (; count > 0; --count, ++done) {
+	    if ((status & IDE_STATUS_DRIVE_ERROR) || !(status & IDE_STATUS_DRIVE_DATA_REQUEST)) {
+		Print("ERROR: Got Write %d\n", status);
+		return IDE_ERROR_DRIVE_ERROR;
+	    }
+
+	    bufferW = (short *) Get_Request_Block_Buffer(request, done);
+	    for (i=0; i < 256; i++) {
+	        Out_Word(IDE_DATA_REGISTER, bufferW[i]);
+	    }
+
+	    if (ideDebug) Print("About to wait for Write \n");
+
+	    /* The drive interrupts once it has written the sector. */
+	    status = IDE_Wait_For_Interrupt();
+	}
+
+	if (status & IDE_STATUS_DRIVE_ERROR) {
+	    Print("ERROR: Got Write %d\n", status);
+	    return IDE_ERROR_DRIVE_ERROR;
+	}
+    }
 
     return IDE_ERROR_NO_ERROR;
 }
@@ -303,16 +534,51 @@ static void IDE_Request_Thread(ulong_t arg)
 	request = Dequeue_Request(&s_ideRequestQueue, &s_ideWaitQueue);
 
 	/* Do the I/O */
-	if (request->type == BLOCK_READ)
-	    rc = IDE_Read(request->dev->unit, request->blockNum, request->buf);
+	if (IDE_Can_Use_DMA(request->dev->unit, request))
+	    rc = IDE_Transfer_DMA(request->dev->unit, request);
+	else if (request->type == BLOCK_READ)
+	    rc = IDE_Read(request->dev->unit, request);
 	else
-	    rc = IDE_Write(request->dev->unit, request->blockNum, request->buf);
+	    rc = IDE_Write(request->dev->unit, request);
 
 	/* Notify requesting thread of final status */
 	Notify_Request_Completion(request, rc == 0 ? COMPLETED : ERROR, rc);
     }
 }
 
+/*
+ * Look for a PCI IDE controller that can do bus-master DMA,
+ * and set up s_ideBusMasterBase and the PRD table if there is one.
+ * Otherwise the driver keeps using PIO.
+ */
+static void IDE_Probe_Bus_Master(void)
+{
+    struct PCI_Device pci;
+    ulong_t bar;
+
+    if (!PCI_Find_Class(PCI_CLASS_STORAGE, PCI_SUBCLASS_IDE, &pci)) {
+	if (ideDebug) Print("ide: no PCI IDE controller, using PIO\n");
+	return;
+    }
+
+    /* Bit 7 of the programming interface says bus mastering is supported */
+    bar = PCI_Read_Config(&pci, PCI_CONFIG_BAR(4));
+    if (!(pci.progIf & 0x80) || !(bar & 1) || (bar & 0xfffc) == 0) {
+	if (ideDebug) Print("ide: controller can't do bus-master DMA, using PIO\n");
+	return;
+    }
+
+    s_idePrdTable = Alloc_Page();
+    if (s_idePrdTable == 0)
+	return;
+
+    PCI_Write_Config(&pci, PCI_CONFIG_COMMAND,
+	PCI_Read_Config(&pci, PCI_CONFIG_COMMAND) | PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+    s_ideBusMasterBase = bar & 0xfffc;
+
+    Print("    ide: bus-master DMA at port %x\n", s_ideBusMasterBase);
+}
+
 static int readDriveConfig(int drive)
 {
     int i;
@@ -343,6 +609,7 @@ static int readDriveConfig(int drive)
 	drives[drive].num_Heads = info[IDE_INDENTIFY_NUM_HEADS];
 	drives[drive].num_SectorsPerTrack = info[IDE_INDENTIFY_NUM_SECTORS_TRACK];
 	drives[drive].num_BytesPerSector = info[IDE_INDENTIFY_NUM_BYTES_SECTOR];
+	drives[drive].dma = (info[IDE_INDENTIFY_CAPABILITIES] & IDE_CAPABILITY_DMA) != 0;
     } else {
        /* try for ATAPI */
        Out_Byte(IDE_FEATURE_REG, 0);		 /* disable dma & overlap */
@@ -355,8 +622,9 @@ static int readDriveConfig(int drive)
        return -1;
     }
 
-    Print("    ide%d: cyl=%d, heads=%d, sectors=%d\n", drive, drives[drive].num_Cylinders,
-	drives[drive].num_Heads, drives[drive].num_SectorsPerTrack);
+    Print("    ide%d: cyl=%d, heads=%d, sectors=%d%s\n", drive, drives[drive].num_Cylinders,
+	drives[drive].num_Heads, drives[drive].num_SectorsPerTrack,
+	drives[drive].dma ? ", dma" : "");
 
     /* Register the drive as a block device */
     snprintf(devname, sizeof(devname), "ide%d", drive);
@@ -404,6 +672,17 @@ void Init_IDE(void)
 	++numDrives;
     if (ideDebug) Print("Found %d IDE drives\n", numDrives);
 
+    if (numDrives > 0)
+	IDE_Probe_Bus_Master();
+
+    /*
+     * Probing was done by polling; from now on the drives
+     * interrupt when they need attention.
+     */
+    Install_IRQ(IDE_IRQ, &IDE_Interrupt_Handler);
+    Enable_IRQ(IDE_IRQ);
+    Out_Byte(IDE_DEVICE_CONTROL_REGISTER, 0);
+
     /* Start request thread */
     if (numDrives > 0)
 	kthread = Start_Kernel_Thread(IDE_Request_Thread, 0, PRIORITY_NORMAL, true);
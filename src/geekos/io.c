@@ -65,6 +65,34 @@ ushort_t In_Word(ushort_t port)
     return value;
 }
 
+/*
+ * Write a doubleword to an I/O port.
+ */
+void Out_DWord(ushort_t port, ulong_t value)
+{
+    __asm__ __volatile__ (
+	"outl %0, %w1"
+	:
+	: "a" (value), "Nd" (port)
+    );
+}
+
+/*
+ * Read a doubleword from an I/O port.
+ */
+ulong_t In_DWord(ushort_t port)
+{
+    ulong_t value;
+
+    __asm__ __volatile__ (
+	"inl %w1, %0"
+	: "=a" (value)
+	: "Nd" (port)
+    );
+
+    return value;
+}
+
 /*
  * Short delay.  May be needed when talking to some
  * (slow) I/O devices.
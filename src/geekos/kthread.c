@@ -16,6 +16,7 @@
 #include <geekos/string.h>
 #include <geekos/kthread.h>
 #include <geekos/malloc.h>
+#include <geekos/slab.h>
 #include <geekos/user.h> // improtant
 
 // For sched algorithm
@@ -39,8 +40,21 @@ static struct All_Thread_List s_allThreadList;
 
 /*
  * Run queues.  0 is the highest priority queue.
+ * Each level holds one FIFO per thread priority.  s_runQueueLevelMask
+ * has bit N set iff level N has a runnable thread, and
+ * s_runQueuePrioMask[N] has bit P set iff s_runQueue[N][P] is non-empty,
+ * so picking the next thread never walks a queue.
  */
-static struct Thread_Queue s_runQueue[4];
+#define NUM_RUN_QUEUE_LEVELS 4
+#define NUM_PRIORITIES (PRIORITY_HIGH + 1)
+static struct Thread_Queue s_runQueue[NUM_RUN_QUEUE_LEVELS][NUM_PRIORITIES];
+static ulong_t s_runQueueLevelMask;
+static ulong_t s_runQueuePrioMask[NUM_RUN_QUEUE_LEVELS];
+
+/*
+ * Scheduler statistics, reported by the SchedStat system call.
+ */
+static struct Sched_Stat s_schedStat;
 
 /*
  * Current thread.
@@ -61,6 +75,12 @@ int g_needReschedule;
  */
 volatile int g_preemptionDisabled;
 
+/*
+ * Thread context objects (other than the initial thread's,
+ * which lives at KERN_THREAD_OBJ).
+ */
+static struct Object_Cache *s_threadCache;
+
 /*
  * Queue of finished threads needing disposal,
  * and a wait queue used for communication between exited threads
@@ -125,10 +145,10 @@ static struct Kernel_Thread* Create_Thread(int priority, bool detached)
     void* stackPage = 0;
 
     /*
-     * For now, just allocate one page each for the thread context
-     * object and the thread's stack.
+     * The thread context object comes from the thread cache;
+     * the stack is one page.
      */
-    kthread = Alloc_Page();
+    kthread = Cache_Alloc(s_threadCache);
     if (kthread != 0)
         stackPage = Alloc_Page();    
 
@@ -136,7 +156,7 @@ static struct Kernel_Thread* Create_Thread(int priority, bool detached)
     if (kthread == 0)
 		return 0;
     if (stackPage == 0) {
-		Free_Page(kthread);
+		Cache_Free(s_threadCache, kthread);
 		return 0;
     }
 
@@ -179,7 +199,10 @@ static void Destroy_Thread(struct Kernel_Thread* kthread)
     /* Dispose of the thread's memory. */
     Disable_Interrupts();
     Free_Page(kthread->stackPage);
-    Free_Page(kthread);
+    if (kthread == (struct Kernel_Thread *) KERN_THREAD_OBJ)
+		Free_Page(kthread);
+    else
+		Cache_Free(s_threadCache, kthread);
 
     /* Remove from list of all threads */
     Remove_From_All_Thread_List(&s_allThreadList, kthread);
@@ -371,8 +394,11 @@ static void Setup_Kernel_Thread(
  */
 static void Idle(ulong_t arg)
 {
-    while (true)
+    while (true) {
+	/* Use the spare time to zero pages for Alloc_Zeroed_Page() */
+	Zero_Free_Page();
 	Yield();
+    }
 }
 
 /*
@@ -422,6 +448,79 @@ static void Reaper(ulong_t arg)
     }
 }
 
+/*
+ * Index of the lowest/highest set bit in a non-zero mask.
+ */
+static __inline__ int Find_Lowest_Bit(ulong_t mask)
+{
+    int bit;
+    __asm__ ("bsfl %1, %0" : "=r" (bit) : "rm" (mask));
+    return bit;
+}
+
+static __inline__ int Find_Highest_Bit(ulong_t mask)
+{
+    int bit;
+    __asm__ ("bsrl %1, %0" : "=r" (bit) : "rm" (mask));
+    return bit;
+}
+
+/*
+ * Read the processor time stamp counter (low 32 bits).
+ */
+static __inline__ ulong_t Read_TSC(void)
+{
+    ulong_t lo, hi;
+    __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
+    return lo;
+}
+
+/*
+ * Map a thread priority onto a run queue slot.
+ */
+static __inline__ int Run_Queue_Prio(struct Kernel_Thread* kthread)
+{
+    int prio = kthread->priority;
+    if (prio < 0)
+	prio = 0;
+    else if (prio >= NUM_PRIORITIES)
+	prio = NUM_PRIORITIES - 1;
+    return prio;
+}
+
+/*
+ * Put a thread on the back (or front) of its run queue at given level.
+ * Must be called with interrupts disabled!
+ */
+static void Run_Queue_Insert(struct Kernel_Thread* kthread, int level, bool front)
+{
+    int prio = Run_Queue_Prio(kthread);
+
+    KASSERT(level >= 0 && level < NUM_RUN_QUEUE_LEVELS);
+    if (front)
+	Add_To_Front_Of_Thread_Queue(&s_runQueue[level][prio], kthread);
+    else
+	Add_To_Back_Of_Thread_Queue(&s_runQueue[level][prio], kthread);
+    s_runQueuePrioMask[level] |= (1UL << prio);
+    s_runQueueLevelMask |= (1UL << level);
+}
+
+/*
+ * Take a thread off its run queue at given level.
+ * Must be called with interrupts disabled!
+ */
+static void Run_Queue_Remove(struct Kernel_Thread* kthread, int level)
+{
+    int prio = Run_Queue_Prio(kthread);
+
+    Remove_Thread(&s_runQueue[level][prio], kthread);
+    if (Is_Thread_Queue_Empty(&s_runQueue[level][prio])) {
+	s_runQueuePrioMask[level] &= ~(1UL << prio);
+	if (s_runQueuePrioMask[level] == 0)
+	    s_runQueueLevelMask &= ~(1UL << level);
+    }
+}
+
 /*
  * Find the best (highest priority) thread in given
  * thread queue.  Returns null if queue is empty.
@@ -492,21 +591,20 @@ void Switch_To_RR(void)
 	KASSERT(!Interrupts_Enabled());
 
 	struct Kernel_Thread* kthread;
-	int i;
-	for(i = 1; i < MAX_QUEUE_LEVEL; i++)
+	int i, prio;
+	for(i = 1; i < NUM_RUN_QUEUE_LEVELS; i++)
 	{
-		kthread = (&s_runQueue[i])->head;
-		while (kthread != 0) 
+		for(prio = 0; prio < NUM_PRIORITIES; prio++)
 		{
-			Print("%d pid: %d\n", i, kthread->pid); 
-			kthread->currentReadyQueue = 0;
-			Remove_From_Thread_Queue(&s_runQueue[i],kthread);
-			Add_To_Front_Of_Thread_Queue(&s_runQueue, kthread);
-			kthread = (&s_runQueue[i])->head;
+			while ((kthread = s_runQueue[i][prio].tail) != 0)
+			{
+				Run_Queue_Remove(kthread, i);
+				kthread->currentReadyQueue = 0;
+				Run_Queue_Insert(kthread, 0, true);
+			}
 		}
 	}
 	MAX_QUEUE_LEVEL = 1;
-	//Print("MAX_QUEUE_LEVEL : %d\n", MAX_QUEUE_LEVEL); 
 }
 
 void Switch_To_MLF(void)
@@ -514,25 +612,33 @@ void Switch_To_MLF(void)
 	KASSERT(!Interrupts_Enabled());
 
 	struct Kernel_Thread *kthread;
-	struct Kernel_Thread *temp;
-	
-	kthread = s_runQueue->head;
 
 	// Transition to MLF
-	MAX_QUEUE_LEVEL = 4;
-	
-	while (kthread != 0) {
-		if (kthread->priority == PRIORITY_IDLE)
-		{
-			temp = Get_Next_In_Thread_Queue(kthread);
-			Remove_From_Thread_Queue(&s_runQueue ,kthread);
-			Add_To_Front_Of_Thread_Queue(&s_runQueue[MAX_QUEUE_LEVEL-1], kthread);
-			kthread->currentReadyQueue = MAX_QUEUE_LEVEL-1;
-			kthread = temp;
-		}
-		else
-			kthread = Get_Next_In_Thread_Queue(kthread);
+	MAX_QUEUE_LEVEL = NUM_RUN_QUEUE_LEVELS;
+
+	/* Idle threads always live on the last level */
+	while ((kthread = s_runQueue[0][PRIORITY_IDLE].tail) != 0) {
+		Run_Queue_Remove(kthread, 0);
+		kthread->currentReadyQueue = MAX_QUEUE_LEVEL-1;
+		Run_Queue_Insert(kthread, MAX_QUEUE_LEVEL-1, true);
+	}
+}
+
+/*
+ * Copy out the scheduler statistics, optionally resetting them.
+ */
+void Get_Sched_Stat(struct Sched_Stat* stat, bool reset)
+{
+	bool iflag = Begin_Int_Atomic();
+
+	*stat = s_schedStat;
+	if (reset) {
+		s_schedStat.numSwitches = 0;
+		s_schedStat.pickCycles = 0;
+		s_schedStat.maxPickCycles = 0;
 	}
+
+	End_Int_Atomic(iflag);
 }
 
 void Init_Scheduler(void)
@@ -549,6 +655,8 @@ void Init_Scheduler(void)
     g_currentThread = mainThread;
     Add_To_Back_Of_All_Thread_List(&s_allThreadList, mainThread);
 
+    s_threadCache = Create_Object_Cache("Kernel_Thread", sizeof(struct Kernel_Thread), 0);
+    KASSERT(s_threadCache != 0);
 
     /*
      * Create the idle thread.
@@ -632,6 +740,36 @@ Start_User_Thread(struct User_Context* userContext, bool detached)
 
 }
 
+/*
+ * Start the child of a Fork(): a user-mode thread that resumes
+ * where the parent made the system call, with the same registers
+ * except that the call returns 0.
+ * Returns pointer to the new thread if successful, null otherwise.
+ */
+struct Kernel_Thread*
+Start_Forked_User_Thread(struct User_Context* userContext, struct Interrupt_State* state)
+{
+	struct Kernel_Thread* kthread;
+	struct User_Interrupt_State* childState;
+
+	KASSERT(Is_User_Interrupt(state));
+
+	kthread = Create_Thread(PRIORITY_USER, false);
+	if (kthread != 0) {
+		Attach_User_Context(kthread, userContext);
+
+		/* Same interrupted context as the parent, user stack included */
+		kthread->esp -= sizeof(struct User_Interrupt_State);
+		childState = (struct User_Interrupt_State*) kthread->esp;
+		memcpy(childState, state, sizeof(struct User_Interrupt_State));
+		childState->state.eax = 0;
+
+		Make_Runnable_Atomic(kthread);
+	}
+
+	return kthread;
+}
+
 /*
  * Add given thread to the run queue, so that it
  * may be scheduled.  Must be called with interrupts disabled!
@@ -656,8 +794,8 @@ void Make_Runnable(struct Kernel_Thread* kthread)
 			kthread->currentReadyQueue = MAX_QUEUE_LEVEL - 1 ;
 
 		kthread->blocked = false;
-		Enqueue_Thread(&s_runQueue[kthread->currentReadyQueue], kthread);
-		
+		Run_Queue_Insert(kthread, kthread->currentReadyQueue, false);
+		++s_schedStat.numRunnable;
 }
 
 /*
@@ -686,18 +824,26 @@ struct Kernel_Thread* Get_Current(void)
 struct Kernel_Thread* Get_Next_Runnable(void)
 {
     struct Kernel_Thread* best = 0;
+    ulong_t start = Read_TSC(), cycles;
+    int level, prio;
 
-    /* Find the best thread from the highest-priority run queue */
-	int i;
-	for(i = 0; i < MAX_QUEUE_LEVEL; i++)
-	{
-		best = Find_Best(&s_runQueue[i]);
-		if(best != 0)
-			break;
-	}
+    /*
+     * The lowest non-empty level, and within it the highest
+     * non-empty priority, holds the best thread.
+     */
+	KASSERT(s_runQueueLevelMask != 0);
+	level = Find_Lowest_Bit(s_runQueueLevelMask);
+	prio = Find_Highest_Bit(s_runQueuePrioMask[level]);
+	best = Get_Front_Of_Thread_Queue(&s_runQueue[level][prio]);
 	KASSERT(best != 0);
-	Remove_Thread(&s_runQueue[i], best);
-	
+	Run_Queue_Remove(best, level);
+	--s_schedStat.numRunnable;
+
+	cycles = Read_TSC() - start;
+	++s_schedStat.numSwitches;
+	s_schedStat.pickCycles += cycles;
+	if (cycles > s_schedStat.maxPickCycles)
+		s_schedStat.maxPickCycles = cycles;
 
 /*
  *    Print("Scheduling %x\n", best);
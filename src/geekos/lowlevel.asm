@@ -234,7 +234,7 @@ Enable_Paging:
 	mov	eax, cr3
 	mov	cr3, eax
 	mov	ebx, cr0
-	or	ebx, 0x80000000
+	or	ebx, 0x80010000		; PG, and WP so the kernel faults on copy-on-write pages too
 	mov	cr0, ebx
 	ret
 
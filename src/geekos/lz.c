@@ -0,0 +1,150 @@
+/*
+ * Fast LZ77-style compression
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#include <geekos/kassert.h>
+#include <geekos/errno.h>
+#include <geekos/string.h>
+#include <geekos/lz.h>
+
+/*
+ * The compressed data is a sequence of items, each starting with
+ * a control byte c:
+ *   c < 32:  a run of c+1 literal bytes follows
+ *   c >= 32: a match: copy len+2 bytes from offset+1 bytes back in
+ *            the output, where len = c >> 5 (if it is 7, the next
+ *            byte is added to it) and the offset is (c & 31) << 8
+ *            plus the byte after that.
+ * Matches are found through a hash table of the last position at
+ * which each 3-byte sequence was seen.  Stale or uninitialized
+ * entries only cost a failed comparison, so the table is never
+ * cleared.
+ */
+#define LZ_MAX_LITERAL	32
+#define LZ_MAX_OFFSET	(1 << 13)
+#define LZ_MAX_MATCH	(7 + 255 + 2)
+
+#define LZ_HASH(p) \
+    ((((((ulong_t) (p)[0] << 16) | ((ulong_t) (p)[1] << 8) | (p)[2]) * 2654435761UL) \
+	>> (32 - LZ_HASH_BITS)) & ((1 << LZ_HASH_BITS) - 1))
+
+/*
+ * Compress inLen bytes (at most 64K) into a buffer of outMax bytes.
+ * Returns the compressed length, or 0 if it would not fit.
+ */
+ulong_t LZ_Compress(const void *in, ulong_t inLen, void *out, ulong_t outMax,
+    struct LZ_Workspace *work)
+{
+    const uchar_t *start = (const uchar_t*) in;
+    const uchar_t *ip = start, *inEnd = start + inLen;
+    uchar_t *op = (uchar_t*) out, *outEnd = op + outMax;
+    uchar_t *litCtrl = op++;	/* control byte of the current literal run */
+    ulong_t numLit = 0;
+
+    KASSERT(inLen <= 0x10000);
+
+    while (ip < inEnd) {
+	if (ip + 2 < inEnd) {
+	    ulong_t hash = LZ_HASH(ip);
+	    const uchar_t *ref = start + work->table[hash];
+	    ulong_t offset = ip - ref - 1;
+
+	    work->table[hash] = ip - start;
+	    if (ref < ip && offset < LZ_MAX_OFFSET &&
+		ref[0] == ip[0] && ref[1] == ip[1] && ref[2] == ip[2]) {
+		ulong_t len = 3, maxLen = inEnd - ip;
+
+		if (maxLen > LZ_MAX_MATCH)
+		    maxLen = LZ_MAX_MATCH;
+		while (len < maxLen && ref[len] == ip[len])
+		    ++len;
+
+		/* End the literal run, or take back its unused control byte */
+		if (numLit > 0)
+		    *litCtrl = numLit - 1;
+		else
+		    --op;
+
+		if (op + 3 > outEnd)
+		    return 0;
+		len -= 2;
+		if (len < 7) {
+		    *op++ = (len << 5) | (offset >> 8);
+		} else {
+		    *op++ = (7 << 5) | (offset >> 8);
+		    *op++ = len - 7;
+		}
+		*op++ = offset & 0xff;
+		ip += len + 2;
+
+		litCtrl = op++;
+		numLit = 0;
+		continue;
+	    }
+	}
+
+	if (op >= outEnd)
+	    return 0;
+	*op++ = *ip++;
+	if (++numLit == LZ_MAX_LITERAL) {
+	    *litCtrl = numLit - 1;
+	    litCtrl = op++;
+	    numLit = 0;
+	}
+    }
+
+    if (numLit > 0)
+	*litCtrl = numLit - 1;
+    else
+	--op;
+    return op - (uchar_t*) out;
+}
+
+/*
+ * Decompress inLen bytes into a buffer of outMax bytes.
+ * Returns the decompressed length, or EINVALID if the
+ * data is corrupt or does not fit.
+ */
+int LZ_Decompress(const void *in, ulong_t inLen, void *out, ulong_t outMax)
+{
+    const uchar_t *ip = (const uchar_t*) in, *inEnd = ip + inLen;
+    uchar_t *op = (uchar_t*) out, *outEnd = op + outMax;
+
+    while (ip < inEnd) {
+	ulong_t c = *ip++;
+
+	if (c < LZ_MAX_LITERAL) {
+	    ulong_t len = c + 1;
+
+	    if (len > (ulong_t) (inEnd - ip) || len > (ulong_t) (outEnd - op))
+		return EINVALID;
+	    memcpy(op, ip, len);
+	    op += len;
+	    ip += len;
+	} else {
+	    ulong_t len = c >> 5;
+	    const uchar_t *ref;
+
+	    if (len == 7) {
+		if (ip >= inEnd)
+		    return EINVALID;
+		len += *ip++;
+	    }
+	    if (ip >= inEnd)
+		return EINVALID;
+	    ref = op - (((c & 0x1f) << 8) | *ip++) - 1;
+	    len += 2;
+	    if (ref < (uchar_t*) out || len > (ulong_t) (outEnd - op))
+		return EINVALID;
+
+	    /* Byte by byte: the match may overlap what it produces */
+	    while (len-- > 0)
+		*op++ = *ref++;
+	}
+    }
+
+    return op - (uchar_t*) out;
+}
@@ -17,6 +17,7 @@
 #include <geekos/tss.h>
 #include <geekos/int.h>
 #include <geekos/kthread.h>
+#include <geekos/synch.h>
 #include <geekos/trap.h>
 #include <geekos/timer.h>
 #include <geekos/keyboard.h>
@@ -25,6 +26,7 @@
 #include <geekos/floppy.h>
 #include <geekos/pfat.h>
 #include <geekos/vfs.h>
+#include <geekos/dcache.h>
 #include <geekos/user.h>
 #include <geekos/paging.h>
 
@@ -87,12 +89,14 @@ void Main(struct Boot_Info* bootInfo)
     Init_Interrupts();
     Init_VM(bootInfo);
     Init_Scheduler();
+    Init_Semaphores();
     Init_Traps();
     Init_Timer();
     Init_Keyboard();
     Init_DMA();
     Init_Floppy();
     Init_IDE();
+    Init_Dentry_Cache();
     Init_PFAT();
     Init_GOSFS();
 
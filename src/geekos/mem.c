@@ -11,6 +11,7 @@
 #include <geekos/defs.h>
 #include <geekos/ktypes.h>
 #include <geekos/kassert.h>
+#include <geekos/errno.h>
 #include <geekos/bootinfo.h>
 #include <geekos/gdt.h>
 #include <geekos/screen.h>
@@ -18,7 +19,9 @@
 #include <geekos/malloc.h>
 #include <geekos/string.h>
 #include <geekos/paging.h>
+#include <geekos/kthread.h>
 #include <geekos/mem.h>
+#include <geekos/user.h>
 
 /* ----------------------------------------------------------------------
  * Global data
@@ -35,6 +38,11 @@ uint_t g_totalFreePageCount = 0;
  */
 uint_t g_freePageCount = 0;
 
+/*
+ * Paging counters.
+ */
+struct VM_Stat g_vmStat;
+
 /* ----------------------------------------------------------------------
  * Private data and functions
  * ---------------------------------------------------------------------- */
@@ -46,15 +54,128 @@ extern int debugFaults;
 #define Debug(args...) if (debugFaults) Print(args)
 
 /*
- * List of pages available for allocation.
+ * Pages available for allocation, kept by a binary buddy allocator.
+ * A free block of 2^order pages starts at a page index that is a
+ * multiple of its size, and sits on s_freeLists[order]; its first
+ * page has PAGE_BUDDY set and records the order.  A freed block is
+ * merged with its buddy (the other half of the next larger block)
+ * as long as the buddy is free too.  The number of free blocks of
+ * each order is kept in g_vmStat.numFreeBlocks[].
  */
-static struct Page_List s_freeList;
+static struct Page_List s_freeLists[PAGE_MAX_ORDER + 1];
 
 /*
  * Total number of physical pages.
  */
 int unsigned s_numPages;
 
+/*
+ * Page replacement.
+ * Pageable pages sit on s_activeList in the order the CLOCK hand
+ * reaches them: the page under the hand is at the front.  A page
+ * whose accessed bit is set gets a second chance: the bit is
+ * cleared and the page goes to the back.
+ * With the two-list policy, pages that go unreferenced for a trip
+ * around the active list move to s_inactiveList, and victims are
+ * taken from there; an inactive page that is referenced again
+ * goes back to the active list.
+ */
+static struct Page_List s_activeList;
+static struct Page_List s_inactiveList;
+static int s_pageReplacement = PAGE_REPLACE_CLOCK;
+
+/*
+ * The pageout daemon wakes when an allocation leaves fewer than
+ * PAGEOUT_FREE_LOW free pages, and pages out until there are
+ * PAGEOUT_FREE_HIGH, up to PAGEOUT_CLUSTER pages per disk write.
+ */
+#define PAGEOUT_FREE_LOW	32
+#define PAGEOUT_FREE_HIGH	64
+#define PAGEOUT_CLUSTER		8
+#define PAGEOUT_RETRIES		4	/* direct reclaim attempts per allocation */
+
+static struct Thread_Queue s_pageoutWaitQueue;
+
+/*
+ * Pages zeroed ahead of time by the idle thread, for
+ * Alloc_Zeroed_Page().  They are allocated (not counted as free),
+ * and the pool is only refilled while there are more than
+ * PAGEOUT_FREE_HIGH free pages; when the freelists run dry,
+ * Alloc_Page() hands out pool pages like any other.
+ * The pool size is kept in g_vmStat.numZeroedPages.
+ */
+#define ZEROED_POOL_MAX		32
+
+static struct Page_List s_zeroedList;
+
+/*
+ * Put a block of 2^order free pages on the freelists, merging it
+ * with its buddy as far as possible.
+ * Interrupts must be disabled.
+ */
+static void Add_Free_Block(struct Page *page, int order)
+{
+    ulong_t index = page - g_pageList;
+
+    while (order < PAGE_MAX_ORDER) {
+		ulong_t buddyIndex = index ^ (1UL << order);
+		struct Page *buddy;
+
+		if (buddyIndex + (1UL << order) > s_numPages)
+			break;
+		buddy = &g_pageList[buddyIndex];
+		if (!(buddy->flags & PAGE_BUDDY) || buddy->order != order)
+			break;
+
+		/* Buddy is free: take it off its list, and go up one order */
+		Remove_From_Page_List(&s_freeLists[order], buddy);
+		--g_vmStat.numFreeBlocks[order];
+		buddy->flags &= ~(PAGE_BUDDY);
+		index &= ~(1UL << order);
+		++order;
+    }
+
+    page = &g_pageList[index];
+    page->flags |= PAGE_BUDDY;
+    page->order = order;
+    Add_To_Back_Of_Page_List(&s_freeLists[order], page);
+    ++g_vmStat.numFreeBlocks[order];
+}
+
+/*
+ * Take a free block of 2^order pages off the freelists.  If there
+ * is none of that size, a larger block is split, and the halves
+ * not needed are put back.
+ * Interrupts must be disabled.
+ * Returns null if there is no large enough block.
+ */
+static struct Page *Take_Free_Block(int order)
+{
+    struct Page *page;
+    int blockOrder = order;
+
+    while (Is_Page_List_Empty(&s_freeLists[blockOrder]))
+		if (++blockOrder > PAGE_MAX_ORDER)
+			return 0;
+
+    page = Remove_From_Front_Of_Page_List(&s_freeLists[blockOrder]);
+    --g_vmStat.numFreeBlocks[blockOrder];
+    page->flags &= ~(PAGE_BUDDY);
+
+    while (blockOrder > order) {
+		struct Page *buddy;
+
+		--blockOrder;
+		buddy = page + (1UL << blockOrder);
+		buddy->flags |= PAGE_BUDDY;
+		buddy->order = blockOrder;
+		Add_To_Back_Of_Page_List(&s_freeLists[blockOrder], buddy);
+		++g_vmStat.numFreeBlocks[blockOrder];
+    }
+
+    return page;
+}
+
 /*
  * Add a range of pages to the inventory of physical memory.
  */
@@ -70,10 +191,14 @@ static void Add_Page_Range(ulong_t start, ulong_t end, int flags)
 		struct Page *page = Get_Page(addr);
 
 		page->flags = flags;
+		page->vaddr = 0;
+		page->entry = 0;
+		page->refCount = 0;
+		page->order = 0;
 
 		if (flags == PAGE_AVAIL) {
-		    /* Add the page to the freelist */
-		    Add_To_Back_Of_Page_List(&s_freeList, page);
+		    /* Add the page to the freelists */
+		    Add_Free_Block(page, 0);
 
 		    /* Update free page count */
 		    ++g_freePageCount;
@@ -81,10 +206,6 @@ static void Add_Page_Range(ulong_t start, ulong_t end, int flags)
 		    Set_Next_In_Page_List(page, 0);
 		    Set_Prev_In_Page_List(page, 0);
 		}
-
-		page->clock = 0;
-		page->vaddr = 0;
-		page->entry = 0;
     }
 }
 
@@ -142,6 +263,9 @@ void Init_Mem(struct Boot_Info* bootInfo)
     g_pageList = (struct Page*) pageListAddr;
 	s_numPages = numPages;
 
+    /* No page may look like a free block before it has been added */
+    memset(g_pageList, '\0', numPageListBytes);
+
     /*
      * The initial kernel thread and its stack are placed
      * just beyond the ISA hole.
@@ -195,153 +319,593 @@ void Init_BSS(void)
 }
 
 /*
- * Allocate a page of physical memory.
+ * Allocate a physically contiguous run of 2^order pages,
+ * aligned to its size.  Each page of the run is allocated
+ * as if by Alloc_Page().
  */
-void* Alloc_Page(void)
+void* Alloc_Pages(int order)
 {
     struct Page* page;
     void *result = 0;
+    ulong_t i;
 
-    bool iflag = Begin_Int_Atomic();
+    KASSERT(order >= 0 && order <= PAGE_MAX_ORDER);
 
-    /* See if we have a free page */
-    if (!Is_Page_List_Empty(&s_freeList)) {
-		/* Remove the first page on the freelist. */
-		page = Get_Front_Of_Page_List(&s_freeList);
-		KASSERT((page->flags & PAGE_ALLOCATED) == 0);
-		Remove_From_Front_Of_Page_List(&s_freeList);
+    bool iflag = Begin_Int_Atomic();
 
-		/* Mark page as having been allocated. */
-		page->flags |= PAGE_ALLOCATED;
-		g_freePageCount--;
+    page = Take_Free_Block(order);
+    if (page != 0) {
+		/* Mark the pages as having been allocated. */
+		for (i = 0; i < (1UL << order); ++i) {
+			KASSERT((page[i].flags & PAGE_ALLOCATED) == 0);
+			page[i].flags |= PAGE_ALLOCATED;
+			page[i].refCount = 1;
+		}
+		g_freePageCount -= 1UL << order;
+		result = (void*) Get_Page_Address(page);
+    } else if (order == 0 && !Is_Page_List_Empty(&s_zeroedList)) {
+		/* Out of free pages: a zeroed page will do */
+		page = Remove_From_Front_Of_Page_List(&s_zeroedList);
+		--g_vmStat.numZeroedPages;
 		result = (void*) Get_Page_Address(page);
     }
 
+    /* Running low: have the pageout daemon make room */
+    if (g_freePageCount < PAGEOUT_FREE_LOW)
+		Wake_Up(&s_pageoutWaitQueue);
+
     End_Int_Atomic(iflag);
 
     return result;
 }
 
 /*
- * Choose a page to evict.
+ * Allocate a page of physical memory.
+ */
+void* Alloc_Page(void)
+{
+    return Alloc_Pages(0);
+}
+
+/*
+ * Allocate a page of physical memory filled with zeroes.
+ * The page comes from the pool zeroed by the idle thread if
+ * there is one; otherwise it is zeroed here.
+ */
+void* Alloc_Zeroed_Page(void)
+{
+    struct Page *page = 0;
+    void *paddr;
+    bool iflag;
+
+    iflag = Begin_Int_Atomic();
+    if (!Is_Page_List_Empty(&s_zeroedList)) {
+		page = Remove_From_Front_Of_Page_List(&s_zeroedList);
+		--g_vmStat.numZeroedPages;
+		++g_vmStat.numZeroedHits;
+    } else {
+		++g_vmStat.numZeroedMisses;
+    }
+    End_Int_Atomic(iflag);
+
+    if (page != 0)
+		return (void*) Get_Page_Address(page);
+
+    paddr = Alloc_Page();
+    if (paddr != 0)
+		memset(paddr, '\0', PAGE_SIZE);
+    return paddr;
+}
+
+/*
+ * Zero a free page and put it in the pool for Alloc_Zeroed_Page(),
+ * unless the pool is full or free pages are getting scarce.
+ * Called by the idle thread, with interrupts enabled; they stay
+ * enabled while the page is zeroed.
+ * Returns true if a page was added to the pool.
+ */
+bool Zero_Free_Page(void)
+{
+    void *paddr = 0;
+
+    KASSERT(Interrupts_Enabled());
+
+    Disable_Interrupts();
+    if (g_vmStat.numZeroedPages < ZEROED_POOL_MAX && g_freePageCount > PAGEOUT_FREE_HIGH)
+		paddr = Alloc_Page();
+    Enable_Interrupts();
+    if (paddr == 0)
+		return false;
+
+    memset(paddr, '\0', PAGE_SIZE);
+
+    Disable_Interrupts();
+    Add_To_Back_Of_Page_List(&s_zeroedList, Get_Page((ulong_t) paddr));
+    ++g_vmStat.numZeroedPages;
+    Enable_Interrupts();
+    return true;
+}
+
+/*
+ * Put a pageable page at the back of the active list.
+ */
+static void Activate_Page(struct Page *page)
+{
+    page->flags &= ~(PAGE_INACTIVE);
+    Add_To_Back_Of_Page_List(&s_activeList, page);
+    ++g_vmStat.numActive;
+}
+
+/*
+ * Put a pageable page at the back of the inactive list.
+ */
+static void Deactivate_Page(struct Page *page)
+{
+    page->flags |= PAGE_INACTIVE;
+    Add_To_Back_Of_Page_List(&s_inactiveList, page);
+    ++g_vmStat.numInactive;
+}
+
+/*
+ * Take a pageable page off whichever replacement list it is on.
+ */
+static void Remove_From_Replacement_Lists(struct Page *page)
+{
+    if (page->flags & PAGE_INACTIVE) {
+		Remove_From_Page_List(&s_inactiveList, page);
+		--g_vmStat.numInactive;
+    } else {
+		Remove_From_Page_List(&s_activeList, page);
+		--g_vmStat.numActive;
+    }
+    page->flags &= ~(PAGE_INACTIVE);
+}
+
+/*
+ * Return whether the page was referenced since the last time
+ * we looked, and clear the accessed bit of its page table entry.
+ * A TLB entry cached before the bit was cleared would hide a
+ * later reference, so a referenced page is added to the batch
+ * to invalidate.
+ */
+static bool Test_And_Clear_Accessed(struct Page *page, struct TLB_Batch *batch)
+{
+    bool accessed = page->entry->accesed != 0;
+
+    /* First look at a page read in ahead: was it worth reading? */
+    if (page->flags & PAGE_READAHEAD) {
+		page->flags &= ~(PAGE_READAHEAD);
+		if (accessed)
+			++g_vmStat.numReadaheadHits;
+		else
+			++g_vmStat.numReadaheadMisses;
+    }
+
+    if (accessed) {
+		page->entry->accesed = 0;
+		Add_To_TLB_Batch(batch, page->vaddr);
+    }
+    return accessed;
+}
+
+/*
+ * Two-list policy: age the front of the active list until the
+ * inactive list holds at least a third of the pageable pages.
+ */
+static void Refill_Inactive_List(ulong_t *numScanned, struct TLB_Batch *batch)
+{
+    uint_t toScan = g_vmStat.numActive;
+
+    while (toScan-- > 0 && g_vmStat.numInactive * 2 < g_vmStat.numActive) {
+		struct Page *page = Get_Front_Of_Page_List(&s_activeList);
+
+		Remove_From_Page_List(&s_activeList, page);
+		--g_vmStat.numActive;
+		++*numScanned;
+		if (Test_And_Clear_Accessed(page, batch))
+			Activate_Page(page);
+		else
+			Deactivate_Page(page);
+    }
+}
+
+/*
+ * Choose a page to evict, and take it off the replacement lists.
+ * Pages whose accessed bit is cleared are added to the given batch.
+ * Interrupts must be disabled.
  * Returns null if no pages are available.
  */
-static struct Page *Find_Page_To_Page_Out()
+static struct Page *Find_Page_To_Page_Out(struct TLB_Batch *batch)
 {
-    int i;
-    struct Page *curr, *best;
-
-    best = NULL;
-
-    for (i=0; i < s_numPages; i++) {
-		if ((g_pageList[i].flags & PAGE_PAGEABLE) &&
-		    (g_pageList[i].flags & PAGE_ALLOCATED)) {
-			    if (!best) best = &g_pageList[i];
-			    curr = &g_pageList[i];
-			    if ((curr->clock < best->clock) && (curr->flags & PAGE_PAGEABLE)) {
-				best = curr;
-			    }
-		}
+    struct Page *page;
+    ulong_t numScanned = 0;
+
+    KASSERT(!Interrupts_Enabled());
+
+    if (s_pageReplacement == PAGE_REPLACE_TWO_LIST)
+		Refill_Inactive_List(&numScanned, batch);
+
+    /*
+     * Every page that is passed over has its accessed bit cleared,
+     * so this ends within one trip around the lists.
+     */
+    for (;;) {
+		if (!Is_Page_List_Empty(&s_inactiveList))
+			page = Get_Front_Of_Page_List(&s_inactiveList);
+		else if (!Is_Page_List_Empty(&s_activeList))
+			page = Get_Front_Of_Page_List(&s_activeList);
+		else
+			return 0;
+
+		++numScanned;
+		Remove_From_Replacement_Lists(page);
+		if (!Test_And_Clear_Accessed(page, batch))
+			break;
+
+		/* Referenced: second chance */
+		Activate_Page(page);
     }
 
-    return best;
+    ++g_vmStat.numEvictions;
+    g_vmStat.numScanned += numScanned;
+
+    return page;
 }
 
-/**
- * Allocate a page of pageable physical memory, to be mapped
- * into a user address space.
- *
- * @param entry pointer to user page table entry which will
- *   refer to the allocated page
- * @param vaddr virtual address where page will be mapped
- *   in user address space
+/*
+ * Select the page replacement policy.
+ * Returns 0 if successful, EINVALID if the policy is unknown.
  */
-void* Alloc_Pageable_Page(pte_t *entry, ulong_t vaddr)
+int Set_Page_Replacement(int policy)
 {
     bool iflag;
-    void* paddr = 0;
-    struct Page* page = 0;
+
+    if (policy != PAGE_REPLACE_CLOCK && policy != PAGE_REPLACE_TWO_LIST)
+		return EINVALID;
 
     iflag = Begin_Int_Atomic();
+    s_pageReplacement = policy;
+
+    /* CLOCK uses only the active list; put inactive pages back in front */
+    if (policy == PAGE_REPLACE_CLOCK) {
+		while (!Is_Page_List_Empty(&s_inactiveList)) {
+			struct Page *page = Get_Back_Of_Page_List(&s_inactiveList);
+			Remove_From_Page_List(&s_inactiveList, page);
+			--g_vmStat.numInactive;
+			page->flags &= ~(PAGE_INACTIVE);
+			Add_To_Front_Of_Page_List(&s_activeList, page);
+			++g_vmStat.numActive;
+		}
+    }
+    End_Int_Atomic(iflag);
 
-    KASSERT(!Interrupts_Enabled());
-    KASSERT(Is_Page_Multiple(vaddr));
+    return 0;
+}
 
-    paddr = Alloc_Page();
-    if (paddr != 0) {
-		page = Get_Page((ulong_t) paddr);
-		KASSERT((page->flags & PAGE_PAGEABLE) == 0);
-    } else { // there is no free page
-		int pagefileIndex;
-
-	    /* Select a page to steal from another process */
-		Debug("About to hunt for a page to page out\n");
-		page = Find_Page_To_Page_Out();
+/*
+ * Get the page replacement policy in use.
+ */
+int Get_Page_Replacement(void)
+{
+    return s_pageReplacement;
+}
+
+/*
+ * Page out up to maxPages pages, chosen by the replacement policy,
+ * to consecutive slots of the paging file with a single request.
+ * The pages are returned in victims[]: still allocated, but no
+ * longer mapped and no longer pageable.
+ * The owners keep running while the pages are written, so their
+ * dirty bits are cleared first; a page that is touched before the
+ * write is done may not match its copy, and is kept instead.
+ * Interrupts must be disabled; they are enabled during the write.
+ * Returns the number of pages paged out.
+ */
+static int Page_Out_Pages(struct Page **victims, int maxPages)
+{
+    void *paddrs[PAGEOUT_CLUSTER];
+    struct TLB_Batch batch;
+    int numPages = 0, numPagedOut = 0, pagefileIndex, i;
+
+    KASSERT(!Interrupts_Enabled());
+    KASSERT(maxPages > 0 && maxPages <= PAGEOUT_CLUSTER);
+
+    /* Select pages to steal */
+    Debug("About to hunt for pages to page out\n");
+    Init_TLB_Batch(&batch);
+    while (numPages < maxPages) {
+		struct Page *page = Find_Page_To_Page_Out(&batch);
+		if (page == 0)
+			break;
 		KASSERT(page->flags & PAGE_PAGEABLE);
-		paddr = (void*) Get_Page_Address(page);
-		Debug("Selected page at addr %p (age = %d)\n", paddr, page->clock);
-
-		/* Find a place on disk for it */
-		pagefileIndex = Find_Space_On_Paging_File();
-		if (pagefileIndex < 0){
-		    /* No space available in paging file. */
-			Debug("No space available in paging file\n");
-			paddr = 0;
-		    goto done;
-		}
-		Debug("Free disk page at index %d\n", pagefileIndex);
+		victims[numPages++] = page;
+    }
+    if (numPages == 0) {
+		Debug("No pageable page to page out\n");
+		Flush_TLB_Batch(&batch);
+		return 0;
+    }
 
+    /* Find a place on disk for them; settle for a shorter run if need be */
+    while ((pagefileIndex = Find_Run_On_Paging_File(numPages)) < 0 && numPages > 1)
+		Activate_Page(victims[--numPages]);
+    if (pagefileIndex < 0) {
+		/* No space available in paging file; leave the page where it was. */
+		Debug("No space available in paging file\n");
+		Activate_Page(victims[0]);
+		Flush_TLB_Batch(&batch);
+		return 0;
+    }
+    Debug("Free disk pages at index %d\n", pagefileIndex);
+
+    /*
+     * Write the pages in page table entry order: pages of the same
+     * process then sit in slots in address order, for swap-in
+     * read-ahead.
+     */
+    for (i = 1; i < numPages; ++i) {
+		struct Page *page = victims[i];
+		int j;
+
+		for (j = i; j > 0 && victims[j - 1]->entry > page->entry; --j)
+			victims[j] = victims[j - 1];
+		victims[j] = page;
+    }
+
+    for (i = 0; i < numPages; ++i) {
 		/* Make the page temporarily unpageable (can't let another process steal it) */
-		page->flags &= ~(PAGE_PAGEABLE);
+		victims[i]->flags &= ~(PAGE_PAGEABLE);
 
 		/* Lock the page so it cannot be freed while we're writing */
-        page->flags |= PAGE_LOCKED;
-
-		/* Write the page to disk. Interrupts are enabled, since the I/O may block. */
-		Debug("Writing physical frame %p to paging file at %d\n", paddr, pagefileIndex);
-		Enable_Interrupts();
-		Write_To_Paging_File(paddr, page->vaddr, pagefileIndex);
-		Disable_Interrupts();
-
-	        /* While we were writing got notification this page isn't even needed anymore */
-	        if (page->flags & PAGE_ALLOCATED)
-	        {
-	           /* The page is still in use update its bookeping info */
-	           /* Update page table to reflect the page being on disk */
-	           page->entry->present = 0;
-	           page->entry->kernelInfo = KINFO_PAGE_ON_DISK;
-	           page->entry->pageBaseAddr = pagefileIndex; /* Remember where it is located! */
-	        }
-	        else // if ohter thread die
-	        {
-	           /* The page got freed, don't need bookeeping or it on disk */
-	           Free_Space_On_Paging_File(pagefileIndex);
-
-	           /* Its still allocated though to us now */
-	           page->flags |= PAGE_ALLOCATED;
-	        }
-
-	        /* Unlock the page */
-	        page->flags &= ~(PAGE_LOCKED);
-
-		/* XXX - flush TLB should only flush the one page */
-		Flush_TLB();
+		victims[i]->flags |= PAGE_LOCKED;
+		paddrs[i] = (void*) Get_Page_Address(victims[i]);
+
+		/* A store from now on sets the dirty bit again */
+		victims[i]->entry->dirty = 0;
+		Add_To_TLB_Batch(&batch, victims[i]->vaddr);
+    }
+    Flush_TLB_Batch(&batch);
+
+    /* Write the pages to disk. Interrupts are enabled, since the I/O may block. */
+    Debug("Writing %d frames to paging file at %d\n", numPages, pagefileIndex);
+    Enable_Interrupts();
+    Write_Pages_To_Paging_File(paddrs, numPages, pagefileIndex);
+    Disable_Interrupts();
+    g_vmStat.numPageOuts += numPages;
+
+    for (i = 0; i < numPages; ++i) {
+		struct Page *page = victims[i];
+
+		/* While we were writing got notification this page isn't even needed anymore */
+		if ((page->flags & PAGE_ALLOCATED) && (page->entry->dirty || page->entry->accesed)) {
+			/* Used during the write, so the copy may be stale: keep the page */
+			Free_Space_On_Paging_File(pagefileIndex + i);
+			page->flags &= ~(PAGE_LOCKED);
+			page->flags |= PAGE_PAGEABLE;
+			Activate_Page(page);
+			++g_vmStat.numPageOutsAborted;
+			continue;
+		} else if (page->flags & PAGE_ALLOCATED) {
+			/* The page is still in use; update page table to reflect the page being on disk */
+			page->entry->present = 0;
+			page->entry->kernelInfo = KINFO_PAGE_ON_DISK;
+			page->entry->pageBaseAddr = pagefileIndex + i; /* Remember where it is located! */
+			Add_To_TLB_Batch(&batch, page->vaddr);
+		} else {
+			/* The page got freed, don't need it on disk */
+			Free_Space_On_Paging_File(pagefileIndex + i);
+
+			/* Its still allocated though to us now */
+			page->flags |= PAGE_ALLOCATED;
+			page->refCount = 1;
+		}
+
+		/* Unlock the page */
+		page->flags &= ~(PAGE_LOCKED);
+		victims[numPagedOut++] = page;
+    }
+
+    Flush_TLB_Batch(&batch);
+
+    return numPagedOut;
+}
+
+/*
+ * The pageout daemon.
+ * Sleeps until the number of free pages drops below the low
+ * watermark, then pages out clusters of pages and frees them
+ * until it is back above the high watermark.
+ */
+static void Pageout_Daemon(ulong_t arg)
+{
+    struct Page *victims[PAGEOUT_CLUSTER];
+
+    Disable_Interrupts();
+    for (;;) {
+		int numPages, i;
+
+		while (g_freePageCount >= PAGEOUT_FREE_LOW)
+			Wait(&s_pageoutWaitQueue);
+		++g_vmStat.numPageoutWakeups;
+
+		while (g_freePageCount < PAGEOUT_FREE_HIGH) {
+			int want = PAGEOUT_FREE_HIGH - g_freePageCount;
+
+			if (want > PAGEOUT_CLUSTER)
+				want = PAGEOUT_CLUSTER;
+			numPages = Page_Out_Pages(victims, want);
+			if (numPages == 0)
+				break;	/* nothing to page out; wait for the next allocation */
+
+			for (i = 0; i < numPages; ++i)
+				Free_Page((void*) Get_Page_Address(victims[i]));
+		}
+
+		/* Let the next allocation below the low watermark wake us again */
+		Wait(&s_pageoutWaitQueue);
+    }
+}
+
+/*
+ * Start the pageout daemon.
+ * Called once the paging file is available.
+ */
+void Start_Pageout_Daemon(void)
+{
+    struct Kernel_Thread *kthread;
+
+    kthread = Start_Kernel_Thread(Pageout_Daemon, 0, PRIORITY_NORMAL, true);
+    if (kthread != 0)
+		strcpy(kthread->name, "{Pageout}");
+}
+
+/**
+ * Allocate a page that is to be filled in and then mapped into
+ * a user address space with Map_Pageable_Page().  Until then it
+ * is not pageable, so it can't be stolen while it is being filled.
+ * Normally the pageout daemon keeps free pages around; if there
+ * are none, a page is paged out right here.
+ * Interrupts must be disabled (they are enabled during a page out).
+ *
+ * @return the page, or null if no page could be freed
+ */
+void* Alloc_Unmapped_Page(void)
+{
+    void* paddr;
+    struct Page* page;
+    int i;
+
+    KASSERT(!Interrupts_Enabled());
+
+    paddr = Alloc_Page();
+    if (paddr == 0) { // there is no free page
+		++g_vmStat.numDirectReclaims;
+		/* The victim may be kept, if it was used while being written */
+		for (i = 0; paddr == 0 && i < PAGEOUT_RETRIES; ++i) {
+			if (Page_Out_Pages(&page, 1) > 0)
+				paddr = (void*) Get_Page_Address(page);
+			else
+				paddr = Alloc_Page();
+		}
+		if (paddr == 0)
+			return 0;
+    }
+
+    KASSERT((Get_Page((ulong_t) paddr)->flags & PAGE_PAGEABLE) == 0);
+    return paddr;
+}
+
+/*
+ * Like Alloc_Unmapped_Page(), but the page is filled with zeroes.
+ * Interrupts must be disabled (they are enabled during a page out).
+ */
+void* Alloc_Zeroed_Unmapped_Page(void)
+{
+    void* paddr;
+
+    KASSERT(!Interrupts_Enabled());
+
+    paddr = Alloc_Zeroed_Page();
+    if (paddr == 0) {
+		paddr = Alloc_Unmapped_Page();
+		if (paddr != 0)
+			memset(paddr, '\0', PAGE_SIZE);
     }
+    return paddr;
+}
+
+/**
+ * Make a page from Alloc_Unmapped_Page() pageable, mapped
+ * by given user page table entry.
+ * Interrupts must be disabled.
+ *
+ * @param paddr the page
+ * @param entry pointer to user page table entry which
+ *   refers to the page
+ * @param vaddr virtual address where page is mapped
+ *   in user address space
+ */
+void Map_Pageable_Page(void *paddr, pte_t *entry, ulong_t vaddr)
+{
+    struct Page* page = Get_Page((ulong_t) paddr);
+
+    KASSERT(!Interrupts_Enabled());
+    KASSERT(Is_Page_Multiple(vaddr));
+    KASSERT(page->flags & PAGE_ALLOCATED);
 
     /* Fill in accounting information for page */
     page->flags |= PAGE_PAGEABLE;
     page->entry = entry;
     page->entry->kernelInfo = 0;
     page->vaddr = vaddr;
-    KASSERT(page->flags & PAGE_ALLOCATED);
+    Activate_Page(page);
+}
+
+/**
+ * Allocate a page of pageable physical memory, to be mapped
+ * into a user address space.
+ *
+ * @param entry pointer to user page table entry which will
+ *   refer to the allocated page
+ * @param vaddr virtual address where page will be mapped
+ *   in user address space
+ */
+void* Alloc_Pageable_Page(pte_t *entry, ulong_t vaddr)
+{
+    bool iflag;
+    void* paddr;
+
+    iflag = Begin_Int_Atomic();
+
+    paddr = Alloc_Unmapped_Page();
+    if (paddr != 0)
+		Map_Pageable_Page(paddr, entry, vaddr);
 
-done:
     End_Int_Atomic(iflag);
     return paddr;
 }
 
+/*
+ * Take another reference to an allocated page, which is
+ * shared (e.g., mapped by more than one process).
+ * Each reference is dropped by a call to Free_Page().
+ */
+void Get_Page_Reference(void* pageAddr)
+{
+    struct Page* page = Get_Page((ulong_t) pageAddr);
+    bool iflag;
+
+    iflag = Begin_Int_Atomic();
+    KASSERT((page->flags & PAGE_ALLOCATED) != 0);
+    KASSERT(page->refCount > 0);
+    ++page->refCount;
+    End_Int_Atomic(iflag);
+}
+
+/*
+ * Take another reference to an allocated page that is about to be
+ * mapped copy-on-write by a second page table entry.  A Page only
+ * records a single mapping, so the page stops being pageable; the
+ * write fault that ends the sharing makes it pageable again.
+ * Interrupts must be disabled.
+ */
+void Share_Page(void* pageAddr)
+{
+    struct Page* page = Get_Page((ulong_t) pageAddr);
+
+    KASSERT(!Interrupts_Enabled());
+    KASSERT((page->flags & PAGE_ALLOCATED) != 0);
+    KASSERT((page->flags & PAGE_LOCKED) == 0);
+
+    if (page->flags & PAGE_PAGEABLE)
+		Remove_From_Replacement_Lists(page);
+    page->flags &= ~(PAGE_PAGEABLE | PAGE_READAHEAD);
+    ++page->refCount;
+}
+
 /*
  * Free a page of physical memory.
+ * If the page is shared, this just drops one reference to it.
  */
 void Free_Page(void* pageAddr)
 {
@@ -357,19 +921,58 @@ void Free_Page(void* pageAddr)
     page = Get_Page(addr);
     KASSERT((page->flags & PAGE_ALLOCATED) != 0);
 
+    /* Someone else still uses it */
+    if (page->refCount > 1) {
+		--page->refCount;
+		End_Int_Atomic(iflag);
+		return;
+    }
+    page->refCount = 0;
+
     /* Clear the allocation bit */
     page->flags &= ~(PAGE_ALLOCATED);
 
     /* When a page is locked, don't free it just let other thread know its not needed */
-    if (page->flags & PAGE_LOCKED)
-      return;
+    if (page->flags & PAGE_LOCKED) {
+		End_Int_Atomic(iflag);
+		return;
+    }
 
-    /* Clear the pageable bit */
-    page->flags &= ~(PAGE_PAGEABLE);
+    /* Take it out of page replacement, and clear the pageable bit */
+    if (page->flags & PAGE_PAGEABLE)
+		Remove_From_Replacement_Lists(page);
+    page->flags &= ~(PAGE_PAGEABLE | PAGE_READAHEAD);
 
-    /* Put the page back on the freelist */
-    Add_To_Back_Of_Page_List(&s_freeList, page);
+    /* Put the page back on the freelists */
+    Add_Free_Block(page, 0);
     g_freePageCount++;
 
     End_Int_Atomic(iflag);
 }
+
+/*
+ * Free a run of 2^order pages allocated with Alloc_Pages().
+ * None of the pages may be shared.
+ */
+void Free_Pages(void* pageAddr, int order)
+{
+    struct Page* page = Get_Page((ulong_t) pageAddr);
+    bool iflag;
+    ulong_t i;
+
+    KASSERT(order >= 0 && order <= PAGE_MAX_ORDER);
+    KASSERT((Get_Page_Address(page) >> PAGE_POWER) % (1UL << order) == 0);
+
+    iflag = Begin_Int_Atomic();
+
+    for (i = 0; i < (1UL << order); ++i) {
+		KASSERT((page[i].flags & (PAGE_ALLOCATED | PAGE_PAGEABLE | PAGE_LOCKED)) == PAGE_ALLOCATED);
+		KASSERT(page[i].refCount == 1);
+		page[i].flags &= ~(PAGE_ALLOCATED);
+		page[i].refCount = 0;
+    }
+    Add_Free_Block(page, order);
+    g_freePageCount += 1UL << order;
+
+    End_Int_Atomic(iflag);
+}
@@ -8,6 +8,7 @@
  * redistribute, and modify it as specified in the file "COPYING".
  */
 
+#include <geekos/errno.h>
 #include <geekos/string.h>
 #include <geekos/int.h>
 #include <geekos/idt.h>
@@ -22,6 +23,7 @@
 #include <geekos/vfs.h>
 #include <geekos/crc32.h>
 #include <geekos/paging.h>
+#include <geekos/zswap.h>
 
 /* ----------------------------------------------------------------------
  * Public data
@@ -31,13 +33,38 @@ extern int sh_pid;
 /* ----------------------------------------------------------------------
  * Private functions/data
  * ---------------------------------------------------------------------- */
-static char* swapMap;
 static uint_t totalPage;
 static ulong_t startSector;
 struct Block_Device* dev;
 
 #define SECTORS_PER_PAGE (PAGE_SIZE / SECTOR_SIZE)
 
+/*
+ * Allocation map of the paging file: one bit per page-sized slot,
+ * set if the slot is in use.  It is scanned a word at a time,
+ * starting where the last allocation left off (next fit), so
+ * pages evicted one after another land in consecutive slots.
+ * Bits past the end of the paging file are kept set.
+ */
+#define SWAP_BITS_PER_WORD (sizeof(ulong_t) * 8)
+#define SWAP_FULL_WORD     (~0UL)
+
+static ulong_t *s_swapMap;
+static uint_t s_swapMapWords;
+static uint_t s_swapCursor;
+static uint_t s_numFreeSlots;
+
+/*
+ * Swap-in read-ahead: a fault on a page in the paging file also
+ * reads in up to s_swapReadahead of the pages that follow it in
+ * the same page table, as long as they went out to the slots that
+ * follow its slot (Page_Out_Pages() writes the pages of a cluster
+ * in address order, so a process's pages tend to be contiguous).
+ */
+#define SWAP_READAHEAD_DEFAULT 4
+
+static int s_swapReadahead = SWAP_READAHEAD_DEFAULT;
+
 /*
  * flag to indicate if debugging paging code
  */
@@ -76,6 +103,86 @@ static void Print_Fault_Info(uint_t address, faultcode_t faultCode)
         Print ("in Supervisor Mode\n");
 }
 
+/*
+ * Handle a write to a page shared copy-on-write after a Fork().
+ * If other processes still map the page, the writer gets a copy
+ * of its own; if it is the last one, it simply takes the page back.
+ * Either way the page ends up writable and pageable.
+ * Interrupts must be disabled (they are enabled to free a page).
+ */
+static void Copy_On_Write(pte_t *entry, ulong_t vaddr)
+{
+    void *oldPage = (void*) (entry->pageBaseAddr << 12);
+    void *newPage = oldPage;
+
+    ++g_vmStat.numCowFaults;
+    if (Get_Page((ulong_t) oldPage)->refCount > 1) {
+	newPage = Alloc_Unmapped_Page();
+	if (newPage == 0) {
+	    if (g_currentThread->pid != sh_pid)
+		Exit(-1);
+	    return;
+	}
+	memcpy(newPage, oldPage, PAGE_SIZE);
+	Free_Page(oldPage);
+	++g_vmStat.numCowCopies;
+    }
+
+    Map_Pageable_Page(newPage, entry, vaddr);
+    entry->flags = VM_USER | VM_WRITE;
+    entry->pageBaseAddr = PAGE_ALLIGNED_ADDR(newPage);
+    Invalidate_Page(vaddr);
+}
+
+/*
+ * Read the page at pte[k] back in from the paging file into paddr,
+ * with as many of the following pages as read-ahead allows, in one
+ * request.  The pages read ahead are mapped right away, marked
+ * PAGE_READAHEAD so the replacement scan can tell if they get used.
+ * The caller maps the faulting page.
+ * Interrupts must be disabled; they are enabled during the read.
+ */
+static void Swap_In_Pages(pte_t *pte, int k, void *paddr, ulong_t vaddr)
+{
+    void *paddrs[SWAP_READAHEAD_MAX + 1];
+    int window = s_swapReadahead;
+    int slot = pte[k].pageBaseAddr;
+    int numPages = 1, i;
+
+    paddrs[0] = paddr;
+    while (numPages <= window && k + numPages < NUM_PAGE_TABLE_ENTRIES) {
+	pte_t *entry = &pte[k + numPages];
+
+	if (entry->present || entry->kernelInfo != KINFO_PAGE_ON_DISK ||
+	    entry->pageBaseAddr != slot + numPages)
+	    break;
+	/* Only read ahead into free memory; don't page out for it */
+	paddrs[numPages] = Alloc_Page();
+	if (paddrs[numPages] == 0)
+	    break;
+	++numPages;
+    }
+
+    Enable_Interrupts();
+    Read_Pages_From_Paging_File(paddrs, numPages, slot);
+    Disable_Interrupts();
+
+    for (i = 0; i < numPages; ++i)
+	Free_Space_On_Paging_File(slot + i);
+
+    for (i = 1; i < numPages; ++i) {
+	pte_t *entry = &pte[k + i];
+
+	Map_Pageable_Page(paddrs[i], entry, vaddr + i * PAGE_SIZE);
+	Get_Page((ulong_t) paddrs[i])->flags |= PAGE_READAHEAD;
+	entry->present = 1;
+	entry->flags = VM_USER | VM_WRITE;
+	entry->accesed = 0;
+	entry->pageBaseAddr = PAGE_ALLIGNED_ADDR(paddrs[i]);
+    }
+    g_vmStat.numReadaheadPages += numPages - 1;
+}
+
 /*
  * Handler for page faults.
  * You should call the Install_Interrupt_Handler() function to
@@ -94,6 +201,7 @@ static void Print_Fault_Info(uint_t address, faultcode_t faultCode)
 	
     /* Get the fault code */
     faultCode = *((faultcode_t *) &(state->errorCode));
+    ++g_vmStat.numFaults;
 
     /* rest of your handling code here */
 	#if 0
@@ -114,8 +222,7 @@ static void Print_Fault_Info(uint_t address, faultcode_t faultCode)
 		pde = &(Get_PDBR()[j]);
 		if(pde->pageTableBaseAddr == '\0')
 		{
-			pte = (pte_t*)Alloc_Page();
-			memset(pte,'\0',PAGE_SIZE);
+			pte = (pte_t*)Alloc_Zeroed_Page();
 			pde->pageTableBaseAddr = (uint_t)PAGE_ALLIGNED_ADDR(pte);
 			pde->present = 1;
 			pde->flags = VM_USER | VM_WRITE;
@@ -127,28 +234,73 @@ static void Print_Fault_Info(uint_t address, faultcode_t faultCode)
 
 		k = PAGE_TABLE_INDEX(address);
 		kernelInfo = pte[k].kernelInfo;
-		paddr = Alloc_Pageable_Page(&pte[k], PAGE_ADDR(address));
-		
+
+		/* Text pages are mapped read-only, shared with other instances */
+		if(kernelInfo != KINFO_PAGE_ON_DISK)
+		{
+			paddr = Get_Shared_Text_Page(g_currentThread->userContext, PAGE_ADDR(address));
+			if(paddr != 0)
+			{
+				pte[k].present = 1;
+				pte[k].flags = VM_USER;
+				pte[k].pageBaseAddr = PAGE_ALLIGNED_ADDR(paddr);
+				return;
+			}
+		}
+
+		/* The page is not pageable until it has been filled in */
+		if(kernelInfo == KINFO_PAGE_ON_DISK)
+			paddr = Alloc_Unmapped_Page();
+		else
+			paddr = Alloc_Zeroed_Unmapped_Page();
 		if(paddr == 0){ /* There is no free space in swap space*/
 			if(g_currentThread->pid != sh_pid)
 				Exit(-1);
+			return;
 		}
-	
+
 		if(kernelInfo == KINFO_PAGE_ON_DISK) // case 2
 		{
 			//Print ("KINFO_PAGE_ON_DISK\n");
+			++g_vmStat.numRefaults;
+			Swap_In_Pages(pte, k, paddr, PAGE_ADDR(address));
+		}
+		else
+		{
+			/* First touch: executable image or zero fill */
+			int rc;
+
 			Enable_Interrupts();
-			Read_From_Paging_File(paddr, address, pte[k].pageBaseAddr);
+			rc = Load_User_Page(g_currentThread->userContext, paddr, PAGE_ADDR(address));
 			Disable_Interrupts();
-			Free_Space_On_Paging_File(pte[k].pageBaseAddr);
+			if (rc != 0) {
+				Free_Page(paddr);
+				Exit(-1);
+			}
 		}
-		
+
+		Map_Pageable_Page(paddr, &pte[k], PAGE_ADDR(address));
 		pte[k].present = 1;
 		pte[k].flags = VM_USER | VM_WRITE;			
 		pte[k].pageBaseAddr = PAGE_ALLIGNED_ADDR(paddr);	
 		
-		return 0;
+		return;
     }
+
+    /* Write to a copy-on-write page; this may come from the kernel, as in Copy_To_User() */
+    if (faultCode.writeFault) {
+	pde_t *pde = &Get_PDBR()[PAGE_DIRECTORY_INDEX(address)];
+
+	if (pde->present && !pde->largePages) {
+	    pte_t *pte = &((pte_t*) (pde->pageTableBaseAddr << 12))[PAGE_TABLE_INDEX(address)];
+
+	    if (pte->present && pte->kernelInfo == KINFO_PAGE_COW) {
+		Copy_On_Write(pte, PAGE_ADDR(address));
+		return;
+	    }
+	}
+    }
+
     /* user faults just kill the process */
     if (!faultCode.userModeFault) KASSERT(0);
 
@@ -156,6 +308,58 @@ static void Print_Fault_Info(uint_t address, faultcode_t faultCode)
     Exit(-1);
 }
 
+/*
+ * CPU features for mapping physical memory with 4 MB pages.
+ */
+#define EFLAGS_ID	(1 << 21)	 /* can be toggled iff the CPU has CPUID */
+#define CPUID_EDX_PSE	(1 << 3)	 /* page size extension */
+#define CR4_PSE		(1 << 4)
+
+/*
+ * Return whether the CPU supports 4 MB pages.
+ */
+static bool Cpu_Has_PSE(void)
+{
+    ulong_t before, after, eax, ebx, ecx, edx;
+
+    /* Without CPUID (a 486 or older) there are no 4 MB pages either */
+    __asm__ __volatile__ (
+	"pushfl\n\t"
+	"popl %0\n\t"
+	"movl %0, %1\n\t"
+	"xorl %2, %1\n\t"
+	"pushl %1\n\t"
+	"popfl\n\t"
+	"pushfl\n\t"
+	"popl %1\n\t"
+	"pushl %0\n\t"
+	"popfl"
+	: "=&r" (before), "=&r" (after)
+	: "i" (EFLAGS_ID)
+    );
+    if (((before ^ after) & EFLAGS_ID) == 0)
+	return false;
+
+    __asm__ __volatile__ (
+	"cpuid"
+	: "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+	: "a" (1)
+    );
+    return (edx & CPUID_EDX_PSE) != 0;
+}
+
+/*
+ * Let page directory entries map 4 MB pages.
+ */
+static void Enable_PSE(void)
+{
+    ulong_t cr4;
+
+    __asm__ __volatile__ ("movl %%cr4, %0" : "=r" (cr4));
+    cr4 |= CR4_PSE;
+    __asm__ __volatile__ ("movl %0, %%cr4" : : "r" (cr4));
+}
+
 /* ----------------------------------------------------------------------
  * Public functions
  * ---------------------------------------------------------------------- */
@@ -164,6 +368,9 @@ static void Print_Fault_Info(uint_t address, faultcode_t faultCode)
 /*
  * Initialize virtual memory by building page tables
  * for the kernel and physical memory.
+ * If the CPU supports it, physical memory is mapped with 4 MB
+ * pages: no page tables are needed, and the whole kernel map
+ * (which every user page directory copies) takes a few TLB entries.
  */
 void Init_VM(struct Boot_Info *bootInfo)
 {
@@ -183,11 +390,23 @@ void Init_VM(struct Boot_Info *bootInfo)
     uint_t memSizeB = (bootInfo->memSizeKB) << 10;
 	pde_t* pde = 0;
 	pte_t* pte = 0;
+	bool largePages = Cpu_Has_PSE();
+
+	if (largePages)
+		Enable_PSE();
 
 	pde = (pde_t*)Alloc_Page();
 	memset(pde,'\0',PAGE_SIZE);
 	// alloc ptable
     for (i=0; i < PAGE_DIRECTORY_INDEX(memSizeB); i++) {
+		if (largePages) {
+			pde[i].pageTableBaseAddr = i*NUM_PAGE_TABLE_ENTRIES; /* address of the 4 MB page */
+			pde[i].present = 1;
+			pde[i].flags = VM_WRITE;
+			pde[i].largePages = 1;
+			continue;
+		}
+
 		pte = (pte_t*)Alloc_Page();
 		memset(pte,'\0',PAGE_SIZE);
 		pde[i].pageTableBaseAddr = (uint_t)PAGE_ALLIGNED_ADDR(pte);
@@ -222,30 +441,236 @@ void Init_Paging(void)
 	dev = pagedev->dev;
 	totalPage = (pagedev->numSectors)/SECTORS_PER_PAGE; 
 	startSector = pagedev->startSector;
-	swapMap = (char*)Malloc(totalPage);
-	memset(swapMap,0,totalPage);
-	
-	//TODO("Initialize paging file data structures");
+
+	s_swapMapWords = (totalPage + SWAP_BITS_PER_WORD - 1) / SWAP_BITS_PER_WORD;
+	s_swapMap = (ulong_t*)Malloc(s_swapMapWords * sizeof(ulong_t));
+	KASSERT(s_swapMap != 0);
+	memset(s_swapMap,0,s_swapMapWords * sizeof(ulong_t));
+	if (totalPage % SWAP_BITS_PER_WORD != 0)
+		s_swapMap[s_swapMapWords - 1] = SWAP_FULL_WORD << (totalPage % SWAP_BITS_PER_WORD);
+	s_swapCursor = 0;
+	s_numFreeSlots = totalPage;
+
+	Start_Pageout_Daemon();
+}
+
+/*
+ * Look for numSlots free slots in a row, starting the scan
+ * at slot from and giving up at slot to.  Whole words that are
+ * full (or empty) are stepped over without looking at their bits.
+ * Returns the first slot of the run, or -1.
+ */
+static int Find_Free_Run(uint_t from, uint_t to, uint_t numSlots)
+{
+    uint_t pos = from, runStart = 0, runLen = 0;
+
+    while (pos < to) {
+	ulong_t word = s_swapMap[pos / SWAP_BITS_PER_WORD];
+	uint_t bit = pos % SWAP_BITS_PER_WORD;
+
+	if (bit == 0 && word == SWAP_FULL_WORD) {
+	    runLen = 0;
+	    pos += SWAP_BITS_PER_WORD;
+	} else if (bit == 0 && word == 0) {
+	    if (runLen == 0)
+		runStart = pos;
+	    runLen += SWAP_BITS_PER_WORD;
+	    pos += SWAP_BITS_PER_WORD;
+	    if (runLen >= numSlots)
+		return runStart;
+	} else if (word & (1UL << bit)) {
+	    runLen = 0;
+	    ++pos;
+	} else {
+	    if (runLen == 0)
+		runStart = pos;
+	    ++pos;
+	    if (++runLen >= numSlots)
+		return runStart;
+	}
+    }
+
+    return -1;
 }
 
 /**
- * Find a free bit of disk on the paging file for this page.
+ * Find numSlots consecutive free page sized chunks of the paging
+ * file, and mark them as in use.
  * Interrupts must be disabled.
- * @return index of free page sized chunk of disk space in
- *   the paging file, or -1 if the paging file is full
+ * @return index of the first chunk, or -1 if there is
+ *   no such run of free space in the paging file
  */
-int Find_Space_On_Paging_File(void)
+int Find_Run_On_Paging_File(int numSlots)
 {
-	int i;
+    int first;
+    uint_t i;
+
     KASSERT(!Interrupts_Enabled());
+    KASSERT(numSlots > 0);
 
-	for(i = 0; i < totalPage; i++){
-		if(swapMap[i] == 0){
-			return i;
-		}
-	}
+    if (s_numFreeSlots < (uint_t) numSlots)
 	return -1;
-    //TODO("Find free page in paging file");
+
+    /* Next fit: from the cursor to the end, then from the start */
+    first = Find_Free_Run(s_swapCursor, totalPage, numSlots);
+    if (first < 0)
+	first = Find_Free_Run(0, s_swapCursor, numSlots);
+    if (first < 0)
+	return -1;
+
+    for (i = first; i < first + (uint_t) numSlots; ++i)
+	s_swapMap[i / SWAP_BITS_PER_WORD] |= 1UL << (i % SWAP_BITS_PER_WORD);
+    s_numFreeSlots -= numSlots;
+    s_swapCursor = (first + numSlots) % totalPage;
+
+    return first;
+}
+
+/**
+ * Get virtual memory statistics, and optionally reset the counters.
+ */
+void Get_VM_Stat(struct VM_Stat *stat, bool reset)
+{
+    extern uint_t g_freePageCount;
+    bool iflag;
+
+    iflag = Begin_Int_Atomic();
+    *stat = g_vmStat;
+    stat->numFreePages = g_freePageCount;
+    stat->numFreeSwapSlots = s_numFreeSlots;
+    stat->replacement = Get_Page_Replacement();
+    stat->swapReadahead = s_swapReadahead;
+    if (reset) {
+	g_vmStat.numFaults = 0;
+	g_vmStat.numRefaults = 0;
+	g_vmStat.numEvictions = 0;
+	g_vmStat.numScanned = 0;
+	g_vmStat.numPageOuts = 0;
+	g_vmStat.numPageOutsAborted = 0;
+	g_vmStat.numPageoutWakeups = 0;
+	g_vmStat.numDirectReclaims = 0;
+	g_vmStat.numExePageIns = 0;
+	g_vmStat.numZeroFills = 0;
+	g_vmStat.numTextShares = 0;
+	g_vmStat.numCowFaults = 0;
+	g_vmStat.numCowCopies = 0;
+	g_vmStat.numTlbInvalidations = 0;
+	g_vmStat.numTlbFlushes = 0;
+	g_vmStat.numZeroedHits = 0;
+	g_vmStat.numZeroedMisses = 0;
+	g_vmStat.numReadaheadPages = 0;
+	g_vmStat.numReadaheadHits = 0;
+	g_vmStat.numReadaheadMisses = 0;
+	g_vmStat.numZswapStores = 0;
+	g_vmStat.numZswapRejects = 0;
+	g_vmStat.numZswapHits = 0;
+	g_vmStat.numZswapMisses = 0;
+	g_vmStat.numZswapWritebacks = 0;
+    }
+    End_Int_Atomic(iflag);
+}
+
+/*
+ * Set how many pages after a faulting page are read in with it
+ * from the paging file (0 turns read-ahead off).
+ * Returns 0 if successful, EINVALID if out of range.
+ */
+int Set_Swap_Readahead(int numPages)
+{
+    if (numPages < 0 || numPages > SWAP_READAHEAD_MAX)
+	return EINVALID;
+    s_swapReadahead = numPages;
+    return 0;
+}
+
+/*
+ * Make sure the kernel can store to the user page at given (linear)
+ * address of the current address space: fault it in if it is not
+ * present, and break copy-on-write sharing.  With CR0.WP set, a
+ * store to a read-only page faults even in kernel mode, and such a
+ * fault is fatal, so writes to user memory must check first.
+ * Interrupts must be disabled.
+ * Returns false if the page stays read-only (a shared text page),
+ * or could not be brought in.
+ */
+bool Prepare_User_Page_For_Write(ulong_t vaddr)
+{
+    pde_t *pde;
+    pte_t *pte;
+
+    KASSERT(!Interrupts_Enabled());
+
+    /* A read faults the page in like any other first touch */
+    (void) *((volatile char*) vaddr);
+
+    pde = &Get_PDBR()[PAGE_DIRECTORY_INDEX(vaddr)];
+    if (!pde->present || pde->largePages)
+	return false;
+    pte = &((pte_t*) (pde->pageTableBaseAddr << 12))[PAGE_TABLE_INDEX(vaddr)];
+    if (pte->present && pte->kernelInfo == KINFO_PAGE_COW)
+	Copy_On_Write(pte, PAGE_ADDR(vaddr));
+
+    return pte->present && (pte->flags & VM_WRITE);
+}
+
+/*
+ * Invalidate the TLB entry for one page of the current address space.
+ * Other address spaces need nothing: their entries are flushed
+ * when CR3 is loaded to switch to them.
+ */
+void Invalidate_Page(ulong_t vaddr)
+{
+    __asm__ __volatile__ ("invlpg (%0)" : : "r" (vaddr) : "memory");
+    ++g_vmStat.numTlbInvalidations;
+}
+
+/*
+ * Start an empty batch of pages to invalidate.
+ */
+void Init_TLB_Batch(struct TLB_Batch *batch)
+{
+    batch->numPages = 0;
+}
+
+/*
+ * Add a page to a batch.  The page table entry must already be
+ * changed; the stale TLB entry is dropped by Flush_TLB_Batch().
+ */
+void Add_To_TLB_Batch(struct TLB_Batch *batch, ulong_t vaddr)
+{
+    if (batch->numPages < TLB_BATCH_MAX)
+	batch->vaddr[batch->numPages] = vaddr;
+    ++batch->numPages;
+}
+
+/*
+ * Invalidate every page of a batch, or the whole TLB if
+ * the batch overflowed, and empty the batch.
+ */
+void Flush_TLB_Batch(struct TLB_Batch *batch)
+{
+    int i;
+
+    if (batch->numPages > TLB_BATCH_MAX) {
+	Flush_TLB();
+	++g_vmStat.numTlbFlushes;
+    } else {
+	for (i = 0; i < batch->numPages; ++i)
+	    Invalidate_Page(batch->vaddr[i]);
+    }
+    batch->numPages = 0;
+}
+
+/**
+ * Find a free bit of disk on the paging file for this page,
+ * and mark it as in use.
+ * Interrupts must be disabled.
+ * @return index of free page sized chunk of disk space in
+ *   the paging file, or -1 if the paging file is full
+ */
+int Find_Space_On_Paging_File(void)
+{
+    return Find_Run_On_Paging_File(1);
 }
 
 /**
@@ -255,10 +680,18 @@ int Find_Space_On_Paging_File(void)
  */
 void Free_Space_On_Paging_File(int pagefileIndex)
 {
+    ulong_t mask = 1UL << (pagefileIndex % SWAP_BITS_PER_WORD);
+
     KASSERT(!Interrupts_Enabled());
-	swapMap[pagefileIndex] = 0;
+    KASSERT(pagefileIndex >= 0 && (uint_t) pagefileIndex < totalPage);
+    KASSERT(s_swapMap[pagefileIndex / SWAP_BITS_PER_WORD] & mask);
 
-    //TODO("Free page in paging file");
+    /* Still being written back from the compressed cache; it frees the slot */
+    if (!Zswap_Release(pagefileIndex))
+	return;
+
+    s_swapMap[pagefileIndex / SWAP_BITS_PER_WORD] &= ~mask;
+    ++s_numFreeSlots;
 }
 
 /**
@@ -271,14 +704,44 @@ void Free_Space_On_Paging_File(int pagefileIndex)
  */
 void Write_To_Paging_File(void *paddr, ulong_t vaddr, int pagefileIndex)
 {
-	int i;
-	block_t* block = (block_t*)paddr;
 	struct Page *page = Get_Page((ulong_t) paddr);
     KASSERT(!(page->flags & PAGE_PAGEABLE)); /* Page must be locked! */
-	for(i = 0; i < SECTORS_PER_PAGE; i++)
-		Block_Write(dev, startSector+pagefileIndex*SECTORS_PER_PAGE+i, &block[i]);
-	swapMap[pagefileIndex] = 1;
-    //TODO("Write page data to paging file");
+	if (!Zswap_Store(paddr, pagefileIndex))
+		Block_Write_Multi(dev, startSector+pagefileIndex*SECTORS_PER_PAGE, SECTORS_PER_PAGE, paddr);
+}
+
+/**
+ * Write several pages to consecutive chunks of the paging file
+ * (as returned by Find_Run_On_Paging_File()).  Pages the compressed
+ * cache keeps are skipped; each run of the others is written with
+ * one request.
+ * @param paddrs pointers to the physical memory of the pages,
+ *   which must all be locked
+ * @param numPages number of pages, at most BLOCK_MAX_SEGMENTS
+ * @param pagefileIndex index of the chunk for the first page
+ */
+void Write_Pages_To_Paging_File(void **paddrs, int numPages, int pagefileIndex)
+{
+	struct Block_Segment segments[BLOCK_MAX_SEGMENTS];
+	int i, numSegments = 0;
+
+	KASSERT(numPages > 0 && numPages <= BLOCK_MAX_SEGMENTS);
+	for (i = 0; i <= numPages; ++i) {
+		if (i < numPages) {
+			KASSERT(!(Get_Page((ulong_t) paddrs[i])->flags & PAGE_PAGEABLE));
+			if (!Zswap_Store(paddrs[i], pagefileIndex + i)) {
+				segments[numSegments].buf = paddrs[i];
+				segments[numSegments].numBlocks = SECTORS_PER_PAGE;
+				++numSegments;
+				continue;
+			}
+		}
+		/* End of a run that goes to disk */
+		if (numSegments > 0)
+			Block_Write_Segments(dev, startSector+(pagefileIndex+i-numSegments)*SECTORS_PER_PAGE,
+				segments, numSegments);
+		numSegments = 0;
+	}
 }
 
 /**
@@ -292,12 +755,37 @@ void Write_To_Paging_File(void *paddr, ulong_t vaddr, int pagefileIndex)
  */
 void Read_From_Paging_File(void *paddr, ulong_t vaddr, int pagefileIndex)
 {
-	int i;
-	block_t* block = (block_t*)paddr;
-    struct Page *page = Get_Page((ulong_t) paddr);
-    for(i = 0; i < SECTORS_PER_PAGE; i++)
-		Block_Read(dev, startSector+pagefileIndex*SECTORS_PER_PAGE+i, &block[i]);
+	if (!Zswap_Load(paddr, pagefileIndex))
+		Block_Read_Multi(dev, startSector+pagefileIndex*SECTORS_PER_PAGE, SECTORS_PER_PAGE, paddr);
 	//Free_Space_On_Paging_File(pagefileIndex);
     //TODO("Read page data from paging file");
 }
 
+/**
+ * Read consecutive chunks of the paging file into several pages.
+ * Pages in the compressed cache come from there; each run of the
+ * others is read with one request.
+ * @param paddrs pointers to the physical memory of the pages
+ * @param numPages number of pages, at most BLOCK_MAX_SEGMENTS
+ * @param pagefileIndex index of the chunk for the first page
+ */
+void Read_Pages_From_Paging_File(void **paddrs, int numPages, int pagefileIndex)
+{
+	struct Block_Segment segments[BLOCK_MAX_SEGMENTS];
+	int i, numSegments = 0;
+
+	KASSERT(numPages > 0 && numPages <= BLOCK_MAX_SEGMENTS);
+	for (i = 0; i <= numPages; ++i) {
+		if (i < numPages && !Zswap_Load(paddrs[i], pagefileIndex + i)) {
+			segments[numSegments].buf = paddrs[i];
+			segments[numSegments].numBlocks = SECTORS_PER_PAGE;
+			++numSegments;
+			continue;
+		}
+		if (numSegments > 0)
+			Block_Read_Segments(dev, startSector+(pagefileIndex+i-numSegments)*SECTORS_PER_PAGE,
+				segments, numSegments);
+		numSegments = 0;
+	}
+}
+
@@ -0,0 +1,103 @@
+/*
+ * PCI configuration space access
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+/*
+ * Configuration space is reached through configuration
+ * mechanism #1: write the address of a register to the
+ * CONFIG_ADDRESS port, then move the data through CONFIG_DATA.
+ * Only bus 0 is scanned, which is where the chipset functions
+ * (and everything QEMU and Bochs emulate) live.
+ */
+
+#include <geekos/int.h>
+#include <geekos/io.h>
+#include <geekos/pci.h>
+
+#define PCI_CONFIG_ADDRESS	0xcf8
+#define PCI_CONFIG_DATA		0xcfc
+
+#define PCI_MAX_DEVICES		32
+#define PCI_MAX_FUNCTIONS	8
+
+/* Header type bit saying the device has more than one function */
+#define PCI_HEADER_MULTIFUNCTION 0x80
+
+static ulong_t PCI_Config_Address(int bus, int device, int function, int reg)
+{
+    return 0x80000000UL | (bus << 16) | (device << 11) | (function << 8) | (reg & 0xfc);
+}
+
+static ulong_t PCI_Read(int bus, int device, int function, int reg)
+{
+    bool iflag;
+    ulong_t value;
+
+    iflag = Begin_Int_Atomic();
+    Out_DWord(PCI_CONFIG_ADDRESS, PCI_Config_Address(bus, device, function, reg));
+    value = In_DWord(PCI_CONFIG_DATA);
+    End_Int_Atomic(iflag);
+
+    return value;
+}
+
+/*
+ * Read the configuration register at given offset
+ * (rounded down to a doubleword).
+ */
+ulong_t PCI_Read_Config(struct PCI_Device *pci, int reg)
+{
+    return PCI_Read(pci->bus, pci->device, pci->function, reg);
+}
+
+/*
+ * Write the configuration register at given offset
+ * (rounded down to a doubleword).
+ */
+void PCI_Write_Config(struct PCI_Device *pci, int reg, ulong_t value)
+{
+    bool iflag;
+
+    iflag = Begin_Int_Atomic();
+    Out_DWord(PCI_CONFIG_ADDRESS, PCI_Config_Address(pci->bus, pci->device, pci->function, reg));
+    Out_DWord(PCI_CONFIG_DATA, value);
+    End_Int_Atomic(iflag);
+}
+
+/*
+ * Find the first function on bus 0 with given class and subclass.
+ * Returns true and fills in pci if one was found.
+ */
+bool PCI_Find_Class(int classCode, int subclass, struct PCI_Device *pci)
+{
+    int device, function, numFunctions;
+    ulong_t id, class;
+
+    for (device = 0; device < PCI_MAX_DEVICES; ++device) {
+	numFunctions = 1;
+	for (function = 0; function < numFunctions; ++function) {
+	    id = PCI_Read(0, device, function, PCI_CONFIG_VENDOR_ID);
+	    if ((id & 0xffff) == 0xffff)
+		continue;  /* no such function */
+
+	    if (function == 0 &&
+		(PCI_Read(0, device, 0, PCI_CONFIG_HEADER_TYPE) >> 16) & PCI_HEADER_MULTIFUNCTION)
+		numFunctions = PCI_MAX_FUNCTIONS;
+
+	    class = PCI_Read(0, device, function, PCI_CONFIG_CLASS);
+	    if ((int) ((class >> 24) & 0xff) == classCode &&
+		(int) ((class >> 16) & 0xff) == subclass) {
+		pci->bus = 0;
+		pci->device = device;
+		pci->function = function;
+		pci->progIf = (class >> 8) & 0xff;
+		return true;
+	    }
+	}
+    }
+
+    return false;
+}
@@ -13,6 +13,7 @@
 #include <geekos/screen.h>
 #include <geekos/string.h>
 #include <geekos/malloc.h>
+#include <geekos/slab.h>
 #include <geekos/ide.h>
 #include <geekos/blockdev.h>
 #include <geekos/bitset.h>
@@ -75,6 +76,13 @@ struct PFAT_File {
 };
 IMPLEMENT_LIST(PFAT_File_List, PFAT_File);
 
+/*
+ * PFAT_File objects come from an object cache.  They are shared
+ * by every open of the file and keep its data cache, so they
+ * stay on the instance's list after the last close.
+ */
+static struct Object_Cache *s_pfatFileCache;
+
 /*
  * Copy file metadata from directory entry into
  * struct VFS_File_Stat object.
@@ -102,6 +110,68 @@ static int PFAT_FStat(struct File *file, struct VFS_File_Stat *stat)
     return 0;
 }
 
+/*
+ * Ensure that blocks first to end - 1 of a file are in its file
+ * data cache.  Each run of missing blocks that are consecutive on
+ * the device is read with a single request.
+ * Called with the file's lock held.
+ */
+static int Read_File_Blocks(struct PFAT_Instance *instance, struct Block_Device *dev,
+    struct PFAT_File *pfatFile, ulong_t first, ulong_t end)
+{
+    ulong_t curBlock = pfatFile->entry->firstBlock;
+    ulong_t runStart = 0, runDevBlock = 0, runLength = 0;
+    ulong_t i;
+    int rc = 0;
+
+    /*
+     * Traverse the FAT finding the blocks of the file.
+     * A run ends at a block that is cached already, or one
+     * that doesn't follow the previous one on the device.
+     */
+    for (i = 0; i <= end; ++i) {
+		bool missing = false;
+
+		if (i < end) {
+		    /* Are we at a valid block? */
+		    if (curBlock == FAT_ENTRY_FREE || curBlock == FAT_ENTRY_EOF) {
+			Print("Unexpected end of file in FAT at file block %lu\n", i);
+			rc = EIO;  /* probable filesystem corruption */
+			break;
+		    }
+		    missing = (i >= first && !Is_Bit_Set(pfatFile->validBlockSet, i));
+		}
+
+		if (runLength != 0 && !(missing && curBlock == runDevBlock + runLength)) {
+		    /* Read the run into the file data cache */
+		    Debug("Reading file blocks %lu-%lu (device block %lu)\n",
+			runStart, runStart + runLength - 1, runDevBlock);
+		    rc = Block_Read_Multi(dev, runDevBlock, runLength,
+			pfatFile->fileDataCache + runStart*SECTOR_SIZE);
+		    if (rc != 0)
+			break;
+
+		    /* Mark as having read these blocks */
+		    while (runLength > 0)
+			Set_Bit(pfatFile->validBlockSet, runStart + --runLength);
+		}
+
+		if (missing) {
+		    if (runLength == 0) {
+			runStart = i;
+			runDevBlock = curBlock;
+		    }
+		    ++runLength;
+		}
+
+		/* Continue to next block */
+		if (i < end)
+		    curBlock = instance->fat[curBlock];
+    }
+
+    return rc;
+}
+
 /*
  * Read function for PFAT files.
  */
@@ -111,8 +181,8 @@ static int PFAT_Read(struct File *file, void *buf, ulong_t numBytes)
     struct PFAT_Instance *instance = (struct PFAT_Instance*) file->mountPoint->fsData;
     ulong_t start = file->filePos;
     ulong_t end = file->filePos + numBytes;
-    ulong_t startBlock, endBlock, curBlock;
-    ulong_t i;
+    ulong_t startBlock, endBlock, raStart, raEnd;
+    int rc;
 
     /* Special case: can't handle reads longer than INT_MAX */
     if (numBytes > INT_MAX)
@@ -127,52 +197,28 @@ static int PFAT_Read(struct File *file, void *buf, ulong_t numBytes)
 
     /*
      * Now the complicated part; ensure that all blocks containing the
-     * data we need are in the file data cache.
+     * data we need are in the file data cache.  The blocks to be read
+     * ahead are read along with them: there is no buffer cache to
+     * read them into in the background, but reading them now turns
+     * a sequential reader's one-block requests into large ones.
      */
-    startBlock = (start % SECTOR_SIZE) / SECTOR_SIZE;
+    startBlock = start / SECTOR_SIZE;
     endBlock = Round_Up_To_Block(end) / SECTOR_SIZE;
 
-    /*
-     * Traverse the FAT finding the blocks of the file.
-     * As we encounter requested blocks that aren't in the
-     * file data cache, we issue requests to read them.
-     */
-    curBlock = pfatFile->entry->firstBlock;
-    for (i = 0; i < endBlock; ++i) {
-		/* Are we at a valid block? */
-		if (curBlock == FAT_ENTRY_FREE || curBlock == FAT_ENTRY_EOF) {
-		    Print("Unexpected end of file in FAT at file block %lu\n", i);
-		    return EIO;  /* probable filesystem corruption */
-		}
-
-		/* Do we need to read this block? */
-		if (i >= startBlock) {
-		    int rc = 0;
-
-		    /* Only allow one thread at a time to read this block. */
-		    Mutex_Lock(&pfatFile->lock);
-
-		    if (!Is_Bit_Set(pfatFile->validBlockSet, i)) {
-				/* Read block into the file data cache */
-				Debug("Reading file block %lu (device block %lu)\n", i, curBlock);
-				rc = Block_Read(file->mountPoint->dev, curBlock, pfatFile->fileDataCache + i*SECTOR_SIZE);
-
-				if (rc == 0)
-				    /* Mark as having read this block */
-				    Set_Bit(pfatFile->validBlockSet, i);
-		    }
-
-		    /* Done attempting to fetch the block */
-		    Mutex_Unlock(&pfatFile->lock);
-
-		    if (rc != 0)
-				return rc;
-		}
-
-		/* Continue to next block */
-		ulong_t nextBlock = instance->fat[curBlock];
-		curBlock = nextBlock;
+    /* Only allow one thread at a time to read blocks of the file. */
+    Mutex_Lock(&pfatFile->lock);
+    if (!Readahead_Range(file, startBlock, endBlock, pfatFile->numBlocks, SECTOR_SIZE, &raStart, &raEnd))
+		raStart = raEnd = endBlock;
+    if (raStart <= endBlock) {
+		rc = Read_File_Blocks(instance, file->mountPoint->dev, pfatFile, startBlock, raEnd);
+    } else if ((rc = Read_File_Blocks(instance, file->mountPoint->dev, pfatFile, startBlock, endBlock)) == 0) {
+		/* If this fails, the reader will find out when it gets there */
+		Read_File_Blocks(instance, file->mountPoint->dev, pfatFile, raStart, raEnd);
     }
+    Mutex_Unlock(&pfatFile->lock);
+
+    if (rc != 0)
+		return rc;
 
     /*
      * All cached data we need is up to date,
@@ -356,7 +402,7 @@ static struct PFAT_File *Get_PFAT_File(struct PFAT_Instance *instance, directory
 	 * Allocate File object, PFAT_File object, file block data cache,
 	 * and valid cache block bitset
 	 */
-	if ((pfatFile = (struct PFAT_File *) Malloc(sizeof(*pfatFile))) == 0 ||
+	if ((pfatFile = (struct PFAT_File *) Cache_Alloc(s_pfatFileCache)) == 0 ||
 	    (fileDataCache = Malloc(numBlocks * SECTOR_SIZE)) == 0 ||
 	    (validBlockSet = Create_Bit_Set(numBlocks)) == 0) {
 	    goto memfail;
@@ -379,7 +425,7 @@ static struct PFAT_File *Get_PFAT_File(struct PFAT_Instance *instance, directory
 
 memfail:
     if (pfatFile != 0)
-	Free(pfatFile);
+	Cache_Free(s_pfatFileCache, pfatFile);
     if (fileDataCache != 0)
 	Free(fileDataCache);
     if (validBlockSet != 0)
@@ -586,7 +632,6 @@ static int PFAT_Mount(struct Mount_Point *mountPoint)
     void *bootSect = 0;
     int rootDirSize;
     int rc;
-    int i;
 
     /* Allocate instance. */
     instance = (struct PFAT_Instance*) Malloc(sizeof(*instance));
@@ -636,12 +681,9 @@ static int PFAT_Mount(struct Mount_Point *mountPoint)
 	goto memfail;
 
     /* Read the FAT */
-    for (i = 0; i < fsinfo->fileAllocationLength; ++i) {
-		int blockNum = fsinfo->fileAllocationOffset + i;
-		char *p = ((char*)instance->fat) + (i * SECTOR_SIZE);
-		if ((rc = Block_Read(mountPoint->dev, blockNum, p)) < 0)
-		    goto fail;
-    }
+    if ((rc = Block_Read_Multi(mountPoint->dev, fsinfo->fileAllocationOffset,
+	    fsinfo->fileAllocationLength, instance->fat)) < 0)
+	goto fail;
     Debug("Read FAT successfully!\n");
 
     /* Allocate root directory */
@@ -652,12 +694,9 @@ static int PFAT_Mount(struct Mount_Point *mountPoint)
       * Bug FIX : 
       */
 	Debug("Root directory size = %d\n", rootDirSize);
-		for (i = 0; i < rootDirSize/SECTOR_SIZE; ++i) {
-			int blockNum = fsinfo->rootDirectoryOffset + i;
-			//Print("%d ", blockNum);
-			if ((rc = Block_Read(mountPoint->dev, blockNum, ((char*)instance->rootDir) + (i*SECTOR_SIZE))) < 0)
-				goto fail;
-	}
+	if ((rc = Block_Read_Multi(mountPoint->dev, fsinfo->rootDirectoryOffset,
+		rootDirSize/SECTOR_SIZE, instance->rootDir)) < 0)
+		goto fail;
     Debug("Read root directory successfully!\n");
 
     /* Create the fake root directory entry. */
@@ -711,5 +750,7 @@ static struct Filesystem_Ops s_pfatFilesystemOps = {
 
 void Init_PFAT(void)
 {
+    s_pfatFileCache = Create_Object_Cache("PFAT_File", sizeof(struct PFAT_File), 0);
+    KASSERT(s_pfatFileCache != 0);
     Register_Filesystem("pfat", &s_pfatFilesystemOps);
 }
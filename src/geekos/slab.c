@@ -0,0 +1,216 @@
+/*
+ * Object caches (slab allocator)
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#include <geekos/kassert.h>
+#include <geekos/int.h>
+#include <geekos/list.h>
+#include <geekos/mem.h>
+#include <geekos/malloc.h>
+#include <geekos/string.h>
+#include <geekos/slab.h>
+
+/*
+ * An object cache hands out objects of one size from slabs: runs
+ * of 2^slabOrder pages from Alloc_Pages(), which are aligned to
+ * their size, so the slab an object belongs to is found by masking
+ * its address.  A slab starts with a struct Slab, followed by the
+ * objects.  Each object is followed by the link that chains it on
+ * its slab's freelist while it is free, so that the link does not
+ * clobber the constructed state of the object.
+ * Allocation takes the first object off the freelist of a slab with
+ * free objects.  A slab whose objects are all free is kept for reuse,
+ * but only one such slab per cache; the pages of any other are freed.
+ * Caches are protected by disabling interrupts.
+ */
+
+/* Try for at least this many objects per slab... */
+#define SLAB_MIN_OBJECTS	8
+
+/* ...but don't use runs of more pages than this (log2) */
+#define SLAB_MAX_ORDER		3
+
+struct Slab;
+DEFINE_LIST(Slab_List, Slab);
+
+struct Slab {
+    struct Object_Cache *cache;
+    void *freeList;			/* first free object */
+    int numInUse;			/* objects allocated from the slab */
+    DEFINE_LINK(Slab_List, Slab);
+};
+
+IMPLEMENT_LIST(Slab_List, Slab);
+
+struct Object_Cache {
+    char name[32];
+    ulong_t objSize;			/* size requested by the creator */
+    ulong_t stride;			/* object and its free link */
+    int slabOrder;			/* slabs are 2^slabOrder pages */
+    int objsPerSlab;
+    Object_Constructor ctor;
+    struct Slab_List partialList;	/* slabs with both free and allocated objects */
+    struct Slab_List fullList;		/* slabs with no free objects */
+    struct Slab *emptySlab;		/* a slab with no allocated objects, or null */
+    ulong_t numSlabs;
+    ulong_t numInUse;
+};
+
+/*
+ * Find the free link that follows given object.
+ */
+static __inline__ void **Free_Link(struct Object_Cache *cache, void *obj)
+{
+    return (void**) ((char*) obj + cache->stride - sizeof(void*));
+}
+
+/*
+ * Find the slab given object was allocated from.
+ */
+static __inline__ struct Slab *Get_Slab(struct Object_Cache *cache, void *obj)
+{
+    return (struct Slab*) ((ulong_t) obj & ~((PAGE_SIZE << cache->slabOrder) - 1));
+}
+
+/*
+ * Allocate and construct a new slab.
+ * Returns null if there are no free pages.
+ */
+static struct Slab *Create_Slab(struct Object_Cache *cache)
+{
+    struct Slab *slab;
+    char *obj;
+    int i;
+
+    slab = (struct Slab*) Alloc_Pages(cache->slabOrder);
+    if (slab == 0)
+	return 0;
+
+    slab->cache = cache;
+    slab->numInUse = 0;
+    slab->freeList = 0;
+
+    /* Build the freelist back to front, so objects go out in address order */
+    obj = (char*) (slab + 1) + cache->stride * cache->objsPerSlab;
+    for (i = 0; i < cache->objsPerSlab; ++i) {
+	obj -= cache->stride;
+	if (cache->ctor != 0)
+	    cache->ctor(obj);
+	*Free_Link(cache, obj) = slab->freeList;
+	slab->freeList = obj;
+    }
+
+    ++cache->numSlabs;
+    return slab;
+}
+
+/*
+ * Create a cache for objects of given size.
+ * Returns null if out of memory.
+ */
+struct Object_Cache *Create_Object_Cache(const char *name, ulong_t objSize,
+    Object_Constructor ctor)
+{
+    struct Object_Cache *cache;
+    ulong_t stride;
+    int order;
+
+    KASSERT(objSize > 0);
+
+    stride = ((objSize + sizeof(void*) - 1) & ~(sizeof(void*) - 1)) + sizeof(void*);
+    for (order = 0; order < SLAB_MAX_ORDER; ++order)
+	if (((PAGE_SIZE << order) - sizeof(struct Slab)) / stride >= SLAB_MIN_OBJECTS)
+	    break;
+    if (((PAGE_SIZE << order) - sizeof(struct Slab)) / stride == 0)
+	return 0;
+
+    cache = (struct Object_Cache*) Malloc(sizeof(*cache));
+    if (cache == 0)
+	return 0;
+    memset(cache, '\0', sizeof(*cache));
+    strncpy(cache->name, name, sizeof(cache->name) - 1);
+    cache->objSize = objSize;
+    cache->stride = stride;
+    cache->slabOrder = order;
+    cache->objsPerSlab = ((PAGE_SIZE << order) - sizeof(struct Slab)) / stride;
+    cache->ctor = ctor;
+
+    return cache;
+}
+
+/*
+ * Allocate an object from given cache.
+ * Returns null if out of memory.
+ */
+void *Cache_Alloc(struct Object_Cache *cache)
+{
+    struct Slab *slab;
+    void *obj = 0;
+    bool iflag;
+
+    iflag = Begin_Int_Atomic();
+
+    if (!Is_Slab_List_Empty(&cache->partialList)) {
+	slab = Get_Front_Of_Slab_List(&cache->partialList);
+    } else {
+	slab = cache->emptySlab;
+	if (slab != 0)
+	    cache->emptySlab = 0;
+	else
+	    slab = Create_Slab(cache);
+	if (slab == 0)
+	    goto done;
+	Add_To_Front_Of_Slab_List(&cache->partialList, slab);
+    }
+
+    obj = slab->freeList;
+    KASSERT(obj != 0);
+    slab->freeList = *Free_Link(cache, obj);
+    ++cache->numInUse;
+    if (++slab->numInUse == cache->objsPerSlab) {
+	Remove_From_Slab_List(&cache->partialList, slab);
+	Add_To_Front_Of_Slab_List(&cache->fullList, slab);
+    }
+
+done:
+    End_Int_Atomic(iflag);
+    return obj;
+}
+
+/*
+ * Return an object to the cache it was allocated from.
+ */
+void Cache_Free(struct Object_Cache *cache, void *obj)
+{
+    struct Slab *slab = Get_Slab(cache, obj);
+    bool iflag;
+
+    KASSERT(slab->cache == cache);
+
+    iflag = Begin_Int_Atomic();
+
+    KASSERT(slab->numInUse > 0);
+    if (slab->numInUse == cache->objsPerSlab) {
+	Remove_From_Slab_List(&cache->fullList, slab);
+	Add_To_Front_Of_Slab_List(&cache->partialList, slab);
+    }
+
+    *Free_Link(cache, obj) = slab->freeList;
+    slab->freeList = obj;
+    --cache->numInUse;
+
+    if (--slab->numInUse == 0) {
+	Remove_From_Slab_List(&cache->partialList, slab);
+	if (cache->emptySlab == 0) {
+	    cache->emptySlab = slab;
+	} else {
+	    Free_Pages(slab, cache->slabOrder);
+	    --cache->numSlabs;
+	}
+    }
+
+    End_Int_Atomic(iflag);
+}
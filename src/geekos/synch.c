@@ -7,11 +7,13 @@
  * redistribute, and modify it as specified in the file "COPYING".
  */
 
+#include <geekos/errno.h>
 #include <geekos/kthread.h>
 #include <geekos/int.h>
 #include <geekos/kassert.h>
 #include <geekos/screen.h>
 #include <geekos/synch.h>
+#include <geekos/slab.h>
 #include <geekos/user.h>
 /*
  * NOTES:
@@ -28,6 +30,28 @@
  * ---------------------------------------------------------------------- */
 
 static struct Semaphore_List s_semaphoreList;
+
+/*
+ * Semaphores come from an object cache, created by Init_Semaphores()
+ * at boot.  A semaphore is destroyed only when no one
+ * uses it, so its mutex and condition are free and empty then.
+ */
+static struct Object_Cache *s_semaphoreCache;
+
+static void Construct_Semaphore(void *obj)
+{
+	struct Semaphore* sema = (struct Semaphore*) obj;
+
+	Mutex_Init(&(sema->mutex));
+	Cond_Init(&(sema->cond));
+}
+
+void Init_Semaphores(void)
+{
+	s_semaphoreCache = Create_Object_Cache("Semaphore", sizeof(struct Semaphore),
+		Construct_Semaphore);
+	KASSERT(s_semaphoreCache != 0);
+}
 	
 int Create_Semaphore(char* name, int ival)
 {
@@ -48,13 +72,12 @@ int Create_Semaphore(char* name, int ival)
 	}
 
 	/* If there is no sem, then create sem */
-	sema = (struct Semaphore*)Malloc(sizeof(struct Semaphore));
+	if ((sema = (struct Semaphore*)Cache_Alloc(s_semaphoreCache)) == 0)
+		return ENOMEM;
 	sema->sid = sid++;
 	strcpy(sema->name, name);
 	sema->count = ival;
-	sema->refCount++;
-	Mutex_Init(&(sema->mutex));
-	Cond_Init(&(sema->cond));
+	sema->refCount = 1;
 	Add_To_Back_Of_Semaphore_List(&s_semaphoreList, sema);
 
 	userSemaphoreList = g_currentThread->userContext->semaphores;
@@ -87,7 +110,7 @@ int Destroy_Semaphore(int sid)
 			if(--sema->refCount == 0) {
 				//Print("*** Destoroyed Sem : %d ***\n", sid);
 				Remove_From_Semaphore_List(&s_semaphoreList, sema);
-				Free(sema);
+				Cache_Free(s_semaphoreCache, sema);
 			}
 			userSemaphoreList = g_currentThread->userContext->semaphores;
 			for(i = 0; i < USER_MAX_FILES; i++){
@@ -8,6 +8,7 @@
  * redistribute, and modify it as specified in the file "COPYING".
  */
 
+#include <limits.h>
 #include <geekos/syscall.h>
 #include <geekos/errno.h>
 #include <geekos/kthread.h>
@@ -20,7 +21,20 @@
 #include <geekos/user.h>
 #include <geekos/timer.h>
 #include <geekos/vfs.h>
+#include <geekos/dcache.h>
 #include <geekos/signal.h>
+#include <geekos/bufcache.h>
+#include <geekos/blockdev.h>
+#include <geekos/mem.h>
+
+/*
+ * Sys_Read() and Sys_Write() move file data through a kernel
+ * buffer of at most this many bytes at a time, so the filesystem
+ * never touches user memory.  A fault on a user page may read a
+ * file (an executable being paged in), which would deadlock with
+ * the file lock or block buffer a filesystem holds while copying.
+ */
+#define FILE_IO_CHUNK PAGE_SIZE
 
 /*
  * Null system call.
@@ -458,7 +472,42 @@ static int Sys_Delete(struct Interrupt_State *state)
  */
 static int Sys_Read(struct Interrupt_State *state)
 {
-    TODO("Read system call");
+	int rc = 0;
+	ulong_t done = 0, chunk;
+	void *buf;
+	struct File** fileList = g_currentThread->userContext->fileList;
+
+	if(state->ebx >= USER_MAX_FILES || fileList[state->ebx] == NULL)
+		return EINVALID;
+	if(state->edx > (ulong_t) INT_MAX)
+		return EINVALID;
+	if(state->edx == 0)
+		return 0;
+
+	buf = Malloc(state->edx < FILE_IO_CHUNK ? state->edx : FILE_IO_CHUNK);
+	if(buf == 0)
+		return ENOMEM;
+
+	while(done < state->edx){
+		chunk = state->edx - done;
+		if(chunk > FILE_IO_CHUNK)
+			chunk = FILE_IO_CHUNK;
+		Enable_Interrupts();
+		rc = Read(fileList[state->ebx], buf, chunk);
+		Disable_Interrupts();
+		if(rc <= 0)
+			break;
+		if(!Copy_To_User(state->ecx + done, buf, rc)){
+			rc = EINVALID;
+			break;
+		}
+		done += rc;
+		if((ulong_t) rc < chunk)
+			break;
+	}
+
+	Free(buf);
+	return (done > 0 && rc != EINVALID) ? (int) done : rc;
 }
 
 /*
@@ -471,12 +520,19 @@ static int Sys_Read(struct Interrupt_State *state)
 static int Sys_ReadEntry(struct Interrupt_State *state)
 {
 	int rc;
+	struct VFS_Dir_Entry entry;
 	struct File** fileList = g_currentThread->userContext->fileList;
 
+	if(state->ebx >= USER_MAX_FILES || fileList[state->ebx] == NULL)
+		return EINVALID;
+
 	Enable_Interrupts();
 	//Print("%d, fileList[state->ebx] : %x\n", state->ebx, fileList[state->ebx]);
-	rc = Read_Entry(fileList[state->ebx], (struct VFS_File_Stat *)(USER_BASE_ADDR + state->ecx));  /* weak */
+	rc = Read_Entry(fileList[state->ebx], &entry);
 	Disable_Interrupts();
+
+	if(rc == 0 && !Copy_To_User(state->ecx, &entry, sizeof(entry)))
+		rc = EINVALID;
 	return rc;
 
     //TODO("ReadEntry system call");
@@ -494,14 +550,42 @@ static int Sys_ReadEntry(struct Interrupt_State *state)
  */
 static int Sys_Write(struct Interrupt_State *state)
 {
-	struct File *pFile;
-	int fd;
-	int rc;
+	int rc = 0;
+	ulong_t done = 0, chunk;
+	void *buf;
 	struct File** fileList = g_currentThread->userContext->fileList;
 
-	fd = fileList[state->ebx];
-	rc = Write(fd, USER_BASE_ADDR + state->ecx, state->edx);  /* weak */
-	return rc;
+	if(state->ebx >= USER_MAX_FILES || fileList[state->ebx] == NULL)
+		return EINVALID;
+	if(state->edx > (ulong_t) INT_MAX)
+		return EINVALID;
+	if(state->edx == 0)
+		return 0;
+
+	buf = Malloc(state->edx < FILE_IO_CHUNK ? state->edx : FILE_IO_CHUNK);
+	if(buf == 0)
+		return ENOMEM;
+
+	while(done < state->edx){
+		chunk = state->edx - done;
+		if(chunk > FILE_IO_CHUNK)
+			chunk = FILE_IO_CHUNK;
+		if(!Copy_From_User(buf, state->ecx + done, chunk)){
+			rc = EINVALID;
+			break;
+		}
+		Enable_Interrupts();
+		rc = Write(fileList[state->ebx], buf, chunk);
+		Disable_Interrupts();
+		if(rc <= 0)
+			break;
+		done += rc;
+		if((ulong_t) rc < chunk)
+			break;
+	}
+
+	Free(buf);
+	return (done > 0 && rc != EINVALID) ? (int) done : rc;
 	
     //TODO("Write system call");
 }
@@ -518,12 +602,20 @@ static int Sys_Write(struct Interrupt_State *state)
 static int Sys_Stat(struct Interrupt_State *state)
 {
 	char path[VFS_MAX_PATH_LEN] = {'\0', };
+	struct VFS_File_Stat stat;
 	int rc = 0;
-	Copy_From_User(path, state->ebx, state->ecx);
+
+	if(state->ecx >= VFS_MAX_PATH_LEN)
+		return ENAMETOOLONG;
+	if(!Copy_From_User(path, state->ebx, state->ecx))
+		return EINVALID;
 	
     Enable_Interrupts();
-	rc = Stat(path, (struct VFS_File_Stat *)(USER_BASE_ADDR + state->edx));  /* weak */
+	rc = Stat(path, &stat);
 	Disable_Interrupts();
+
+	if(rc == 0 && !Copy_To_User(state->edx, &stat, sizeof(stat)))
+		rc = EINVALID;
 	return rc;
     //TODO("Stat system call");
 }
@@ -538,7 +630,20 @@ static int Sys_Stat(struct Interrupt_State *state)
  */
 static int Sys_FStat(struct Interrupt_State *state)
 {
-    TODO("FStat system call");
+	int rc;
+	struct VFS_File_Stat stat;
+	struct File** fileList = g_currentThread->userContext->fileList;
+
+	if(state->ebx >= USER_MAX_FILES || fileList[state->ebx] == NULL)
+		return EINVALID;
+
+	Enable_Interrupts();
+	rc = FStat(fileList[state->ebx], &stat);
+	Disable_Interrupts();
+
+	if(rc == 0 && !Copy_To_User(state->ecx, &stat, sizeof(stat)))
+		rc = EINVALID;
+	return rc;
 }
 
 /*
@@ -551,7 +656,16 @@ static int Sys_FStat(struct Interrupt_State *state)
  */
 static int Sys_Seek(struct Interrupt_State *state)
 {
-    TODO("Seek system call");
+	int rc;
+	struct File** fileList = g_currentThread->userContext->fileList;
+
+	if(state->ebx >= USER_MAX_FILES || fileList[state->ebx] == NULL)
+		return EINVALID;
+
+	Enable_Interrupts();
+	rc = Seek(fileList[state->ebx], state->ecx);
+	Disable_Interrupts();
+	return rc;
 }
 
 /*
@@ -584,7 +698,12 @@ static int Sys_CreateDir(struct Interrupt_State *state)
  */
 static int Sys_Sync(struct Interrupt_State *state)
 {
-    TODO("Sync system call");
+	int rc;
+
+	Enable_Interrupts();
+	rc = Sync();
+	Disable_Interrupts();
+	return rc;
 }
 
 /*
@@ -782,6 +901,157 @@ static int Sys_WaitNoPID(struct Interrupt_State* state)
     //TODO("Sys_WaitNoPID system call");
 }
 
+/*
+ * Get scheduler statistics.
+ * Params:
+ *   state->ebx - user address of struct Sched_Stat to fill in
+ *   state->ecx - if non-zero, reset the counters after reading them
+ * Returns: 0 on success or error code (< 0) on error
+ */
+static int Sys_SchedStat(struct Interrupt_State* state)
+{
+	struct Sched_Stat stat;
+
+	Get_Sched_Stat(&stat, state->ecx != 0);
+	if (!Copy_To_User(state->ebx, &stat, sizeof(stat)))
+		return EINVALID;
+	return 0;
+}
+
+/*
+ * Get buffer cache statistics of a block device.
+ * Params:
+ *   state->ebx - user address of name of block device
+ *   state->ecx - length of block device name
+ *   state->edx - user address of struct FS_Buffer_Cache_Stat to fill in
+ * Returns: 0 on success or error code (< 0) on error
+ */
+static int Sys_BufCacheStat(struct Interrupt_State* state)
+{
+	char devname[BLOCKDEV_MAX_NAME_LEN+1] = {'\0', };
+	struct FS_Buffer_Cache_Stat stat;
+	int rc;
+
+	if (state->ecx > BLOCKDEV_MAX_NAME_LEN)
+		return ENAMETOOLONG;
+	if (!Copy_From_User(devname, state->ebx, state->ecx))
+		return EINVALID;
+
+	Enable_Interrupts();
+	rc = Get_FS_Buffer_Cache_Stat(devname, &stat);
+	Disable_Interrupts();
+
+	if (rc == 0 && !Copy_To_User(state->edx, &stat, sizeof(stat)))
+		rc = EINVALID;
+	return rc;
+}
+
+/*
+ * Select the I/O scheduler of a block device.
+ * Params:
+ *   state->ebx - user address of name of block device
+ *   state->ecx - length of block device name
+ *   state->edx - user address of name of scheduler ("fifo" or "clook")
+ *   state->esi - length of scheduler name
+ * Returns: 0 on success or error code (< 0) on error
+ */
+static int Sys_SetIOScheduler(struct Interrupt_State* state)
+{
+	char devname[BLOCKDEV_MAX_NAME_LEN+1] = {'\0', };
+	char schedname[16] = {'\0', };
+	int rc;
+
+	if (state->ecx > BLOCKDEV_MAX_NAME_LEN || state->esi >= sizeof(schedname))
+		return ENAMETOOLONG;
+	if (!Copy_From_User(devname, state->ebx, state->ecx) ||
+	    !Copy_From_User(schedname, state->edx, state->esi))
+		return EINVALID;
+
+	Enable_Interrupts();
+	rc = Set_Block_Scheduler(devname, schedname);
+	Disable_Interrupts();
+
+	return rc;
+}
+
+/*
+ * Get virtual memory statistics.
+ * Params:
+ *   state->ebx - user address of struct VM_Stat to fill in
+ *   state->ecx - if non-zero, reset the counters after reading them
+ * Returns: 0 on success or error code (< 0) on error
+ */
+static int Sys_VMStat(struct Interrupt_State* state)
+{
+	struct VM_Stat stat;
+
+	Get_VM_Stat(&stat, state->ecx != 0);
+	if (!Copy_To_User(state->ebx, &stat, sizeof(stat)))
+		return EINVALID;
+	return 0;
+}
+
+/*
+ * Select the page replacement policy.
+ * Params:
+ *   state->ebx - PAGE_REPLACE_CLOCK or PAGE_REPLACE_TWO_LIST
+ * Returns: 0 on success or error code (< 0) on error
+ */
+static int Sys_SetPageReplacement(struct Interrupt_State* state)
+{
+	return Set_Page_Replacement(state->ebx);
+}
+
+/*
+ * Fork the current process.
+ * Params:
+ *   state - processor registers from user mode
+ * Returns: pid of the child in the parent, 0 in the child,
+ *   or error code (< 0) on error
+ */
+static int Sys_Fork(struct Interrupt_State* state)
+{
+	struct Kernel_Thread *child;
+	int pid;
+
+	Enable_Interrupts();
+	pid = Fork(state, &child);
+	Disable_Interrupts();
+	return pid;
+}
+
+/*
+ * Set how many pages are read ahead when a page comes back
+ * in from the paging file.
+ * Params:
+ *   state->ebx - number of pages, 0 to SWAP_READAHEAD_MAX
+ * Returns: 0 on success or error code (< 0) on error
+ */
+static int Sys_SetSwapReadahead(struct Interrupt_State* state)
+{
+	return Set_Swap_Readahead(state->ebx);
+}
+
+/*
+ * Get statistics for the dentry cache of recent path lookups.
+ * Params:
+ *   state->ebx - user address of struct VFS_Dentry_Cache_Stat to fill in
+ *   state->ecx - if non-zero, reset the counters after reading them
+ * Returns: 0 on success or error code (< 0) on error
+ */
+static int Sys_DCacheStat(struct Interrupt_State* state)
+{
+	struct VFS_Dentry_Cache_Stat stat;
+
+	Enable_Interrupts();
+	Get_Dentry_Cache_Stat(&stat, state->ecx != 0);
+	Disable_Interrupts();
+
+	if (!Copy_To_User(state->ebx, &stat, sizeof(stat)))
+		return EINVALID;
+	return 0;
+}
+
 /*
  * Global table of system call handler functions.
  */
@@ -829,6 +1099,14 @@ const Syscall g_syscallTable[] = {
     Sys_RegDeliver,
     Sys_ReturnSignal,
     Sys_WaitNoPID,
+    Sys_SchedStat,
+    Sys_BufCacheStat,
+    Sys_SetIOScheduler,
+    Sys_VMStat,
+    Sys_SetPageReplacement,
+    Sys_Fork,
+    Sys_SetSwapReadahead,
+    Sys_DCacheStat,
 };
 
 /*
@@ -31,6 +31,13 @@ static uint_t rear = -1;
  */
 volatile ulong_t g_numTicks;
 
+/*
+ * Threads blocked in Sleep_Ticks(), and the earliest tick at which
+ * one of them is due.
+ */
+static struct Thread_Queue s_sleepQueue;
+static ulong_t s_nextWakeTick = ULONG_MAX;
+
 /*
  * Number of times the spin loop can execute during one timer tick
  */
@@ -72,6 +79,29 @@ int g_Quantum = DEFAULT_MAX_TICKS;
 /* ----------------------------------------------------------------------
  * Private functions
  * ---------------------------------------------------------------------- */
+
+/*
+ * Make runnable every sleeping thread whose wake tick has passed,
+ * and recompute the next tick at which one is due.
+ * Called with interrupts disabled.
+ */
+static void Wake_Sleepers(void)
+{
+    struct Kernel_Thread *kthread = Get_Front_Of_Thread_Queue(&s_sleepQueue), *next;
+
+    s_nextWakeTick = ULONG_MAX;
+    while (kthread != 0) {
+	next = Get_Next_In_Thread_Queue(kthread);
+	if (kthread->wakeTick <= g_numTicks) {
+	    Remove_Thread(&s_sleepQueue, kthread);
+	    Make_Runnable(kthread);
+	    g_needReschedule = true;
+	} else if (kthread->wakeTick < s_nextWakeTick)
+	    s_nextWakeTick = kthread->wakeTick;
+	kthread = next;
+    }
+}
+
 static void Timer_Interrupt_Handler(struct Interrupt_State* state)
 {
     int i;
@@ -83,6 +113,9 @@ static void Timer_Interrupt_Handler(struct Interrupt_State* state)
     ++g_numTicks;
     ++current->numTicks;
 
+    if (g_numTicks >= s_nextWakeTick)
+	Wake_Sleepers();
+
     /* update timer events */
     for (i=0; i < timeEventCount; i++) {
     	if(pendingTimerEvents[i].id < 0)
@@ -297,6 +330,38 @@ int Cancel_Timer(int id)
     return -1;
 }
 
+/*
+ * Block the current thread for at least given number of ticks.
+ * Must be called with interrupts enabled.
+ */
+void Sleep_Ticks(int ticks)
+{
+    struct Kernel_Thread* current = g_currentThread;
+
+    KASSERT(Interrupts_Enabled());
+
+    Disable_Interrupts();
+    current->wakeTick = g_numTicks + (ticks > 0 ? ticks : 1);
+    if (current->wakeTick < s_nextWakeTick)
+	s_nextWakeTick = current->wakeTick;
+    Wait(&s_sleepQueue);
+    Enable_Interrupts();
+}
+
+/*
+ * Wake given thread early if it is blocked in Sleep_Ticks().
+ * Does nothing otherwise.
+ */
+void Wake_Sleeper(struct Kernel_Thread* kthread)
+{
+    bool iflag = Begin_Int_Atomic();
+
+    if (kthread->blocked && kthread->waitQueue == &s_sleepQueue)
+	Wake_Up_Process(kthread);
+
+    End_Int_Atomic(iflag);
+}
+
 #define US_PER_TICK (1000000 / TICKS_PER_SEC)
 
 /*
@@ -90,7 +90,7 @@ int Spawn(const char *program, const char *command, struct Kernel_Thread **pThre
 {
     /*
      * Hints:
-     * - Call Read_Fully() to load the entire executable into a memory buffer
+     * - Open the executable and read its headers into a memory buffer
      * - Call Parse_ELF_Executable() to verify that the executable is
      *   valid, and to populate an Exe_Format data structure describing
      *   how the executable should be loaded
@@ -102,44 +102,121 @@ int Spawn(const char *program, const char *command, struct Kernel_Thread **pThre
      * pThread and return 0.  Otherwise, return an error code.
      */
 
- 	char *exeFileData = 0;
-	ulong_t exeFileLength;
+	struct File *exeFile = 0;
+	struct VFS_File_Stat stat;
+	char *exeHeader = 0;
+	ulong_t headerLength, numRead;
 	struct Exe_Format exeFormat;
 	struct User_Context* pUserContext;
-	int rc;
+	int i, rc;
 
 	if (userdebug){
 		Print("Reading %s...\n", program);
 	}
-	
-	if ((rc = Read_Fully(program, (void**) &exeFileData, &exeFileLength)) != 0){
-		if(userdebug) Print("Read_Fully failed to read %s from disk\n", program);
+
+	/*
+	 * Only the ELF headers are read now; the segments are
+	 * paged in from the file as the program touches them.
+	 */
+	if ((rc = Open(program, O_READ, &exeFile)) != 0){
+		if(userdebug) Print("Failed to open %s\n", program);
 		return rc;
 	}
+	if ((rc = FStat(exeFile, &stat)) != 0)
+		goto fail;
+	if (stat.size <= 0) {
+		rc = ENOEXEC;
+		goto fail;
+	}
+
+	headerLength = stat.size < PAGE_SIZE ? stat.size : PAGE_SIZE;
+	exeHeader = (char*) Malloc(headerLength);
+	if (exeHeader == 0) {
+		rc = ENOMEM;
+		goto fail;
+	}
+	for (numRead = 0; numRead < headerLength; numRead += rc) {
+		rc = Read(exeFile, exeHeader + numRead, headerLength - numRead);
+		if (rc == 0)
+			rc = EIO;
+		if (rc < 0)
+			goto fail;
+	}
 
 	if (userdebug){  
-		Print("Read_Fully OK\n");
+		Print("Read headers OK\n");
 	}
 	
-	if (Parse_ELF_Executable(exeFileData, exeFileLength, &exeFormat) != 0){
+	if ((rc = Parse_ELF_Executable(exeHeader, headerLength, &exeFormat)) != 0){
 		if(userdebug) Print("Parse_ELF_Executable failed\n");
-		return EUNSPECIFIED;
+		goto fail;
+	}
+	Free(exeHeader);
+	exeHeader = 0;
+
+	/* Every segment's file image must be inside the file */
+	for (i = 0; i < exeFormat.numSegments; ++i) {
+		struct Exe_Segment *segment = &exeFormat.segmentList[i];
+		if (segment->offsetInFile + segment->lengthInFile > (ulong_t) stat.size ||
+		    segment->lengthInFile > segment->sizeInMemory) {
+			rc = ENOEXEC;
+			goto fail;
+		}
 	}
 
 	if (userdebug){ 
     	Print("Parse_ELF_Executable OK\n");
     }	 
-	Load_User_Program(exeFileData, exeFileLength, &exeFormat, command,
-    (struct User_Context **)&pUserContext);
+	if ((rc = Load_User_Program(program, exeFile, &exeFormat, command,
+	    (struct User_Context **)&pUserContext)) != 0)
+		goto fail;
 
-	Free(exeFileData);
 	*pThread = Start_User_Thread(pUserContext, detached);
 	strcpy((*pThread)->name, command); 
 	
 	return (*pThread)->pid;   
+
+fail:
+	if (exeHeader != 0)
+		Free(exeHeader);
+	Close(exeFile);
+	return rc;
     //TODO("Spawn a process by reading an executable from a filesystem");
 }
 
+/*
+ * Fork the current user process.
+ * The child gets a copy-on-write duplicate of the parent's address
+ * space, and resumes from the same system call with a return value
+ * of 0.  Nothing is read from the executable.
+ * Params:
+ *   state - the parent's registers at the system call
+ *   pThread - reference to Kernel_Thread pointer where a pointer to
+ *     the child should be stored
+ * Returns:
+ *   The pid of the child, or an error code if it couldn't be created.
+ */
+int Fork(struct Interrupt_State* state, struct Kernel_Thread **pThread)
+{
+	struct User_Context *parent = g_currentThread->userContext;
+	struct User_Context *child;
+	int rc;
+
+	KASSERT(parent != 0);
+
+	if ((rc = Fork_User_Context(parent, &child)) != 0)
+		return rc;
+
+	*pThread = Start_Forked_User_Thread(child, state);
+	if (*pThread == 0) {
+		Destroy_User_Context(child);
+		return ENOMEM;
+	}
+	strcpy((*pThread)->name, g_currentThread->name);
+
+	return (*pThread)->pid;
+}
+
 /*
  * If the given thread has a User_Context,
  * switch to its memory space.
@@ -7,6 +7,7 @@
  * redistribute, and modify it as specified in the file "COPYING".
  */
 
+#include <geekos/errno.h>
 #include <geekos/int.h>
 #include <geekos/mem.h>
 #include <geekos/paging.h>
@@ -30,7 +31,245 @@
 extern int debugFaults;
 #define Debug(args...) if (debugFaults) Print(args)
 
-// TODO: Add private functions
+/*
+ * Read-only text pages shared by all processes running the same
+ * executable.  An image is looked up by path, and must be of the
+ * same file (the filesystem's object for it) with the same size.
+ * Writing to the file makes its image stale: processes started
+ * afterwards get a new image, so a rebuilt executable isn't mistaken
+ * for the old one while that still runs.  Each text page is read in
+ * on the first fault of any process, and stays cached (holding one
+ * reference to the frame) until the last process using the image
+ * exits.  Shared pages are not pageable.
+ * The image list is protected by disabling interrupts.
+ */
+struct Exe_Image;
+DEFINE_LIST(Exe_Image_List, Exe_Image);
+
+struct Exe_Image {
+    char *path;
+    int size;
+    struct Mount_Point *mountPoint;	/* identify the file the image was read from */
+    void *fsData;
+    bool stale;				/* file written since; off the image list */
+    int refCount;			/* User_Contexts using the image */
+    struct Exe_Format exeFormat;
+    ulong_t *textPages[EXE_MAX_SEGMENTS]; /* frames of read-only segments (0 = not read yet) */
+    DEFINE_LINK(Exe_Image_List, Exe_Image);
+};
+
+IMPLEMENT_LIST(Exe_Image_List, Exe_Image);
+
+static struct Exe_Image_List s_exeImageList;
+
+/*
+ * Can pages of given segment be shared?
+ */
+static bool Is_Text_Segment(struct Exe_Segment *segment)
+{
+	return !(segment->protFlags & PF_W) && segment->lengthInFile > 0;
+}
+
+/*
+ * Number of pages spanned by the file image of a text segment.
+ */
+static ulong_t Num_Text_Pages(struct Exe_Segment *segment)
+{
+	return (Round_Up_To_Page(segment->startAddress + segment->lengthInFile) -
+		Round_Down_To_Page(segment->startAddress)) / PAGE_SIZE;
+}
+
+/*
+ * Drop a reference to an executable image, freeing it
+ * and its cached text pages when it is no longer used.
+ */
+static void Put_Exe_Image(struct Exe_Image *image)
+{
+	bool iflag;
+	ulong_t j;
+	int i;
+
+	iflag = Begin_Int_Atomic();
+	KASSERT(image->refCount > 0);
+	if (--image->refCount > 0) {
+		End_Int_Atomic(iflag);
+		return;
+	}
+	if (!image->stale)
+		Remove_From_Exe_Image_List(&s_exeImageList, image);
+
+	for (i = 0; i < image->exeFormat.numSegments; ++i) {
+		if (image->textPages[i] == 0)
+			continue;
+		for (j = 0; j < Num_Text_Pages(&image->exeFormat.segmentList[i]); ++j) {
+			if (image->textPages[i][j] != 0) {
+				Free_Page((void*) image->textPages[i][j]);
+				--g_vmStat.numSharedTextPages;
+			}
+		}
+		Free(image->textPages[i]);
+	}
+	Free(image->path);
+	Free(image);
+	End_Int_Atomic(iflag);
+}
+
+/*
+ * Find (or create) the image for given executable, and take
+ * a reference to it.  Returns null if out of memory.
+ */
+static struct Exe_Image *Get_Exe_Image(const char *path, struct File *exeFile,
+	struct Exe_Format *exeFormat)
+{
+	struct VFS_File_Stat stat;
+	struct Exe_Image *image;
+	bool iflag;
+	int i;
+
+	if (FStat(exeFile, &stat) != 0)
+		return 0;
+
+	iflag = Begin_Int_Atomic();
+	for (image = Get_Front_Of_Exe_Image_List(&s_exeImageList); image != 0;
+	     image = Get_Next_In_Exe_Image_List(image)) {
+		if (image->size == stat.size && image->mountPoint == exeFile->mountPoint &&
+		    image->fsData == exeFile->fsData && strcmp(image->path, path) == 0) {
+			++image->refCount;
+			End_Int_Atomic(iflag);
+			return image;
+		}
+	}
+
+	image = (struct Exe_Image*) Malloc(sizeof(struct Exe_Image));
+	if (image == 0)
+		goto fail;
+	memset(image, '\0', sizeof(struct Exe_Image));
+	image->refCount = 1;
+	image->size = stat.size;
+	image->mountPoint = exeFile->mountPoint;
+	image->fsData = exeFile->fsData;
+	image->exeFormat = *exeFormat;
+	image->path = (char*) Malloc(strlen(path) + 1);
+	if (image->path == 0)
+		goto fail;
+	strcpy(image->path, path);
+
+	for (i = 0; i < exeFormat->numSegments; ++i) {
+		struct Exe_Segment *segment = &exeFormat->segmentList[i];
+		ulong_t size;
+
+		if (!Is_Text_Segment(segment))
+			continue;
+		size = Num_Text_Pages(segment) * sizeof(ulong_t);
+		image->textPages[i] = (ulong_t*) Malloc(size);
+		if (image->textPages[i] == 0)
+			goto fail;
+		memset(image->textPages[i], '\0', size);
+	}
+
+	Add_To_Back_Of_Exe_Image_List(&s_exeImageList, image);
+	End_Int_Atomic(iflag);
+	return image;
+
+fail:
+	if (image != 0) {
+		for (i = 0; i < exeFormat->numSegments; ++i)
+			if (image->textPages[i] != 0)
+				Free(image->textPages[i]);
+		if (image->path != 0)
+			Free(image->path);
+		Free(image);
+	}
+	End_Int_Atomic(iflag);
+	return 0;
+}
+
+/*
+ * Note that given file was written to.  An image read from it is
+ * kept for the processes using it, but no longer shared with new ones.
+ */
+void Exe_Image_File_Written(struct File *file)
+{
+	struct Exe_Image *image, *next;
+	bool iflag;
+
+	iflag = Begin_Int_Atomic();
+	for (image = Get_Front_Of_Exe_Image_List(&s_exeImageList); image != 0; image = next) {
+		next = Get_Next_In_Exe_Image_List(image);
+		if (image->mountPoint == file->mountPoint && image->fsData == file->fsData) {
+			Remove_From_Exe_Image_List(&s_exeImageList, image);
+			image->stale = true;
+		}
+	}
+	End_Int_Atomic(iflag);
+}
+
+/*
+ * Get the shared frame for the text page at given (linear) address,
+ * reading it in if no process has touched it yet, and take a
+ * reference to it for the caller's page table entry.
+ * Returns null if the page is not a shareable text page (it lies
+ * outside the read-only segments, or shares a page with writable
+ * data), or if no frame is free; the caller then gives the process
+ * a private page.
+ * Interrupts must be disabled; they are enabled while reading.
+ */
+void *Get_Shared_Text_Page(struct User_Context *context, ulong_t vaddr)
+{
+	struct Exe_Image *image = context != 0 ? context->exeImage : 0;
+	ulong_t pageStart = vaddr - USER_BASE_ADDR;
+	ulong_t pageEnd = pageStart + PAGE_SIZE;
+	ulong_t *slot = 0;
+	void *paddr;
+	int i;
+
+	KASSERT(!Interrupts_Enabled());
+
+	if (image == 0 || vaddr < USER_BASE_ADDR)
+		return 0;
+
+	for (i = 0; i < image->exeFormat.numSegments; ++i) {
+		struct Exe_Segment *segment = &image->exeFormat.segmentList[i];
+		ulong_t segStart = Round_Down_To_Page(segment->startAddress);
+		ulong_t segEnd = Round_Up_To_Page(segment->startAddress + segment->sizeInMemory);
+
+		if (pageEnd <= segStart || pageStart >= segEnd)
+			continue;  /* segment doesn't touch this page */
+		if (!Is_Text_Segment(segment) ||
+		    pageStart >= Round_Up_To_Page(segment->startAddress + segment->lengthInFile))
+			return 0;  /* page holds something private */
+		slot = &image->textPages[i][(pageStart - segStart) / PAGE_SIZE];
+	}
+	if (slot == 0)
+		return 0;
+
+	if (*slot == 0) {
+		paddr = Alloc_Zeroed_Page();
+		if (paddr == 0)
+			return 0;
+
+		Enable_Interrupts();
+		if (Load_User_Page(context, paddr, vaddr) != 0) {
+			Disable_Interrupts();
+			Free_Page(paddr);
+			return 0;
+		}
+		Disable_Interrupts();
+
+		if (*slot != 0) {
+			/* Another process read it in while we were */
+			Free_Page(paddr);
+		} else {
+			*slot = (ulong_t) paddr;
+			++g_vmStat.numSharedTextPages;
+		}
+	} else {
+		++g_vmStat.numTextShares;
+	}
+
+	Get_Page_Reference((void*) *slot);
+	return (void*) *slot;
+}
 /* ----------------------------------------------------------------------
  * Public functions
  * ---------------------------------------------------------------------- */
@@ -129,6 +368,10 @@ void Destroy_User_Context(struct User_Context* context)
 	/* Free samaphores */
 	for(i = 0; i < USER_MAX_FILES; i++)
 		Destroy_Semaphore((context->semaphores)[i]);
+	if (context->exeImage != 0)
+		Put_Exe_Image(context->exeImage);
+	if (context->exeFile != 0)
+		Close(context->exeFile);
     Free_Segment_Descriptor(context->ldtDescriptor);
     //Free(context->memory);
     Free(context);
@@ -137,12 +380,120 @@ void Destroy_User_Context(struct User_Context* context)
     //TODO("Destroy User_Context data structure after process exits");
 }
 
+/*
+ * Set up the LDT of a user context, with its code and data segments
+ * covering the user half of the address space.
+ */
+static void Init_User_Segments(struct User_Context *context)
+{
+	struct Segment_Descriptor* desc;
+	unsigned short LDTSelector;
+	unsigned short codeSelector, dataSelector;
+
+	/* Setup LDT */
+	/* Alloc LDT seg desc in GDT */
+	desc = Allocate_Segment_Descriptor();
+	Init_LDT_Descriptor(
+					 desc,
+					 (context->ldt), // base address
+					 2  // num pages
+					 );
+	LDTSelector = Selector(KERNEL_PRIVILEGE, true, Get_Descriptor_Index( desc )); //
+	context->ldtDescriptor = desc;
+	context->ldtSelector = LDTSelector;
+
+	desc = &(context->ldt)[0];
+	Init_Code_Segment_Descriptor(
+					 desc,
+					 (unsigned long)USER_BASE_ADDR, // base address
+					 (USER_BASE_ADDR/PAGE_SIZE),  // need to modify
+					 USER_PRIVILEGE		   // privilege level (0 == kernel)
+					 );
+	codeSelector = Selector(USER_PRIVILEGE, false, 0);
+	context->csSelector = codeSelector;
+
+	desc = &(context->ldt)[1];
+	Init_Data_Segment_Descriptor(
+					 desc,
+					 (unsigned long)USER_BASE_ADDR, // base address
+					 (USER_BASE_ADDR/PAGE_SIZE),  // num pages
+					 USER_PRIVILEGE		   // privilege level (0 == kernel)
+					 );
+	dataSelector = Selector(USER_PRIVILEGE, false, 1);
+	context->dsSelector = dataSelector;
+}
+
+/*
+ * Fill in the page of user memory at given (linear) address the
+ * first time it is touched.  The parts of the page holding a
+ * segment's file image are read from the executable; everything
+ * else (the BSS, heap, and stack) is left as it is, so the page
+ * must come filled with zeroes (see Alloc_Zeroed_Page()).
+ * Called with interrupts enabled, on a page that is not yet pageable.
+ * Returns 0 if successful, or an error code (< 0) if the
+ * executable could not be read.
+ */
+int Load_User_Page(struct User_Context *context, void *paddr, ulong_t vaddr)
+{
+	ulong_t pageStart = vaddr - USER_BASE_ADDR;
+	ulong_t pageEnd = pageStart + PAGE_SIZE;
+	bool fromFile = false;
+	int i, rc;
+
+	KASSERT(Interrupts_Enabled());
+
+	if (context != 0 && context->exeFile != 0 && vaddr >= USER_BASE_ADDR) {
+		for (i = 0; i < context->exeFormat.numSegments; ++i) {
+			struct Exe_Segment *segment = &context->exeFormat.segmentList[i];
+			ulong_t from = segment->startAddress;
+			ulong_t to = segment->startAddress + segment->lengthInFile;
+			ulong_t numRead;
+
+			/* The part of the file image that falls in this page */
+			if (from < pageStart)
+				from = pageStart;
+			if (to > pageEnd)
+				to = pageEnd;
+			if (from >= to)
+				continue;
+
+			rc = Seek(context->exeFile, segment->offsetInFile + (from - segment->startAddress));
+			for (numRead = 0; rc == 0 && numRead < to - from; numRead += rc) {
+				rc = Read(context->exeFile, (char*) paddr + (from - pageStart) + numRead,
+					(to - from) - numRead);
+				if (rc == 0)
+					rc = EIO;	/* file is shorter than its headers say */
+				if (rc < 0)
+					break;
+			}
+			if (rc < 0)
+				return rc;
+			fromFile = true;
+		}
+	}
+
+	Disable_Interrupts();
+	if (fromFile)
+		++g_vmStat.numExePageIns;
+	else
+		++g_vmStat.numZeroFills;
+	Enable_Interrupts();
+
+	return 0;
+}
+
 /*
  * Load a user executable into memory by creating a User_Context
  * data structure.
+ * Nothing of the executable is read here: the text and data
+ * segments are paged in from exeFile as they are touched (see
+ * Load_User_Page()).  Only the stack and argument block are
+ * set up now.
  * Params:
- * exeFileData - a buffer containing the executable to load
- * exeFileLength - number of bytes in exeFileData
+ * program - the full path of the executable file, which identifies
+ *   it for sharing text pages with other processes running it
+ * exeFile - the executable file; the User_Context takes it over,
+ *   and closes it when it is destroyed
  * exeFormat - parsed ELF segment information describing how to
  *   load the executable's text and data segments, and the
  *   code entry point address
@@ -155,24 +506,11 @@ void Destroy_User_Context(struct User_Context* context)
  * Returns:
  *   0 if successful, or an error code (< 0) if unsuccessful
  */
-int Load_User_Program(char *exeFileData, ulong_t exeFileLength,
+int Load_User_Program(const char *program, struct File *exeFile,
     struct Exe_Format *exeFormat, const char *command,
     struct User_Context **pUserContext)
 {
-    /*
-     * Hints:
-     * - This will be similar to the same function in userseg.c
-     * - Determine space requirements for code, data, argument block,
-     *   and stack
-     * - Allocate pages for above, map them into user address
-     *   space (allocating page directory and page tables as needed)
-     * - Fill in initial stack pointer, argument block address,
-     *   and code entry point fields in User_Context
-     */
-	struct Segment_Descriptor* desc;
 	unsigned long virtSize;
-	unsigned short LDTSelector;
-	unsigned short codeSelector, dataSelector;
 	int i, j, k;
 	ulong_t maxva = 0;
 	unsigned numArgs;
@@ -197,83 +535,18 @@ int Load_User_Program(char *exeFileData, ulong_t exeFileLength,
 	virtSize = Round_Up_To_Page(maxva);
 	stackPointerAddr = PAGE_ADDR(END_OF_VM);
 	
-    pde_t* base_pde = 0;
+	pde_t* base_pde = 0;
 	pde_t* pde = 0;
-	pte_t* base_pte = 0;
 	pte_t* pte = 0;
 
 	/* Copy all of the mappings from the kernel mode page directory */ 
-	base_pde = (pde_t*)Alloc_Page();
-	memset(base_pde,'\0',PAGE_SIZE); /* Null char means that there is no entry */
+	base_pde = (pde_t*)Alloc_Zeroed_Page(); /* Null char means that there is no entry */
 	memcpy(base_pde, Get_PDBR(), PAGE_SIZE/2); // very important
 	
-	/* Alloc user page dir entry(start from 0x80000000) */
-	for(i=0; i < exeFormat->numSegments; ++i){
-		struct Exe_Segment *segment = &exeFormat->segmentList[i];
-		ulong_t startAddress = USER_BASE_ADDR + segment->startAddress;
-		ulong_t offsetInFile = segment->offsetInFile;	
-		Debug("\nSegment %d : %d\n", i, segment->lengthInFile);
-		Debug( "%6s %-12s%-15s%-15s\n",
-			   "Idx", "Start VAddr", "Offset In File", "Sample Data" );
-		Debug( "%6d %-12x%-15x0x%-15x\n",
-			   PAGE_DIRECTORY_INDEX(startAddress), startAddress,
-			   offsetInFile, *(int*)(exeFileData + offsetInFile));
-
-		
-		pde = &base_pde[PAGE_DIRECTORY_INDEX(startAddress)];
-		/* Alloc page table */
-	    for(j=0; j<=PAGE_DIRECTORY_INDEX(segment->lengthInFile); j++) 
-	    {
-	    	/* Page table is not exist */
-	    	if(pde[j].pageTableBaseAddr == '\0') 
-	    	{
-				base_pte = (pte_t*)Alloc_Page();
-			 	memset(base_pte,'\0', PAGE_SIZE);
-			}
-			else
-			{
-				base_pte = pde[j].pageTableBaseAddr<<12;
-			}
-			
-			pde[j].pageTableBaseAddr = (uint_t)PAGE_ALLIGNED_ADDR(base_pte);
-			pde[j].present = 1;
-			pde[j].flags = VM_USER | VM_WRITE; // weak : code segment?
-
-			pte = &base_pte[PAGE_TABLE_INDEX(startAddress)];
-			Debug( "\n%6s %-12s%-15s%-15s%-15s\n",
-			   "Idx", "VAddr", "PAddr", "Offset", "Sample Data");
-
-			/* Alloc page table entry and map to physical address */
-			for(k=0;
-				k <= PAGE_TABLE_INDEX(segment->lengthInFile); k++)
-			{
-				vaddr = PAGE_ADDR(startAddress + PAGE_ADDR_BY_IDX(j, k)); // vaddr?
-				paddr = Alloc_Pageable_Page(&pte[k], vaddr);
-				pte[k].pageBaseAddr = PAGE_ALLIGNED_ADDR(paddr); 
-				memcpy(paddr,
-					   exeFileData + PAGE_ADDR(segment->offsetInFile + PAGE_ADDR_BY_IDX(j, k)),
-					   PAGE_SIZE);
-					   
-				if(k == PAGE_TABLE_INDEX(segment->lengthInFile)) /* End of segment */
-				{
-					int sizeOfEnd = ((segment->startAddress%PAGE_SIZE)+segment->lengthInFile)%PAGE_SIZE;
-					memset(paddr + sizeOfEnd, 0, PAGE_SIZE-sizeOfEnd);
-				}
-				
-				Debug( "%6d %-12x%-15x%-15x%-15x\n", k, vaddr, paddr,
-						PAGE_ADDR(segment->offsetInFile + PAGE_ADDR_BY_IDX(j, k)),
-						*(int*)paddr);
-				pte[k].present = 1;
-				pte[k].flags = VM_USER | VM_WRITE;
-			}
-		}
-	}
-
 	/* Alloc userspace stack.. */
 	j = PAGE_DIRECTORY_INDEX(stackPointerAddr);
 	pde = &base_pde[j];
-	pte = (pte_t*)Alloc_Page();
-	memset(pte,'\0',PAGE_SIZE);
+	pte = (pte_t*)Alloc_Zeroed_Page();
 	pde->pageTableBaseAddr = (uint_t)PAGE_ALLIGNED_ADDR(pte);
 	pde->present = 1;
 	pde->flags = VM_USER | VM_WRITE;
@@ -310,45 +583,174 @@ int Load_User_Program(char *exeFileData, ulong_t exeFileLength,
 
 	(*pUserContext)->signal = 0;
 	memset((*pUserContext)->saHandler, 0, MAXSIG*sizeof(signal_handler));
-	
-	/* Setup LDT */
-	/* Alloc LDT seg desc in GDT */
-	desc = Allocate_Segment_Descriptor();
-	Init_LDT_Descriptor(
-					 desc,
-					 ((*pUserContext)->ldt), // base address
-					 2  // num pages
-					 );
-	LDTSelector = Selector(KERNEL_PRIVILEGE, true, Get_Descriptor_Index( desc )); //
-	(*pUserContext)->ldtDescriptor = desc;
-	(*pUserContext)->ldtSelector = LDTSelector;
 
-	desc = &((*pUserContext)->ldt)[0];
-	Init_Code_Segment_Descriptor(
-					 desc,
-					 (unsigned long)USER_BASE_ADDR, // base address
-					 (USER_BASE_ADDR/PAGE_SIZE),  // need to modify
-					 USER_PRIVILEGE		   // privilege level (0 == kernel)
-					 );
-	codeSelector = Selector(USER_PRIVILEGE, false, 0);
-	(*pUserContext)->csSelector = codeSelector;
-
-	desc = &((*pUserContext)->ldt)[1];
-	Init_Data_Segment_Descriptor(
-					 desc,
-					 (unsigned long)USER_BASE_ADDR, // base address
-					 (USER_BASE_ADDR/PAGE_SIZE),  // num pages
-					 USER_PRIVILEGE		   // privilege level (0 == kernel)
-					 );
-	dataSelector = Selector(USER_PRIVILEGE, false, 1);
-	(*pUserContext)->dsSelector = dataSelector;	
+	(*pUserContext)->exeFile = exeFile;
+	memcpy(&(*pUserContext)->exeFormat, exeFormat, sizeof(struct Exe_Format));
+	/* Without an image, every text page is simply private */
+	(*pUserContext)->exeImage = Get_Exe_Image(program, exeFile, exeFormat);
 	
+	Init_User_Segments(*pUserContext);
+
 	//Print("virtSize : %d\n", exeFormat->entryAddr);
 	//DisplayMemory(base_pde);
 	//TODO("");
 	return 0;
 }
 
+/*
+ * Give the child of a Fork() the page of the parent at given
+ * (linear) address.  Writable pages, and pages that are already
+ * shared, are mapped read-only by both and copied on the first
+ * write; text pages are shared as they are.  A page in the paging
+ * file is read into a private page of the child.  Pages that were
+ * never touched are left for the child to page in itself.
+ * Parent pages made read-only are added to the batch to invalidate.
+ * Interrupts must be disabled; they are enabled to allocate and read.
+ * Returns 0 if successful, or ENOMEM.
+ */
+static int Fork_Page(pte_t *parentEntry, pte_t *childEntry, ulong_t vaddr,
+	struct TLB_Batch *batch)
+{
+	void *paddr, *copy;
+
+	KASSERT(!Interrupts_Enabled());
+
+again:
+	if (!parentEntry->present) {
+		if (parentEntry->kernelInfo != KINFO_PAGE_ON_DISK)
+			return 0;
+
+		/* The slot stays the parent's: it can't fault it back in while we read */
+		copy = Alloc_Unmapped_Page();
+		if (copy == 0)
+			return ENOMEM;
+		Enable_Interrupts();
+		Read_From_Paging_File(copy, vaddr, parentEntry->pageBaseAddr);
+		Disable_Interrupts();
+		goto private;
+	}
+
+	paddr = (void*) (parentEntry->pageBaseAddr << 12);
+
+	if (!(parentEntry->flags & VM_WRITE) && parentEntry->kernelInfo != KINFO_PAGE_COW) {
+		/* Shared text page */
+		Get_Page_Reference(paddr);
+		*childEntry = *parentEntry;
+		return 0;
+	}
+
+	if (Get_Page((ulong_t) paddr)->flags & PAGE_LOCKED) {
+		/* On its way to the paging file; the child gets a copy */
+		copy = Alloc_Unmapped_Page();
+		if (copy == 0)
+			return ENOMEM;
+		if (!parentEntry->present || (void*) (parentEntry->pageBaseAddr << 12) != paddr) {
+			/* Paged out while we were allocating */
+			Free_Page(copy);
+			goto again;
+		}
+		memcpy(copy, paddr, PAGE_SIZE);
+		goto private;
+	}
+
+	Share_Page(paddr);
+	if (parentEntry->flags & VM_WRITE)
+		Add_To_TLB_Batch(batch, vaddr);
+	parentEntry->flags = VM_USER;
+	parentEntry->kernelInfo = KINFO_PAGE_COW;
+	*childEntry = *parentEntry;
+	return 0;
+
+private:
+	Map_Pageable_Page(copy, childEntry, vaddr);
+	childEntry->present = 1;
+	childEntry->flags = VM_USER | VM_WRITE;
+	childEntry->pageBaseAddr = PAGE_ALLIGNED_ADDR(copy);
+	return 0;
+}
+
+/*
+ * Create a copy of the calling process's user context for Fork().
+ * The address space is duplicated copy-on-write (see Fork_Page()),
+ * so no page is copied until one of the processes writes to it.
+ * The child opens its own handle on the executable, to page in what
+ * the parent hasn't touched yet.  Open files and semaphores are not
+ * inherited.
+ * Called with interrupts enabled.
+ * Returns 0 if successful, or an error code (< 0).
+ */
+int Fork_User_Context(struct User_Context *parent, struct User_Context **pChild)
+{
+	struct User_Context *child;
+	struct File *exeFile;
+	pde_t *pde, *parentPde = parent->pageDir;
+	pte_t *pte, *parentPte;
+	struct TLB_Batch batch;
+	int i, j, rc = 0;
+
+	KASSERT(Interrupts_Enabled());
+
+	/* The image is the only record of where the executable is */
+	if (parent->exeImage == 0)
+		return ENOMEM;
+	if ((rc = Open(parent->exeImage->path, O_READ, &exeFile)) != 0)
+		return rc;
+
+	pde = (pde_t*) Alloc_Zeroed_Page();
+	child = (struct User_Context*) Malloc(sizeof(struct User_Context));
+	if (pde == 0 || child == 0) {
+		if (pde != 0)
+			Free_Page(pde);
+		if (child != 0)
+			Free(child);
+		Close(exeFile);
+		return ENOMEM;
+	}
+
+	/* Registers, signal handlers, working directory and segment layout are the parent's */
+	memcpy(child, parent, sizeof(struct User_Context));
+	child->refCount = 0;
+	memset(child->semaphores, '\0', sizeof(child->semaphores));
+	memset(child->fileList, '\0', sizeof(child->fileList));
+	child->exeFile = exeFile;
+	Init_User_Segments(child);
+
+	memcpy(pde, parentPde, PAGE_SIZE/2);
+	child->pageDir = pde;
+
+	Disable_Interrupts();
+	++parent->exeImage->refCount;
+	Init_TLB_Batch(&batch);
+
+	for (i = PAGE_DIRECTORY_INDEX(USER_BASE_ADDR); rc == 0 && i < NUM_PAGE_DIR_ENTRIES; ++i) {
+		if (parentPde[i].pageTableBaseAddr == '\0')
+			continue;
+		pte = (pte_t*) Alloc_Zeroed_Page();
+		if (pte == 0) {
+			rc = ENOMEM;
+			break;
+		}
+		pde[i] = parentPde[i];
+		pde[i].pageTableBaseAddr = (uint_t) PAGE_ALLIGNED_ADDR(pte);
+
+		parentPte = (pte_t*) (parentPde[i].pageTableBaseAddr << 12);
+		for (j = 0; rc == 0 && j < NUM_PAGE_TABLE_ENTRIES; ++j)
+			rc = Fork_Page(&parentPte[j], &pte[j], PAGE_ADDR_BY_IDX(i, j), &batch);
+	}
+
+	/* The parent's writable pages are now read-only */
+	Flush_TLB_Batch(&batch);
+	Enable_Interrupts();
+
+	if (rc != 0) {
+		Destroy_User_Context(child);
+		return rc;
+	}
+
+	*pChild = child;
+	return 0;
+}
+
 ulong_t Get_User_Address(ulong_t kernelAddr)
 {
 	/* need to impl boundary check routine*/
@@ -363,6 +765,20 @@ ulong_t Get_Kernel_Address(ulong_t userAddr)
 	return (void*)(userAddr - USER_BASE_ADDR);
 }
 
+/*
+ * Does the range of user memory lie within the user half of the
+ * address space, which the process's segments cover?  (The size of
+ * the context only covers the executable image, not the stack at
+ * the top.)  Checked so a buffer passed to a system call can't
+ * reach into kernel memory.
+ */
+static bool Validate_User_Memory(ulong_t userAddr, ulong_t numBytes)
+{
+	ulong_t userLimit = END_OF_VM - USER_BASE_ADDR + 1;
+
+	return userAddr <= userLimit && numBytes <= userLimit - userAddr;
+}
+
 /*
  * Copy data from user buffer into kernel buffer.
  * Returns true if successful, false otherwise.
@@ -391,6 +807,8 @@ bool Copy_From_User(void* destInKernel, ulong_t srcInUser, ulong_t numBytes)
     struct User_Context* userContext = g_currentThread->userContext;
 
 	KASSERT(!Interrupts_Enabled());
+	if (!Validate_User_Memory(srcInUser, numBytes))
+		return false;
     memcpy(destInKernel, (void*)Get_User_Address(srcInUser), numBytes); // because kernel mode
 
     return true;    
@@ -421,10 +839,28 @@ bool Copy_To_User(ulong_t destInUser, void* srcInKernel, ulong_t numBytes)
      * - Also, make sure the memory is mapped into the user
      *   address space with write permission enabled
      */
-	struct User_Context* userContext = g_currentThread->userContext;
-	
-	memcpy((void*)Get_User_Address(destInUser), srcInKernel, numBytes);
-	return true;
+	ulong_t dest = Get_User_Address(destInUser);
+	ulong_t page, lastPage;
+	bool iflag, ok = true;
+
+	if (!Validate_User_Memory(destInUser, numBytes))
+		return false;
+	if (numBytes == 0)
+		return true;
+
+	/* Every page must be writable; text pages are mapped read-only */
+	iflag = Begin_Int_Atomic();
+	lastPage = Round_Down_To_Page(dest + numBytes - 1);
+	for (page = Round_Down_To_Page(dest); ok; page += PAGE_SIZE) {
+		ok = Prepare_User_Page_For_Write(page);
+		if (page == lastPage)
+			break;
+	}
+	if (ok)
+		memcpy((void*)dest, srcInKernel, numBytes);
+	End_Int_Atomic(iflag);
+
+	return ok;
      
 	//TODO("Copy kernel data to user buffer");
 }
@@ -15,6 +15,8 @@
 #include <geekos/malloc.h>
 #include <geekos/synch.h>
 #include <geekos/vfs.h>
+#include <geekos/dcache.h>
+#include <geekos/zswap.h>
 #include <geekos/user.h> /* weak */
 
 /*
@@ -182,6 +184,8 @@ static struct Mount_Point *Lookup_Mount_Point(const char *prefix)
     return mountPoint;
 }
 
+static int Do_Open_File(struct Mount_Point *mountPoint, const char *path, int mode, struct File **pFile);
+
 /*
  * Common implementation function for Open() and Open_Directory().
  */
@@ -192,12 +196,18 @@ static int Do_Open(
     char prefix[MAX_PREFIX_LEN + 1];
     const char *suffix;
     struct Mount_Point *mountPoint;
+    ulong_t generation;
     int rc;
 
     /* Check whether relative path */
     if (*path != '/')
 		Convert_To_Abs_Path(path);
 
+    /* Known not to exist? */
+    if (!(mode & O_CREATE) && Dentry_Cache_Lookup(path, &rc, 0) && rc == ENOTFOUND)
+	return ENOTFOUND;
+    generation = Dentry_Cache_Generation();
+
     if (!Unpack_Path(path, prefix, &suffix))
 	return ENOTFOUND;
 
@@ -212,6 +222,11 @@ static int Do_Open(
 		/* File opened successfully! */
 		(*pFile)->mode = mode;
 		(*pFile)->mountPoint = mountPoint;
+		if (mode & O_CREATE)
+		    Dentry_Cache_Invalidate(path, false);
+    } else if (rc == ENOTFOUND && !(mode & O_CREATE) && openFunc == &Do_Open_File) {
+		/* Files that aren't there are looked for again, along PATH */
+		Dentry_Cache_Insert(path, generation, mountPoint, 0, ENOTFOUND, 0);
     }
 
     return rc;
@@ -372,6 +387,9 @@ int Mount(const char *devname, const char *pathPrefix, const char *fstype)
      Add_To_Back_Of_Mount_Point_List(&s_mountPointList, mountPoint);
      Mutex_Unlock(&s_vfsLock);
 
+     /* Paths under the new prefix may be cached as not existing */
+     Dentry_Cache_Flush();
+
      return 0;
 
      memfail:
@@ -434,25 +452,37 @@ int Stat(const char *path, struct VFS_File_Stat *stat)
     char prefix[MAX_PREFIX_LEN + 1];
     const char *suffix;
     struct Mount_Point *mountPoint;
+    ulong_t generation, fileGeneration;
+    int rc;
 
     /* Check whether relative path */
     if (*path != '/')
 		Convert_To_Abs_Path(path);
 
+    /* Looked up recently? */
+    if (Dentry_Cache_Lookup(path, &rc, stat))
+	return rc;
+    generation = Dentry_Cache_Generation();
+
     if (!Unpack_Path(path, prefix, &suffix))
 		return ENOTFOUND;
 
     /* Get mount point for path */
     Debug("Stat: lookup mount point for %s\n", prefix);
     mountPoint = Lookup_Mount_Point(prefix);
-    if (mountPoint == 0)
+    if (mountPoint == 0) {
+	Dentry_Cache_Insert(path, generation, 0, 0, ENOTFOUND, 0);
 	return ENOTFOUND;
+    }
 
     Debug("Stat: found mount point, dispatching to filesystem\n");
     if (mountPoint->ops->Stat == 0)
 	return EUNSUPPORTED;
-    else
-	return mountPoint->ops->Stat(mountPoint, suffix, stat);
+
+    fileGeneration = mountPoint->fileGeneration;
+    rc = mountPoint->ops->Stat(mountPoint, suffix, stat);
+    Dentry_Cache_Insert(path, generation, mountPoint, fileGeneration, rc, stat);
+    return rc;
 }
 
 /*
@@ -503,6 +533,7 @@ struct File *Allocate_File(struct File_Ops *ops, int filePos, int endPos, void *
 		file->fsData = fsData;
 		file->mode = mode;
 		file->mountPoint = mountPoint;
+		memset(&file->readahead, '\0', sizeof(file->readahead));
     }
     return file;
 }
@@ -549,10 +580,17 @@ int Read(struct File *file, void *buf, ulong_t len)
  */
 int Write(struct File *file, void *buf, ulong_t len)
 {
+    int rc;
+
     if (file->ops->Write == 0)
 		return EUNSUPPORTED;
-    else
-		return file->ops->Write(file, buf, len);
+
+    rc = file->ops->Write(file, buf, len);
+    if (rc > 0 && file->mountPoint != 0)
+		Dentry_Cache_File_Changed(file->mountPoint);
+    /* Even a failed write may have changed some of the file */
+    Exe_Image_File_Written(file);
+    return rc;
 }
 
 /*
@@ -571,6 +609,61 @@ int Seek(struct File *file, ulong_t len)
 		return file->ops->Seek(file, len);
 }
 
+/*
+ * Decide which blocks of a file to read ahead, when a read covers
+ * blocks first to end - 1.  A read that starts where the previous one
+ * stopped is sequential: the reader then gets a window of blocks read
+ * ahead of it, which starts at VFS_READAHEAD_MIN bytes and doubles,
+ * up to VFS_READAHEAD_MAX bytes, each time the reader has got through
+ * half of it.  Any other read closes the window until reads are
+ * sequential again.
+ * The range also covers the blocks of the read itself that haven't
+ * been read ahead, so a long read goes to the device in big requests.
+ * Params:
+ *   file - the File being read
+ *   first, end - the blocks covered by the read
+ *   numBlocks - number of blocks in the file
+ *   blockSize - size of the filesystem's blocks
+ *   pStart, pEnd - where to store the range of blocks to read ahead
+ * Returns: true if there are blocks to read ahead, false if not
+ */
+bool Readahead_Range(struct File *file, ulong_t first, ulong_t end, ulong_t numBlocks,
+    ulong_t blockSize, ulong_t *pStart, ulong_t *pEnd)
+{
+    struct File_Readahead *ra = &file->readahead;
+    ulong_t maxWindow = VFS_READAHEAD_MAX / blockSize;
+    ulong_t stop = end;
+
+    /* A read of the rest of the last block read still counts as sequential */
+    if (first <= ra->nextBlock && first + 1 >= ra->nextBlock) {
+		if (ra->window == 0)
+		    ra->window = VFS_READAHEAD_MIN / blockSize;
+    } else {
+		ra->window = 0;
+		ra->aheadEnd = first;
+    }
+    ra->nextBlock = end;
+    if (ra->aheadEnd < first)
+		ra->aheadEnd = first;
+
+    /* Less than half the window is left ahead of the reader: extend it */
+    if (ra->window != 0 && ra->aheadEnd < end + ra->window / 2) {
+		stop = end + ra->window;
+		ra->window = (ra->window * 2 < maxWindow) ? ra->window * 2 : maxWindow;
+    }
+    if (stop > numBlocks)
+		stop = numBlocks;
+
+    /* A single block is read faster by the reader itself */
+    if (stop <= ra->aheadEnd + 1)
+		return false;
+
+    *pStart = ra->aheadEnd;
+    *pEnd = stop;
+    ra->aheadEnd = stop;
+    return true;
+}
+
 /*
  * Completely read named file into a buffer.
  * Params:
@@ -636,6 +729,7 @@ int Create_Directory(const char *path)
     char prefix[MAX_PREFIX_LEN + 1];
     const char *suffix;
     struct Mount_Point *mountPoint;
+    int rc;
 
     /* Check whether relative path */
     if (*path != '/')
@@ -652,8 +746,11 @@ int Create_Directory(const char *path)
 
     if (mountPoint->ops->Create_Directory == 0)
 		return EUNSUPPORTED;
-    else
-		return mountPoint->ops->Create_Directory(mountPoint, suffix);
+
+    rc = mountPoint->ops->Create_Directory(mountPoint, suffix);
+    if (rc == 0)
+		Dentry_Cache_Invalidate(path, false);
+    return rc;
 }
 
 /*
@@ -667,6 +764,7 @@ int Delete(const char *path)
     char prefix[MAX_PREFIX_LEN + 1];
     const char *suffix;
     struct Mount_Point *mountPoint;
+    int rc;
 
     /* Check whether relative path */
     if (*path != '/')
@@ -683,8 +781,11 @@ int Delete(const char *path)
 
     if (mountPoint->ops->Delete == 0)
 		return EUNSUPPORTED;
-    else
-		return mountPoint->ops->Delete(mountPoint, suffix);
+
+    rc = mountPoint->ops->Delete(mountPoint, suffix);
+    if (rc == 0)
+		Dentry_Cache_Invalidate(path, true);
+    return rc;
 }
 
 /*
@@ -723,6 +824,9 @@ void Register_Paging_Device(struct Paging_Device *pagingDevice)
     KASSERT(pagingDevice != 0);
     Print("Registering paging device: %s on %s\n", pagingDevice->fileName, pagingDevice->dev->name);
     s_pagingDevice = pagingDevice;
+
+    /* Keep what compresses well in memory, in front of the device */
+    Init_Zswap(pagingDevice);
 }
 
 /*
@@ -755,11 +859,16 @@ int Lookup(char *spath, struct path *path)
     char prefix[MAX_PREFIX_LEN + 1];
     const char *suffix;
     struct Mount_Point *mountPoint;
+    int rc;
     
     /* Check whether relative path */
     if (*spath != '/')
 		Convert_To_Abs_Path(spath);
 
+    /* Known not to exist? */
+    if (Dentry_Cache_Lookup(spath, &rc, 0) && rc == ENOTFOUND)
+		return ENOTFOUND;
+
     /* Split path into prefix and suffix */
     if (!Unpack_Path(spath, prefix, &suffix))
 		return ENOTFOUND;
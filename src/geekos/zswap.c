@@ -0,0 +1,308 @@
+/*
+ * Compressed in-memory cache in front of the paging file
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#include <geekos/kassert.h>
+#include <geekos/int.h>
+#include <geekos/list.h>
+#include <geekos/mem.h>
+#include <geekos/malloc.h>
+#include <geekos/string.h>
+#include <geekos/screen.h>
+#include <geekos/synch.h>
+#include <geekos/kthread.h>
+#include <geekos/blockdev.h>
+#include <geekos/vfs.h>
+#include <geekos/slab.h>
+#include <geekos/lz.h>
+#include <geekos/user.h>
+#include <geekos/zswap.h>
+
+/*
+ * Pages on their way to the paging file are compressed and, if they
+ * shrink to half a page or less, kept in memory instead: the slot
+ * they were given in the paging file is only written if the page
+ * is written back.  An entry lives as long as its slot, so a page
+ * read back in by a fault is dropped when the fault frees the slot,
+ * while the parent of a Fork() keeps its entry when a child reads it.
+ * Entries come from object caches, one per size class.  They are
+ * kept in LRU order; when the pool takes up more than its high mark,
+ * the writeback thread writes the coldest ones to their slots until
+ * it is down to the low mark.  A full pool turns pages away to the
+ * paging file.
+ * The cache is protected by disabling interrupts; the compression
+ * buffer by a mutex.
+ */
+#define SECTORS_PER_PAGE	(PAGE_SIZE / SECTOR_SIZE)
+
+#define ZSWAP_CLASS_SIZE	256
+#define ZSWAP_NUM_CLASSES	((PAGE_SIZE / 2) / ZSWAP_CLASS_SIZE)
+
+/* Pool limit, as a share of memory, and its writeback marks */
+#define ZSWAP_MAX_PERCENT	25
+#define ZSWAP_HIGH_PERCENT	90
+#define ZSWAP_LOW_PERCENT	75
+
+struct Zswap_Entry;
+DEFINE_LIST(Zswap_Entry_List, Zswap_Entry);
+
+struct Zswap_Entry {
+    int slot;				/* paging file slot of the page */
+    ushort_t length;			/* compressed length; the data follows */
+    uchar_t sizeClass;
+    uchar_t flags;
+    DEFINE_LINK(Zswap_Entry_List, Zswap_Entry);
+};
+
+IMPLEMENT_LIST(Zswap_Entry_List, Zswap_Entry);
+
+#define ZSWAP_WRITEBACK	0x1	 /* being written to its slot; not on the LRU list */
+#define ZSWAP_RELEASED	0x2	 /* slot freed during the write */
+
+static struct Paging_Device *s_pagingDevice;
+static struct Zswap_Entry **s_slotEntries;
+static ulong_t s_numSlots;
+static struct Object_Cache *s_classCache[ZSWAP_NUM_CLASSES];
+static struct Zswap_Entry_List s_lruList;
+static ulong_t s_poolLimit, s_highMark, s_lowMark;
+static struct Thread_Queue s_writebackWaitQueue;
+
+static struct Mutex s_compressLock;
+static struct LZ_Workspace s_workspace;
+static uchar_t s_compressBuf[PAGE_SIZE / 2];
+
+static __inline__ void *Entry_Data(struct Zswap_Entry *entry)
+{
+    return entry + 1;
+}
+
+static __inline__ ulong_t Class_Bytes(int sizeClass)
+{
+    return (sizeClass + 1) * ZSWAP_CLASS_SIZE;
+}
+
+/*
+ * Free an entry and the memory it takes up.
+ * Interrupts must be disabled.
+ */
+static void Drop_Entry(struct Zswap_Entry *entry)
+{
+    KASSERT(!Interrupts_Enabled());
+    KASSERT(s_slotEntries[entry->slot] == entry);
+
+    if (!(entry->flags & ZSWAP_WRITEBACK))
+	Remove_From_Zswap_Entry_List(&s_lruList, entry);
+    s_slotEntries[entry->slot] = 0;
+    --g_vmStat.numZswapPages;
+    g_vmStat.zswapCompressedBytes -= entry->length;
+    g_vmStat.zswapPoolBytes -= Class_Bytes(entry->sizeClass);
+    Cache_Free(s_classCache[entry->sizeClass], entry);
+}
+
+/*
+ * Write the coldest entries to their slots in the paging file,
+ * whenever the pool grows past its high mark.
+ */
+static void Zswap_Writeback(ulong_t arg)
+{
+    void *buf = Alloc_Page();
+
+    KASSERT(buf != 0);
+
+    Disable_Interrupts();
+    for (;;) {
+	while (g_vmStat.zswapPoolBytes <= s_highMark)
+	    Wait(&s_writebackWaitQueue);
+
+	while (g_vmStat.zswapPoolBytes > s_lowMark && !Is_Zswap_Entry_List_Empty(&s_lruList)) {
+	    struct Zswap_Entry *entry = Remove_From_Front_Of_Zswap_Entry_List(&s_lruList);
+	    int slot = entry->slot;
+	    bool released;
+	    int rc;
+
+	    /* Faults still read the page from the entry while it is written */
+	    entry->flags |= ZSWAP_WRITEBACK;
+	    rc = LZ_Decompress(Entry_Data(entry), entry->length, buf, PAGE_SIZE);
+	    KASSERT(rc == PAGE_SIZE);
+
+	    Enable_Interrupts();
+	    Block_Write_Multi(s_pagingDevice->dev,
+		s_pagingDevice->startSector + slot * SECTORS_PER_PAGE, SECTORS_PER_PAGE, buf);
+	    Disable_Interrupts();
+	    ++g_vmStat.numZswapWritebacks;
+
+	    /* The page is on disk now; free the slot if it was let go meanwhile */
+	    released = (entry->flags & ZSWAP_RELEASED) != 0;
+	    Drop_Entry(entry);
+	    if (released)
+		Free_Space_On_Paging_File(slot);
+	}
+    }
+}
+
+/* ----------------------------------------------------------------------
+ * Public functions
+ * ---------------------------------------------------------------------- */
+
+/*
+ * Set up the compressed cache in front of given paging device.
+ * Called when the paging device is registered.
+ */
+void Init_Zswap(struct Paging_Device *pagingDevice)
+{
+    extern uint_t g_totalFreePageCount;
+    struct Zswap_Entry **slotEntries;
+    struct Kernel_Thread *kthread;
+    char name[32];
+    int i;
+
+    for (i = 0; i < ZSWAP_NUM_CLASSES; ++i) {
+	snprintf(name, sizeof(name), "zswap-%lu", Class_Bytes(i));
+	s_classCache[i] = Create_Object_Cache(name,
+	    sizeof(struct Zswap_Entry) + Class_Bytes(i), 0);
+	if (s_classCache[i] == 0)
+	    goto memfail;
+    }
+
+    s_numSlots = pagingDevice->numSectors / SECTORS_PER_PAGE;
+    slotEntries = (struct Zswap_Entry**) Malloc(s_numSlots * sizeof(struct Zswap_Entry*));
+    if (slotEntries == 0)
+	goto memfail;
+    memset(slotEntries, '\0', s_numSlots * sizeof(struct Zswap_Entry*));
+
+    s_pagingDevice = pagingDevice;
+    s_poolLimit = (g_totalFreePageCount / 100) * ZSWAP_MAX_PERCENT * PAGE_SIZE;
+    s_highMark = (s_poolLimit / 100) * ZSWAP_HIGH_PERCENT;
+    s_lowMark = (s_poolLimit / 100) * ZSWAP_LOW_PERCENT;
+    Mutex_Init(&s_compressLock);
+
+    kthread = Start_Kernel_Thread(Zswap_Writeback, 0, PRIORITY_NORMAL, true);
+    if (kthread == 0) {
+	Free(slotEntries);
+	goto memfail;
+    }
+    strcpy(kthread->name, "{Zswap}");
+
+    /* Now the cache is in use */
+    s_slotEntries = slotEntries;
+    Print("Compressed swap cache: up to %lu KB in front of %s\n",
+	s_poolLimit / 1024, pagingDevice->fileName);
+    return;
+
+memfail:
+    Print("  Error: could not create compressed swap cache\n");
+}
+
+/*
+ * Keep the page for given paging file slot compressed in memory,
+ * if it compresses well enough and the pool has room.
+ * Called with interrupts enabled.
+ * Returns true if the page was kept, false if it must be written
+ * to the paging file.
+ */
+bool Zswap_Store(void *paddr, int pagefileIndex)
+{
+    struct Zswap_Entry *entry = 0;
+    ulong_t length;
+    bool iflag;
+
+    KASSERT(Interrupts_Enabled());
+
+    if (s_slotEntries == 0)
+	return false;
+    KASSERT(pagefileIndex >= 0 && (ulong_t) pagefileIndex < s_numSlots);
+
+    Mutex_Lock(&s_compressLock);
+    length = LZ_Compress(paddr, PAGE_SIZE, s_compressBuf, sizeof(s_compressBuf), &s_workspace);
+
+    iflag = Begin_Int_Atomic();
+    if (length > 0) {
+	int sizeClass = (length - 1) / ZSWAP_CLASS_SIZE;
+
+	if (g_vmStat.zswapPoolBytes + Class_Bytes(sizeClass) <= s_poolLimit)
+	    entry = (struct Zswap_Entry*) Cache_Alloc(s_classCache[sizeClass]);
+	if (entry != 0) {
+	    entry->slot = pagefileIndex;
+	    entry->length = length;
+	    entry->sizeClass = sizeClass;
+	    entry->flags = 0;
+	    memcpy(Entry_Data(entry), s_compressBuf, length);
+
+	    KASSERT(s_slotEntries[pagefileIndex] == 0);
+	    s_slotEntries[pagefileIndex] = entry;
+	    Add_To_Back_Of_Zswap_Entry_List(&s_lruList, entry);
+	    ++g_vmStat.numZswapStores;
+	    ++g_vmStat.numZswapPages;
+	    g_vmStat.zswapCompressedBytes += length;
+	    g_vmStat.zswapPoolBytes += Class_Bytes(sizeClass);
+	}
+    }
+    if (entry == 0)
+	++g_vmStat.numZswapRejects;
+    if (g_vmStat.zswapPoolBytes > s_highMark)
+	Wake_Up(&s_writebackWaitQueue);
+    End_Int_Atomic(iflag);
+
+    Mutex_Unlock(&s_compressLock);
+    return entry != 0;
+}
+
+/*
+ * Read the page for given paging file slot from the cache, if it is
+ * there.  The entry stays until the slot is freed.
+ * Returns true if the page was found, false if it must be read
+ * from the paging file.
+ */
+bool Zswap_Load(void *paddr, int pagefileIndex)
+{
+    struct Zswap_Entry *entry;
+    bool iflag;
+
+    if (s_slotEntries == 0)
+	return false;
+
+    iflag = Begin_Int_Atomic();
+    entry = s_slotEntries[pagefileIndex];
+    if (entry != 0) {
+	int rc = LZ_Decompress(Entry_Data(entry), entry->length, paddr, PAGE_SIZE);
+	KASSERT(rc == PAGE_SIZE);
+	++g_vmStat.numZswapHits;
+
+	/* Still wanted: it is the most recently used now */
+	if (!(entry->flags & ZSWAP_WRITEBACK)) {
+	    Remove_From_Zswap_Entry_List(&s_lruList, entry);
+	    Add_To_Back_Of_Zswap_Entry_List(&s_lruList, entry);
+	}
+    } else {
+	++g_vmStat.numZswapMisses;
+    }
+    End_Int_Atomic(iflag);
+
+    return entry != 0;
+}
+
+/*
+ * Drop the page for a paging file slot that is being freed.
+ * Interrupts must be disabled.
+ * Returns false if the slot can't be reused yet, because the page is
+ * being written back to it; the writeback thread frees it when done.
+ */
+bool Zswap_Release(int pagefileIndex)
+{
+    struct Zswap_Entry *entry;
+
+    KASSERT(!Interrupts_Enabled());
+
+    if (s_slotEntries == 0 || (entry = s_slotEntries[pagefileIndex]) == 0)
+	return true;
+
+    if (entry->flags & ZSWAP_WRITEBACK) {
+	entry->flags |= ZSWAP_RELEASED;
+	return false;
+    }
+    Drop_Entry(entry);
+    return true;
+}
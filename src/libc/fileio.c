@@ -83,3 +83,12 @@ int Mount(const char *devname, const char *prefix, const char *fstype)
     return rc;
 }
 
+DEF_SYSCALL(Get_Buffer_Cache_Stat,SYS_BUFCACHESTAT,int,(const char *devname, struct FS_Buffer_Cache_Stat *stat),
+    const char *arg0 = devname; size_t arg1 = strlen(devname); struct FS_Buffer_Cache_Stat *arg2 = stat;,
+    SYSCALL_REGS_3)
+DEF_SYSCALL(Set_IO_Scheduler,SYS_SETIOSCHEDULER,int,(const char *devname, const char *sched),
+    const char *arg0 = devname; size_t arg1 = strlen(devname); const char *arg2 = sched; size_t arg3 = strlen(sched);,
+    SYSCALL_REGS_4)
+DEF_SYSCALL(Get_Dentry_Cache_Stat,SYS_DCACHESTAT,int,(struct VFS_Dentry_Cache_Stat *stat, int reset),
+    struct VFS_Dentry_Cache_Stat *arg0 = stat; int arg1 = reset;,
+    SYSCALL_REGS_2)
@@ -30,6 +30,11 @@ DEF_SYSCALL(usleep,SYS_USLEEP,void,(int us), char *arg0 = us;, SYSCALL_REGS_1)
 DEF_SYSCALL(alarm,SYS_ALARM,void,(int us, int* cb), int arg0 = us; int *arg1 = cb;, SYSCALL_REGS_2)
 DEF_SYSCALL(PS,SYS_PS,int,(struct Process_Info *ptable, int len),struct Process_Info *arg0 = ptable; int arg1 = len;,SYSCALL_REGS_2)
 DEF_SYSCALL(WaitNoPID,SYS_WAITNOPID,int,(int *status),int *arg0 = status;,SYSCALL_REGS_1)
+DEF_SYSCALL(Get_VM_Stat,SYS_VMSTAT,int,(struct VM_Stat *stat, int reset),
+    struct VM_Stat *arg0 = stat; int arg1 = reset;,SYSCALL_REGS_2)
+DEF_SYSCALL(Set_Page_Replacement,SYS_SETPAGEREPLACEMENT,int,(int policy),int arg0 = policy;,SYSCALL_REGS_1)
+DEF_SYSCALL(Fork,SYS_FORK,int,(void),,SYSCALL_REGS_0)
+DEF_SYSCALL(Set_Swap_Readahead,SYS_SETSWAPREADAHEAD,int,(int numPages),int arg0 = numPages;,SYSCALL_REGS_1)
 
 #define CMDLEN 79
 
@@ -10,9 +10,12 @@
 
 #include <geekos/syscall.h>
 #include <string.h>
+#include <sched.h>
 
 DEF_SYSCALL(Set_Scheduling_Policy,SYS_SETSCHEDULINGPOLICY,int, (int policy, int quantum),
     int arg0 = policy; int arg1 = quantum;,
     SYSCALL_REGS_2)
 DEF_SYSCALL(Get_Time_Of_Day,SYS_GETTIMEOFDAY,int,(void),,SYSCALL_REGS_0)
-
+DEF_SYSCALL(Get_Sched_Stat,SYS_SCHEDSTAT,int,(struct Sched_Stat *stat, int reset),
+    struct Sched_Stat *arg0 = stat; int arg1 = reset;,
+    SYSCALL_REGS_2)
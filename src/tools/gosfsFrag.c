@@ -0,0 +1,307 @@
+/*
+ * Fragmentation report for a GOSFS disk image
+ *
+ * Walks the directory tree of the image and reports how many extents
+ * (runs of consecutive blocks) each file's data is split into, and
+ * how the free space is broken up.
+ *
+ * usage: gosfsFrag [-v] <diskImage>
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#define _XOPEN_SOURCE 700	/* for pread() */
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The on-disk layout, from <geekos/gosfs.h>, with the sizes it has
+ * on the target.
+ */
+#define FS_BLOCK_SIZE		4096
+#define MAGIC			0xDEADBEEF
+#define MAGIC_EXTENTS		0xDEADBEF1
+#define DIRENTRY_USED		0x01
+#define DIRENTRY_ISDIRECTORY	0x02
+#define NUM_DIRECT_BLOCKS	8
+#define NUM_BLOCK_PTRS		10
+#define PTRS_PER_BLOCK		(FS_BLOCK_SIZE / 4)
+#define NUM_INLINE_EXTENTS	(NUM_DIRECT_BLOCKS / 2)
+#define EXTENTS_PER_BLOCK	(FS_BLOCK_SIZE / 8)
+#define DIR_INDEX_PTR		1
+#define DIR_INDEX_MAX		(FS_BLOCK_SIZE / 8 - 1)
+#define MAX_DEPTH		32
+
+typedef struct {
+    int32_t magic;
+    int32_t rootDirectoryPointer;
+    int32_t size;
+    unsigned char bitmap[FS_BLOCK_SIZE - 12];
+} superBlock_t;
+
+typedef struct {
+    uint32_t size;
+    uint32_t flags;
+    char filename[128];
+    uint32_t blockList[NUM_BLOCK_PTRS];
+    uint32_t acl[10];
+} dirEntry_t;
+
+#define DIR_ENTRIES_PER_BLOCK	(FS_BLOCK_SIZE / sizeof(dirEntry_t))
+
+static int s_fd;
+static superBlock_t s_super;
+static int s_verbose;
+
+/* Totals */
+static unsigned long s_numFiles, s_numDirs, s_numFragmented;
+static unsigned long s_numDataBlocks, s_numExtents, s_numMapBlocks;
+
+/* Extents of the file being looked at */
+static unsigned long s_fileExtents, s_fileBlocks, s_runEnd;
+
+static void readBlock(uint32_t block, void *buf)
+{
+    if (block >= (uint32_t) s_super.size ||
+	pread(s_fd, buf, FS_BLOCK_SIZE, (off_t) block * FS_BLOCK_SIZE) != FS_BLOCK_SIZE) {
+	fprintf(stderr, "could not read block %u\n", block);
+	exit(1);
+    }
+}
+
+/* Add the next count blocks of the file, starting at given block. */
+static void addRun(uint32_t start, uint32_t count)
+{
+    if (count == 0)
+	return;
+    if (s_fileBlocks == 0 || start != s_runEnd)
+	++s_fileExtents;
+    s_fileBlocks += count;
+    s_runEnd = start + count;
+}
+
+static void walkPointers(uint32_t block, int depth, unsigned long *numLeft)
+{
+    uint32_t ptrs[PTRS_PER_BLOCK];
+    int i;
+
+    ++s_numMapBlocks;
+    readBlock(block, ptrs);
+    for (i = 0; i < PTRS_PER_BLOCK && *numLeft > 0; ++i) {
+	if (ptrs[i] == 0) {
+	    /* A hole */
+	    *numLeft -= (depth == 0) ? 1 : ((*numLeft < PTRS_PER_BLOCK) ? *numLeft : PTRS_PER_BLOCK);
+	} else if (depth == 0) {
+	    addRun(ptrs[i], 1);
+	    --*numLeft;
+	} else {
+	    walkPointers(ptrs[i], depth - 1, numLeft);
+	}
+    }
+}
+
+static int walkExtents(const uint32_t *extents, int numExtents)
+{
+    int i;
+
+    for (i = 0; i < numExtents; ++i) {
+	if (extents[2*i + 1] == 0)
+	    return 0;
+	addRun(extents[2*i], extents[2*i + 1]);
+    }
+    return 1;
+}
+
+static void mapFile(const dirEntry_t *entry, int extents)
+{
+    uint32_t buf[PTRS_PER_BLOCK];
+    unsigned long numLeft = (entry->size + FS_BLOCK_SIZE - 1) / FS_BLOCK_SIZE;
+    int i;
+
+    s_fileExtents = s_fileBlocks = 0;
+
+    if (extents) {
+	if (!walkExtents(entry->blockList, NUM_INLINE_EXTENTS))
+	    return;
+	if (entry->blockList[NUM_DIRECT_BLOCKS] != 0) {
+	    ++s_numMapBlocks;
+	    readBlock(entry->blockList[NUM_DIRECT_BLOCKS], buf);
+	    if (!walkExtents(buf, EXTENTS_PER_BLOCK))
+		return;
+	}
+	if (entry->blockList[NUM_DIRECT_BLOCKS + 1] != 0) {
+	    uint32_t index[PTRS_PER_BLOCK];
+
+	    ++s_numMapBlocks;
+	    readBlock(entry->blockList[NUM_DIRECT_BLOCKS + 1], index);
+	    for (i = 0; i < EXTENTS_PER_BLOCK && index[2*i] != 0; ++i) {
+		++s_numMapBlocks;
+		readBlock(index[2*i], buf);
+		if (!walkExtents(buf, EXTENTS_PER_BLOCK))
+		    return;
+	    }
+	}
+	return;
+    }
+
+    for (i = 0; i < NUM_DIRECT_BLOCKS && numLeft > 0; ++i, --numLeft) {
+	if (entry->blockList[i] != 0)
+	    addRun(entry->blockList[i], 1);
+    }
+    if (numLeft > 0 && entry->blockList[NUM_DIRECT_BLOCKS] != 0)
+	walkPointers(entry->blockList[NUM_DIRECT_BLOCKS], 0, &numLeft);
+    else if (numLeft > PTRS_PER_BLOCK)
+	numLeft -= PTRS_PER_BLOCK;
+    else
+	numLeft = 0;
+    if (numLeft > 0 && entry->blockList[NUM_DIRECT_BLOCKS + 1] != 0)
+	walkPointers(entry->blockList[NUM_DIRECT_BLOCKS + 1], 1, &numLeft);
+}
+
+static void walkDirectory(uint32_t block, const char *path, int depth);
+
+/* Look at the entries in one block of a directory, from given one on. */
+static void walkDirBlock(uint32_t block, const char *path, int depth, unsigned first)
+{
+    dirEntry_t entries[FS_BLOCK_SIZE / sizeof(dirEntry_t) + 1];
+    char childPath[1024];
+    int extents = (s_super.magic == (int32_t) MAGIC_EXTENTS);
+    unsigned i;
+
+    readBlock(block, entries);
+
+    for (i = first; i < DIR_ENTRIES_PER_BLOCK; ++i) {
+	dirEntry_t *entry = &entries[i];
+
+	if (entry->flags != DIRENTRY_USED && entry->flags != DIRENTRY_ISDIRECTORY)
+	    continue;
+	entry->filename[sizeof(entry->filename) - 1] = '\0';
+	snprintf(childPath, sizeof(childPath), "%s/%s", path, entry->filename);
+
+	if (entry->flags == DIRENTRY_ISDIRECTORY) {
+	    walkDirectory(entry->blockList[0], childPath, depth + 1);
+	    continue;
+	}
+
+	mapFile(entry, extents);
+	++s_numFiles;
+	s_numDataBlocks += s_fileBlocks;
+	s_numExtents += s_fileExtents;
+	if (s_fileExtents > 1)
+	    ++s_numFragmented;
+	if (s_verbose)
+	    printf("%-40s %10u bytes %7lu blocks %5lu extents\n",
+		childPath, entry->size, s_fileBlocks, s_fileExtents);
+    }
+}
+
+/*
+ * Look at a directory: its first block, and the leaves of its
+ * index, if it has one.
+ */
+static void walkDirectory(uint32_t block, const char *path, int depth)
+{
+    dirEntry_t head;
+    uint32_t index[PTRS_PER_BLOCK];
+    uint32_t i;
+
+    if (depth > MAX_DEPTH) {
+	fprintf(stderr, "%s: directories nested too deeply\n", path);
+	return;
+    }
+
+    ++s_numDirs;
+
+    /* Skip "." and ".." */
+    walkDirBlock(block, path, depth, 2);
+
+    if (pread(s_fd, &head, sizeof(head), (off_t) block * FS_BLOCK_SIZE) != sizeof(head) ||
+	head.blockList[DIR_INDEX_PTR] == 0)
+	return;
+    readBlock(head.blockList[DIR_INDEX_PTR], index);
+    for (i = 0; i < index[0] && i < DIR_INDEX_MAX; ++i)
+	walkDirBlock(index[2 + 2*i + 1], path, depth, 0);
+}
+
+static void reportFreeSpace(void)
+{
+    unsigned long numFree = 0, numRuns = 0, run = 0, largest = 0;
+    int32_t i;
+
+    for (i = 0; i <= s_super.size; ++i) {
+	int used = (i == s_super.size) || (s_super.bitmap[i / 8] & (1 << (i % 8)));
+
+	if (!used) {
+	    ++numFree;
+	    if (run++ == 0)
+		++numRuns;
+	} else {
+	    if (run > largest)
+		largest = run;
+	    run = 0;
+	}
+    }
+
+    printf("free space: %lu of %d blocks, in %lu runs", numFree, s_super.size, numRuns);
+    if (numRuns > 0)
+	printf(" (average %lu, largest %lu)", numFree / numRuns, largest);
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *imageFile;
+
+    if (argc == 3 && strcmp(argv[1], "-v") == 0)
+	s_verbose = 1;
+    else if (argc != 2) {
+	printf("usage: gosfsFrag [-v] <diskImage>\n");
+	exit(1);
+    }
+    imageFile = argv[argc - 1];
+
+    s_fd = open(imageFile, O_RDONLY, 0);
+    if (s_fd < 0) {
+	perror(imageFile);
+	exit(1);
+    }
+    if (pread(s_fd, &s_super, sizeof(s_super), 0) != sizeof(s_super)) {
+	fprintf(stderr, "%s: could not read superblock\n", imageFile);
+	exit(1);
+    }
+    if (s_super.magic != (int32_t) MAGIC && s_super.magic != (int32_t) MAGIC_EXTENTS) {
+	fprintf(stderr, "%s: not a GOSFS image (magic %x)\n", imageFile, (unsigned) s_super.magic);
+	exit(1);
+    }
+    if (s_super.size <= 0 || s_super.size > (int32_t) (sizeof(s_super.bitmap) * 8)) {
+	fprintf(stderr, "%s: bad filesystem size %d\n", imageFile, s_super.size);
+	exit(1);
+    }
+
+    printf("%s: %d blocks, files mapped by %s\n", imageFile, s_super.size,
+	s_super.magic == (int32_t) MAGIC_EXTENTS ? "extents" : "block pointers");
+    walkDirectory(s_super.rootDirectoryPointer, "", 0);
+
+    printf("files: %lu in %lu directories, %lu data blocks\n", s_numFiles, s_numDirs, s_numDataBlocks);
+    printf("extents: %lu", s_numExtents);
+    if (s_numFiles > 0)
+	printf(" (%lu.%02lu per file)", s_numExtents / s_numFiles,
+	    (s_numExtents % s_numFiles) * 100 / s_numFiles);
+    printf(", %lu mapping blocks\n", s_numMapBlocks);
+    printf("fragmented files: %lu", s_numFragmented);
+    if (s_numFiles > 0)
+	printf(" (%lu%%)", s_numFragmented * 100 / s_numFiles);
+    printf("\n");
+    reportFreeSpace();
+
+    close(s_fd);
+    return 0;
+}
@@ -0,0 +1,30 @@
+/*
+ * bcstat - Print buffer cache statistics of a block device
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#include <conio.h>
+#include <process.h>
+#include <fileio.h>
+
+int main(int argc, char **argv)
+{
+    int rc;
+    struct FS_Buffer_Cache_Stat stat;
+    const char *devname = (argc > 1) ? argv[1] : "ide1";
+
+    rc = Get_Buffer_Cache_Stat(devname, &stat);
+    if (rc != 0) {
+	Print("Could not get buffer cache stats for %s: %s\n", devname, Get_Error_String(rc));
+	return 1;
+    }
+
+    Print("%s: %u buffers cached, %u dirty\n", devname, stat.numCached, stat.numDirty);
+    Print("hits %lu, misses %lu, evictions %lu, flushed %lu\n",
+	stat.numHits, stat.numMisses, stat.numEvictions, stat.numFlushed);
+    Print("read ahead %lu, then used %lu\n", stat.numReadahead, stat.numReadaheadHits);
+
+    return 0;
+}
@@ -0,0 +1,34 @@
+/*
+ * dcstat - Print statistics of the dentry cache of recent path lookups
+ *
+ * usage: dcstat [-r]
+ *   -r       reset the counters after printing them
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#include <conio.h>
+#include <process.h>
+#include <fileio.h>
+#include <string.h>
+
+int main(int argc, char **argv)
+{
+    int rc;
+    int reset = (argc > 1 && !strcmp(argv[1], "-r"));
+    struct VFS_Dentry_Cache_Stat stat;
+
+    rc = Get_Dentry_Cache_Stat(&stat, reset);
+    if (rc != 0) {
+	Print("Could not get dentry cache stats: %s\n", Get_Error_String(rc));
+	return 1;
+    }
+
+    Print("%u entries cached\n", stat.numCached);
+    Print("hits %lu, negative hits %lu, misses %lu\n",
+	stat.numHits, stat.numNegativeHits, stat.numMisses);
+    Print("evictions %lu, invalidations %lu\n", stat.numEvictions, stat.numInvalidations);
+
+    return 0;
+}
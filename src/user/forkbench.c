@@ -0,0 +1,80 @@
+/*
+ * Fork benchmark
+ *
+ * Forks N children, each of which writes to the given number of
+ * pages of a buffer it shares copy-on-write with the parent, and
+ * reports how long it took and how many pages had to be copied.
+ *
+ * usage: forkbench <nchildren> <npages>
+ */
+
+#include <conio.h>
+#include <process.h>
+#include <sched.h>
+#include <string.h>
+
+#define MAX_CHILDREN 64
+#define MAX_PAGES 64
+#define PAGE_BYTES 4096
+
+static char s_buf[MAX_PAGES * PAGE_BYTES];
+static int s_pid[MAX_CHILDREN];
+
+int main(int argc, char **argv)
+{
+  int nchildren, npages;
+  int i, j, forked = 0;
+  int start, elapsed;
+  struct VM_Stat stat;
+
+  if (argc != 3) {
+    Print("usage: %s <nchildren> <npages>\n", argv[0]);
+    Exit(1);
+  }
+  nchildren = atoi(argv[1]);
+  npages = atoi(argv[2]);
+  if (nchildren < 1 || nchildren > MAX_CHILDREN || npages < 0 || npages > MAX_PAGES) {
+    Print("nchildren must be between 1 and %d, npages between 0 and %d\n",
+      MAX_CHILDREN, MAX_PAGES);
+    Exit(1);
+  }
+
+  /* Make the whole buffer resident in the parent */
+  memset(s_buf, 'p', sizeof(s_buf));
+
+  Get_VM_Stat(&stat, 1);
+  start = Get_Time_Of_Day();
+
+  for (i = 0; i < nchildren; i++) {
+    s_pid[i] = Fork();
+    if (s_pid[i] == 0) {
+      for (j = 0; j < npages; j++)
+        s_buf[j * PAGE_BYTES] = 'c';
+      Exit(0);
+    }
+    if (s_pid[i] < 0) {
+      Print("fork of child %d failed: %d\n", i, s_pid[i]);
+      break;
+    }
+    ++forked;
+  }
+
+  for (i = 0; i < forked; i++)
+    Wait(s_pid[i]);
+
+  elapsed = Get_Time_Of_Day() - start;
+  Get_VM_Stat(&stat, 0);
+
+  for (j = 0; j < MAX_PAGES; j++) {
+    if (s_buf[j * PAGE_BYTES] != 'p') {
+      Print("page %d of the parent was changed by a child\n", j);
+      return 1;
+    }
+  }
+
+  Print("children=%d pages=%d ticks=%d\n", forked, npages, elapsed);
+  Print("copy on write: %lu faults, %lu copies\n",
+    stat.numCowFaults, stat.numCowCopies);
+
+  return 0;
+}
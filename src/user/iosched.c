@@ -0,0 +1,28 @@
+/*
+ * iosched - Select the I/O scheduler of a block device
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#include <conio.h>
+#include <process.h>
+#include <fileio.h>
+
+int main(int argc, char **argv)
+{
+    int rc;
+
+    if (argc != 3) {
+	Print("Usage: iosched <device> [fifo|clook]\n");
+	return 1;
+    }
+
+    rc = Set_IO_Scheduler(argv[1], argv[2]);
+    if (rc != 0) {
+	Print("Could not set I/O scheduler of %s to %s: %s\n", argv[1], argv[2], Get_Error_String(rc));
+	return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,74 @@
+/*
+ * Scheduler stress benchmark
+ *
+ * Spawns N copies of long.exe under the given scheduling policy,
+ * waits for all of them, and reports how many context switches
+ * happened and how long the scheduler took to pick each thread.
+ *
+ * usage: schedbench [rr|mlf] <quantum> <nworkers>
+ */
+
+#include <conio.h>
+#include <process.h>
+#include <sched.h>
+#include <string.h>
+
+#define MAX_WORKERS 256
+
+static int s_pid[MAX_WORKERS];
+
+int main(int argc, char **argv)
+{
+  int policy = -1, quantum, nworkers;
+  int i, spawned = 0;
+  int start, elapsed;
+  struct Sched_Stat stat;
+
+  if (argc != 4) {
+    Print("usage: %s [rr|mlf] <quantum> <nworkers>\n", argv[0]);
+    Exit(1);
+  }
+  if (!strcmp(argv[1], "rr")) {
+    policy = 0;
+  } else if (!strcmp(argv[1], "mlf")) {
+    policy = 1;
+  } else {
+    Print("usage: %s [rr|mlf] <quantum> <nworkers>\n", argv[0]);
+    Exit(1);
+  }
+  quantum = atoi(argv[2]);
+  nworkers = atoi(argv[3]);
+  if (nworkers < 1 || nworkers > MAX_WORKERS) {
+    Print("nworkers must be between 1 and %d\n", MAX_WORKERS);
+    Exit(1);
+  }
+
+  Set_Scheduling_Policy(policy, quantum);
+  Get_Sched_Stat(&stat, 1);
+  start = Get_Time_Of_Day();
+
+  for (i = 0; i < nworkers; i++) {
+    s_pid[i] = Spawn_Program("/c/long.exe", "/c/long.exe", false);
+    if (s_pid[i] < 0) {
+      Print("spawn of worker %d failed: %d\n", i, s_pid[i]);
+      break;
+    }
+    ++spawned;
+  }
+
+  for (i = 0; i < spawned; i++)
+    Wait(s_pid[i]);
+
+  elapsed = Get_Time_Of_Day() - start;
+  Get_Sched_Stat(&stat, 0);
+
+  Print("\n%s quantum=%d workers=%d ticks=%d\n",
+    argv[1], quantum, spawned, elapsed);
+  Print("switches: %lu (%lu per tick)\n", stat.numSwitches,
+    elapsed > 0 ? stat.numSwitches / elapsed : stat.numSwitches);
+  Print("pick-next cycles: avg %lu, max %lu\n",
+    stat.numSwitches > 0 ? stat.pickCycles / stat.numSwitches : 0,
+    stat.maxPickCycles);
+
+  return 0;
+}
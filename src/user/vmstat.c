@@ -0,0 +1,109 @@
+/*
+ * vmstat - Print virtual memory statistics
+ *
+ * usage: vmstat [-r] [-w pages] [clock|twolist]
+ *   -r       reset the counters after printing them
+ *   -w pages read ahead this many pages on swap-in
+ *   clock    use a single CLOCK hand for page replacement
+ *   twolist  use active/inactive lists for page replacement
+ *
+ * This is free software.  You are permitted to use,
+ * redistribute, and modify it as specified in the file "COPYING".
+ */
+
+#include <conio.h>
+#include <process.h>
+#include <string.h>
+
+static const char *s_policyName[] = { "clock", "twolist" };
+
+int main(int argc, char **argv)
+{
+    int i, rc;
+    int reset = 0;
+    unsigned long ratio = 0, ratioFrac = 0;
+    struct VM_Stat stat;
+
+    for (i = 1; i < argc; ++i) {
+	if (!strcmp(argv[i], "-r")) {
+	    reset = 1;
+	} else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+	    rc = Set_Swap_Readahead(atoi(argv[++i]));
+	    if (rc != 0) {
+		Print("Could not set read-ahead to %s: %s\n", argv[i], Get_Error_String(rc));
+		return 1;
+	    }
+	} else if (!strcmp(argv[i], "clock") || !strcmp(argv[i], "twolist")) {
+	    rc = Set_Page_Replacement(!strcmp(argv[i], "clock") ? PAGE_REPLACE_CLOCK : PAGE_REPLACE_TWO_LIST);
+	    if (rc != 0) {
+		Print("Could not select %s: %s\n", argv[i], Get_Error_String(rc));
+		return 1;
+	    }
+	} else {
+	    Print("usage: %s [-r] [-w pages] [clock|twolist]\n", argv[0]);
+	    return 1;
+	}
+    }
+
+    rc = Get_VM_Stat(&stat, reset);
+    if (rc != 0) {
+	Print("Could not get VM stats: %s\n", Get_Error_String(rc));
+	return 1;
+    }
+
+    Print("replacement %s: %u active, %u inactive, %u free pages, %u free swap slots\n",
+	s_policyName[stat.replacement], stat.numActive, stat.numInactive,
+	stat.numFreePages, stat.numFreeSwapSlots);
+    Print("faults %lu, refaults %lu, evictions %lu, page outs %lu (%lu aborted)\n",
+	stat.numFaults, stat.numRefaults, stat.numEvictions, stat.numPageOuts,
+	stat.numPageOutsAborted);
+    Print("scanned %lu (%lu per eviction)\n", stat.numScanned,
+	stat.numEvictions > 0 ? stat.numScanned / stat.numEvictions : 0);
+    Print("pageout wakeups %lu, direct reclaims %lu\n",
+	stat.numPageoutWakeups, stat.numDirectReclaims);
+    Print("first touch: %lu from executables, %lu zero filled\n",
+	stat.numExePageIns, stat.numZeroFills);
+    Print("shared text: %u pages cached, %lu faults shared\n",
+	stat.numSharedTextPages, stat.numTextShares);
+    Print("copy on write: %lu faults, %lu copies\n",
+	stat.numCowFaults, stat.numCowCopies);
+    Print("TLB: %lu pages invalidated, %lu full flushes\n",
+	stat.numTlbInvalidations, stat.numTlbFlushes);
+    Print("zeroed pages: %u ready, %lu hits, %lu misses\n",
+	stat.numZeroedPages, stat.numZeroedHits, stat.numZeroedMisses);
+    Print("swap read-ahead %d: %lu pages, %lu hits, %lu misses\n",
+	stat.swapReadahead, stat.numReadaheadPages, stat.numReadaheadHits,
+	stat.numReadaheadMisses);
+    if (stat.zswapCompressedBytes > 0) {
+	unsigned long orig = stat.numZswapPages * 4096UL;
+
+	ratio = orig / stat.zswapCompressedBytes;
+	ratioFrac = (orig % stat.zswapCompressedBytes) * 100 / stat.zswapCompressedBytes;
+    }
+    Print("compressed cache: %u pages in %lu KB (ratio %lu.%02lu), %lu stores, %lu rejects\n",
+	stat.numZswapPages, stat.zswapPoolBytes / 1024, ratio, ratioFrac,
+	stat.numZswapStores, stat.numZswapRejects);
+    Print("  %lu hits, %lu misses, %lu written back\n",
+	stat.numZswapHits, stat.numZswapMisses, stat.numZswapWritebacks);
+
+    /*
+     * Fragmentation: for each order, the share of free pages that
+     * are in blocks too small for an allocation of that order.
+     */
+    Print("free blocks by order:");
+    for (i = 0; i <= PAGE_MAX_ORDER; ++i)
+	Print(" %u", stat.numFreeBlocks[i]);
+    Print("\nunusable free space %%:");
+    for (i = 0; i <= PAGE_MAX_ORDER; ++i) {
+	unsigned long usable = 0;
+	int j;
+
+	for (j = i; j <= PAGE_MAX_ORDER; ++j)
+	    usable += (unsigned long) stat.numFreeBlocks[j] << j;
+	Print(" %lu", stat.numFreePages > 0 ?
+	    (stat.numFreePages - usable) * 100 / stat.numFreePages : 0);
+    }
+    Print("\n");
+
+    return 0;
+}